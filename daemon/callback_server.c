@@ -194,6 +194,30 @@ static enum_t handle_cb_recall(
     return res->status;
 }
 
+/* OP_CB_RECALL_ANY */
+static enum_t handle_cb_recall_any(
+    IN nfs41_rpc_clnt *rpc_clnt,
+    IN struct cb_recall_any_args *args,
+    OUT struct cb_recall_any_res *res)
+{
+    /* return the coldest delegations asynchronously */
+    res->status = nfs41_delegation_recall_any(rpc_clnt->client,
+        args->objects_to_keep, &args->type_mask);
+    return res->status;
+}
+
+/* OP_CB_NOTIFY */
+static enum_t handle_cb_notify(
+    IN nfs41_rpc_clnt *rpc_clnt,
+    IN struct cb_notify_args *args,
+    OUT struct cb_notify_res *res)
+{
+    /* apply the changes to the directory's cached entries */
+    res->status = nfs41_delegation_notify(rpc_clnt->client,
+        &args->stateid, args->change_list, args->change_count);
+    return res->status;
+}
+
 /* OP_CB_NOTIFY_DEVICEID */
 static enum_t handle_cb_notify_deviceid(
     IN nfs41_rpc_clnt *rpc_clnt,
@@ -457,7 +481,8 @@ static void handle_cb_compound(nfs41_rpc_clnt *rpc_clnt, cb_req *req, struct cb_
             break;
         case OP_CB_NOTIFY:
             DPRINTF(1, ("OP_CB_NOTIFY\n"));
-            res->status = NFS4ERR_NOTSUPP;
+            res->status = handle_cb_notify(rpc_clnt,
+                &argop->args.notify, &resop->res.notify);
             break;
         case OP_CB_PUSH_DELEG:
             DPRINTF(1, ("OP_CB_PUSH_DELEG\n"));
@@ -465,7 +490,8 @@ static void handle_cb_compound(nfs41_rpc_clnt *rpc_clnt, cb_req *req, struct cb_
             break;
         case OP_CB_RECALL_ANY:
             DPRINTF(1, ("OP_CB_RECALL_ANY\n"));
-            res->status = NFS4ERR_NOTSUPP;
+            res->status = handle_cb_recall_any(rpc_clnt,
+                &argop->args.recall_any, &resop->res.recall_any);
             break;
         case OP_CB_RECALLABLE_OBJ_AVAIL:
             DPRINTF(1, ("OP_CB_RECALLABLE_OBJ_AVAIL\n"));
@@ -54,7 +54,8 @@ static bool_t common_fsid(XDR *xdr, nfs41_fsid *fsid)
 
 static bool_t common_notify4(XDR *xdr, struct notify4 *notify)
 {
-    return xdr_bitmap4(xdr, &notify->mask)
+    /* xdr_bitmap4() fails on XDR_FREE, but the list still needs freeing */
+    return (xdr->x_op == XDR_FREE || xdr_bitmap4(xdr, &notify->mask))
         && xdr_bytes(xdr, &notify->list, &notify->len, NFS4_OPAQUE_LIMIT);
 }
 
@@ -329,12 +330,176 @@ out:
 }
 
 /* OP_CB_NOTIFY */
-static bool_t op_cb_notify_args(XDR *xdr, struct cb_notify_args *res)
+static bool_t cb_notify_entry4(XDR *xdr, struct notify_entry4 *entry)
 {
+    char *name = entry->name;
     bool_t result;
 
-    result = xdr_u_int32_t(xdr, &res->target_highest_slotid);
-    if (!result) { CBX_ERR("notify.target_highest_slotid"); goto out; }
+    result = xdr_bytes(xdr, &name, &entry->name_len, NFS41_MAX_COMPONENT_LEN);
+    if (!result) { CBX_ERR("notify.entry.name"); goto out; }
+    entry->name[entry->name_len] = '\0';
+
+    result = xdr_fattr4(xdr, &entry->attrs);
+    if (!result) { CBX_ERR("notify.entry.attrs"); goto out; }
+out:
+    return result;
+}
+
+/* notify_remove4 and prev_entry4 are both an entry and its cookie */
+static bool_t cb_notify_entry_cookie(XDR *xdr, struct notify_entry4 *entry)
+{
+    uint64_t cookie;
+    bool_t result;
+
+    result = cb_notify_entry4(xdr, entry);
+    if (!result) goto out;
+
+    result = xdr_u_hyper(xdr, &cookie);
+    if (!result) { CBX_ERR("notify.entry.cookie"); goto out; }
+out:
+    return result;
+}
+
+static bool_t cb_notify_add4(XDR *xdr, struct notify_dir4 *change)
+{
+    struct notify_entry4 unused;
+    uint32_t count;
+    bool_t last, result;
+
+    /* nad_old_entry<1>, an entry that the new one replaced */
+    result = xdr_u_int32_t(xdr, &count) && count <= 1;
+    if (!result) { CBX_ERR("notify.add.old_entry"); goto out; }
+    if (count && !cb_notify_entry_cookie(xdr, &unused))
+        goto out_false;
+
+    result = cb_notify_entry4(xdr, &change->entry);
+    if (!result) { CBX_ERR("notify.add.new_entry"); goto out; }
+
+    /* nad_new_entry_cookie<1> */
+    result = xdr_u_int32_t(xdr, &count) && count <= 1;
+    if (!result) { CBX_ERR("notify.add.new_entry_cookie"); goto out; }
+    change->has_cookie = count;
+    if (count) {
+        result = xdr_u_hyper(xdr, &change->cookie);
+        if (!result) { CBX_ERR("notify.add.new_entry_cookie"); goto out; }
+    }
+
+    /* nad_prev_entry<1> */
+    result = xdr_u_int32_t(xdr, &count) && count <= 1;
+    if (!result) { CBX_ERR("notify.add.prev_entry"); goto out; }
+    if (count && !cb_notify_entry_cookie(xdr, &unused))
+        goto out_false;
+
+    result = xdr_bool(xdr, &last);
+    if (!result) { CBX_ERR("notify.add.last_entry"); goto out; }
+out:
+    return result;
+out_false:
+    result = FALSE;
+    goto out;
+}
+
+static bool_t cb_notify_dir4(XDR *xdr, struct notify_dir4 *change)
+{
+    unsigned char verf[NFS4_VERIFIER_SIZE];
+    bool_t result;
+
+    switch (change->type) {
+    case NOTIFY4_CHANGE_CHILD_ATTRS:
+    case NOTIFY4_CHANGE_DIR_ATTRS:
+        result = cb_notify_entry4(xdr, &change->entry);
+        if (!result) { CBX_ERR("notify.attr"); goto out; }
+        break;
+    case NOTIFY4_REMOVE_ENTRY:
+        result = cb_notify_entry_cookie(xdr, &change->entry);
+        if (!result) { CBX_ERR("notify.remove"); goto out; }
+        break;
+    case NOTIFY4_ADD_ENTRY:
+        result = cb_notify_add4(xdr, change);
+        if (!result) { CBX_ERR("notify.add"); goto out; }
+        break;
+    case NOTIFY4_RENAME_ENTRY:
+        result = cb_notify_entry_cookie(xdr, &change->old_entry);
+        if (!result) { CBX_ERR("notify.rename.old_entry"); goto out; }
+        result = cb_notify_add4(xdr, change);
+        if (!result) { CBX_ERR("notify.rename.new_entry"); goto out; }
+        break;
+    case NOTIFY4_CHANGE_COOKIE_VERIFIER:
+        /* nv_old_cookieverf, nv_new_cookieverf */
+        result = xdr_opaque(xdr, (char*)verf, NFS4_VERIFIER_SIZE)
+            && xdr_opaque(xdr, (char*)verf, NFS4_VERIFIER_SIZE);
+        if (!result) { CBX_ERR("notify.verifier"); goto out; }
+        break;
+    default:
+        /* can't skip over values we don't understand */
+        result = FALSE;
+        break;
+    }
+out:
+    return result;
+}
+
+static bool_t op_cb_notify_args(XDR *xdr, struct cb_notify_args *args)
+{
+    XDR notify_xdr;
+    uint32_t i, j, bit, c;
+    bool_t result;
+
+    result = common_stateid(xdr, &args->stateid);
+    if (!result) { CBX_ERR("notify.stateid"); goto out; }
+
+    result = common_fh(xdr, &args->fh);
+    if (!result) { CBX_ERR("notify.fh"); goto out; }
+
+    /* decode the generic notify4 list */
+    result = xdr_array(xdr, (char**)&args->notify_list,
+        &args->notify_count, CB_COMPOUND_MAX_OPERATIONS,
+        sizeof(struct notify4), (xdrproc_t)common_notify4);
+    if (!result) { CBX_ERR("notify.notify_list"); goto out; }
+
+    switch (xdr->x_op) {
+    case XDR_FREE:
+        free(args->change_list);
+    case XDR_ENCODE:
+        return TRUE;
+    default:
+        break;
+    }
+
+    /* count the number of directory changes; each notify4 holds the
+     * values for the bits set in its mask, in bit order */
+    args->change_count = 0;
+    for (i = 0; i < args->notify_count; i++)
+        for (j = 0; j < args->notify_list[i].mask.count; j++)
+            for (bit = 0; bit < 32; bit++)
+                if (args->notify_list[i].mask.arr[j] & (1u << bit))
+                    args->change_count++;
+
+    args->change_list = calloc(args->change_count, sizeof(struct notify_dir4));
+    if (args->change_list == NULL)
+        return FALSE;
+
+    c = 0;
+    for (i = 0; i < args->notify_count; i++) {
+        struct notify4 *notify = &args->notify_list[i];
+
+        /* decode the directory changes out of the opaque buffer */
+        xdrmem_create(&notify_xdr, notify->list, notify->len, XDR_DECODE);
+
+        for (j = 0; j < notify->mask.count; j++) {
+            for (bit = 0; bit < 32; bit++) {
+                struct notify_dir4 *change;
+                if ((notify->mask.arr[j] & (1u << bit)) == 0)
+                    continue;
+
+                change = &args->change_list[c++];
+                change->type = (enum notify_type4)(j * 32 + bit);
+
+                result = cb_notify_dir4(&notify_xdr, change);
+                if (!result) { CBX_ERR("notify.change"); goto out; }
+            }
+        }
+    }
 out:
     return result;
 }
@@ -375,8 +540,11 @@ static bool_t op_cb_recall_any_args(XDR *xdr, struct cb_recall_any_args *res)
 {
     bool_t result;
 
-    result = xdr_u_int32_t(xdr, &res->target_highest_slotid);
-    if (!result) { CBX_ERR("recall_any.target_highest_slotid"); goto out; }
+    result = xdr_u_int32_t(xdr, &res->objects_to_keep);
+    if (!result) { CBX_ERR("recall_any.objects_to_keep"); goto out; }
+
+    result = xdr_bitmap4(xdr, &res->type_mask);
+    if (!result) { CBX_ERR("recall_any.type_mask"); goto out; }
 out:
     return result;
 }
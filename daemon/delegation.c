@@ -22,7 +22,10 @@
 
 #include "delegation.h"
 #include "nfs41_ops.h"
+#include "nfs41_callback.h"
 #include "name_cache.h"
+#include "readdir.h"
+#include "readwrite.h"
 #include "util.h"
 #include "daemon_debug.h"
 
@@ -60,6 +63,10 @@ static int delegation_create(
     fh_copy(&state->parent.fh, &parent->fh);
 
     list_init(&state->client_entry);
+    list_init(&state->stateid_entry);
+    list_init(&state->fh_entry);
+    list_init(&state->fileid_entry);
+    state->last_used = GetTickCount64();
     state->status = DELEGATION_GRANTED;
     InitializeSRWLock(&state->lock);
     InitializeConditionVariable(&state->cond);
@@ -89,19 +96,55 @@ void nfs41_delegation_deref(
 
 #define open_entry(pos) list_container(pos, nfs41_open_state, client_entry)
 
+#define open_fileid_entry(pos) list_container(pos, nfs41_open_state, fileid_entry)
+
+/* delegations are indexed by stateid for CB_RECALL, by filehandle for
+ * nfs41_delegation_getattr(), and by fileid for opens.  the indexes are
+ * updated under client_state.lock along with the list, and the stateid
+ * can only change (on reclaim) under the same lock */
+static void delegation_index_add(
+    IN struct client_state *state,
+    IN nfs41_delegation_state *deleg)
+{
+    state_index_add(&state->delegations_by_stateid,
+        stateid_hash(&deleg->state.stateid), &deleg->stateid_entry);
+    state_index_add(&state->delegations_by_fh,
+        fh_hash(&deleg->file.fh), &deleg->fh_entry);
+    state_index_add(&state->delegations_by_fileid,
+        fileid_hash(deleg->file.fh.fileid), &deleg->fileid_entry);
+}
+
+static void delegation_index_remove(
+    IN struct client_state *state,
+    IN nfs41_delegation_state *deleg)
+{
+    state_index_remove(&state->delegations_by_stateid,
+        stateid_hash(&deleg->state.stateid), &deleg->stateid_entry);
+    state_index_remove(&state->delegations_by_fh,
+        fh_hash(&deleg->file.fh), &deleg->fh_entry);
+    state_index_remove(&state->delegations_by_fileid,
+        fileid_hash(deleg->file.fh.fileid), &deleg->fileid_entry);
+}
+
 static void delegation_remove(
     IN nfs41_client *client,
     IN nfs41_delegation_state *deleg)
 {
+    struct state_bucket *bucket;
     struct list_entry *entry;
 
-    /* remove from the client's list */
+    /* remove from the client's list and indexes */
     EnterCriticalSection(&client->state.lock);
     list_remove(&deleg->client_entry);
+    delegation_index_remove(&client->state, deleg);
+    LeaveCriticalSection(&client->state.lock);
 
-    /* remove from each associated open */
-    list_for_each(entry, &client->state.opens) {
-        nfs41_open_state *open = open_entry(entry);
+    /* remove from each associated open; they're all on the same file */
+    bucket = state_index_bucket(&client->state.opens_by_fileid,
+        fileid_hash(deleg->file.fh.fileid));
+    AcquireSRWLockShared(&bucket->lock);
+    list_for_each(entry, &bucket->head) {
+        nfs41_open_state *open = open_fileid_entry(entry);
         AcquireSRWLockExclusive(&open->lock);
         if (open->delegation.state == deleg) {
             /* drop the delegation reference */
@@ -110,7 +153,7 @@ static void delegation_remove(
         }
         ReleaseSRWLockExclusive(&open->lock);
     }
-    LeaveCriticalSection(&client->state.lock);
+    ReleaseSRWLockShared(&bucket->lock);
 
     /* signal threads waiting on delegreturn */
     AcquireSRWLockExclusive(&deleg->lock);
@@ -139,7 +182,7 @@ static bool_t has_delegated_locks(
 
 static int open_deleg_cmp(const struct list_entry *entry, const void *value)
 {
-    nfs41_open_state *open = open_entry(entry);
+    nfs41_open_state *open = open_fileid_entry(entry);
     int result = -1;
 
     /* open must match the delegation and have state to reclaim */
@@ -157,16 +200,19 @@ static nfs41_open_state* deleg_open_find(
     IN struct client_state *state,
     IN const nfs41_delegation_state *deleg)
 {
+    struct state_bucket *bucket;
     struct list_entry *entry;
     nfs41_open_state *open = NULL;
 
-    EnterCriticalSection(&state->lock);
-    entry = list_search(&state->opens, deleg, open_deleg_cmp);
+    bucket = state_index_bucket(&state->opens_by_fileid,
+        fileid_hash(deleg->file.fh.fileid));
+    AcquireSRWLockShared(&bucket->lock);
+    entry = list_search(&bucket->head, deleg, open_deleg_cmp);
     if (entry) {
-        open = open_entry(entry);
+        open = open_fileid_entry(entry);
         nfs41_open_state_ref(open); /* return a reference */
     }
-    LeaveCriticalSection(&state->lock);
+    ReleaseSRWLockShared(&bucket->lock);
     return open;
 }
 
@@ -260,15 +306,66 @@ static int delegation_flush_locks(
     return status;
 }
 
+static int open_write_behind_cmp(const struct list_entry *entry, const void *value)
+{
+    nfs41_open_state *open = open_fileid_entry(entry);
+    int result = -1;
+
+    AcquireSRWLockShared(&open->lock);
+    if (open->delegation.state != value) goto out;
+    if (list_empty(&open->write_behind.ranges) &&
+        !open->write_behind.resize) goto out;
+    /* the file is being removed; its writes are flushed only if that
+     * fails, by nfs41_write_behind_discard() */
+    if (open->write_behind.discard) goto out;
+    result = 0;
+out:
+    ReleaseSRWLockShared(&open->lock);
+    return result;
+}
+
+/* send buffered writes and sizes while the delegation stateid is
+ * still valid */
+static void delegation_flush_writes(
+    IN struct client_state *state,
+    IN const nfs41_delegation_state *deleg)
+{
+    struct state_bucket *bucket;
+    struct list_entry *entry;
+    nfs41_open_state *open;
+
+    bucket = state_index_bucket(&state->opens_by_fileid,
+        fileid_hash(deleg->file.fh.fileid));
+    for (;;) {
+        AcquireSRWLockShared(&bucket->lock);
+        entry = list_search(&bucket->head, deleg, open_write_behind_cmp);
+        open = entry ? open_fileid_entry(entry) : NULL;
+        if (open)
+            nfs41_open_state_ref(open);
+        ReleaseSRWLockShared(&bucket->lock);
+
+        if (open == NULL)
+            break;
+
+        /* stop on error, rather than retrying the same open forever */
+        if (nfs41_write_behind_flush(open)) {
+            nfs41_open_state_deref(open);
+            break;
+        }
+        nfs41_open_state_deref(open);
+    }
+}
+
 #pragma warning (disable : 4706) /* assignment within conditional expression */
 
-static int delegation_return(
+/* everything up to the DELEGRETURN: invalidate the kernel's cache,
+ * flush writes, and move any delegated opens and locks to the server */
+static void delegation_return_prepare(
     IN nfs41_client *client,
     IN nfs41_delegation_state *deleg,
     IN bool_t truncate,
     IN bool_t try_recovery)
 {
-    stateid_arg stateid;
     nfs41_open_state *open;
     int status;
 
@@ -298,6 +395,8 @@ static int delegation_return(
     }
 out_downcall:
 
+    delegation_flush_writes(&client->state, deleg);
+
     /* recover opens and locks associated with the delegation */
     while (open = deleg_open_find(&client->state, deleg)) {
         status = nfs41_delegation_to_open(open, try_recovery);
@@ -308,14 +407,30 @@ out_downcall:
         if (status)
             break;
     }
+}
+
+static void delegation_stateid(
+    IN nfs41_delegation_state *deleg,
+    OUT stateid_arg *stateid)
+{
+    stateid->type = STATEID_DELEG_FILE;
+    stateid->open = NULL;
+    stateid->delegation = deleg;
+    AcquireSRWLockShared(&deleg->lock);
+    stateid4_cpy(&stateid->stateid, &deleg->state.stateid);
+    ReleaseSRWLockShared(&deleg->lock);
+}
+
+static int delegation_return_finish(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN bool_t try_recovery)
+{
+    stateid_arg stateid;
+    int status;
 
     /* return the delegation */
-    stateid.type = STATEID_DELEG_FILE;
-    stateid.open = NULL;
-    stateid.delegation = deleg;
-    AcquireSRWLockShared(&deleg->lock);
-    stateid4_cpy(&stateid.stateid, &deleg->state.stateid);
-    ReleaseSRWLockShared(&deleg->lock);
+    delegation_stateid(deleg, &stateid);
 
     status = nfs41_delegreturn(client->session,
         &deleg->file, &stateid, try_recovery);
@@ -327,6 +442,16 @@ out:
     return status;
 }
 
+static int delegation_return(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN bool_t truncate,
+    IN bool_t try_recovery)
+{
+    delegation_return_prepare(client, deleg, truncate, try_recovery);
+    return delegation_return_finish(client, deleg, try_recovery);
+}
+
 /* open delegation */
 int nfs41_delegation_granted(
     IN nfs41_session *session,
@@ -359,6 +484,7 @@ int nfs41_delegation_granted(
     EnterCriticalSection(&client->state.lock);
     /* XXX: check for duplicates by fh and stateid? */
     list_add_tail(&client->state.delegations, &state->client_entry);
+    delegation_index_add(&client->state, state);
     LeaveCriticalSection(&client->state.lock);
 
     nfs41_delegation_ref(state); /* return a reference */
@@ -375,11 +501,29 @@ out_return: /* return the delegation on failure */
     goto out;
 }
 
+
+void nfs41_delegation_reclaimed(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN const open_delegation4 *delegation)
+{
+    /* the server may hand back a new stateid, so move the
+     * delegation to its new bucket in delegations_by_stateid */
+    state_index_remove(&client->state.delegations_by_stateid,
+        stateid_hash(&deleg->state.stateid), &deleg->stateid_entry);
+    open_delegation4_cpy(&deleg->state, delegation);
+    state_index_add(&client->state.delegations_by_stateid,
+        stateid_hash(&deleg->state.stateid), &deleg->stateid_entry);
+}
+
 #define deleg_entry(pos) list_container(pos, nfs41_delegation_state, client_entry)
+#define deleg_stateid_entry(pos) list_container(pos, nfs41_delegation_state, stateid_entry)
+#define deleg_fh_entry(pos) list_container(pos, nfs41_delegation_state, fh_entry)
+#define deleg_fileid_entry(pos) list_container(pos, nfs41_delegation_state, fileid_entry)
 
 static int deleg_file_cmp(const struct list_entry *entry, const void *value)
 {
-    const nfs41_fh *lhs = &deleg_entry(entry)->file.fh;
+    const nfs41_fh *lhs = &deleg_fileid_entry(entry)->file.fh;
     const nfs41_fh *rhs = (const nfs41_fh*)value;
     if (lhs->superblock != rhs->superblock) return -1;
     if (lhs->fileid != rhs->fileid) return -1;
@@ -413,31 +557,95 @@ static bool_t delegation_compatible(
     }
 }
 
+/* delegation scoring: each lookup adds to a delegation's heat, which
+ * halves for every DELEGATION_HEAT_HALFLIFE ms that it goes unused.
+ * its value is its heat plus a large bonus for each open that holds
+ * a reference, so eviction and CB_RECALL_ANY take the coldest first
+ * and hot files keep their delegations under pressure */
+#define DELEGATION_HEAT_HALFLIFE 30000
+#define DELEGATION_HEAT_USE 16
+#define DELEGATION_HEAT_MAX 0x40000000
+#define DELEGATION_OPEN_VALUE 4096
+
+static uint32_t delegation_heat(
+    IN const nfs41_delegation_state *deleg,
+    IN uint64_t now)
+{
+    const uint64_t last_used = (uint64_t)deleg->last_used;
+    const uint64_t halvings = now > last_used ?
+        (now - last_used) / DELEGATION_HEAT_HALFLIFE : 0;
+    return halvings >= 32 ? 0 : deleg->heat >> halvings;
+}
+
+static void delegation_touch(
+    IN nfs41_delegation_state *deleg)
+{
+    const uint64_t now = GetTickCount64();
+    uint32_t heat;
+
+    AcquireSRWLockExclusive(&deleg->lock);
+    heat = delegation_heat(deleg, now) + DELEGATION_HEAT_USE;
+    deleg->heat = min(heat, DELEGATION_HEAT_MAX);
+    InterlockedExchange64(&deleg->last_used, now);
+    ReleaseSRWLockExclusive(&deleg->lock);
+}
+
+static uint64_t delegation_score(
+    IN nfs41_delegation_state *deleg,
+    IN uint64_t now)
+{
+    /* the client's list holds one reference; the rest are opens,
+     * or lookups that are about to become opens */
+    const LONG opens = deleg->ref_count - 1;
+    uint64_t score;
+
+    AcquireSRWLockShared(&deleg->lock);
+    score = delegation_heat(deleg, now);
+    ReleaseSRWLockShared(&deleg->lock);
+
+    if (opens > 0)
+        score += (uint64_t)opens * DELEGATION_OPEN_VALUE;
+    return score;
+}
+
 static int delegation_find(
-    IN nfs41_client *client,
+    IN struct state_index *index,
+    IN uint32_t hash,
     IN const void *value,
     IN list_compare_fn cmp,
+    IN size_t entry_offset,
     OUT nfs41_delegation_state **deleg_out)
 {
+    struct state_bucket *bucket = state_index_bucket(index, hash);
     struct list_entry *entry;
     int status = NFS4ERR_BADHANDLE;
 
-    EnterCriticalSection(&client->state.lock);
-    entry = list_search(&client->state.delegations, value, cmp);
+    AcquireSRWLockShared(&bucket->lock);
+    entry = list_search(&bucket->head, value, cmp);
     if (entry) {
         /* return a reference to the delegation */
-        *deleg_out = deleg_entry(entry);
+        *deleg_out = (nfs41_delegation_state*)((char*)entry - entry_offset);
         nfs41_delegation_ref(*deleg_out);
-
-        /* move to the 'most recently used' end of the list */
-        list_remove(entry);
-        list_add_tail(&client->state.delegations, entry);
         status = NFS4_OK;
     }
-    LeaveCriticalSection(&client->state.lock);
+    ReleaseSRWLockShared(&bucket->lock);
+
+    /* outside of the bucket lock; recovery takes them in reverse */
+    if (status == NFS4_OK)
+        delegation_touch(*deleg_out);
     return status;
 }
 
+static int delegation_find_file(
+    IN nfs41_client *client,
+    IN const nfs41_fh *fh,
+    OUT nfs41_delegation_state **deleg_out)
+{
+    return delegation_find(&client->state.delegations_by_fileid,
+        fileid_hash(fh->fileid), fh, deleg_file_cmp,
+        FIELD_OFFSET(nfs41_delegation_state, fileid_entry), deleg_out);
+}
+
 static int delegation_truncate(
     IN nfs41_delegation_state *deleg,
     IN nfs41_client *client,
@@ -475,7 +683,7 @@ int nfs41_delegate_open(
     int status;
 
     /* search for a delegation with this filehandle */
-    status = delegation_find(client, &file->fh, deleg_file_cmp, &deleg);
+    status = delegation_find_file(client, &file->fh, &deleg);
     if (status)
         goto out;
 
@@ -615,7 +823,7 @@ void nfs41_delegation_remove_srvopen(
     nfs41_delegation_state *deleg = NULL;
 
     /* find a delegation for this file */
-    if (delegation_find(session->client, &file->fh, deleg_file_cmp, &deleg))
+    if (delegation_find_file(session->client, &file->fh, &deleg))
         return;
     DPRINTF(1, ("nfs41_delegation_remove_srvopen: removing reference to "
         "srv_open=%x\n", deleg->srv_open));
@@ -638,7 +846,7 @@ int nfs41_delegation_return(
     int status;
 
     /* find a delegation for this file */
-    status = delegation_find(client, &file->fh, deleg_file_cmp, &deleg);
+    status = delegation_find_file(client, &file->fh, &deleg);
     if (status)
         goto out;
 
@@ -671,28 +879,517 @@ out:
 
 
 /* asynchronous delegation recall */
-struct recall_thread_args {
+/* directory delegation
+ *
+ *   a directory delegation lets us cache a directory's names and its
+ * listing until the server recalls it.  we ask for CB_NOTIFY on added,
+ * removed and renamed entries, and on changes to the attributes of the
+ * directory and its entries, so that the server doesn't have to recall
+ * the delegation for them; nfs41_readdir_notify() applies each change
+ * to the name cache and the listing.  directory delegations can't be
+ * reclaimed, so state recovery just forgets them */
+#define DIR_DELEGATION_MAX 64
+
+#define NOTIFY_MASK(type) (1u << (type))
+#define DIR_DELEGATION_NOTIFY ( \
+    NOTIFY_MASK(NOTIFY4_CHANGE_CHILD_ATTRS) | \
+    NOTIFY_MASK(NOTIFY4_CHANGE_DIR_ATTRS) | \
+    NOTIFY_MASK(NOTIFY4_REMOVE_ENTRY) | \
+    NOTIFY_MASK(NOTIFY4_ADD_ENTRY) | \
+    NOTIFY_MASK(NOTIFY4_RENAME_ENTRY) | \
+    NOTIFY_MASK(NOTIFY4_CHANGE_COOKIE_VERIFIER))
+
+#define dir_deleg_entry(pos) list_container(pos, nfs41_dir_delegation, client_entry)
+
+static int dir_deleg_fh_cmp(const struct list_entry *entry, const void *value)
+{
+    const nfs41_fh *lhs = &dir_deleg_entry(entry)->file.fh;
+    const nfs41_fh *rhs = (const nfs41_fh*)value;
+    if (lhs->superblock != rhs->superblock) return -1;
+    if (lhs->fileid != rhs->fileid) return -1;
+    return 0;
+}
+
+static int dir_deleg_stateid_cmp(const struct list_entry *entry, const void *value)
+{
+    const stateid4 *lhs = &dir_deleg_entry(entry)->stateid;
+    const stateid4 *rhs = (const stateid4*)value;
+    return memcmp(lhs->other, rhs->other, NFS4_STATEID_OTHER);
+}
+
+/* release the name cache's hold on the directory and free the delegation */
+static void dir_delegation_remove(
+    IN nfs41_client *client,
+    IN nfs41_dir_delegation *deleg)
+{
+    if (client->server)
+        nfs41_name_cache_dir_delegreturn(client_name_cache(client),
+            &deleg->file.fh);
+
+    EnterCriticalSection(&client->state.lock);
+    list_remove(&deleg->client_entry);
+    client->state.dir_delegation_count--;
+    LeaveCriticalSection(&client->state.lock);
+
+    free(deleg);
+}
+
+static int dir_delegation_return(
+    IN nfs41_client *client,
+    IN nfs41_dir_delegation *deleg,
+    IN bool_t try_recovery)
+{
+    stateid_arg stateid;
+    int status;
+
+    stateid.type = STATEID_DELEG_DIR;
+    stateid.open = NULL;
+    stateid.delegation = NULL;
+    stateid4_cpy(&stateid.stateid, &deleg->stateid);
+
+    status = nfs41_delegreturn(client->session,
+        &deleg->file, &stateid, try_recovery);
+
+    dir_delegation_remove(client, deleg);
+    return status;
+}
+
+int nfs41_delegation_dir_request(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN const bitmap4 *child_attributes)
+{
+    nfs41_client *client = session->client;
+    nfs41_get_dir_delegation_args args = { 0 };
+    nfs41_get_dir_delegation_res res = { 0 };
+    nfs41_dir_delegation *deleg;
+    bool_t hold_attributes;
+    int status = NFS4_OK;
+
+    EnterCriticalSection(&client->state.lock);
+    if (client->state.dir_delegation_unsupported ||
+        client->state.dir_delegation_count >= DIR_DELEGATION_MAX ||
+        list_search(&client->state.dir_delegations, &dir->fh, dir_deleg_fh_cmp))
+        status = NFS4ERR_DELAY;
+    LeaveCriticalSection(&client->state.lock);
+    if (status)
+        goto out;
+
+    args.signal_deleg_avail = FALSE;
+    args.notification_types.count = 1;
+    args.notification_types.arr[0] = DIR_DELEGATION_NOTIFY;
+    bitmap4_cpy(&args.child_attributes, child_attributes);
+    args.dir_attributes.count = 1;
+    args.dir_attributes.arr[0] = FATTR4_WORD0_CHANGE;
+
+    status = nfs41_get_dir_delegation(session, dir, &args, &res);
+    if (status == NFS4ERR_NOTSUPP) {
+        /* don't ask this server again */
+        EnterCriticalSection(&client->state.lock);
+        client->state.dir_delegation_unsupported = TRUE;
+        LeaveCriticalSection(&client->state.lock);
+        goto out;
+    }
+    if (status)
+        goto out;
+    if (res.gdd_status != GDD4_OK) {
+        status = NFS4ERR_DELAY;
+        goto out;
+    }
+
+    deleg = calloc(1, sizeof(nfs41_dir_delegation));
+    if (deleg == NULL) {
+        status = NFS4ERR_SERVERFAULT;
+        goto out_return;
+    }
+    stateid4_cpy(&deleg->stateid, &res.stateid);
+    AcquireSRWLockShared(&dir->path->lock);
+    abs_path_copy(&deleg->path, dir->path);
+    ReleaseSRWLockShared(&dir->path->lock);
+    path_fh_init(&deleg->file, &deleg->path);
+    fh_copy(&deleg->file.fh, &dir->fh);
+    bitmap4_cpy(&deleg->notification, &res.notification);
+    bitmap4_cpy(&deleg->child_attributes, &res.child_attributes);
+    list_init(&deleg->client_entry);
+    deleg->status = DELEGATION_GRANTED;
+
+    /* the directory's attributes are only covered if the server will
+     * notify us when its change attribute does */
+    hold_attributes =
+        bitmap_isset(&res.notification, 0,
+            NOTIFY_MASK(NOTIFY4_CHANGE_DIR_ATTRS)) &&
+        bitmap_isset(&res.dir_attributes, 0, FATTR4_WORD0_CHANGE);
+
+    /* register the delegation and hold the directory in the name cache
+     * under the state lock, so a recall can't come between them */
+    EnterCriticalSection(&client->state.lock);
+    if (list_search(&client->state.dir_delegations,
+            &dir->fh, dir_deleg_fh_cmp)) {
+        /* another thread got one first */
+        LeaveCriticalSection(&client->state.lock);
+        free(deleg);
+        goto out_return;
+    }
+    list_add_tail(&client->state.dir_delegations, &deleg->client_entry);
+    client->state.dir_delegation_count++;
+    nfs41_name_cache_dir_delegate(session_name_cache(session),
+        deleg->path.path, &deleg->file.name, &deleg->file.fh,
+        hold_attributes);
+    LeaveCriticalSection(&client->state.lock);
+
+    DPRINTF(DGLVL, ("nfs41_delegation_dir_request('%s') granted, "
+        "notification=0x%x\n", deleg->path.path,
+        res.notification.count ? res.notification.arr[0] : 0));
+out:
+    return status;
+
+out_return: /* return the delegation on failure */
+    {
+        stateid_arg stateid;
+        stateid.type = STATEID_DELEG_DIR;
+        stateid.open = NULL;
+        stateid.delegation = NULL;
+        stateid4_cpy(&stateid.stateid, &res.stateid);
+        nfs41_delegreturn(session, dir, &stateid, TRUE);
+    }
+    goto out;
+}
+
+bool_t nfs41_delegation_dir_listing(
+    IN nfs41_client *client,
+    IN const nfs41_fh *dir)
+{
+    struct list_entry *entry;
+    nfs41_dir_delegation *deleg;
+    bool_t held = FALSE;
+
+    EnterCriticalSection(&client->state.lock);
+    entry = list_search(&client->state.dir_delegations, dir, dir_deleg_fh_cmp);
+    if (entry) {
+        /* the entries' attributes are only covered if the server
+         * will notify us when they change */
+        deleg = dir_deleg_entry(entry);
+        held = deleg->status == DELEGATION_GRANTED &&
+            bitmap_isset(&deleg->notification, 0,
+                NOTIFY_MASK(NOTIFY4_CHANGE_CHILD_ATTRS));
+    }
+    LeaveCriticalSection(&client->state.lock);
+    return held;
+}
+
+int nfs41_delegation_notify(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid,
+    IN struct notify_dir4 *changes,
+    IN uint32_t count)
+{
+    struct list_entry *entry;
+    nfs41_abs_path path;
+    nfs41_fh dir;
+    bool_t have_path;
+    uint32_t i;
+    int status = NFS4_OK;
+
+    DPRINTF(2, ("--> nfs41_delegation_notify(%u changes)\n", count));
+
+    /* copy the directory out, since a recall could free the delegation */
+    EnterCriticalSection(&client->state.lock);
+    entry = list_search(&client->state.dir_delegations,
+        stateid, dir_deleg_stateid_cmp);
+    if (entry)
+        fh_copy(&dir, &dir_deleg_entry(entry)->file.fh);
+    else
+        status = NFS4ERR_BAD_STATEID;
+    LeaveCriticalSection(&client->state.lock);
+    if (status)
+        goto out;
+
+    /* the path we were granted it under may have been renamed since;
+     * without a current one, only the attributes and listing are updated */
+    have_path = nfs41_name_cache_dir_path(client_name_cache(client),
+        &dir, &path) == NO_ERROR;
+
+    for (i = 0; i < count; i++)
+        nfs41_readdir_notify(client_name_cache(client),
+            have_path ? &path : NULL, &dir, &changes[i]);
+out:
+    DPRINTF(DGLVL, ("<-- nfs41_delegation_notify() returning '%s'\n",
+        nfs_error_string(status)));
+    return status;
+}
+
+/* recalled delegations are returned by a pool of long-lived workers.
+ * the callback thread can't make rpc calls, so it only queues a job;
+ * the pool grows on demand up to RECALL_MAX_WORKERS.  a worker takes
+ * up to NFS41_DELEGRETURN_BATCH queued file delegations of the same
+ * client, and returns them together in a single compound.  jobs for
+ * CB_RECALL go ahead of those for CB_RECALL_ANY, since another client
+ * is waiting on them, and a large CB_RECALL_ANY can queue hundreds */
+#define RECALL_MAX_WORKERS 8
+
+struct recall_job {
+    struct list_entry       entry; /* in recall_pool.queue */
     nfs41_client            *client;
     nfs41_delegation_state  *delegation;
+    nfs41_dir_delegation    *dir_delegation;
     bool_t                  truncate;
+    bool_t                  recalled; /* by CB_RECALL */
+    uint64_t                queued; /* util_getusec() */
+};
+
+static struct recall_pool {
+    SRWLOCK                 lock;
+    CONDITION_VARIABLE      cond;
+    struct list_entry       queue;
+    uint32_t                workers;
+    uint32_t                idle;
+
+    /* recall-to-return latency, in microseconds */
+    uint64_t                returned;
+    uint64_t                latency_total;
+    uint64_t                latency_max;
+} recall_pool = {
+    SRWLOCK_INIT,
+    CONDITION_VARIABLE_INIT,
+    { &recall_pool.queue, &recall_pool.queue },
+    0
 };
 
-static unsigned int WINAPI delegation_recall_thread(void *args)
+#define recall_job_entry(pos) list_container(pos, struct recall_job, entry)
+
+static void recall_job_free(
+    IN struct recall_job *job)
 {
-    struct recall_thread_args *recall = (struct recall_thread_args*)args;
+    if (job->delegation)
+        nfs41_delegation_deref(job->delegation);
+    nfs41_root_deref(job->client->root);
+    free(job);
+}
 
-    delegation_return(recall->client, recall->delegation, recall->truncate, TRUE);
+static void recall_job_done(
+    IN struct recall_job *job,
+    IN uint64_t now)
+{
+    const uint64_t latency = now > job->queued ? now - job->queued : 0;
+    uint64_t returned, average, worst;
+
+    AcquireSRWLockExclusive(&recall_pool.lock);
+    recall_pool.returned++;
+    recall_pool.latency_total += latency;
+    if (recall_pool.latency_max < latency)
+        recall_pool.latency_max = latency;
+    returned = recall_pool.returned;
+    average = recall_pool.latency_total / returned;
+    worst = recall_pool.latency_max;
+    ReleaseSRWLockExclusive(&recall_pool.lock);
+
+    DPRINTF(DGLVL, ("recall returned after %llu us (%llu returned, "
+        "average %llu us, max %llu us)\n", latency, returned, average, worst));
+    recall_job_free(job);
+}
 
-    /* clean up thread arguments */
-    nfs41_delegation_deref(recall->delegation);
-    nfs41_root_deref(recall->client->root);
-    free(recall);
+/* return a batch of file delegations of the same client */
+static void recall_return_batch(
+    IN struct recall_job **jobs,
+    IN uint32_t count)
+{
+    nfs41_delegreturn_batch_args returns[NFS41_DELEGRETURN_BATCH];
+    nfs41_client *client = jobs[0]->client;
+    nfs41_delegation_state *deleg;
+    uint32_t i, sent = 0;
+    int status = NFS4_OK;
+
+    for (i = 0; i < count; i++) {
+        deleg = jobs[i]->delegation;
+        delegation_return_prepare(client, deleg, jobs[i]->truncate, TRUE);
+
+        returns[i].file = &deleg->file;
+        delegation_stateid(deleg, &returns[i].stateid);
+    }
+
+    /* resend any that the server didn't get to */
+    while (sent < count) {
+        status = nfs41_delegreturn_batch(client->session,
+            count - sent, returns + sent);
+        if (status)
+            break;
+
+        for (i = sent; i < count && returns[i].status == NFS4_OK; i++)
+            delegation_remove(client, jobs[i]->delegation);
+        if (i < count && returns[i].status != NFS4ERR_DELAY)
+            break; /* it failed; don't resend the rest together */
+        if (i == sent)
+            break; /* no progress */
+        sent = i;
+    }
+
+    /* fall back to a separate DELEGRETURN with recovery for the rest */
+    for (i = sent; i < count; i++)
+        if (returns[i].status != NFS4_OK)
+            delegation_return_finish(client, jobs[i]->delegation, TRUE);
+}
+
+/* take the next job, along with any file delegations of the same
+ * client that fit in one compound.  a CB_RECALL is only batched with
+ * other CB_RECALLs, so it doesn't wait on the opens that a batch of
+ * CB_RECALL_ANY jobs would have to flush before the compound goes out.
+ * called with recall_pool.lock held */
+static uint32_t recall_pool_take(
+    OUT struct recall_job **jobs)
+{
+    struct list_entry *entry, *tmp;
+    struct recall_job *job;
+    uint32_t count = 0, limit = NFS41_DELEGRETURN_BATCH;
+
+    job = recall_job_entry(recall_pool.queue.next);
+    list_remove(&job->entry);
+    jobs[count++] = job;
+    if (job->delegation == NULL)
+        return count;
+
+    limit = min(limit, (job->client->session->fore_chan_attrs.
+        ca_maxoperations - 1) / 2);
+
+    list_for_each_tmp(entry, tmp, &recall_pool.queue) {
+        if (count >= limit)
+            break;
+        job = recall_job_entry(entry);
+        if (job->client == jobs[0]->client && job->delegation &&
+            job->recalled == jobs[0]->recalled) {
+            list_remove(&job->entry);
+            jobs[count++] = job;
+        }
+    }
+    return count;
+}
+
+static unsigned int WINAPI recall_worker(void *args)
+{
+    struct recall_job *jobs[NFS41_DELEGRETURN_BATCH];
+    uint64_t now;
+    uint32_t i, count;
+
+    for (;;) {
+        AcquireSRWLockExclusive(&recall_pool.lock);
+        recall_pool.idle++;
+        while (list_empty(&recall_pool.queue))
+            SleepConditionVariableSRW(&recall_pool.cond,
+                &recall_pool.lock, INFINITE, 0);
+        recall_pool.idle--;
+        count = recall_pool_take(jobs);
+        ReleaseSRWLockExclusive(&recall_pool.lock);
+
+        if (jobs[0]->dir_delegation)
+            dir_delegation_return(jobs[0]->client,
+                jobs[0]->dir_delegation, TRUE);
+        else
+            recall_return_batch(jobs, count);
+
+        now = util_getusec();
+        for (i = 0; i < count; i++)
+            recall_job_done(jobs[i], now);
+    }
     return 0;
 }
 
+/* queue a delegation to be returned by the recall pool; takes over the
+ * caller's reference on a file delegation, and adds one on the root */
+static int recall_pool_queue(
+    IN nfs41_client *client,
+    IN OPTIONAL nfs41_delegation_state *deleg,
+    IN OPTIONAL nfs41_dir_delegation *dir,
+    IN bool_t truncate,
+    IN bool_t recalled)
+{
+    struct list_entry *next;
+    struct recall_job *job;
+    HANDLE thread;
+    int status = NFS4_OK;
+
+    job = calloc(1, sizeof(struct recall_job));
+    if (job == NULL) {
+        status = NFS4ERR_SERVERFAULT;
+        eprintf("recall_pool_queue() failed to allocate a job\n");
+        goto out;
+    }
+
+    /* hold a reference on the root */
+    nfs41_root_ref(client->root);
+    job->client = client;
+    job->delegation = deleg;
+    job->dir_delegation = dir;
+    job->truncate = truncate;
+    job->recalled = recalled;
+    job->queued = util_getusec();
+
+    AcquireSRWLockExclusive(&recall_pool.lock);
+    if (recalled) {
+        /* after other recalls, but before any CB_RECALL_ANY jobs */
+        next = recall_pool.queue.next;
+        while (next != &recall_pool.queue && recall_job_entry(next)->recalled)
+            next = next->next;
+        list_add(&job->entry, next->prev, next);
+    } else
+        list_add_tail(&recall_pool.queue, &job->entry);
+
+    /* start another worker if none are waiting for work */
+    if (recall_pool.idle == 0 && recall_pool.workers < RECALL_MAX_WORKERS) {
+        thread = (HANDLE)_beginthreadex(NULL, 0, recall_worker, NULL, 0, NULL);
+        if (thread) {
+            CloseHandle(thread);
+            recall_pool.workers++;
+        } else if (recall_pool.workers == 0) {
+            /* nobody to run it */
+            list_remove(&job->entry);
+            status = NFS4ERR_SERVERFAULT;
+            eprintf("recall_pool_queue() failed to start a worker %d\n",
+                GetLastError());
+        }
+    }
+    ReleaseSRWLockExclusive(&recall_pool.lock);
+
+    if (status) {
+        nfs41_root_deref(client->root);
+        free(job);
+        goto out;
+    }
+    WakeConditionVariable(&recall_pool.cond);
+out:
+    return status;
+}
+
+static int dir_delegation_recall(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid)
+{
+    struct list_entry *entry;
+    nfs41_dir_delegation *deleg = NULL;
+    int status = NFS4ERR_BADHANDLE;
+
+    EnterCriticalSection(&client->state.lock);
+    entry = list_search(&client->state.dir_delegations,
+        stateid, dir_deleg_stateid_cmp);
+    if (entry) {
+        deleg = dir_deleg_entry(entry);
+        /* return BADHANDLE if we've already responded to CB_RECALL */
+        if (deleg->status == DELEGATION_GRANTED) {
+            deleg->status = DELEGATION_RETURNING;
+            status = NFS4_OK;
+        }
+    }
+    LeaveCriticalSection(&client->state.lock);
+    if (status)
+        goto out;
+
+    /* the callback thread can't make rpc calls, so queue it */
+    status = recall_pool_queue(client, NULL, deleg, FALSE, TRUE);
+out:
+    return status;
+}
+
 static int deleg_stateid_cmp(const struct list_entry *entry, const void *value)
 {
-    const stateid4 *lhs = &deleg_entry(entry)->state.stateid;
+    const stateid4 *lhs = &deleg_stateid_entry(entry)->state.stateid;
     const stateid4 *rhs = (const stateid4*)value;
     return memcmp(lhs->other, rhs->other, NFS4_STATEID_OTHER);
 }
@@ -704,7 +1401,6 @@ int nfs41_delegation_recall(
     IN bool_t truncate)
 {
     nfs41_delegation_state *deleg;
-    struct recall_thread_args *args;
     int status;
 
     DPRINTF(2, ("--> nfs41_delegation_recall()\n"));
@@ -712,9 +1408,14 @@ int nfs41_delegation_recall(
     /* search for the delegation by stateid instead of filehandle;
      * deleg_file_cmp() relies on a proper superblock and fileid,
      * which we don't get with CB_RECALL */
-    status = delegation_find(client, stateid, deleg_stateid_cmp, &deleg);
-    if (status)
+    status = delegation_find(&client->state.delegations_by_stateid,
+        stateid_hash(stateid), stateid, deleg_stateid_cmp,
+        FIELD_OFFSET(nfs41_delegation_state, stateid_entry), &deleg);
+    if (status) {
+        /* CB_RECALL is also used for directory delegations */
+        status = dir_delegation_recall(client, stateid);
         goto out;
+    }
 
     AcquireSRWLockExclusive(&deleg->lock);
     if (deleg->state.recalled) {
@@ -734,44 +1435,200 @@ int nfs41_delegation_recall(
     if (status != NFS4ERR_DELEG_REVOKED)
         goto out_deleg;
 
-    /* allocate thread arguments */
-    args = calloc(1, sizeof(struct recall_thread_args));
-    if (args == NULL) {
-        status = NFS4ERR_SERVERFAULT;
-        eprintf("nfs41_delegation_recall() failed to allocate arguments\n");
+    /* the callback thread can't make rpc calls, so queue it;
+     * the job takes over our reference on the delegation */
+    status = recall_pool_queue(client, deleg, NULL, truncate, TRUE);
+    if (status)
         goto out_deleg;
-    }
-
-    /* hold a reference on the root */
-    nfs41_root_ref(client->root);
-    args->client = client;
-    args->delegation = deleg;
-    args->truncate = truncate;
-
-    /* the callback thread can't make rpc calls, so spawn a separate thread */
-    if (_beginthreadex(NULL, 0, delegation_recall_thread, args, 0, NULL) == 0) {
-        status = NFS4ERR_SERVERFAULT;
-        eprintf("nfs41_delegation_recall() failed to start thread\n");
-        goto out_args;
-    }
-    status = NFS4_OK;
 out:
     DPRINTF(DGLVL, ("<-- nfs41_delegation_recall() returning '%s'\n",
         nfs_error_string(status)));
     return status;
 
-out_args:
-    free(args);
-    nfs41_root_deref(client->root);
 out_deleg:
     nfs41_delegation_deref(deleg);
     goto out;
 }
 
 
+/* CB_RECALL_ANY */
+struct recall_any_candidate {
+    uint64_t                score;
+    LONGLONG                last_used;
+    nfs41_delegation_state  *deleg;
+    nfs41_dir_delegation    *dir;
+};
+
+static int recall_any_cmp(const void *lhs, const void *rhs)
+{
+    const struct recall_any_candidate *l = lhs, *r = rhs;
+    if (l->score != r->score)
+        return l->score < r->score ? -1 : 1;
+    if (l->last_used != r->last_used)
+        return l->last_used < r->last_used ? -1 : 1;
+    return 0;
+}
+
+static bool_t recall_any_type(
+    IN const bitmap4 *type_mask,
+    IN uint32_t type)
+{
+    if (type == OPEN_DELEGATE_READ)
+        return (type_mask->arr[0] & (1 << RCA4_TYPE_MASK_RDATA_DLG)) != 0;
+    if (type == OPEN_DELEGATE_WRITE)
+        return (type_mask->arr[0] & (1 << RCA4_TYPE_MASK_WDATA_DLG)) != 0;
+    return FALSE;
+}
+
+/* status can change under deleg->lock alone, so the count and the
+ * scoring pass below may disagree; both check it under the lock */
+static bool_t recall_any_eligible(
+    IN nfs41_delegation_state *deleg,
+    IN const bitmap4 *type_mask)
+{
+    bool_t eligible;
+
+    AcquireSRWLockShared(&deleg->lock);
+    eligible = deleg->status == DELEGATION_GRANTED &&
+        recall_any_type(type_mask, deleg->state.type);
+    ReleaseSRWLockShared(&deleg->lock);
+    return eligible;
+}
+
+/* directory delegations change status under client->state.lock */
+static bool_t recall_any_dir_eligible(
+    IN nfs41_dir_delegation *deleg,
+    IN const bitmap4 *type_mask)
+{
+    return deleg->status == DELEGATION_GRANTED &&
+        (type_mask->arr[0] & (1 << RCA4_TYPE_MASK_DIR_DLG)) != 0;
+}
+
+int nfs41_delegation_recall_any(
+    IN nfs41_client *client,
+    IN uint32_t objects_to_keep,
+    IN const bitmap4 *type_mask)
+{
+    struct recall_any_candidate *candidates = NULL;
+    struct list_entry *entry;
+    nfs41_delegation_state *deleg;
+    nfs41_dir_delegation *dir;
+    const uint64_t now = GetTickCount64();
+    uint32_t count = 0, i, n = 0;
+    int status = NFS4_OK;
+
+    DPRINTF(2, ("--> nfs41_delegation_recall_any(%u)\n", objects_to_keep));
+
+    if (type_mask->count == 0)
+        goto out;
+
+    EnterCriticalSection(&client->state.lock);
+
+    /* count the delegations of the requested types */
+    list_for_each(entry, &client->state.delegations)
+        if (recall_any_eligible(deleg_entry(entry), type_mask))
+            count++;
+    list_for_each(entry, &client->state.dir_delegations)
+        if (recall_any_dir_eligible(dir_deleg_entry(entry), type_mask))
+            count++;
+    if (count <= objects_to_keep)
+        goto out_unlock;
+
+    candidates = calloc(count, sizeof(struct recall_any_candidate));
+    if (candidates == NULL) {
+        status = NFS4ERR_SERVERFAULT;
+        eprintf("nfs41_delegation_recall_any() failed to allocate candidates\n");
+        goto out_unlock;
+    }
+
+    /* score them, including those in use; the server asked for
+     * a number, and delegation_return() recovers their opens */
+    i = 0;
+    list_for_each(entry, &client->state.delegations) {
+        deleg = deleg_entry(entry);
+        if (i == count)
+            break;
+        if (recall_any_eligible(deleg, type_mask)) {
+            candidates[i].score = delegation_score(deleg, now);
+            candidates[i].last_used = deleg->last_used;
+            candidates[i].deleg = deleg;
+            i++;
+        }
+    }
+    /* directory delegations hold no opens or dirty data, only the
+     * cached listing, so they score as the coldest */
+    list_for_each(entry, &client->state.dir_delegations) {
+        dir = dir_deleg_entry(entry);
+        if (i == count)
+            break;
+        if (recall_any_dir_eligible(dir, type_mask)) {
+            candidates[i].dir = dir;
+            i++;
+        }
+    }
+    /* some may have been returned in the meantime */
+    count = i;
+    if (count <= objects_to_keep)
+        goto out_unlock;
+    qsort(candidates, count, sizeof(struct recall_any_candidate), recall_any_cmp);
+
+    /* start returning the coldest, keeping objects_to_keep */
+    for (i = 0; i < count - objects_to_keep; i++) {
+        dir = candidates[i].dir;
+        if (dir) {
+            dir->status = DELEGATION_RETURNING;
+            candidates[n].deleg = NULL;
+            candidates[n++].dir = dir;
+            continue;
+        }
+        deleg = candidates[i].deleg;
+        AcquireSRWLockExclusive(&deleg->lock);
+        if (deleg->status == DELEGATION_GRANTED) {
+            deleg->status = DELEGATION_RETURNING;
+            nfs41_delegation_ref(deleg);
+            candidates[n].dir = NULL;
+            candidates[n++].deleg = deleg;
+        }
+        ReleaseSRWLockExclusive(&deleg->lock);
+    }
+    LeaveCriticalSection(&client->state.lock);
+
+    /* the recall pool returns them coldest first, in batches */
+    for (i = 0; i < n; i++) {
+        deleg = candidates[i].deleg;
+        dir = candidates[i].dir;
+        if (recall_pool_queue(client, deleg, dir, FALSE, FALSE) == NFS4_OK)
+            continue;
+
+        /* put it back as it was */
+        status = NFS4ERR_SERVERFAULT;
+        if (dir) {
+            EnterCriticalSection(&client->state.lock);
+            dir->status = DELEGATION_GRANTED;
+            LeaveCriticalSection(&client->state.lock);
+            continue;
+        }
+        AcquireSRWLockExclusive(&deleg->lock);
+        deleg->status = DELEGATION_GRANTED;
+        WakeAllConditionVariable(&deleg->cond);
+        ReleaseSRWLockExclusive(&deleg->lock);
+        nfs41_delegation_deref(deleg);
+    }
+out:
+    free(candidates);
+    DPRINTF(DGLVL, ("<-- nfs41_delegation_recall_any() returning '%s'\n",
+        nfs_error_string(status)));
+    return status;
+
+out_unlock:
+    LeaveCriticalSection(&client->state.lock);
+    goto out;
+}
+
+
 static int deleg_fh_cmp(const struct list_entry *entry, const void *value)
 {
-    const nfs41_fh *lhs = &deleg_entry(entry)->file.fh;
+    const nfs41_fh *lhs = &deleg_fh_entry(entry)->file.fh;
     const nfs41_fh *rhs = (const nfs41_fh*)value;
     if (lhs->len != rhs->len) return -1;
     return memcmp(lhs->fh, rhs->fh, lhs->len);
@@ -790,7 +1647,9 @@ int nfs41_delegation_getattr(
     DPRINTF(2, ("--> nfs41_delegation_getattr()\n"));
 
     /* search for a delegation on this file handle */
-    status = delegation_find(client, fh, deleg_fh_cmp, &deleg);
+    status = delegation_find(&client->state.delegations_by_fh,
+        fh_hash(fh), fh, deleg_fh_cmp,
+        FIELD_OFFSET(nfs41_delegation_state, fh_entry), &deleg);
     if (status)
         goto out;
 
@@ -830,8 +1689,11 @@ void nfs41_client_delegation_free(
     EnterCriticalSection(&client->state.lock);
     list_for_each_tmp (entry, tmp, &client->state.delegations) {
         list_remove(entry);
+        delegation_index_remove(&client->state, deleg_entry(entry));
         nfs41_delegation_deref(deleg_entry(entry));
     }
+    list_for_each_tmp (entry, tmp, &client->state.dir_delegations)
+        dir_delegation_remove(client, dir_deleg_entry(entry));
     LeaveCriticalSection(&client->state.lock);
 }
 
@@ -885,6 +1747,14 @@ int nfs41_client_delegation_recovery(
             goto out;
     }
 
+    /* directory delegations can't be reclaimed; 'forget' the ones that
+     * aren't already being returned by a recall thread */
+    list_for_each_tmp(entry, tmp, &client->state.dir_delegations) {
+        nfs41_dir_delegation *dir = dir_deleg_entry(entry);
+        if (dir->status == DELEGATION_GRANTED)
+            dir_delegation_remove(client, dir);
+    }
+
     /* use DELEGPURGE to indicate that we're done reclaiming delegations */
     status = nfs41_delegpurge(client->session);
 
@@ -900,39 +1770,43 @@ int nfs41_client_delegation_return_lru(
     IN nfs41_client *client)
 {
     struct list_entry *entry;
-    nfs41_delegation_state *state = NULL;
+    nfs41_delegation_state *state, *coldest = NULL;
+    const uint64_t now = GetTickCount64();
+    uint64_t score, lowest = 0;
     int status = NFS4ERR_BADHANDLE;
 
-    /* starting from the least recently opened, find and return
-     * the first delegation that's not 'in use' (currently open) */
-
-    /* TODO: use a more robust algorithm, taking into account:
-     *  -number of total opens
-     *  -time since last operation on an associated open, or
-     *  -number of operations/second over last n seconds */
+    /* find and return the delegation of lowest value that's
+     * not 'in use' (currently open) */
     EnterCriticalSection(&client->state.lock);
     list_for_each(entry, &client->state.delegations) {
         state = deleg_entry(entry);
 
-        /* skip if it's currently in use for an open; note that ref_count
-         * can't go from 1 to 2 without holding client->state.lock */
-        if (state->ref_count > 1)
+        /* skip if it's currently in use for an open */
+        if (state->ref_count > 1 || state->status != DELEGATION_GRANTED)
             continue;
 
-        AcquireSRWLockExclusive(&state->lock);
-        if (state->status == DELEGATION_GRANTED) {
+        score = delegation_score(state, now);
+        if (coldest == NULL || score < lowest || (score == lowest &&
+                state->last_used < coldest->last_used)) {
+            coldest = state;
+            lowest = score;
+        }
+    }
+    if (coldest) {
+        AcquireSRWLockExclusive(&coldest->lock);
+        if (coldest->status == DELEGATION_GRANTED) {
             /* start returning the delegation */
-            state->status = DELEGATION_RETURNING;
+            coldest->status = DELEGATION_RETURNING;
             status = NFS4ERR_DELEG_REVOKED;
         }
-        ReleaseSRWLockExclusive(&state->lock);
-
-        if (status == NFS4ERR_DELEG_REVOKED)
-            break;
+        ReleaseSRWLockExclusive(&coldest->lock);
     }
     LeaveCriticalSection(&client->state.lock);
 
+    /* lookups through the indexes take a reference without holding
+     * client->state.lock, so an open may still race with us here;
+     * delegation_return() recovers its state as it does for a recall */
     if (status == NFS4ERR_DELEG_REVOKED)
-        status = delegation_return(client, state, FALSE, TRUE);
+        status = delegation_return(client, coldest, FALSE, TRUE);
     return status;
 }
@@ -49,6 +49,12 @@ int nfs41_delegation_granted(
     IN bool_t try_recovery,
     OUT nfs41_delegation_state **deleg_out);
 
+/* called by recovery with client_state.lock and deleg->lock held */
+void nfs41_delegation_reclaimed(
+    IN nfs41_client *client,
+    IN nfs41_delegation_state *deleg,
+    IN const open_delegation4 *delegation);
+
 int nfs41_delegate_open(
     IN nfs41_open_state *state,
     IN uint32_t create,
@@ -89,6 +95,13 @@ int nfs41_delegation_recall(
     IN const stateid4 *stateid,
     IN bool_t truncate);
 
+/* CB_RECALL_ANY: return the coldest delegations of the given types
+ * in the background, keeping no more than objects_to_keep */
+int nfs41_delegation_recall_any(
+    IN nfs41_client *client,
+    IN uint32_t objects_to_keep,
+    IN const bitmap4 *type_mask);
+
 int nfs41_delegation_getattr(
     IN nfs41_client *client,
     IN const nfs41_fh *fh,
@@ -96,13 +109,35 @@ int nfs41_delegation_getattr(
     OUT nfs41_file_info *info);
 
 
+/* directory delegation */
+struct notify_dir4; /* from nfs41_callback.h */
+
+/* ask for a delegation on a directory that's listed often, with
+ * CB_NOTIFY for changes to its entries and their child_attributes */
+int nfs41_delegation_dir_request(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN const bitmap4 *child_attributes);
+
+/* whether a delegation lets us hold the directory's listing */
+bool_t nfs41_delegation_dir_listing(
+    IN nfs41_client *client,
+    IN const nfs41_fh *dir);
+
+int nfs41_delegation_notify(
+    IN nfs41_client *client,
+    IN const stateid4 *stateid,
+    IN struct notify_dir4 *changes,
+    IN uint32_t count);
+
+
 /* after client state recovery, return any 'recalled' delegations;
  * must be called under the client's state lock */
 int nfs41_client_delegation_recovery(
     IN nfs41_client *client);
 
-/* attempt to return the least recently used delegation;
- * fails with NFS4ERR_BADHANDLE if all delegations are in use */
+/* attempt to return the delegation of lowest value, as scored by
+ * recent use; fails with NFS4ERR_BADHANDLE if all are in use */
 int nfs41_client_delegation_return_lru(
     IN nfs41_client *client);
 
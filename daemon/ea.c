@@ -298,8 +298,7 @@ static int read_entire_dir(
             last_entry = (nfs41_readdir_entry*)(buffer + total_len);
         } else if (len) {
             /* link the previous list to the new one */
-            last_entry->next_entry_offset = (uint32_t)FIELD_OFFSET(
-                nfs41_readdir_entry, name) + last_entry->name_len;
+            last_entry->next_entry_offset = readdir_entry_size(last_entry);
         }
 
         /* find the new last entry */
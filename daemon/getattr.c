@@ -27,6 +27,7 @@
 #include "nfs41_build_features.h"
 #include "nfs41_ops.h"
 #include "name_cache.h"
+#include "readwrite.h"
 #include "nfs41_driver.h" /* only for |NFS41_FILE_QUERY*| */
 #include "upcall.h"
 #include "daemon_debug.h"
@@ -151,6 +152,11 @@ static int handle_getattr(void *daemon_context, nfs41_upcall *upcall)
     }
 #endif /* NFS41_DRIVER_WORKAROUND_FOR_GETATTR_AFTER_CLOSE_HACKS */
 
+    /* the size and times must include writes buffered by any open */
+    status = nfs41_write_behind_flush_file(state, FALSE);
+    if (status)
+        goto out;
+
     status = nfs41_cached_getattr(state->session, &state->file, &info);
     if (status) {
         eprintf("nfs41_cached_getattr() failed with %d\n", status);
@@ -25,6 +25,7 @@
 #include <Winldap.h>
 #include <stdlib.h> /* for strtoul() */
 #include <errno.h>
+#include <process.h> /* for _beginthreadex() */
 
 #include "nfs41_build_features.h"
 #include "idmap.h"
@@ -69,11 +70,15 @@ enum ldap_attr {
 
 
 /* ldap/cache lookups */
+enum config_type {
+    TYPE_STR,
+    TYPE_INT
+};
+
 struct idmap_lookup {
     enum ldap_attr attr;
     enum ldap_class klass;
     enum config_type type;
-    list_compare_fn compare;
     const void *value;
 };
 
@@ -96,14 +101,10 @@ struct idmap_config {
 
     /* caching configuration */
     INT cache_ttl;
+    INT cache_negative_ttl;
 };
 
 
-enum config_type {
-    TYPE_STR,
-    TYPE_INT
-};
-
 struct config_option {
     const char *key;
     const char *def;
@@ -142,6 +143,7 @@ static const struct config_option g_options[] = {
 
     /* caching configuration */
     OPT_INT("cache_ttl", "6000", cache_ttl),
+    OPT_INT("cache_negative_ttl", "60", cache_negative_ttl),
 };
 
 
@@ -385,117 +387,464 @@ out:
 }
 
 
-/* generic cache */
-typedef struct list_entry* (*entry_alloc_fn)();
-typedef void (*entry_free_fn)(struct list_entry*);
-typedef void (*entry_copy_fn)(struct list_entry*, const struct list_entry*);
+/* generic cache
+ *
+ *   entries are kept on a list, and indexed by each of their keys (name,
+ * principal and uid for users; name and gid for groups) in chained hash
+ * tables that double in size once they average more than
+ * CACHE_LOAD_FACTOR entries per bucket.
+ *   lookups that the server can't resolve are cached as negative entries,
+ * indexed only by the key that missed, and expire after negative_ttl.
+ * a hit on an entry in the last quarter of its ttl is still returned,
+ * but also queues a single refresh for idmap_refresh_thread(), so that
+ * identities in regular use don't wait on the server when they expire.
+ *   positive and negative entries are kept on separate lists, newest
+ * first, so that idmap_refresh_thread() can free the expired ones from
+ * the tail of each; see cache_reap() */
+#define CACHE_MAX_KEYS 3
+#define CACHE_INITIAL_BUCKETS 64
+#define CACHE_LOAD_FACTOR 2
+#define CACHE_REAP_BATCH 256
+
+struct cache_entry {
+    struct list_entry list;
+    struct list_entry index[CACHE_MAX_KEYS];
+    util_reltimestamp last_updated;
+    enum ldap_attr negative_attr;
+    bool_t negative;
+    LONG refreshing;
+};
+
+#define cache_index_entry(pos, i) ((struct cache_entry*)((char*)(pos) - \
+    FIELD_OFFSET(struct cache_entry, index) - (i) * sizeof(struct list_entry)))
+
+typedef struct cache_entry* (*entry_alloc_fn)();
+typedef void (*entry_free_fn)(struct cache_entry*);
+typedef void (*entry_copy_fn)(struct cache_entry*, const struct cache_entry*);
+typedef bool_t (*entry_key_fn)(const struct cache_entry*, enum ldap_attr, const void**);
+typedef void (*entry_set_key_fn)(struct cache_entry*, enum ldap_attr, const void*);
 
 struct cache_ops {
     entry_alloc_fn entry_alloc;
     entry_free_fn entry_free;
     entry_copy_fn entry_copy;
+    entry_key_fn entry_key;
+    entry_set_key_fn entry_set_key;
+    uint32_t key_count;
+    enum ldap_attr keys[CACHE_MAX_KEYS];
 };
 
 struct idmap_cache {
     struct list_entry head;
+    struct list_entry negative_head;
+    struct list_entry *tables[CACHE_MAX_KEYS];
+    uint32_t bucket_count;
+    uint32_t count;
     const struct cache_ops *ops;
+    util_reltimestamp ttl;
+    util_reltimestamp negative_ttl;
     SRWLOCK lock;
 };
 
 
-static void cache_init(
+static __inline bool_t attr_is_id(
+    enum ldap_attr attr)
+{
+    return attr == ATTR_UID || attr == ATTR_GID;
+}
+
+static uint32_t cache_key_hash(
+    enum ldap_attr attr,
+    const void *value)
+{
+    const unsigned char *s;
+    uint32_t i, id, hash = 2166136261u;
+
+    if (attr_is_id(attr)) {
+        id = PTR2UINT(value);
+        for (i = 0; i < sizeof(id); i++, id >>= 8)
+            hash = (hash ^ (id & 0xff)) * 16777619u;
+    } else {
+        for (s = (const unsigned char*)value; *s; s++)
+            hash = (hash ^ *s) * 16777619u;
+    }
+    return hash;
+}
+
+static bool_t cache_key_equal(
+    enum ldap_attr attr,
+    const void *lhs,
+    const void *rhs)
+{
+    if (attr_is_id(attr))
+        return PTR2UINT(lhs) == PTR2UINT(rhs);
+    return strcmp((const char*)lhs, (const char*)rhs) == 0;
+}
+
+static struct list_entry* cache_bucket(
+    struct idmap_cache *cache,
+    uint32_t index,
+    const void *value)
+{
+    const uint32_t hash = cache_key_hash(cache->ops->keys[index], value);
+    return &cache->tables[index][hash & (cache->bucket_count - 1)];
+}
+
+static int cache_tables_alloc(
+    struct list_entry *tables[],
+    uint32_t table_count,
+    uint32_t bucket_count)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < table_count; i++) {
+        tables[i] = calloc(bucket_count, sizeof(struct list_entry));
+        if (tables[i] == NULL) {
+            while (i--) {
+                free(tables[i]);
+                tables[i] = NULL;
+            }
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        for (j = 0; j < bucket_count; j++)
+            list_init(&tables[i][j]);
+    }
+    return NO_ERROR;
+}
+
+/* add the entry to the table of each key it has; negative
+ * entries only have the key that missed */
+static void cache_index(
+    struct idmap_cache *cache,
+    struct cache_entry *entry)
+{
+    const struct cache_ops *ops = cache->ops;
+    const void *value;
+    uint32_t i;
+
+    for (i = 0; i < ops->key_count; i++) {
+        list_init(&entry->index[i]);
+        if (entry->negative && entry->negative_attr != ops->keys[i])
+            continue;
+        if (!ops->entry_key(entry, ops->keys[i], &value))
+            continue;
+        list_add_head(cache_bucket(cache, i, value), &entry->index[i]);
+    }
+}
+
+static struct cache_entry* cache_find(
+    struct idmap_cache *cache,
+    enum ldap_attr attr,
+    const void *value)
+{
+    const struct cache_ops *ops = cache->ops;
+    struct list_entry *pos;
+    struct cache_entry *entry;
+    const void *key;
+    uint32_t i;
+
+    for (i = 0; i < ops->key_count; i++)
+        if (ops->keys[i] == attr)
+            break;
+    if (i == ops->key_count)
+        return NULL;
+
+    list_for_each(pos, cache_bucket(cache, i, value)) {
+        entry = cache_index_entry(pos, i);
+        if (ops->entry_key(entry, attr, &key) &&
+            cache_key_equal(attr, key, value))
+            return entry;
+    }
+    return NULL;
+}
+
+static void cache_remove(
+    struct idmap_cache *cache,
+    struct cache_entry *entry)
+{
+    uint32_t i;
+
+    list_remove(&entry->list);
+    for (i = 0; i < cache->ops->key_count; i++)
+        list_remove(&entry->index[i]);
+    cache->ops->entry_free(entry);
+    cache->count--;
+}
+
+/* remove any entries that share a key with 'src' */
+static void cache_remove_keys(
+    struct idmap_cache *cache,
+    const struct cache_entry *src)
+{
+    const struct cache_ops *ops = cache->ops;
+    struct cache_entry *entry;
+    const void *value;
+    uint32_t i;
+
+    for (i = 0; i < ops->key_count; i++) {
+        if (src->negative && src->negative_attr != ops->keys[i])
+            continue;
+        if (!ops->entry_key(src, ops->keys[i], &value))
+            continue;
+        while ((entry = cache_find(cache, ops->keys[i], value)) != NULL)
+            cache_remove(cache, entry);
+    }
+}
+
+static void cache_grow(
+    struct idmap_cache *cache)
+{
+    struct list_entry *tables[CACHE_MAX_KEYS] = { NULL };
+    struct list_entry *pos;
+    uint32_t i;
+
+    /* on allocation failure, keep using the current tables */
+    if (cache_tables_alloc(tables, cache->ops->key_count,
+            cache->bucket_count * 2))
+        return;
+
+    for (i = 0; i < cache->ops->key_count; i++) {
+        free(cache->tables[i]);
+        cache->tables[i] = tables[i];
+    }
+    cache->bucket_count *= 2;
+
+    list_for_each(pos, &cache->head)
+        cache_index(cache, list_container(pos, struct cache_entry, list));
+    list_for_each(pos, &cache->negative_head)
+        cache_index(cache, list_container(pos, struct cache_entry, list));
+
+    DPRINTF(IDLVL, ("cache_grow() %u entries in %u buckets\n",
+        cache->count, cache->bucket_count));
+}
+
+/* add a new entry; called with the lock held exclusive */
+static void cache_add(
+    struct idmap_cache *cache,
+    struct cache_entry *entry)
+{
+    cache_remove_keys(cache, entry);
+
+    list_add_head(entry->negative ? &cache->negative_head : &cache->head,
+        &entry->list);
+    cache_index(cache, entry);
+
+    if (++cache->count > cache->bucket_count * CACHE_LOAD_FACTOR)
+        cache_grow(cache);
+}
+
+static void cache_entry_copy(
+    struct idmap_cache *cache,
+    struct cache_entry *dst,
+    const struct cache_entry *src)
+{
+    cache->ops->entry_copy(dst, src);
+    dst->last_updated = src->last_updated;
+    dst->negative_attr = src->negative_attr;
+    dst->negative = src->negative;
+}
+
+
+static int cache_init(
     struct idmap_cache *cache,
     const struct cache_ops *ops)
 {
     list_init(&cache->head);
+    list_init(&cache->negative_head);
     cache->ops = ops;
+    cache->bucket_count = CACHE_INITIAL_BUCKETS;
     InitializeSRWLock(&cache->lock);
+    return cache_tables_alloc(cache->tables,
+        ops->key_count, cache->bucket_count);
 }
 
 static void cache_cleanup(
     struct idmap_cache *cache)
 {
     struct list_entry *entry, *tmp;
+    uint32_t i;
+
     list_for_each_tmp(entry, tmp, &cache->head)
-        cache->ops->entry_free(entry);
+        cache->ops->entry_free(list_container(entry, struct cache_entry, list));
+    list_for_each_tmp(entry, tmp, &cache->negative_head)
+        cache->ops->entry_free(list_container(entry, struct cache_entry, list));
     list_init(&cache->head);
+    list_init(&cache->negative_head);
+    cache->count = 0;
+
+    for (i = 0; i < CACHE_MAX_KEYS; i++) {
+        free(cache->tables[i]);
+        cache->tables[i] = NULL;
+    }
 }
 
 static int cache_insert(
     struct idmap_cache *cache,
-    const struct idmap_lookup *lookup,
-    const struct list_entry *src)
+    const struct cache_entry *src)
 {
-    struct list_entry *entry;
+    struct cache_entry *entry;
     int status = NO_ERROR;
 
-    AcquireSRWLockExclusive(&cache->lock);
-
-    /* search for an existing match */
-    entry = list_search(&cache->head, lookup->value, lookup->compare);
-    if (entry) {
-        /* overwrite the existing entry with the new results */
-        cache->ops->entry_copy(entry, src);
+    /* initialize a new entry; this replaces any existing
+     * entries that share one of its keys */
+    entry = cache->ops->entry_alloc();
+    if (entry == NULL) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
         goto out;
     }
+    cache_entry_copy(cache, entry, src);
+    entry->negative = FALSE;
+
+    AcquireSRWLockExclusive(&cache->lock);
+    cache_add(cache, entry);
+    ReleaseSRWLockExclusive(&cache->lock);
+out:
+    return status;
+}
+
+/* record that the server has no entry for the lookup's key */
+static int cache_insert_negative(
+    struct idmap_cache *cache,
+    const struct idmap_lookup *lookup)
+{
+    struct cache_entry *entry;
+    int status = NO_ERROR;
 
-    /* initialize a new entry and add it to the list */
     entry = cache->ops->entry_alloc();
     if (entry == NULL) {
-        status = GetLastError();
+        status = ERROR_NOT_ENOUGH_MEMORY;
         goto out;
     }
-    cache->ops->entry_copy(entry, src);
-    list_add_head(&cache->head, entry);
-out:
+    cache->ops->entry_set_key(entry, lookup->attr, lookup->value);
+    entry->negative_attr = lookup->attr;
+    entry->negative = TRUE;
+    entry->last_updated = UTIL_GETRELTIME();
+
+    AcquireSRWLockExclusive(&cache->lock);
+    if (cache->negative_ttl) {
+        cache_add(cache, entry);
+        entry = NULL;
+    } else {
+        /* negative caching is disabled; just drop any stale entry */
+        cache_remove_keys(cache, entry);
+    }
     ReleaseSRWLockExclusive(&cache->lock);
+
+    if (entry)
+        cache->ops->entry_free(entry);
+out:
     return status;
 }
 
 static int cache_lookup(
     struct idmap_cache *cache,
     const struct idmap_lookup *lookup,
-    struct list_entry *entry_out)
+    struct cache_entry *entry_out,
+    bool_t *refresh_out)
 {
-    struct list_entry *entry;
+    struct cache_entry *entry;
+    util_reltimestamp age;
     int status = ERROR_NOT_FOUND;
 
     AcquireSRWLockShared(&cache->lock);
 
-    entry = list_search(&cache->head, lookup->value, lookup->compare);
-    if (entry) {
-        /* make a copy for use outside of the lock */
-        cache->ops->entry_copy(entry_out, entry);
-        status = NO_ERROR;
-    }
+    entry = cache_find(cache, lookup->attr, lookup->value);
+    if (entry == NULL)
+        goto out;
+
+    /* don't return expired entries */
+    age = UTIL_DIFFRELTIME(UTIL_GETRELTIME(), entry->last_updated);
+    if (age >= (entry->negative ? cache->negative_ttl : cache->ttl))
+        goto out;
 
+    /* ask for one refresh once the entry nears expiration */
+    *refresh_out = !entry->negative && age >= cache->ttl - cache->ttl / 4 &&
+        InterlockedCompareExchange(&entry->refreshing, 1, 0) == 0;
+
+    /* make a copy for use outside of the lock */
+    cache_entry_copy(cache, entry_out, entry);
+    status = NO_ERROR;
+out:
     ReleaseSRWLockShared(&cache->lock);
     return status;
 }
 
+/* free the expired entries at the tail of one list, stopping at the
+ * first one that's still valid.  the lock is dropped after every
+ * CACHE_REAP_BATCH entries, so lookups don't wait on a long sweep */
+static uint32_t cache_reap_list(
+    struct idmap_cache *cache,
+    struct list_entry *head,
+    util_reltimestamp ttl,
+    util_reltimestamp now)
+{
+    struct cache_entry *entry;
+    util_reltimestamp age;
+    uint32_t i, count = 0;
+
+    do {
+        AcquireSRWLockExclusive(&cache->lock);
+        for (i = 0; i < CACHE_REAP_BATCH && !list_empty(head); i++) {
+            entry = list_container(head->prev, struct cache_entry, list);
+            age = UTIL_DIFFRELTIME(now, entry->last_updated);
+            if (age < ttl)
+                break;
+            cache_remove(cache, entry);
+        }
+        ReleaseSRWLockExclusive(&cache->lock);
+        count += i;
+    } while (i == CACHE_REAP_BATCH);
+    return count;
+}
+
+/* free entries that lookups would ignore anyway, so the cache doesn't
+ * keep every identity and every miss it has ever seen */
+static uint32_t cache_reap(
+    struct idmap_cache *cache)
+{
+    const util_reltimestamp now = UTIL_GETRELTIME();
+
+    return cache_reap_list(cache, &cache->head, cache->ttl, now) +
+        cache_reap_list(cache, &cache->negative_head,
+            cache->negative_ttl, now);
+}
+
+/* allow another refresh of an entry whose refresh failed */
+static void cache_refresh_cancel(
+    struct idmap_cache *cache,
+    const struct idmap_lookup *lookup)
+{
+    struct cache_entry *entry;
+
+    AcquireSRWLockShared(&cache->lock);
+    entry = cache_find(cache, lookup->attr, lookup->value);
+    if (entry)
+        InterlockedExchange(&entry->refreshing, 0);
+    ReleaseSRWLockShared(&cache->lock);
+}
+
 
 /* user cache */
 struct idmap_user {
-    struct list_entry entry;
+    struct cache_entry entry;
     char username[VAL_LEN];
     char principal[VAL_LEN];
     uid_t uid;
     gid_t gid;
-    util_reltimestamp last_updated;
 };
 
-static struct list_entry* user_cache_alloc()
+static struct cache_entry* user_cache_alloc()
 {
     struct idmap_user *user = calloc(1, sizeof(struct idmap_user));
     return user == NULL ? NULL : &user->entry;
 }
-static void user_cache_free(struct list_entry *entry)
+static void user_cache_free(struct cache_entry *entry)
 {
     free(list_container(entry, struct idmap_user, entry));
 }
 static void user_cache_copy(
-    struct list_entry *lhs,
-    const struct list_entry *rhs)
+    struct cache_entry *lhs,
+    const struct cache_entry *rhs)
 {
     struct idmap_user *dst = list_container(lhs, struct idmap_user, entry);
     const struct idmap_user *src = list_container(rhs, const struct idmap_user, entry);
@@ -503,46 +852,123 @@ static void user_cache_copy(
     StringCchCopyA(dst->principal, VAL_LEN, src->principal);
     dst->uid = src->uid;
     dst->gid = src->gid;
-    dst->last_updated = src->last_updated;
+}
+static bool_t user_cache_key(
+    const struct cache_entry *entry,
+    enum ldap_attr attr,
+    const void **value)
+{
+    const struct idmap_user *user = list_container(entry, const struct idmap_user, entry);
+    switch (attr) {
+    case ATTR_USER_NAME:
+        *value = user->username;
+        return user->username[0] != 0;
+    case ATTR_PRINCIPAL:
+        *value = user->principal;
+        return user->principal[0] != 0;
+    case ATTR_UID:
+        *value = UID_T2PTR(user->uid);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+static void user_cache_set_key(
+    struct cache_entry *entry,
+    enum ldap_attr attr,
+    const void *value)
+{
+    struct idmap_user *user = list_container(entry, struct idmap_user, entry);
+    switch (attr) {
+    case ATTR_USER_NAME:
+        StringCchCopyA(user->username, VAL_LEN, (const char*)value);
+        break;
+    case ATTR_PRINCIPAL:
+        StringCchCopyA(user->principal, VAL_LEN, (const char*)value);
+        break;
+    case ATTR_UID:
+        user->uid = PTR2UID_T(value);
+        break;
+    default:
+        break;
+    }
 }
 static const struct cache_ops user_cache_ops = {
     user_cache_alloc,
     user_cache_free,
-    user_cache_copy
+    user_cache_copy,
+    user_cache_key,
+    user_cache_set_key,
+    3, { ATTR_USER_NAME, ATTR_PRINCIPAL, ATTR_UID }
 };
 
 
 /* group cache */
 struct idmap_group {
-    struct list_entry entry;
+    struct cache_entry entry;
     char name[VAL_LEN];
     gid_t gid;
-    util_reltimestamp last_updated;
 };
 
-static struct list_entry* group_cache_alloc()
+static struct cache_entry* group_cache_alloc()
 {
     struct idmap_group *group = calloc(1, sizeof(struct idmap_group));
     return group == NULL ? NULL : &group->entry;
 }
-static void group_cache_free(struct list_entry *entry)
+static void group_cache_free(struct cache_entry *entry)
 {
     free(list_container(entry, struct idmap_group, entry));
 }
 static void group_cache_copy(
-    struct list_entry *lhs,
-    const struct list_entry *rhs)
+    struct cache_entry *lhs,
+    const struct cache_entry *rhs)
 {
     struct idmap_group *dst = list_container(lhs, struct idmap_group, entry);
     const struct idmap_group *src = list_container(rhs, const struct idmap_group, entry);
     StringCchCopyA(dst->name, VAL_LEN, src->name);
     dst->gid = src->gid;
-    dst->last_updated = src->last_updated;
+}
+static bool_t group_cache_key(
+    const struct cache_entry *entry,
+    enum ldap_attr attr,
+    const void **value)
+{
+    const struct idmap_group *group = list_container(entry, const struct idmap_group, entry);
+    switch (attr) {
+    case ATTR_GROUP_NAME:
+        *value = group->name;
+        return group->name[0] != 0;
+    case ATTR_GID:
+        *value = GID_T2PTR(group->gid);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+static void group_cache_set_key(
+    struct cache_entry *entry,
+    enum ldap_attr attr,
+    const void *value)
+{
+    struct idmap_group *group = list_container(entry, struct idmap_group, entry);
+    switch (attr) {
+    case ATTR_GROUP_NAME:
+        StringCchCopyA(group->name, VAL_LEN, (const char*)value);
+        break;
+    case ATTR_GID:
+        group->gid = PTR2GID_T(value);
+        break;
+    default:
+        break;
+    }
 }
 static const struct cache_ops group_cache_ops = {
     group_cache_alloc,
     group_cache_free,
-    group_cache_copy
+    group_cache_copy,
+    group_cache_key,
+    group_cache_set_key,
+    2, { ATTR_GROUP_NAME, ATTR_GID }
 };
 
 
@@ -552,6 +978,14 @@ struct idmap_context {
     struct idmap_cache users;
     struct idmap_cache groups;
     LDAP *ldap;
+
+    /* asynchronous cache refresh */
+    struct list_entry refresh_queue;
+    uint32_t refresh_count;
+    SRWLOCK refresh_lock;
+    CONDITION_VARIABLE refresh_cond;
+    HANDLE refresh_thread;
+    bool_t refresh_shutdown;
 };
 
 
@@ -628,7 +1062,8 @@ static int idmap_query_attrs(
         status = LDAP_NO_RESULTS_RETURNED;
         eprintf("ldap search for '%s' failed with %d: '%s'\n",
             filter, status, ldap_err2stringA(status));
-        status = LdapMapErrorToWin32(status);
+        /* ERROR_NOT_FOUND results are cached as negative entries */
+        status = ERROR_NOT_FOUND;
         goto out;
     }
 
@@ -655,7 +1090,8 @@ out:
     return status;
 }
 
-static int idmap_lookup_user(
+/* query the server for a user, bypassing the cache */
+static int idmap_query_user(
     struct idmap_context *context,
     const struct idmap_lookup *lookup,
     struct idmap_user *user)
@@ -671,14 +1107,6 @@ static int idmap_lookup_user(
 #endif /* !NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN */
     int i, status;
 
-    /* check the user cache for an existing entry */
-    status = cache_lookup(&context->users, lookup, &user->entry);
-    if (status == NO_ERROR) {
-        /* don't return expired entries; query new attributes
-         * and overwrite the entry with cache_insert() */
-        if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), user->last_updated) < context->config.cache_ttl)
-            goto out;
-    }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
     /* send the query to the ldap server */
     status = idmap_query_attrs(context, lookup,
@@ -715,7 +1143,7 @@ static int idmap_lookup_user(
         status = ERROR_INVALID_PARAMETER;
         goto out_free_values;
     }
-    user->last_updated = UTIL_GETRELTIME();
+    user->entry.last_updated = UTIL_GETRELTIME();
 #else
     if (lookup->attr == ATTR_USER_NAME) {
         char principal_name[VAL_LEN];
@@ -804,7 +1232,7 @@ static int idmap_lookup_user(
     }
 
     if (status == 0) {
-        user->last_updated = UTIL_GETRELTIME();
+        user->entry.last_updated = UTIL_GETRELTIME();
         DPRINTF(CYGWINIDLVL, ("## idmap_lookup_user: "
             "found username='%s', principal='%s', uid=%u, gid=%u\n",
             user->username,
@@ -813,20 +1241,16 @@ static int idmap_lookup_user(
             (unsigned int)user->gid));
     }
 #endif /* !NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN */
-    if (context->config.cache_ttl) {
-        /* insert the entry into the cache */
-        cache_insert(&context->users, lookup, &user->entry);
-    }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
 out_free_values:
 #endif
     for (i = 0; i < NUM_ATTRIBUTES; i++)
         ldap_value_freeA(values[i]);
-out:
     return status;
 }
 
-static int idmap_lookup_group(
+/* query the server for a group, bypassing the cache */
+static int idmap_query_group(
     struct idmap_context *context,
     const struct idmap_lookup *lookup,
     struct idmap_group *group)
@@ -838,14 +1262,6 @@ static int idmap_lookup_group(
 #endif
     int i, status;
 
-    /* check the group cache for an existing entry */
-    status = cache_lookup(&context->groups, lookup, &group->entry);
-    if (status == NO_ERROR) {
-        /* don't return expired entries; query new attributes
-         * and overwrite the entry with cache_insert() */
-        if (UTIL_DIFFRELTIME(UTIL_GETRELTIME(), group->last_updated) < context->config.cache_ttl)
-            goto out;
-    }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
     /* send the query to the ldap server */
     status = idmap_query_attrs(context, lookup,
@@ -868,7 +1284,7 @@ static int idmap_lookup_group(
         status = ERROR_INVALID_PARAMETER;
         goto out_free_values;
     }
-    group->last_updated = UTIL_GETRELTIME();
+    group->entry.last_updated = UTIL_GETRELTIME();
 #else
     if (lookup->attr == ATTR_GROUP_NAME) {
         gid_t cy_gid = 0;
@@ -911,22 +1327,220 @@ static int idmap_lookup_group(
     }
 
     if (status == 0) {
-        group->last_updated = UTIL_GETRELTIME();
+        group->entry.last_updated = UTIL_GETRELTIME();
         DPRINTF(CYGWINIDLVL,
             ("## idmap_lookup_group: found name='%s', gid=%u\n",
             group->name,
             (unsigned int)group->gid));
     }
 #endif /* !NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN */
-    if (context->config.cache_ttl) {
-        /* insert the entry into the cache */
-        cache_insert(&context->groups, lookup, &group->entry);
-    }
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
 out_free_values:
 #endif
     for (i = 0; i < NUM_ATTRIBUTES; i++)
         ldap_value_freeA(values[i]);
+    return status;
+}
+
+/* cache the result of a query; a lookup that the server
+ * couldn't resolve is cached as a negative entry */
+static void idmap_cache_result(
+    struct idmap_cache *cache,
+    const struct idmap_lookup *lookup,
+    const struct cache_entry *entry,
+    int status)
+{
+    if (status == NO_ERROR)
+        status = cache_insert(cache, entry);
+    else if (status == ERROR_NOT_FOUND)
+        status = cache_insert_negative(cache, lookup);
+
+    if (status)
+        cache_refresh_cancel(cache, lookup);
+}
+
+
+/* asynchronous refresh */
+#define REFRESH_QUEUE_MAX 256
+#define REAP_INTERVAL_MAX 60 /* seconds */
+
+struct idmap_refresh {
+    struct list_entry entry;
+    struct idmap_lookup lookup;
+    char value[VAL_LEN];
+};
+
+static void idmap_refresh_queue(
+    struct idmap_context *context,
+    const struct idmap_lookup *lookup)
+{
+    struct idmap_cache *cache = lookup->klass == CLASS_USER ?
+        &context->users : &context->groups;
+    struct idmap_refresh *refresh;
+    bool_t queued = FALSE;
+
+    refresh = calloc(1, sizeof(struct idmap_refresh));
+    if (refresh == NULL)
+        goto out;
+
+    /* copy the key, which belongs to the caller */
+    refresh->lookup = *lookup;
+    if (lookup->type == TYPE_STR) {
+        if (FAILED(StringCchCopyA(refresh->value, VAL_LEN,
+                (const char*)lookup->value)))
+            goto out;
+        refresh->lookup.value = refresh->value;
+    }
+
+    AcquireSRWLockExclusive(&context->refresh_lock);
+    if (context->refresh_thread && !context->refresh_shutdown &&
+        context->refresh_count < REFRESH_QUEUE_MAX) {
+        list_add_tail(&context->refresh_queue, &refresh->entry);
+        context->refresh_count++;
+        queued = TRUE;
+    }
+    ReleaseSRWLockExclusive(&context->refresh_lock);
+
+    if (queued)
+        WakeConditionVariable(&context->refresh_cond);
+out:
+    if (!queued) {
+        /* let a later hit try again */
+        free(refresh);
+        cache_refresh_cancel(cache, lookup);
+    }
+}
+
+/* reap expired entries about as often as the shortest ttl */
+static util_reltimestamp idmap_reap_interval(
+    const struct idmap_context *context)
+{
+    util_reltimestamp interval = min(context->users.ttl, REAP_INTERVAL_MAX);
+    if (context->users.negative_ttl)
+        interval = min(interval, context->users.negative_ttl);
+    return max(interval, 1);
+}
+
+static unsigned int WINAPI idmap_refresh_thread(void *args)
+{
+    struct idmap_context *context = (struct idmap_context*)args;
+    struct idmap_refresh *refresh;
+    struct idmap_user user;
+    struct idmap_group group;
+    util_reltimestamp now, next_reap;
+    uint32_t reaped;
+    int status;
+
+    next_reap = UTIL_GETRELTIME() + idmap_reap_interval(context);
+
+    for (;;) {
+        refresh = NULL;
+
+        AcquireSRWLockExclusive(&context->refresh_lock);
+        while (list_empty(&context->refresh_queue) && !context->refresh_shutdown) {
+            now = UTIL_GETRELTIME();
+            if (now >= next_reap)
+                break;
+            SleepConditionVariableSRW(&context->refresh_cond,
+                &context->refresh_lock, (DWORD)(next_reap - now) * 1000, 0);
+        }
+        if (context->refresh_shutdown) {
+            ReleaseSRWLockExclusive(&context->refresh_lock);
+            break;
+        }
+        if (!list_empty(&context->refresh_queue)) {
+            refresh = list_container(context->refresh_queue.next,
+                struct idmap_refresh, entry);
+            list_remove(&refresh->entry);
+            context->refresh_count--;
+        }
+        ReleaseSRWLockExclusive(&context->refresh_lock);
+
+        if (refresh) {
+            if (refresh->lookup.klass == CLASS_USER) {
+                ZeroMemory(&user, sizeof(user));
+                status = idmap_query_user(context, &refresh->lookup, &user);
+                idmap_cache_result(&context->users,
+                    &refresh->lookup, &user.entry, status);
+            } else {
+                ZeroMemory(&group, sizeof(group));
+                status = idmap_query_group(context, &refresh->lookup, &group);
+                idmap_cache_result(&context->groups,
+                    &refresh->lookup, &group.entry, status);
+            }
+            DPRINTF(IDLVL, ("idmap_refresh_thread() refreshed %s entry, "
+                "status %d\n", context->config.attributes[refresh->lookup.attr],
+                status));
+            free(refresh);
+        }
+
+        /* reap on schedule, even while refreshes keep coming in */
+        now = UTIL_GETRELTIME();
+        if (now >= next_reap) {
+            reaped = cache_reap(&context->users) +
+                cache_reap(&context->groups);
+            DPRINTF(IDLVL, ("idmap_refresh_thread() reaped %u expired "
+                "entries\n", reaped));
+            next_reap = now + idmap_reap_interval(context);
+        }
+    }
+    return 0;
+}
+
+static int idmap_lookup_user(
+    struct idmap_context *context,
+    const struct idmap_lookup *lookup,
+    struct idmap_user *user)
+{
+    bool_t refresh = FALSE;
+    int status;
+
+    if (context->config.cache_ttl) {
+        /* check the user cache for an existing entry */
+        status = cache_lookup(&context->users, lookup, &user->entry, &refresh);
+        if (status == NO_ERROR) {
+            if (user->entry.negative)
+                status = ERROR_NOT_FOUND;
+            else if (refresh)
+                idmap_refresh_queue(context, lookup);
+            goto out;
+        }
+    }
+
+    ZeroMemory(user, sizeof(struct idmap_user));
+    status = idmap_query_user(context, lookup, user);
+
+    if (context->config.cache_ttl)
+        idmap_cache_result(&context->users, lookup, &user->entry, status);
+out:
+    return status;
+}
+
+static int idmap_lookup_group(
+    struct idmap_context *context,
+    const struct idmap_lookup *lookup,
+    struct idmap_group *group)
+{
+    bool_t refresh = FALSE;
+    int status;
+
+    if (context->config.cache_ttl) {
+        /* check the group cache for an existing entry */
+        status = cache_lookup(&context->groups, lookup, &group->entry, &refresh);
+        if (status == NO_ERROR) {
+            if (group->entry.negative)
+                status = ERROR_NOT_FOUND;
+            else if (refresh)
+                idmap_refresh_queue(context, lookup);
+            goto out;
+        }
+    }
+
+    ZeroMemory(group, sizeof(struct idmap_group));
+    status = idmap_query_group(context, lookup, group);
+
+    if (context->config.cache_ttl)
+        idmap_cache_result(&context->groups, lookup, &group->entry, status);
 out:
     return status;
 }
@@ -952,9 +1566,18 @@ int nfs41_idmap_create(
         goto out;
     }
 
+    list_init(&context->refresh_queue);
+    InitializeSRWLock(&context->refresh_lock);
+    InitializeConditionVariable(&context->refresh_cond);
+
     /* initialize the caches */
-    cache_init(&context->users, &user_cache_ops);
-    cache_init(&context->groups, &group_cache_ops);
+    status = cache_init(&context->users, &user_cache_ops);
+    if (status == NO_ERROR)
+        status = cache_init(&context->groups, &group_cache_ops);
+    if (status) {
+        eprintf("cache_init() failed with %d\n", status);
+        goto out_err_free;
+    }
 
     /* load ldap configuration from file */
     status = config_init(&context->config);
@@ -962,6 +1585,10 @@ int nfs41_idmap_create(
         eprintf("config_init() failed with %d\n", status);
         goto out_err_free;
     }
+    context->users.ttl = context->groups.ttl =
+        context->config.cache_ttl;
+    context->users.negative_ttl = context->groups.negative_ttl =
+        context->config.cache_negative_ttl;
 
 #ifndef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
     /* initialize ldap and configure options */
@@ -998,6 +1625,17 @@ int nfs41_idmap_create(
     context->config.timeout = 6000;
 #endif
 
+    if (context->config.cache_ttl) {
+        /* start the thread that refreshes entries near expiration and
+         * frees expired ones; without it, entries are only queried
+         * again once expired, and unused ones are never freed */
+        context->refresh_thread = (HANDLE)_beginthreadex(NULL, 0,
+            idmap_refresh_thread, context, 0, NULL);
+        if (context->refresh_thread == NULL)
+            eprintf("nfs41_idmap_create() failed to start "
+                "refresh thread with %d\n", errno);
+    }
+
     *context_out = context;
 
 out:
@@ -1011,6 +1649,21 @@ out_err_free:
 void nfs41_idmap_free(
     struct idmap_context *context)
 {
+    struct list_entry *entry, *tmp;
+
+    /* stop the refresh thread before it can touch the caches */
+    if (context->refresh_thread) {
+        AcquireSRWLockExclusive(&context->refresh_lock);
+        context->refresh_shutdown = TRUE;
+        ReleaseSRWLockExclusive(&context->refresh_lock);
+        WakeAllConditionVariable(&context->refresh_cond);
+
+        WaitForSingleObject(context->refresh_thread, INFINITE);
+        CloseHandle(context->refresh_thread);
+    }
+    list_for_each_tmp(entry, tmp, &context->refresh_queue)
+        free(list_container(entry, struct idmap_refresh, entry));
+
     /* clean up the connection */
     if (context->ldap)
         ldap_unbind(context->ldap);
@@ -1022,15 +1675,6 @@ void nfs41_idmap_free(
 
 
 /* username -> uid, gid */
-static int username_cmp(const struct list_entry *list, const void *value)
-{
-    const struct idmap_user *entry = list_container(list,
-        const struct idmap_user, entry);
-    const char *username = (const char*)value;
-    return strcmp(entry->username, username);
-}
-
-
 int nfs41_idmap_name_to_uid(
     struct idmap_context *context,
     const char *username,
@@ -1040,7 +1684,6 @@ int nfs41_idmap_name_to_uid(
         .attr = ATTR_USER_NAME,
         .klass = CLASS_USER,
         .type = TYPE_STR,
-        .compare = username_cmp,
         .value = NULL
     };
     struct idmap_user user;
@@ -1075,7 +1718,6 @@ int nfs41_idmap_name_to_ids(
         .attr = ATTR_USER_NAME,
         .klass = CLASS_USER,
         .type = TYPE_STR,
-        .compare = username_cmp,
         .value = NULL
     };
     struct idmap_user user;
@@ -1105,14 +1747,6 @@ out:
 }
 
 /* uid -> username */
-static int uid_cmp(const struct list_entry *list, const void *value)
-{
-    const struct idmap_user *entry = list_container(list,
-        const struct idmap_user, entry);
-    const uid_t uid = PTR2UID_T(value);
-    return (int)uid - (int)entry->uid;
-}
-
 int nfs41_idmap_uid_to_name(
     struct idmap_context *context,
     uid_t uid,
@@ -1123,7 +1757,6 @@ int nfs41_idmap_uid_to_name(
         .attr = ATTR_UID,
         .klass = CLASS_USER,
         .type = TYPE_INT,
-        .compare = uid_cmp,
         .value = NULL
     };
     struct idmap_user user;
@@ -1155,14 +1788,6 @@ out:
 }
 
 /* principal -> uid, gid */
-static int principal_cmp(const struct list_entry *list, const void *value)
-{
-    const struct idmap_user *entry = list_container(list,
-        const struct idmap_user, entry);
-    const char *principal = (const char*)value;
-    return strcmp(entry->principal, principal);
-}
-
 int nfs41_idmap_principal_to_ids(
     struct idmap_context *context,
     const char *principal,
@@ -1173,7 +1798,6 @@ int nfs41_idmap_principal_to_ids(
         .attr = ATTR_PRINCIPAL,
         .klass = CLASS_USER,
         .type = TYPE_STR,
-        .compare = principal_cmp,
         .value = NULL
     };
     struct idmap_user user;
@@ -1200,14 +1824,6 @@ out:
 }
 
 /* group -> gid */
-static int group_cmp(const struct list_entry *list, const void *value)
-{
-    const struct idmap_group *entry = list_container(list,
-        const struct idmap_group, entry);
-    const char *group = (const char*)value;
-    return strcmp(entry->name, group);
-}
-
 int nfs41_idmap_group_to_gid(
     struct idmap_context *context,
     const char *name,
@@ -1217,7 +1833,6 @@ int nfs41_idmap_group_to_gid(
         .attr = ATTR_GROUP_NAME,
         .klass = CLASS_GROUP,
         .type = TYPE_STR,
-        .compare = group_cmp,
         .value = NULL
     };
     struct idmap_group group;
@@ -1243,14 +1858,6 @@ out:
 }
 
 /* gid -> group */
-static int gid_cmp(const struct list_entry *list, const void *value)
-{
-    const struct idmap_group *entry = list_container(list,
-        const struct idmap_group, entry);
-    const gid_t gid = PTR2GID_T(value);
-    return (int)gid - (int)entry->gid;
-}
-
 int nfs41_idmap_gid_to_group(
     struct idmap_context *context,
     gid_t gid,
@@ -1261,7 +1868,6 @@ int nfs41_idmap_gid_to_group(
         .attr = ATTR_GID,
         .klass = CLASS_GROUP,
         .type = TYPE_INT,
-        .compare = gid_cmp,
         .value = NULL
     };
     struct idmap_group group;
@@ -23,6 +23,7 @@
 #include <Winldap.h>
 #include <stdlib.h> /* for strtoul() */
 #include <time.h>
+#include <process.h> /* for _beginthreadex() */
 
 #include "nfs41_build_features.h"
 #include "idmap.h"
@@ -49,12 +50,320 @@
 #endif /* _WIN64 */
 
 #ifdef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
-int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid, gid_t *res_gid)
+/*
+ * Persistent idmapper co-process
+ *
+ * Instead of starting cygwin_idmapper.ksh for every lookup, we start it
+ * once in "server" mode and keep it running. Each lookup writes one
+ * request line "<id> <mode> <name>" to its stdin, and a reader thread
+ * hands each reply line ("<id> 0 <compound variable>" or "<id> 1") to
+ * the caller waiting for that id. Lookups from several threads are
+ * pipelined through the same pipe, and the script answers them in order.
+ *
+ * If the script dies (or doesn't answer within |IDMAPPER_TIMEOUT|),
+ * all outstanding lookups fail and the next lookup restarts it.
+ */
+#define IDMAPPER_REPLY_LEN 2048
+#define IDMAPPER_TIMEOUT (30*1000) /* milliseconds */
+
+typedef struct _idmapper_request {
+    struct list_entry entry;
+    unsigned long id;
+    bool_t done;
+    int status; /* 0 = match, 1 = no match/failure */
+    char reply[IDMAPPER_REPLY_LEN];
+} idmapper_request;
+
+static struct {
+    SRWLOCK lock; /* protects everything but |hStdin| */
+    CONDITION_VARIABLE cond;
+    SRWLOCK write_lock; /* serialises writes to |hStdin| */
+    HANDLE hStdin;
+    HANDLE hStdout;
+    HANDLE hProcess;
+    bool_t running;
+    unsigned long next_id;
+    struct list_entry pending;
+} idmapper = {
+    SRWLOCK_INIT, CONDITION_VARIABLE_INIT, SRWLOCK_INIT,
+    NULL, NULL, NULL, FALSE, 0, { &idmapper.pending, &idmapper.pending }
+};
+
+static void idmapper_complete(
+    const char *line)
+{
+    struct list_entry *entry;
+    idmapper_request *req;
+    unsigned long id;
+    char *s;
+
+    errno = 0;
+    id = strtoul(line, &s, 10);
+    if ((errno != 0) || (s == line) || (*s != ' ')) {
+        DPRINTF(0, ("idmapper_complete: garbage reply '%s'\n", line));
+        return;
+    }
+    s++;
+
+    AcquireSRWLockExclusive(&idmapper.lock);
+    list_for_each(entry, &idmapper.pending) {
+        req = list_container(entry, idmapper_request, entry);
+        if (req->id != id)
+            continue;
+
+        req->status = (*s == '0')?0:1;
+        if ((req->status == 0) && (s[1] == ' '))
+            (void)strcpy_s(req->reply, sizeof(req->reply), s+2);
+        else
+            req->status = 1;
+        req->done = TRUE;
+        list_remove(&req->entry);
+        break;
+    }
+    ReleaseSRWLockExclusive(&idmapper.lock);
+    WakeAllConditionVariable(&idmapper.cond);
+}
+
+static unsigned int WINAPI idmapper_reader_thread(void *args)
+{
+    HANDLE hStdout = (HANDLE)args;
+    char buff[IDMAPPER_REPLY_LEN+64];
+    size_t len = 0;
+    bool_t overflow = FALSE;
+    DWORD num_read;
+    char *s, *eol;
+    struct list_entry *entry, *tmp;
+
+    /* split the output into lines, and complete one request per line */
+    while (ReadFile(hStdout, buff+len,
+        (DWORD)(sizeof(buff)-1-len), &num_read, NULL) && (num_read > 0)) {
+        len += num_read;
+        buff[len] = '\0';
+
+        s = buff;
+        while ((eol = strchr(s, '\n')) != NULL) {
+            *eol = '\0';
+            if (!overflow)
+                idmapper_complete(s);
+            overflow = FALSE;
+            s = eol+1;
+        }
+        len -= s-buff;
+        (void)memmove(buff, s, len);
+
+        /* discard lines which do not fit into |buff| */
+        if (len == (sizeof(buff)-1)) {
+            DPRINTF(0, ("idmapper_reader_thread: reply too long\n"));
+            overflow = TRUE;
+            len = 0;
+        }
+    }
+
+    DPRINTF(0, ("idmapper_reader_thread: idmapper exited, "
+        "GetLastError()='%d'\n", (int)GetLastError()));
+
+    /* close the pipes, so the next lookup starts a new co-process */
+    AcquireSRWLockExclusive(&idmapper.write_lock);
+    (void)CloseHandle(idmapper.hStdin);
+    idmapper.hStdin = NULL;
+    ReleaseSRWLockExclusive(&idmapper.write_lock);
+
+    AcquireSRWLockExclusive(&idmapper.lock);
+    (void)CloseHandle(hStdout);
+    (void)CloseHandle(idmapper.hProcess);
+    idmapper.hStdout = idmapper.hProcess = NULL;
+    idmapper.running = FALSE;
+
+    /* fail all outstanding requests */
+    list_for_each_tmp(entry, tmp, &idmapper.pending) {
+        idmapper_request *req = list_container(entry, idmapper_request, entry);
+        req->status = 1;
+        req->done = TRUE;
+        list_remove(&req->entry);
+    }
+    ReleaseSRWLockExclusive(&idmapper.lock);
+    WakeAllConditionVariable(&idmapper.cond);
+    return 0;
+}
+
+/* start the co-process; called with |idmapper.lock| held exclusive */
+static bool_t idmapper_start(void)
 {
     char cmdbuff[1024];
-    char buff[2048];
-    DWORD num_buff_read;
-    subcmd_popen_context *script_pipe = NULL;
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    SECURITY_ATTRIBUTES sa = { 0 };
+    HANDLE hStdinRead = NULL, hStdinWrite = NULL;
+    HANDLE hStdoutRead = NULL, hStdoutWrite = NULL;
+    HANDLE hThread;
+
+    sa.nLength = sizeof(SECURITY_ATTRIBUTES);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+
+    if (!CreatePipe(&hStdinRead, &hStdinWrite, &sa, 0) ||
+        !CreatePipe(&hStdoutRead, &hStdoutWrite, &sa, 0)) {
+        DPRINTF(0, ("idmapper_start: CreatePipe error, status=%d\n",
+            (int)GetLastError()));
+        goto fail;
+    }
+
+    /* only the child's ends of the pipes should be inherited */
+    if (!SetHandleInformation(hStdinWrite, HANDLE_FLAG_INHERIT, FALSE) ||
+        !SetHandleInformation(hStdoutRead, HANDLE_FLAG_INHERIT, FALSE)) {
+        DPRINTF(0, ("idmapper_start: SetHandleInformation error\n"));
+        goto fail;
+    }
+
+    (void)snprintf(cmdbuff, sizeof(cmdbuff), "%s server",
+        CYGWIN_IDMAPPER_SCRIPT);
+
+    (void)memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.hStdInput = hStdinRead;
+    si.hStdOutput = hStdoutWrite;
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    si.dwFlags |= STARTF_USESTDHANDLES;
+
+    if (!CreateProcessA(NULL, cmdbuff, NULL, NULL, TRUE, 0, NULL, NULL,
+        &si, &pi)) {
+        DPRINTF(0, ("idmapper_start: cannot create process '%s', "
+            "GetLastError()='%d'\n", cmdbuff, (int)GetLastError()));
+        goto fail;
+    }
+    (void)CloseHandle(pi.hThread);
+    (void)CloseHandle(hStdinRead);
+    (void)CloseHandle(hStdoutWrite);
+    hStdinRead = hStdoutWrite = NULL;
+
+    AcquireSRWLockExclusive(&idmapper.write_lock);
+    idmapper.hStdin = hStdinWrite;
+    ReleaseSRWLockExclusive(&idmapper.write_lock);
+    idmapper.hStdout = hStdoutRead;
+    idmapper.hProcess = pi.hProcess;
+    idmapper.running = TRUE;
+
+    hThread = (HANDLE)_beginthreadex(NULL, 0, idmapper_reader_thread,
+        hStdoutRead, 0, NULL);
+    if (hThread == NULL) {
+        DPRINTF(0, ("idmapper_start: failed to start reader thread\n"));
+        AcquireSRWLockExclusive(&idmapper.write_lock);
+        idmapper.hStdin = NULL;
+        ReleaseSRWLockExclusive(&idmapper.write_lock);
+        idmapper.hStdout = idmapper.hProcess = NULL;
+        idmapper.running = FALSE;
+        (void)TerminateProcess(pi.hProcess, 1);
+        (void)CloseHandle(pi.hProcess);
+        goto fail;
+    }
+    (void)CloseHandle(hThread);
+
+    DPRINTF(CYGWINIDLVL, ("idmapper_start: started '%s', pid=%d\n",
+        cmdbuff, (int)pi.dwProcessId));
+    return TRUE;
+
+fail:
+    if (hStdinRead)
+        (void)CloseHandle(hStdinRead);
+    if (hStdinWrite)
+        (void)CloseHandle(hStdinWrite);
+    if (hStdoutRead)
+        (void)CloseHandle(hStdoutRead);
+    if (hStdoutWrite)
+        (void)CloseHandle(hStdoutWrite);
+    return FALSE;
+}
+
+/*
+ * |idmapper_lookup()| - send one lookup to the co-process and wait
+ * for its reply. Returns |TRUE| and the compound variable describing
+ * the account in |reply| if a match was found.
+ */
+static bool_t idmapper_lookup(
+    const char *mode,
+    const char *name,
+    char *reply,
+    size_t reply_len)
+{
+    char line[1024];
+    idmapper_request *req;
+    DWORD num_written;
+    int len;
+    bool_t res = FALSE;
+
+    /* the protocol is line-based */
+    if (strpbrk(name, "\r\n") != NULL) {
+        DPRINTF(0, ("idmapper_lookup: invalid name '%s'\n", name));
+        return FALSE;
+    }
+
+    req = calloc(1, sizeof(idmapper_request));
+    if (req == NULL)
+        return FALSE;
+
+    AcquireSRWLockExclusive(&idmapper.lock);
+    if (!idmapper.running && !idmapper_start()) {
+        ReleaseSRWLockExclusive(&idmapper.lock);
+        goto out;
+    }
+    req->id = ++idmapper.next_id;
+    list_add_tail(&idmapper.pending, &req->entry);
+    ReleaseSRWLockExclusive(&idmapper.lock);
+
+    len = snprintf(line, sizeof(line), "%lu %s %s\n", req->id, mode, name);
+    if ((len < 0) || (len >= (int)sizeof(line))) {
+        DPRINTF(0, ("idmapper_lookup: name '%s' too long\n", name));
+        goto out_cancel;
+    }
+
+    /* writes must not interleave, but don't hold |idmapper.lock| while
+     * writing, so the reader thread can keep draining the replies */
+    AcquireSRWLockExclusive(&idmapper.write_lock);
+    if ((idmapper.hStdin == NULL) ||
+        !WriteFile(idmapper.hStdin, line, (DWORD)len, &num_written, NULL)) {
+        ReleaseSRWLockExclusive(&idmapper.write_lock);
+        DPRINTF(0, ("idmapper_lookup: WriteFile() failed, "
+            "GetLastError()='%d'\n", (int)GetLastError()));
+        goto out_cancel;
+    }
+    ReleaseSRWLockExclusive(&idmapper.write_lock);
+
+    AcquireSRWLockExclusive(&idmapper.lock);
+    while (!req->done) {
+        if (!SleepConditionVariableSRW(&idmapper.cond, &idmapper.lock,
+            IDMAPPER_TIMEOUT, 0)) {
+            /*
+             * The script is hung; kill it, the reader thread will then
+             * fail all outstanding requests
+             */
+            DPRINTF(0, ("idmapper_lookup(mode='%s', name='%s'): "
+                "timeout, restarting idmapper\n", mode, name));
+            if (idmapper.hProcess)
+                (void)TerminateProcess(idmapper.hProcess, 1);
+            list_remove(&req->entry);
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&idmapper.lock);
+
+    if (req->done && (req->status == 0)) {
+        (void)strcpy_s(reply, reply_len, req->reply);
+        res = TRUE;
+    }
+out:
+    free(req);
+    return res;
+
+out_cancel:
+    AcquireSRWLockExclusive(&idmapper.lock);
+    list_remove(&req->entry);
+    ReleaseSRWLockExclusive(&idmapper.lock);
+    goto out;
+}
+
+int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid, gid_t *res_gid)
+{
+    char buff[IDMAPPER_REPLY_LEN];
     int res = 1;
     unsigned long uid = ~0UL;
     unsigned long gid = ~0UL;
@@ -69,40 +378,8 @@ int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid,
         ("--> cygwin_getent_passwd(name='%s')\n",
         name));
 
-    /* fixme: better quoting for |name| needed */
-    (void)snprintf(cmdbuff, sizeof(cmdbuff),
-        "%s nfsserver_owner2localaccount \"%s\"",
-        CYGWIN_IDMAPPER_SCRIPT,
-        name);
-    if ((script_pipe = subcmd_popen(cmdbuff)) == NULL) {
-        int last_error = GetLastError();
-        DPRINTF(0,
-            ("cygwin_getent_passwd(name='%s'): "
-            "'%s' failed, GetLastError()='%d'\n",
-            name,
-            cmdbuff,
-            last_error));
-        goto fail;
-    }
-
-    if (!subcmd_readcmdoutput(script_pipe,
-        buff, sizeof(buff), &num_buff_read)) {
-        DPRINTF(0,
-            ("cygwin_getent_passwd(name='%s'): "
-            "subcmd_readcmdoutput() failed\n",
-            name));
-        goto fail;
-    }
-
-    buff[num_buff_read] = '\0';
-
-    if (num_buff_read < 10) {
-        DPRINTF(0,
-            ("cygwin_getent_passwd(name='%s'): "
-            "Could not read enough data, returned %d\n",
-            name, (int)num_buff_read));
+    if (!idmapper_lookup("nfsserver_owner2localaccount", name, buff, sizeof(buff)))
         goto fail;
-    }
 
     cpvp = cpv_create_parser(buff, 0/*CPVFLAG_DEBUG_OUTPUT*/);
     if (!cpvp) {
@@ -156,9 +433,6 @@ int cygwin_getent_passwd(const char *name, char *res_loginname, uid_t *res_uid,
     res = 0;
 
 fail:
-    if (script_pipe)
-        (void)subcmd_pclose(script_pipe);
-
     for (i=0 ; i < numcnv ; i++) {
         cpv_free_name_val_data(&cnv[i]);
     }
@@ -185,10 +459,7 @@ fail:
 
 int cygwin_getent_group(const char* name, char* res_group_name, gid_t* res_gid)
 {
-    char cmdbuff[1024];
-    char buff[2048];
-    DWORD num_buff_read;
-    subcmd_popen_context *script_pipe = NULL;
+    char buff[IDMAPPER_REPLY_LEN];
     int res = 1;
     unsigned long gid = ~0UL;
     void *cpvp = NULL;
@@ -203,40 +474,8 @@ int cygwin_getent_group(const char* name, char* res_group_name, gid_t* res_gid)
         ("--> cygwin_getent_group(name='%s')\n",
         name));
 
-    /* fixme: better quoting for |name| needed */
-    (void)snprintf(cmdbuff, sizeof(cmdbuff),
-        "%s nfsserver_owner_group2localgroup \"%s\"",
-        CYGWIN_IDMAPPER_SCRIPT,
-        name);
-    if ((script_pipe = subcmd_popen(cmdbuff)) == NULL) {
-        int last_error = GetLastError();
-        DPRINTF(0,
-            ("cygwin_getent_group(name='%s'): "
-            "'%s' failed, GetLastError()='%d'\n",
-            name,
-            cmdbuff,
-            last_error));
-        goto fail;
-    }
-
-    if (!subcmd_readcmdoutput(script_pipe,
-        buff, sizeof(buff), &num_buff_read)) {
-        DPRINTF(0,
-            ("cygwin_getent_group(name='%s'): "
-            "subcmd_readcmdoutput() failed\n",
-            name));
+    if (!idmapper_lookup("nfsserver_owner_group2localgroup", name, buff, sizeof(buff)))
         goto fail;
-    }
-
-    buff[num_buff_read] = '\0';
-
-    if (num_buff_read < 10) {
-        DPRINTF(0,
-            ("cygwin_getent_group(name='%s'): "
-            "Could not read enough data, returned %d\n",
-            name, (int)num_buff_read));
-        goto fail;
-    }
 
     cpvp = cpv_create_parser(buff, 0/*CPVFLAG_DEBUG_OUTPUT*/);
     if (!cpvp) {
@@ -283,9 +522,6 @@ int cygwin_getent_group(const char* name, char* res_group_name, gid_t* res_gid)
     res = 0;
 
 fail:
-    if (script_pipe)
-        (void)subcmd_pclose(script_pipe);
-
     for (i=0 ; i < numcnv ; i++) {
         cpv_free_name_val_data(&cnv[i]);
     }
@@ -26,6 +26,7 @@
 #include "daemon_debug.h"
 #include "delegation.h"
 #include "nfs41_ops.h"
+#include "readwrite.h"
 #include "upcall.h"
 #include "util.h"
 
@@ -211,6 +212,11 @@ static int handle_lock(void *deamon_context, nfs41_upcall *upcall)
     if (args->length >= NFS4_UINT64_MAX - args->offset)
         args->length = NFS4_UINT64_MAX;
 
+    /* other lock holders must see our buffered writes */
+    status = nfs41_write_behind_flush(state);
+    if (status)
+        goto out;
+
     /* allocate the lock state */
     lock = calloc(1, sizeof(nfs41_lock_state));
     if (lock == NULL) {
@@ -328,7 +334,12 @@ static int handle_unlock(void *daemon_context, nfs41_upcall *upcall)
     unsigned char *buf = args->buf;
     uint32_t buf_len = args->buf_len;
     uint32_t i;
-    int status = NO_ERROR;
+    int status;
+
+    /* buffered writes must be sent while we still hold the lock */
+    status = nfs41_write_behind_flush(state);
+    if (status)
+        goto out;
 
     for (i = 0; i < args->count; i++) {
         if (safe_read(&buf, &buf_len, &input.offset, sizeof(LONGLONG))) break;
@@ -354,6 +365,7 @@ static int handle_unlock(void *daemon_context, nfs41_upcall *upcall)
 
         status = nfs_to_windows_error(status, ERROR_BAD_NET_RESP);
     }
+out:
     return status;
 }
 
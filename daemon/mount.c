@@ -28,6 +28,7 @@
 #include "daemon_debug.h"
 #include "nfs41_ops.h"
 #include "upcall.h"
+#include "name_cache.h"
 #include "util.h"
 #ifdef NFS41_DRIVER_USE_AUTHENTICATIONID_FOR_MOUNT_NAMESPACE
 #include "accesstoken.h"
@@ -52,11 +53,21 @@ static int parse_mount(unsigned char *buffer, uint32_t length, nfs41_upcall *upc
     if (status) goto out;
     status = safe_read(&buffer, &length, &args->use_nfspubfh, sizeof(DWORD));
     if (status) goto out;
+    status = safe_read(&buffer, &length, &args->ac_timeo, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->ac_max, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->namecache_mb, sizeof(DWORD));
+    if (status) goto out;
+    status = safe_read(&buffer, &length, &args->negcache, sizeof(DWORD));
+    if (status) goto out;
 
     DPRINTF(1, ("parsing NFS41_MOUNT: hostport='%s' root='%s' "
-        "sec_flavor='%s' rsize=%d wsize=%d use_nfspubfh=%d\n",
+        "sec_flavor='%s' rsize=%d wsize=%d use_nfspubfh=%d "
+        "ac_timeo=%d ac_max=%d namecache_mb=%d negcache=%d\n",
         args->hostport, args->path, secflavorop2name(args->sec_flavor),
-        args->rsize, args->wsize, args->use_nfspubfh));
+        args->rsize, args->wsize, args->use_nfspubfh,
+        args->ac_timeo, args->ac_max, args->namecache_mb, args->negcache));
     return status;
 out:
     DPRINTF(1, ("parsing NFS41_MOUNT: failed %d\n", status));
@@ -75,6 +86,7 @@ static int handle_mount(void *daemon_context, nfs41_upcall *upcall)
     nfs41_root *root = NULL;
     nfs41_client *client;
     nfs41_path_fh file;
+    nfs41_name_cache_config cache_config;
 
     EASSERT(args->hostport != NULL);
 
@@ -166,6 +178,15 @@ static int handle_mount(void *daemon_context, nfs41_upcall *upcall)
         goto out_err;
     }
 
+    // apply the cache options given for this mount to the server's
+    // name cache; the driver sends the others as NFS41_MOUNT_OPTION_UNSET,
+    // the same value as NAME_CACHE_CONFIG_UNSET
+    cache_config.timeo = args->ac_timeo;
+    cache_config.timeo_max = args->ac_max;
+    cache_config.size_mb = args->namecache_mb;
+    cache_config.negative = args->negcache;
+    nfs41_name_cache_configure(client_name_cache(client), &cache_config);
+
     // make a copy of the path for nfs41_lookup()
     InitializeSRWLock(&path.lock);
     if (FAILED(StringCchCopyA(path.path, NFS41_MAX_PATH_LEN, args->path))) {
@@ -39,10 +39,28 @@ enum {
 };
 
 
-#define NAME_CACHE_EXPIRATION 30 /* TODO: get from configuration */
+/* defaults until a mount passes its own options to
+ * nfs41_name_cache_configure() */
+#define NAME_CACHE_EXPIRATION 30
+#define NAME_CACHE_DEFAULT_MB 32
+#define NAME_CACHE_MAX_MB 1024
 
-/* allow up to 32M of memory for name and attribute cache entries */
-#define NAME_CACHE_MAX_SIZE (32*1024*1024L)
+/* an rb-tree of 2^32 entries is at most 64 levels deep; searches stop
+ * there, in case an optimistic reader finds a tree mid-rebalance */
+#define NAME_CACHE_MAX_DEPTH 64
+
+/* optimistic reads before a reader falls back to the shared lock */
+#define NAME_CACHE_READ_RETRIES 8
+
+/* delegated directories the cache can hold; matches DIR_DELEGATION_MAX
+ * in delegation.c */
+#define NAME_CACHE_DIR_DELEGATIONS 64
+
+/* name and attribute entries are allocated in slabs as the cache grows.
+ * slabs aren't freed until the cache is, since lock-free readers may
+ * still be looking at their entries; see name_cache_read_begin() */
+#define NAME_POOL_SLAB_ENTRIES 4096
+#define NAME_POOL_MAX_SLABS 1024
 
 /* negative lookup caching
  *
@@ -68,6 +86,10 @@ enum {
  * delegations reach a certain percent of the cache capacity.  the error code
  * ERROR_TOO_MANY_OPEN_FILES, chosen arbitrarily for this case, instructs the
  * caller to return an outstanding delegation before caching a new one.
+ *   a directory delegation holds the directory's entry the same way, and
+ * its attributes too when the server notifies us of their changes.  it
+ * also keeps the directory's children from expiring, since CB_NOTIFY
+ * reports any names that are added, removed or renamed.
  */
 static __inline bool_t is_delegation(
     IN enum open_delegation_type4 type)
@@ -75,13 +97,13 @@ static __inline bool_t is_delegation(
     return type == OPEN_DELEGATE_READ || type == OPEN_DELEGATE_WRITE;
 }
 
-/* attribute cache */
+/* attribute cache.  entries are packed, since the cache holds as many
+ * as fit in its budget; expiration times are UTIL_GETRELTIME() seconds,
+ * which fit in 32 bits for 136 years of uptime */
 struct attr_cache_entry {
-    RB_ENTRY(attr_cache_entry) rbnode;
-    struct list_entry       free_entry;
+    uint64_t                fileid; /* first, for attr_cache_search() */
     uint64_t                change;
     uint64_t                size;
-    uint64_t                fileid;
     int64_t                 time_access_s;
     int64_t                 time_create_s;
     int64_t                 time_modify_s;
@@ -93,34 +115,184 @@ struct attr_cache_entry {
     unsigned                hidden : 1;
     unsigned                system : 1;
     unsigned                archive : 1;
-    util_reltimestamp       expiration;
+    uint32_t                timeout; /* seconds until expiration */
     unsigned                ref_count : 26;
     unsigned                type : 4;
     unsigned                invalidated : 1;
     unsigned                delegated : 1;
-    char                    owner[NFS4_FATTR4_OWNER_LIMIT+1];
-    char                    owner_group[NFS4_FATTR4_OWNER_LIMIT+1];
+    uint16_t                owner; /* index into attr_cache.owners */
+    uint16_t                owner_group;
+    uint32_t                expiration;
+    struct attr_cache_entry *next_free; /* in attr_cache.free_entries */
 };
 #define ATTR_ENTRY_SIZE sizeof(struct attr_cache_entry)
 
-RB_HEAD(attr_tree, attr_cache_entry);
+/* attribute entries are found through an open-addressing hash table
+ * keyed by fileid, with linear probing.  removed entries leave a
+ * tombstone in their slot, so a removal never moves other entries and
+ * a lock-free reader can't probe past one that's still there.  once
+ * tombstones and entries fill 3/4 of the table, attr_cache_rehash()
+ * rebuilds it, twice as large if entries alone fill half of it.
+ *
+ *   attribute readers don't use the name cache's sequence number.  each
+ * fileid hashes to one of ATTR_CACHE_STRIPES sequence counters, which
+ * writers bump around any change to that fileid's entry or slot, so a
+ * reader only retries when the file it's reading changes.  writers are
+ * still serialized by the name cache lock.  a rebuild in place bumps
+ * table_seq instead, and a table that was replaced by a larger one is
+ * kept until the cache is freed */
+#define ATTR_TABLE_INITIAL_SIZE 1024
+#define ATTR_CACHE_STRIPES 64
+
+struct attr_table {
+    struct attr_table       *retired; /* next older table */
+    uint32_t                mask;
+    struct attr_cache_entry * volatile slots[1];
+};
+
+/* a tombstone for removed entries; its fileid is never compared */
+static struct attr_cache_entry attr_tombstone;
+
+struct attr_cache_stripe {
+    volatile LONG           seq;
+    char                    pad[60]; /* one cache line per stripe */
+};
+
+/* owner and owner_group strings are interned, since a cache of many
+ * files usually sees only a handful of distinct owners.  each entry
+ * holds a reference on its strings, and a string nobody references
+ * stays in the table until its slot is needed for another one.  index
+ * 0 means no owner, which is also what an entry gets if every slot is
+ * referenced.  slots are allocated in chunks and never move, because
+ * optimistic readers index into them without the lock.
+ *
+ *   a slot is only reused after its last reference went away inside a
+ * write bracket of the entry that held it, so a reader that was still
+ * copying the old string sees the stripe change and retries */
+#define ATTR_OWNER_CHUNK 64
+#define ATTR_CACHE_MAX_OWNERS 4096
+#define ATTR_OWNER_HASH_SIZE (2 * ATTR_CACHE_MAX_OWNERS)
+
+struct attr_cache_owner {
+    uint32_t                ref_count;
+    char                    name[NFS4_FATTR4_OWNER_LIMIT+1];
+};
 
 struct attr_cache {
-    struct attr_tree        head;
-    struct attr_cache_entry *pool;
-    struct list_entry       free_entries;
+    struct attr_table * volatile table;
+    uint32_t                live; /* entries in table */
+    uint32_t                used; /* entries and tombstones in table */
+    volatile LONG           table_seq;
+    struct attr_cache_stripe stripes[ATTR_CACHE_STRIPES];
+    struct attr_cache_entry *slabs[NAME_POOL_MAX_SLABS];
+    uint32_t                slab_count;
+    uint32_t                timeo;
+    uint32_t                timeo_max;
+    struct attr_cache_entry *free_entries;
+    struct attr_cache_owner *owners[ATTR_CACHE_MAX_OWNERS / ATTR_OWNER_CHUNK];
+    uint16_t                owner_hash[ATTR_OWNER_HASH_SIZE];
+    uint16_t                owner_count; /* slots handed out */
+    uint16_t                owner_unused; /* slots without references */
 };
 
-static int attr_cmp(struct attr_cache_entry *lhs, struct attr_cache_entry *rhs)
+static __inline uint32_t attr_hash(
+    IN uint64_t fileid)
 {
-    return lhs->fileid < rhs->fileid ? -1 : lhs->fileid > rhs->fileid;
+    /* fileids are often sequential; mix the bits before masking */
+    fileid ^= fileid >> 33;
+    fileid *= 0xff51afd7ed558ccdULL;
+    fileid ^= fileid >> 33;
+    return (uint32_t)fileid;
+}
+
+static __inline volatile LONG* attr_stripe(
+    IN struct attr_cache *cache,
+    IN uint64_t fileid)
+{
+    return &cache->stripes[attr_hash(fileid) >> 26].seq;
+}
+
+/* writers bracket changes to an entry or its slot with these */
+static __inline void attr_cache_write_begin(
+    IN struct attr_cache *cache,
+    IN uint64_t fileid)
+{
+    InterlockedIncrement(attr_stripe(cache, fileid));
+}
+
+static __inline void attr_cache_write_end(
+    IN struct attr_cache *cache,
+    IN uint64_t fileid)
+{
+    InterlockedIncrement(attr_stripe(cache, fileid));
+}
+
+static struct attr_table* attr_table_alloc(
+    IN uint32_t size)
+{
+    struct attr_table *table = calloc(1, sizeof(struct attr_table)
+        + (size - 1) * sizeof(struct attr_cache_entry*));
+    if (table)
+        table->mask = size - 1;
+    return table;
+}
+
+/* copy the entries of src into an empty table dst */
+static void attr_table_fill(
+    IN struct attr_table *dst,
+    IN const struct attr_table *src)
+{
+    uint32_t i, slot;
+    for (i = 0; i <= src->mask; i++) {
+        struct attr_cache_entry *entry = src->slots[i];
+        if (entry == NULL || entry == &attr_tombstone)
+            continue;
+        slot = attr_hash(entry->fileid) & dst->mask;
+        while (dst->slots[slot])
+            slot = (slot + 1) & dst->mask;
+        dst->slots[slot] = entry;
+    }
+}
+
+static int attr_cache_rehash(
+    IN struct attr_cache *cache)
+{
+    struct attr_table *table = cache->table, *tmp;
+    const uint32_t size = table->mask + 1;
+    const bool_t grow = cache->live >= size / 2;
+    int status = NO_ERROR;
+
+    tmp = attr_table_alloc(grow ? size * 2 : size);
+    if (tmp == NULL) {
+        status = GetLastError();
+        goto out;
+    }
+    attr_table_fill(tmp, table);
+
+    if (grow) {
+        /* publish the new table; readers may keep using the old one,
+         * since changes to its entries still bump their stripes */
+        tmp->retired = table;
+        MemoryBarrier();
+        cache->table = tmp;
+    } else {
+        /* copy the slots back in place, without the tombstones */
+        InterlockedIncrement(&cache->table_seq);
+        (void)memcpy((void*)table->slots, (void*)tmp->slots,
+            size * sizeof(struct attr_cache_entry*));
+        InterlockedIncrement(&cache->table_seq);
+        free(tmp);
+    }
+    cache->used = cache->live;
+
+    DPRINTF(NCLVL1, ("attr_cache_rehash() %u entries in %u slots\n",
+        cache->live, cache->table->mask + 1));
+out:
+    return status;
 }
-RB_GENERATE(attr_tree, attr_cache_entry, rbnode, attr_cmp)
 
 
 /* attr_cache_entry */
-#define attr_entry(pos) list_container(pos, struct attr_cache_entry, free_entry)
-
 static int attr_cache_entry_create(
     IN struct attr_cache *cache,
     IN uint64_t fileid,
@@ -130,29 +302,53 @@ static int attr_cache_entry_create(
     int status = NO_ERROR;
 
     /* get the next entry from free_entries and remove it */
-    if (list_empty(&cache->free_entries)) {
+    entry = cache->free_entries;
+    if (entry == NULL) {
         status = ERROR_OUTOFMEMORY;
         goto out;
     }
-    entry = attr_entry(cache->free_entries.next);
-    list_remove(&entry->free_entry);
+    cache->free_entries = entry->next_free;
 
     entry->fileid = fileid;
+    entry->timeout = 0;
     entry->invalidated = FALSE;
     entry->delegated = FALSE;
+    entry->owner = entry->owner_group = 0;
     *entry_out = entry;
 out:
     return status;
 }
 
+static void attr_cache_owner_put(
+    IN struct attr_cache *cache,
+    IN uint16_t index);
+
 static __inline void attr_cache_entry_free(
     IN struct attr_cache *cache,
     IN struct attr_cache_entry *entry)
 {
+    struct attr_table *table = cache->table;
+    uint32_t i, slot = attr_hash(entry->fileid) & table->mask;
+
     DPRINTF(NCLVL1, ("attr_cache_entry_free(%llu)\n", entry->fileid));
-    RB_REMOVE(attr_tree, &cache->head, entry);
+
+    /* replace its slot with a tombstone, and release its owners */
+    attr_cache_write_begin(cache, entry->fileid);
+    for (i = 0; i <= table->mask && table->slots[slot]; i++) {
+        if (table->slots[slot] == entry) {
+            table->slots[slot] = &attr_tombstone;
+            cache->live--;
+            break;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    attr_cache_owner_put(cache, entry->owner);
+    attr_cache_owner_put(cache, entry->owner_group);
+    entry->owner = entry->owner_group = 0;
+    attr_cache_write_end(cache, entry->fileid);
     /* add it back to free_entries */
-    list_add_tail(&cache->free_entries, &entry->free_entry);
+    entry->next_free = cache->free_entries;
+    cache->free_entries = entry;
 }
 
 static __inline void attr_cache_entry_ref(
@@ -185,59 +381,262 @@ static __inline int attr_cache_entry_expired(
 
 /* attr_cache */
 static int attr_cache_init(
-    IN struct attr_cache *cache,
-    IN uint32_t max_entries)
+    IN struct attr_cache *cache)
 {
-    uint32_t i;
     int status = NO_ERROR;
 
-    /* allocate a pool of entries */
-    cache->pool = calloc(max_entries, ATTR_ENTRY_SIZE);
-    if (cache->pool == NULL) {
+    /* allocate the hash table */
+    cache->table = attr_table_alloc(ATTR_TABLE_INITIAL_SIZE);
+    if (cache->table == NULL) {
         status = GetLastError();
         goto out;
     }
 
-    /* initialize the list of free entries */
-    list_init(&cache->free_entries);
-    for (i = 0; i < max_entries; i++) {
-        list_init(&cache->pool[i].free_entry);
-        list_add_tail(&cache->free_entries, &cache->pool[i].free_entry);
+    /* allocate the first chunk of owners; slot 0 stays empty */
+    cache->owners[0] = calloc(ATTR_OWNER_CHUNK, sizeof(struct attr_cache_owner));
+    if (cache->owners[0] == NULL) {
+        status = GetLastError();
+        free(cache->table);
+        cache->table = NULL;
+        goto out;
     }
+    cache->owner_count = 1;
+    cache->timeo = cache->timeo_max = NAME_CACHE_EXPIRATION;
+
+    /* entries are added by attr_cache_grow() */
+    cache->free_entries = NULL;
 out:
     return status;
 }
 
+static int attr_cache_grow(
+    IN struct attr_cache *cache)
+{
+    struct attr_cache_entry *slab;
+    uint32_t i;
+
+    if (cache->slab_count == NAME_POOL_MAX_SLABS)
+        return ERROR_OUTOFMEMORY;
+
+    slab = calloc(NAME_POOL_SLAB_ENTRIES, ATTR_ENTRY_SIZE);
+    if (slab == NULL)
+        return GetLastError();
+
+    /* add the new entries to the list of free entries */
+    for (i = 0; i < NAME_POOL_SLAB_ENTRIES; i++) {
+        slab[i].next_free = cache->free_entries;
+        cache->free_entries = &slab[i];
+    }
+    cache->slabs[cache->slab_count++] = slab;
+    return NO_ERROR;
+}
+
 static void attr_cache_free(
     IN struct attr_cache *cache)
 {
-    /* free the pool */
-    free(cache->pool);
-    cache->pool = NULL;
-    list_init(&cache->free_entries);
+    struct attr_table *table;
+    uint32_t i;
+
+    /* free the pool and the hash tables */
+    while (cache->slab_count)
+        free(cache->slabs[--cache->slab_count]);
+    while ((table = cache->table) != NULL) {
+        cache->table = table->retired;
+        free(table);
+    }
+    for (i = 0; i < ATTR_CACHE_MAX_OWNERS / ATTR_OWNER_CHUNK; i++) {
+        free(cache->owners[i]);
+        cache->owners[i] = NULL;
+    }
+    cache->free_entries = NULL;
+}
+
+static __inline struct attr_cache_owner* attr_owner_slot(
+    IN const struct attr_cache *cache,
+    IN uint16_t index)
+{
+    return &cache->owners[index / ATTR_OWNER_CHUNK][index % ATTR_OWNER_CHUNK];
+}
+
+static uint32_t attr_owner_hash(
+    IN const char *owner)
+{
+    uint32_t hash = 2166136261u;
+    while (*owner)
+        hash = (hash ^ (unsigned char)*owner++) * 16777619u;
+    return hash % ATTR_OWNER_HASH_SIZE;
+}
+
+/* remove an unreferenced owner from the hash table, moving any later
+ * owners of its probe sequence back into the gap.  only writers under
+ * the name cache lock use the hash table */
+static void attr_owner_unhash(
+    IN struct attr_cache *cache,
+    IN uint16_t index)
+{
+    uint32_t i, j, home;
+
+    i = attr_owner_hash(attr_owner_slot(cache, index)->name);
+    while (cache->owner_hash[i] != index)
+        i = (i + 1) % ATTR_OWNER_HASH_SIZE;
+
+    for (j = (i + 1) % ATTR_OWNER_HASH_SIZE; cache->owner_hash[j];
+            j = (j + 1) % ATTR_OWNER_HASH_SIZE) {
+        home = attr_owner_hash(attr_owner_slot(cache,
+            cache->owner_hash[j])->name);
+        /* move it unless its home lies in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            cache->owner_hash[i] = cache->owner_hash[j];
+            i = j;
+        }
+    }
+    cache->owner_hash[i] = 0;
+}
+
+/* returns the index of owner with a reference, or 0 */
+static uint16_t attr_cache_owner(
+    IN struct attr_cache *cache,
+    IN const char *owner)
+{
+    struct attr_cache_owner *slot;
+    const size_t len = strlen(owner);
+    uint32_t i;
+    uint16_t index;
+
+    if (len > NFS4_FATTR4_OWNER_LIMIT)
+        return 0;
+
+    /* linear probing; the table is never more than half full */
+    for (i = attr_owner_hash(owner); ; i = (i + 1) % ATTR_OWNER_HASH_SIZE) {
+        index = cache->owner_hash[i];
+        if (index == 0)
+            break;
+        slot = attr_owner_slot(cache, index);
+        if (strcmp(slot->name, owner) == 0) {
+            if (slot->ref_count++ == 0)
+                cache->owner_unused--;
+            return index;
+        }
+    }
+
+    if (cache->owner_count < ATTR_CACHE_MAX_OWNERS) {
+        /* take a new slot */
+        index = cache->owner_count;
+        if (cache->owners[index / ATTR_OWNER_CHUNK] == NULL) {
+            cache->owners[index / ATTR_OWNER_CHUNK] = calloc(
+                ATTR_OWNER_CHUNK, sizeof(struct attr_cache_owner));
+            if (cache->owners[index / ATTR_OWNER_CHUNK] == NULL)
+                return 0;
+        }
+        cache->owner_count++;
+    } else if (cache->owner_unused) {
+        /* reuse one that nobody references */
+        for (index = 1; attr_owner_slot(cache, index)->ref_count; index++)
+            ;
+        attr_owner_unhash(cache, index);
+        cache->owner_unused--;
+
+        /* the unhash may have moved the empty slot */
+        i = attr_owner_hash(owner);
+        while (cache->owner_hash[i])
+            i = (i + 1) % ATTR_OWNER_HASH_SIZE;
+
+        DPRINTF(NCLVL1, ("attr_cache_owner() reusing slot %u for '%s'\n",
+            index, owner));
+    } else
+        return 0;
+
+    slot = attr_owner_slot(cache, index);
+    (void)memcpy(slot->name, owner, len + 1);
+    slot->ref_count = 1;
+    /* publish the string before its index, for lock-free readers */
+    MemoryBarrier();
+    cache->owner_hash[i] = index;
+    return index;
+}
+
+/* drop an entry's reference; called inside the entry's write bracket */
+static void attr_cache_owner_put(
+    IN struct attr_cache *cache,
+    IN uint16_t index)
+{
+    struct attr_cache_owner *slot;
+
+    if (index == 0)
+        return;
+    slot = attr_owner_slot(cache, index);
+    EASSERT(slot->ref_count > 0);
+    if (--slot->ref_count == 0)
+        cache->owner_unused++;
+}
+
+static __inline const char* attr_cache_owner_name(
+    IN const struct attr_cache *cache,
+    IN uint16_t index)
+{
+    const struct attr_cache_owner *chunk;
+
+    if (index == 0 || index >= ATTR_CACHE_MAX_OWNERS)
+        return NULL;
+    chunk = cache->owners[index / ATTR_OWNER_CHUNK];
+    return chunk ? chunk[index % ATTR_OWNER_CHUNK].name : NULL;
 }
 
 static struct attr_cache_entry* attr_cache_search(
     IN struct attr_cache *cache,
     IN uint64_t fileid)
 {
-    /* find an entry that matches fileid */
-    struct attr_cache_entry tmp;
-    tmp.fileid = fileid;
-    return RB_FIND(attr_tree, &cache->head, &tmp);
+    /* probe for an entry that matches fileid; bounded by the table
+     * size, for optimistic readers that race with attr_cache_rehash() */
+    const struct attr_table *table = cache->table;
+    struct attr_cache_entry *entry;
+    uint32_t i, slot = attr_hash(fileid) & table->mask;
+
+    for (i = 0; i <= table->mask; i++) {
+        entry = table->slots[slot];
+        if (entry == NULL)
+            break;
+        if (entry != &attr_tombstone && entry->fileid == fileid)
+            return entry;
+        slot = (slot + 1) & table->mask;
+    }
+    return NULL;
 }
 
 static int attr_cache_insert(
     IN struct attr_cache *cache,
     IN struct attr_cache_entry *entry)
 {
+    struct attr_table *table;
+    uint32_t slot;
     int status = NO_ERROR;
 
     DPRINTF(NCLVL2, ("--> attr_cache_insert(%llu)\n", entry->fileid));
 
-    if (RB_INSERT(attr_tree, &cache->head, entry))
+    if (attr_cache_search(cache, entry->fileid)) {
         status = ERROR_FILE_EXISTS;
+        goto out;
+    }
+
+    if (cache->used + 1 > (cache->table->mask + 1) / 4 * 3) {
+        status = attr_cache_rehash(cache);
+        if (status)
+            goto out;
+    }
 
+    /* take the first empty slot or tombstone */
+    table = cache->table;
+    slot = attr_hash(entry->fileid) & table->mask;
+    while (table->slots[slot] && table->slots[slot] != &attr_tombstone)
+        slot = (slot + 1) & table->mask;
+
+    attr_cache_write_begin(cache, entry->fileid);
+    if (table->slots[slot] == NULL)
+        cache->used++;
+    table->slots[slot] = entry;
+    attr_cache_write_end(cache, entry->fileid);
+    cache->live++;
+out:
     DPRINTF(NCLVL2, ("<-- attr_cache_insert() returning %d\n", status));
     return status;
 }
@@ -281,19 +680,30 @@ out_err_free:
 }
 
 static void attr_cache_update(
+    IN struct attr_cache *cache,
     IN struct attr_cache_entry *entry,
     IN const nfs41_file_info *info,
     IN enum open_delegation_type4 delegation)
 {
+    uint16_t previous;
+
+    attr_cache_write_begin(cache, entry->fileid);
+
     /* update the attributes present in mask */
     if (info->attrmask.count > 0) {
         if (info->attrmask.arr[0] & FATTR4_WORD0_TYPE)
             entry->type = (unsigned char)(info->type & NFS_FTYPE_MASK);
         if (info->attrmask.arr[0] & FATTR4_WORD0_CHANGE) {
+            /* revalidate whenever we get a change attribute.  like the
+             * ac* mount options on other clients, the timeout starts at
+             * timeo and doubles up to timeo_max while nothing changes */
+            if (entry->timeout && entry->change == info->change)
+                entry->timeout = min(entry->timeout * 2, cache->timeo_max);
+            else
+                entry->timeout = cache->timeo;
             entry->change = info->change;
-            /* revalidate whenever we get a change attribute */
             entry->invalidated = 0;
-            entry->expiration = UTIL_GETRELTIME() + NAME_CACHE_EXPIRATION;
+            entry->expiration = (uint32_t)(UTIL_GETRELTIME() + entry->timeout);
         }
         if (info->attrmask.arr[0] & FATTR4_WORD0_SIZE)
             entry->size = info->size;
@@ -307,11 +717,15 @@ static void attr_cache_update(
             entry->mode = info->mode;
         if (info->attrmask.arr[1] & FATTR4_WORD1_OWNER) {
             EASSERT(info->owner != NULL);
-            (void)strcpy(entry->owner, info->owner);
+            previous = entry->owner;
+            entry->owner = attr_cache_owner(cache, info->owner);
+            attr_cache_owner_put(cache, previous);
         }
         if (info->attrmask.arr[1] & FATTR4_WORD1_OWNER_GROUP) {
             EASSERT(info->owner_group != NULL);
-            (void)strcpy(entry->owner_group, info->owner_group);
+            previous = entry->owner_group;
+            entry->owner_group = attr_cache_owner(cache, info->owner_group);
+            attr_cache_owner_put(cache, previous);
         }
         if (info->attrmask.arr[1] & FATTR4_WORD1_NUMLINKS)
             entry->numlinks = info->numlinks;
@@ -333,12 +747,18 @@ static void attr_cache_update(
 
     if (is_delegation(delegation))
         entry->delegated = TRUE;
+
+    attr_cache_write_end(cache, entry->fileid);
 }
 
 static void copy_attrs(
+    IN const struct attr_cache *cache,
     OUT nfs41_file_info *dst,
     IN const struct attr_cache_entry *src)
 {
+    const char *owner = attr_cache_owner_name(cache, src->owner);
+    const char *owner_group = attr_cache_owner_name(cache, src->owner_group);
+
     dst->attrmask.count = 2;
     dst->attrmask.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE
         | FATTR4_WORD0_SIZE | FATTR4_WORD0_FILEID
@@ -368,18 +788,20 @@ static void copy_attrs(
     dst->numlinks = src->numlinks;
     dst->mode = src->mode;
 
-    if (src->owner[0] != '\0') {
+    /* bounded copies, since an optimistic reader may see a torn string */
+    if (owner) {
         dst->owner = dst->owner_buf;
-        (void)strcpy(dst->owner, src->owner);
+        (void)StringCchCopyA(dst->owner, NFS4_FATTR4_OWNER_LIMIT+1, owner);
     }
     else {
         /* this should only happen for newly created files/dirs */
         dst->owner = NULL;
     }
 
-    if (src->owner_group[0] != '\0') {
+    if (owner_group) {
         dst->owner_group = dst->owner_group_buf;
-        (void)strcpy(dst->owner_group, src->owner_group);
+        (void)StringCchCopyA(dst->owner_group, NFS4_FATTR4_OWNER_LIMIT+1,
+            owner_group);
     }
     else {
         /* this should only happen for newly created files/dirs */
@@ -399,29 +821,127 @@ static void copy_attrs(
 
 /* name cache */
 RB_HEAD(name_tree, name_cache_entry);
+
+/* an entry's component is followed by the bytes of its filehandle.
+ * the pair is stored inline when it fits in NAME_INLINE_LEN, which
+ * covers most names, and otherwise in a block of the name arena */
+#define NAME_INLINE_LEN 48
+#define NAME_DATA_INLINE 0x7f
+#define NAME_DATA_MAX (NFS41_MAX_COMPONENT_LEN + NFS4_FHSIZE)
+
 struct name_cache_entry {
-    char                    component[NFS41_MAX_COMPONENT_LEN];
-    nfs41_fh                fh;
     RB_ENTRY(name_cache_entry) rbnode;
     struct name_tree        rbchildren;
     struct attr_cache_entry *attributes;
     struct name_cache_entry *parent;
     struct list_entry       exp_entry;
-    util_reltimestamp         expiration;
+    uint64_t                fileid; /* nfs41_fh, minus the handle bytes */
+    struct __nfs41_superblock *superblock;
+    char                    *data; /* component, then filehandle */
+    uint32_t                expiration; /* UTIL_GETRELTIME() */
     unsigned short          component_len;
+    unsigned char           fh_len;
+    unsigned char           data_class : 7; /* arena class or NAME_DATA_INLINE */
+    unsigned char           dir_delegated : 1; /* see nfs41_name_cache_dir_delegate() */
+    char                    inline_data[NAME_INLINE_LEN];
 };
 #define NAME_ENTRY_SIZE sizeof(struct name_cache_entry)
 
+#define name_entry_fh(entry) \
+    ((const unsigned char*)(entry)->data + (entry)->component_len)
+
 static int name_cmp(struct name_cache_entry *lhs, struct name_cache_entry *rhs)
 {
     const int diff = rhs->component_len - lhs->component_len;
-    return diff ? diff : strncmp(lhs->component, rhs->component, lhs->component_len);
+    return diff ? diff : memcmp(lhs->data, rhs->data, lhs->component_len);
 }
 RB_GENERATE(name_tree, name_cache_entry, rbnode, name_cmp)
 
+static int name_key_cmp(
+    IN const nfs41_component *key,
+    IN const struct name_cache_entry *entry)
+{
+    const int diff = entry->component_len - key->len;
+    return diff ? diff : memcmp(key->name, entry->data, key->len);
+}
+
+
+/* name arena
+ *
+ *   blocks for component/filehandle pairs that don't fit inline, in a
+ * few size classes with a free list each.  the arena grows in chunks up
+ * to its limit and never shrinks, so a lock-free reader holding a stale
+ * data pointer still reads arena memory.  arena chunks and entry slabs
+ * are both allocated with NAME_DATA_MAX bytes of slack, so that reader
+ * can't run off the end either */
+#define NAME_ARENA_CLASSES 4
+#define NAME_ARENA_SCAVENGE 16 /* entries to unlink when the arena is full */
+#define NAME_ARENA_CHUNK (256*1024)
+#define NAME_ARENA_MAX_CHUNKS (NAME_CACHE_MAX_MB * 1024 / 8 / 256)
+
+static const uint16_t name_arena_block[NAME_ARENA_CLASSES] = {
+    96, 160, 256, NAME_DATA_MAX
+};
+
+struct name_arena {
+    char                    *chunks[NAME_ARENA_MAX_CHUNKS];
+    uint32_t                chunk_count;
+    size_t                  limit;
+    size_t                  used; /* of the last chunk */
+    char                    *free[NAME_ARENA_CLASSES]; /* linked through
+                                                      * each block's start */
+};
+
+static __inline unsigned char name_arena_class(
+    IN uint32_t len)
+{
+    unsigned char c = 0;
+    if (len <= NAME_INLINE_LEN)
+        return NAME_DATA_INLINE;
+    while (name_arena_block[c] < len)
+        c++;
+    return c;
+}
+
+static char* name_arena_alloc(
+    IN struct name_arena *arena,
+    IN unsigned char c)
+{
+    char *block = arena->free[c];
+    if (block) {
+        arena->free[c] = *(char**)block;
+        return block;
+    }
+
+    if (arena->chunk_count == 0 ||
+        arena->used + name_arena_block[c] > NAME_ARENA_CHUNK) {
+        /* start a new chunk, if the limit allows it */
+        if (arena->chunk_count == NAME_ARENA_MAX_CHUNKS ||
+            (arena->chunk_count + 1) * (size_t)NAME_ARENA_CHUNK > arena->limit)
+            return NULL;
+        block = calloc(1, NAME_ARENA_CHUNK + NAME_DATA_MAX);
+        if (block == NULL)
+            return NULL;
+        arena->chunks[arena->chunk_count++] = block;
+        arena->used = 0;
+    }
+    block = arena->chunks[arena->chunk_count - 1] + arena->used;
+    arena->used += name_arena_block[c];
+    return block;
+}
+
+static __inline void name_arena_free(
+    IN struct name_arena *arena,
+    IN char *block,
+    IN unsigned char c)
+{
+    *(char**)block = arena->free[c];
+    arena->free[c] = block;
+}
+
 struct nfs41_name_cache {
     struct name_cache_entry *root;
-    struct name_cache_entry *pool;
+    struct name_cache_entry *slabs[NAME_POOL_MAX_SLABS];
     struct attr_cache       attributes;
     struct list_entry       exp_entries; /* list of entries by expiry */
     uint32_t                expiration;
@@ -429,9 +949,115 @@ struct nfs41_name_cache {
     uint32_t                max_entries;
     uint32_t                delegations;
     uint32_t                max_delegations;
+    bool_t                  negative; /* serve negative entries? */
+    struct name_arena       arena;
     SRWLOCK                 lock;
+    volatile LONG           seq; /* odd while a writer holds lock */
+    struct name_index * volatile index; /* see name_index_lookup() */
+    /* entries with dir_delegated set, found by fileid and superblock,
+     * since a rename moves them to another path */
+    struct name_cache_entry *dir_delegations[NAME_CACHE_DIR_DELEGATIONS];
+    uint32_t                dir_delegation_count;
+};
+
+
+/* lookups don't take cache->lock.  they walk the cache and copy out
+ * what they need, then start over if a writer was active in the
+ * meantime.  name and attribute entries come from pools that aren't
+ * freed until the cache is, so a reader that races with a writer may
+ * see stale or torn entries, but never freed memory; every pointer it
+ * follows still points into a pool, searches are bounded by
+ * NAME_CACHE_MAX_DEPTH, and copies are bounded by their buffers.
+ * after NAME_CACHE_READ_RETRIES, readers take the shared lock so a
+ * stream of writers can't starve them */
+struct name_cache_read {
+    LONG                    seq;
+    uint32_t                tries;
+    bool_t                  locked;
+};
+
+static __inline void name_cache_read_begin(
+    IN struct nfs41_name_cache *cache,
+    IN OUT struct name_cache_read *read)
+{
+    if (read->tries >= NAME_CACHE_READ_RETRIES) {
+        AcquireSRWLockShared(&cache->lock);
+        read->locked = TRUE;
+    }
+    read->seq = cache->seq;
+    MemoryBarrier();
+}
+
+static __inline bool_t name_cache_read_retry(
+    IN struct nfs41_name_cache *cache,
+    IN OUT struct name_cache_read *read)
+{
+    if (read->locked) {
+        ReleaseSRWLockShared(&cache->lock);
+        return FALSE;
+    }
+    MemoryBarrier();
+    if ((read->seq & 1) == 0 && cache->seq == read->seq)
+        return FALSE;
+    read->tries++;
+    return TRUE;
+}
+
+/* attribute lookups validate against the fileid's stripe instead; see
+ * attr_cache_write_begin() */
+struct attr_cache_read {
+    LONG                    table_seq;
+    LONG                    stripe_seq;
+    uint32_t                tries;
+    bool_t                  locked;
 };
 
+static __inline void attr_cache_read_begin(
+    IN struct nfs41_name_cache *cache,
+    IN uint64_t fileid,
+    IN OUT struct attr_cache_read *read)
+{
+    if (read->tries >= NAME_CACHE_READ_RETRIES) {
+        AcquireSRWLockShared(&cache->lock);
+        read->locked = TRUE;
+    }
+    read->table_seq = cache->attributes.table_seq;
+    read->stripe_seq = *attr_stripe(&cache->attributes, fileid);
+    MemoryBarrier();
+}
+
+static __inline bool_t attr_cache_read_retry(
+    IN struct nfs41_name_cache *cache,
+    IN uint64_t fileid,
+    IN OUT struct attr_cache_read *read)
+{
+    if (read->locked) {
+        ReleaseSRWLockShared(&cache->lock);
+        return FALSE;
+    }
+    MemoryBarrier();
+    if (((read->table_seq | read->stripe_seq) & 1) == 0 &&
+        cache->attributes.table_seq == read->table_seq &&
+        *attr_stripe(&cache->attributes, fileid) == read->stripe_seq)
+        return FALSE;
+    read->tries++;
+    return TRUE;
+}
+
+static __inline void name_cache_write_lock(
+    IN struct nfs41_name_cache *cache)
+{
+    AcquireSRWLockExclusive(&cache->lock);
+    InterlockedIncrement(&cache->seq);
+}
+
+static __inline void name_cache_write_unlock(
+    IN struct nfs41_name_cache *cache)
+{
+    InterlockedIncrement(&cache->seq);
+    ReleaseSRWLockExclusive(&cache->lock);
+}
+
 
 /* internal name cache functions used by the public name cache interface;
  * these functions expect the caller to hold a lock on the cache */
@@ -444,13 +1070,53 @@ static __inline bool_t name_cache_enabled(
     return cache->expiration > 0;
 }
 
-static __inline void name_cache_entry_rename(
-    OUT struct name_cache_entry *entry,
+/* replace an entry's component and filehandle bytes, moving them
+ * between inline storage and the arena as their size requires */
+static int name_cache_entry_set(
+    IN struct nfs41_name_cache *cache,
+    IN struct name_cache_entry *entry,
+    IN const char *name,
+    IN unsigned short name_len,
+    IN const unsigned char *fh,
+    IN uint32_t fh_len)
+{
+    char buffer[NAME_DATA_MAX];
+    const unsigned char c = name_arena_class(name_len + fh_len);
+    char *data = entry->data;
+
+    if (name_len > NFS41_MAX_COMPONENT_LEN || fh_len > NFS4_FHSIZE)
+        return ERROR_BUFFER_OVERFLOW;
+
+    /* stage both, since either one may be in entry->data already */
+    (void)memcpy(buffer, name, name_len);
+    if (fh_len) /* fh is NULL for negative entries */
+        (void)memcpy(buffer + name_len, fh, fh_len);
+
+    if (c != entry->data_class) {
+        if (c == NAME_DATA_INLINE)
+            data = entry->inline_data;
+        else if ((data = name_arena_alloc(&cache->arena, c)) == NULL)
+            return ERROR_OUTOFMEMORY;
+
+        if (entry->data_class != NAME_DATA_INLINE)
+            name_arena_free(&cache->arena, entry->data, entry->data_class);
+        entry->data_class = c;
+    }
+
+    (void)memcpy(data, buffer, name_len + fh_len);
+    entry->data = data;
+    entry->component_len = name_len;
+    entry->fh_len = (unsigned char)fh_len;
+    return NO_ERROR;
+}
+
+static __inline int name_cache_entry_rename(
+    IN struct nfs41_name_cache *cache,
+    IN OUT struct name_cache_entry *entry,
     IN const nfs41_component *component)
 {
-    StringCchCopyNA(entry->component, NFS41_MAX_COMPONENT_LEN,
-        component->name, component->len);
-    entry->component_len = component->len;
+    return name_cache_entry_set(cache, entry, component->name,
+        component->len, name_entry_fh(entry), entry->fh_len);
 }
 
 static __inline void name_cache_remove(
@@ -465,6 +1131,44 @@ static void name_cache_unlink_children_recursive(
     IN struct nfs41_name_cache *cache,
     IN struct name_cache_entry *parent);
 
+static struct name_cache_entry** name_cache_dir_deleg_find(
+    IN struct nfs41_name_cache *cache,
+    IN const struct __nfs41_superblock *superblock,
+    IN uint64_t fileid)
+{
+    struct name_cache_entry *entry;
+    uint32_t i;
+
+    for (i = 0; i < cache->dir_delegation_count; i++) {
+        entry = cache->dir_delegations[i];
+        if (entry->fileid == fileid && entry->superblock == superblock)
+            return &cache->dir_delegations[i];
+    }
+    return NULL;
+}
+
+/* stop holding a delegated directory's entry, and let it expire again */
+static void name_cache_dir_deleg_forget(
+    IN struct nfs41_name_cache *cache,
+    IN struct name_cache_entry *entry)
+{
+    uint32_t i;
+
+    if (!entry->dir_delegated)
+        return;
+    entry->dir_delegated = 0;
+
+    for (i = 0; i < cache->dir_delegation_count; i++) {
+        if (cache->dir_delegations[i] == entry) {
+            cache->dir_delegations[i] =
+                cache->dir_delegations[--cache->dir_delegation_count];
+            break;
+        }
+    }
+    if (list_empty(&entry->exp_entry))
+        list_add_head(&cache->exp_entries, &entry->exp_entry);
+}
+
 static __inline void name_cache_unlink(
     IN struct nfs41_name_cache *cache,
     IN struct name_cache_entry *entry)
@@ -477,11 +1181,20 @@ static __inline void name_cache_unlink(
 
     /* unlink all of its children */
     name_cache_unlink_children_recursive(cache, entry);
+    name_cache_dir_deleg_forget(cache, entry);
     /* release the cached attributes */
     if (entry->attributes) {
         attr_cache_entry_deref(&cache->attributes, entry->attributes);
         entry->attributes = NULL;
     }
+    /* give its arena block back */
+    if (entry->data_class != NAME_DATA_INLINE) {
+        name_arena_free(&cache->arena, entry->data, entry->data_class);
+        entry->data = entry->inline_data;
+        entry->data_class = NAME_DATA_INLINE;
+    }
+    entry->component_len = 0;
+    entry->fh_len = 0;
     /* move it to the end of exp_entries for scavenging */
     list_remove(&entry->exp_entry);
     list_add_tail(&cache->exp_entries, &entry->exp_entry);
@@ -496,6 +1209,36 @@ static void name_cache_unlink_children_recursive(
         name_cache_unlink(cache, entry);
 }
 
+/* add a slab of name entries, and as many attribute entries */
+static int name_cache_grow(
+    IN struct nfs41_name_cache *cache)
+{
+    const uint32_t slab = cache->entries / NAME_POOL_SLAB_ENTRIES;
+    int status = NO_ERROR;
+
+    if (slab == NAME_POOL_MAX_SLABS) {
+        status = ERROR_OUTOFMEMORY;
+        goto out;
+    }
+    if (cache->slabs[slab] == NULL) {
+        cache->slabs[slab] = calloc(1, NAME_POOL_SLAB_ENTRIES * NAME_ENTRY_SIZE
+            + NAME_DATA_MAX);
+        if (cache->slabs[slab] == NULL) {
+            status = GetLastError();
+            goto out;
+        }
+        status = attr_cache_grow(&cache->attributes);
+        if (status) {
+            free(cache->slabs[slab]);
+            cache->slabs[slab] = NULL;
+            goto out;
+        }
+    }
+    DPRINTF(NCLVL1, ("name_cache_grow() added slab %u\n", slab));
+out:
+    return status;
+}
+
 static int name_cache_entry_create(
     IN struct nfs41_name_cache *cache,
     IN const nfs41_component *component,
@@ -513,16 +1256,45 @@ static int name_cache_entry_create(
         entry = name_entry(cache->exp_entries.prev);
         name_cache_unlink(cache, entry);
 
-        DPRINTF(NCLVL2, ("name_cache_entry_create('%s') scavenged 0x%p\n",
-            component->name, entry));
+        DPRINTF(NCLVL2, ("name_cache_entry_create('%.*s') scavenged 0x%p\n",
+            component->len, component->name, entry));
     } else {
         /* take the next entry in the pool and add it to exp_entries */
-        entry = &cache->pool[cache->entries++];
+        if (cache->entries % NAME_POOL_SLAB_ENTRIES == 0) {
+            status = name_cache_grow(cache);
+            if (status)
+                goto out;
+        }
+        entry = &cache->slabs[cache->entries / NAME_POOL_SLAB_ENTRIES]
+            [cache->entries % NAME_POOL_SLAB_ENTRIES];
+        cache->entries++;
+        entry->data = entry->inline_data;
+        entry->data_class = NAME_DATA_INLINE;
+        entry->dir_delegated = 0;
         list_init(&entry->exp_entry);
         list_add_tail(&cache->exp_entries, &entry->exp_entry);
     }
-
-    name_cache_entry_rename(entry, component);
+    entry->fh_len = 0;
+
+    status = name_cache_entry_rename(cache, entry, component);
+    if (status == ERROR_OUTOFMEMORY) {
+        /* the arena is full; unlink the oldest entries that use it */
+        struct list_entry *pos = cache->exp_entries.prev;
+        uint32_t i;
+        for (i = 0; i < NAME_ARENA_SCAVENGE && status; i++) {
+            struct name_cache_entry *victim;
+            if (pos == &cache->exp_entries)
+                break;
+            victim = name_entry(pos);
+            pos = pos->prev;
+            if (victim == entry || victim->data_class == NAME_DATA_INLINE)
+                continue;
+            name_cache_unlink(cache, victim);
+            status = name_cache_entry_rename(cache, entry, component);
+        }
+    }
+    if (status)
+        goto out;
 
     *entry_out = entry;
 out:
@@ -552,7 +1324,7 @@ static void name_cache_entry_updated(
     IN struct name_cache_entry *entry)
 {
     /* update the expiration timer */
-    entry->expiration = UTIL_GETRELTIME() + cache->expiration;
+    entry->expiration = (uint32_t)(UTIL_GETRELTIME() + cache->expiration);
     name_cache_entry_accessed(cache, entry);
 }
 
@@ -563,12 +1335,16 @@ static int name_cache_entry_update(
     IN OPTIONAL const nfs41_file_info *info,
     IN enum open_delegation_type4 delegation)
 {
-    int status = NO_ERROR;
+    int status;
 
-    if (fh)
-        fh_copy(&entry->fh, fh);
-    else
-        entry->fh.len = 0;
+    if (fh) {
+        entry->fileid = fh->fileid;
+        entry->superblock = fh->superblock;
+    }
+    status = name_cache_entry_set(cache, entry, entry->data,
+        entry->component_len, fh ? fh->fh : NULL, fh ? fh->len : 0);
+    if (status)
+        goto out;
 
     if (info) {
         if (entry->attributes == NULL) {
@@ -579,7 +1355,8 @@ static int name_cache_entry_update(
                 goto out;
         }
 
-        attr_cache_update(entry->attributes, info, delegation);
+        attr_cache_update(&cache->attributes, entry->attributes,
+            info, delegation);
 
         /* hold a reference as long as we have the delegation */
         if (is_delegation(delegation)) {
@@ -592,6 +1369,7 @@ static int name_cache_entry_update(
             list_remove(&entry->exp_entry);
     } else if (entry->attributes) {
         /* positive -> negative entry, deref the attributes */
+        name_cache_dir_deleg_forget(cache, entry);
         attr_cache_entry_deref(&cache->attributes, entry->attributes);
         entry->attributes = NULL;
     }
@@ -610,15 +1388,17 @@ static int name_cache_entry_changed(
 
     if (cinfo->after == entry->attributes->change ||
             (cinfo->atomic && cinfo->before == entry->attributes->change)) {
+        attr_cache_write_begin(&cache->attributes, entry->attributes->fileid);
         entry->attributes->change = cinfo->after;
+        attr_cache_write_end(&cache->attributes, entry->attributes->fileid);
         name_cache_entry_updated(cache, entry);
-        DPRINTF(NCLVL1, ("name_cache_entry_changed('%s') has not changed. "
-            "updated change=%llu\n", entry->component,
+        DPRINTF(NCLVL1, ("name_cache_entry_changed('%.*s') has not changed. "
+            "updated change=%llu\n", entry->component_len, entry->data,
             entry->attributes->change));
         return FALSE;
     } else {
-        DPRINTF(NCLVL1, ("name_cache_entry_changed('%s') has changed: was %llu, "
-            "got before=%llu\n", entry->component,
+        DPRINTF(NCLVL1, ("name_cache_entry_changed('%.*s') has changed: was %llu, "
+            "got before=%llu\n", entry->component_len, entry->data,
             entry->attributes->change, cinfo->before));
         return TRUE;
     }
@@ -628,12 +1408,15 @@ static void name_cache_entry_invalidate(
     IN struct nfs41_name_cache *cache,
     IN struct name_cache_entry *entry)
 {
-    DPRINTF(NCLVL1, ("name_cache_entry_invalidate('%s')\n", entry->component));
+    DPRINTF(NCLVL1, ("name_cache_entry_invalidate('%.*s')\n",
+        entry->component_len, entry->data));
 
     if (entry->attributes) {
         /* flag attributes so that entry_invis() will return true
          * if another entry attempts to use them */
+        attr_cache_write_begin(&cache->attributes, entry->attributes->fileid);
         entry->attributes->invalidated = 1;
+        attr_cache_write_end(&cache->attributes, entry->attributes->fileid);
     }
     name_cache_unlink(cache, entry);
 }
@@ -643,16 +1426,26 @@ static struct name_cache_entry* name_cache_search(
     IN struct name_cache_entry *parent,
     IN const nfs41_component *component)
 {
-    struct name_cache_entry tmp, *entry;
-
-    DPRINTF(NCLVL2, ("--> name_cache_search('%.*s' under '%s')\n",
-        component->len, component->name, parent->component));
-
-    StringCchCopyNA(tmp.component, NFS41_MAX_COMPONENT_LEN,
-        component->name, component->len);
-    tmp.component_len = component->len;
-
-    entry = RB_FIND(name_tree, &parent->rbchildren, &tmp);
+    struct name_cache_entry *entry;
+    uint32_t depth;
+
+    DPRINTF(NCLVL2, ("--> name_cache_search('%.*s' under '%.*s')\n",
+        component->len, component->name,
+        parent->component_len, parent->data));
+
+    /* like RB_FIND(), but bounded for optimistic readers */
+    entry = RB_ROOT(&parent->rbchildren);
+    for (depth = 0; entry && depth < NAME_CACHE_MAX_DEPTH; depth++) {
+        const int diff = name_key_cmp(component, entry);
+        if (diff < 0)
+            entry = RB_LEFT(entry, rbnode);
+        else if (diff > 0)
+            entry = RB_RIGHT(entry, rbnode);
+        else
+            break;
+    }
+    if (depth == NAME_CACHE_MAX_DEPTH)
+        entry = NULL;
     if (entry) {
         DPRINTF(NCLVL2, ("<-- name_cache_search() "
             "found existing entry 0x%p\n", entry));
@@ -667,15 +1460,20 @@ static int entry_invis(
     IN struct name_cache_entry *entry,
     OUT OPTIONAL bool_t *is_negative)
 {
-    /* name entry timer expired? */
-    if (!list_empty(&entry->exp_entry) && (UTIL_GETRELTIME() > entry->expiration)) {
-        DPRINTF(NCLVL2, ("name_entry_expired('%s')\n", entry->component));
+    /* name entry timer expired?  names in a delegated directory don't
+     * expire, because CB_NOTIFY tells us when they change */
+    if (!list_empty(&entry->exp_entry) &&
+        (entry->parent == NULL || !entry->parent->dir_delegated) &&
+        (UTIL_GETRELTIME() > entry->expiration)) {
+        DPRINTF(NCLVL2, ("name_entry_expired('%.*s')\n",
+            entry->component_len, entry->data));
         return 1;
     }
     /* negative lookup entry? */
     if (entry->attributes == NULL) {
         if (is_negative) *is_negative = 1;
-        DPRINTF(NCLVL2, ("name_entry_negative('%s')\n", entry->component));
+        DPRINTF(NCLVL2, ("name_entry_negative('%.*s')\n",
+            entry->component_len, entry->data));
         return 1;
     }
     /* attribute entry expired? */
@@ -687,6 +1485,112 @@ static int entry_invis(
     return 0;
 }
 
+/* full-path index
+ *
+ *   a direct-mapped table from a hash of a path's components to the
+ * entry at the end of that path, so a warm lookup costs one probe
+ * instead of an rb-tree search per component.  slots are only hints:
+ * a hit is verified by walking up the entry's parents to the root and
+ * comparing each component against the path.  rename, remove, parent
+ * invalidation and scavenging all unlink or move entries in the tree,
+ * so they can't produce a false hit, and stale slots are simply
+ * overwritten.  slots hold pool pointers only, so lock-free readers
+ * may fill them too */
+#define NAME_INDEX_MAX_COMPONENTS 64
+
+struct name_index {
+    struct name_index       *retired; /* the smaller index this replaced */
+    uint32_t                mask;
+    struct name_cache_entry * volatile slots[1];
+};
+
+/* size the index to the next power of 2 above max_entries.  it only
+ * grows, when a mount raises the cache size.  lock-free readers may
+ * still be probing the old index, so that one is kept until the cache
+ * is freed, like the entry slabs */
+static void name_index_resize(
+    IN struct nfs41_name_cache *cache)
+{
+    struct name_index *index;
+    uint32_t size = 1;
+
+    while (size < cache->max_entries)
+        size <<= 1;
+    if (cache->index && cache->index->mask >= size - 1)
+        return;
+
+    index = calloc(1, sizeof(struct name_index) +
+        (size - 1) * sizeof(struct name_cache_entry*));
+    if (index == NULL)
+        return; /* keep the smaller index, it's only a hint */
+    index->retired = cache->index;
+    index->mask = size - 1;
+    MemoryBarrier(); /* publish the empty slots before the index */
+    cache->index = index;
+}
+
+static uint32_t name_index_hash(
+    IN const nfs41_component *components,
+    IN uint32_t count)
+{
+    /* FNV-1a over the components, with a separator between them */
+    uint32_t i, hash = 2166136261u;
+    unsigned short j;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < components[i].len; j++)
+            hash = (hash ^ (unsigned char)components[i].name[j]) * 16777619u;
+        hash = (hash ^ '\\') * 16777619u;
+    }
+    return hash;
+}
+
+static struct name_cache_entry* name_index_lookup(
+    IN struct nfs41_name_cache *cache,
+    IN bool_t skip_invis,
+    IN const char *path,
+    IN const char *path_end,
+    OUT const char **remaining_out,
+    OUT struct name_cache_entry * volatile **slot_out)
+{
+    nfs41_component components[NAME_INDEX_MAX_COMPONENTS];
+    nfs41_component component;
+    struct name_index *index = cache->index;
+    struct name_cache_entry *entry, *target;
+    const char *path_pos = path;
+    uint32_t count = 0;
+
+    *slot_out = NULL;
+    while (next_component(path_pos, path_end, &component)) {
+        if (count == NAME_INDEX_MAX_COMPONENTS)
+            return NULL;
+        components[count++] = component;
+        path_pos = component.name + component.len;
+    }
+    if (count == 0)
+        return NULL;
+    *remaining_out = component.name;
+    *slot_out = &index->slots[name_index_hash(components, count) &
+        index->mask];
+
+    /* verify the hint from the leaf up to the root */
+    target = entry = **slot_out;
+    while (entry && count) {
+        count--;
+        if (entry->component_len != components[count].len ||
+            memcmp(entry->data, components[count].name,
+                components[count].len) != 0)
+            return NULL;
+        if (skip_invis && entry_invis(entry, NULL))
+            return NULL;
+        entry = entry->parent;
+    }
+    if (count || entry == NULL || entry != cache->root)
+        return NULL;
+    if (skip_invis && entry_invis(entry, NULL))
+        return NULL;
+    return target;
+}
+
 static int name_cache_lookup(
     IN struct nfs41_name_cache *cache,
     IN bool_t skip_invis,
@@ -698,12 +1602,20 @@ static int name_cache_lookup(
     OUT OPTIONAL bool_t *is_negative)
 {
     struct name_cache_entry *parent, *target;
+    struct name_cache_entry * volatile *slot;
     nfs41_component component;
     const char *path_pos;
     int status = NO_ERROR;
 
     DPRINTF(NCLVL1, ("--> name_cache_lookup('%s')\n", path));
 
+    target = name_index_lookup(cache, skip_invis,
+        path, path_end, &component.name, &slot);
+    if (target) {
+        parent = target->parent;
+        goto out;
+    }
+
     parent = NULL;
     target = cache->root;
     component.name = path_pos = path;
@@ -727,6 +1639,8 @@ static int name_cache_lookup(
             break;
         }
     }
+    if (status == NO_ERROR && slot)
+        *slot = target;
 out:
     if (remaining_path_out) *remaining_path_out = component.name;
     if (parent_out) *parent_out = parent;
@@ -741,7 +1655,8 @@ static int name_cache_insert(
 {
     int status = NO_ERROR;
 
-    DPRINTF(NCLVL2, ("--> name_cache_insert('%s')\n", entry->component));
+    DPRINTF(NCLVL2, ("--> name_cache_insert('%.*s')\n",
+        entry->component_len, entry->data));
 
     if (RB_INSERT(name_tree, &parent->rbchildren, entry))
         status = ERROR_FILE_EXISTS;
@@ -759,8 +1674,9 @@ static int name_cache_find_or_create(
 {
     int status = NO_ERROR;
 
-    DPRINTF(NCLVL1, ("--> name_cache_find_or_create('%.*s' under '%s')\n",
-        component->len, component->name, parent->component));
+    DPRINTF(NCLVL1, ("--> name_cache_find_or_create('%.*s' under '%.*s')\n",
+        component->len, component->name,
+        parent->component_len, parent->data));
 
     *target_out = name_cache_search(cache, parent, component);
     if (*target_out)
@@ -787,9 +1703,38 @@ out_err:
 
 /* public name cache interface, declared in name_cache.h */
 
-/* assuming no hard links, calculate how many entries will fit in the cache */
+/* assuming no hard links, calculate how many entries will fit in the
+ * cache after setting aside the name arena for long components */
 #define SIZE_PER_ENTRY (ATTR_ENTRY_SIZE + NAME_ENTRY_SIZE)
-#define NAME_CACHE_MAX_ENTRIES (NAME_CACHE_MAX_SIZE / SIZE_PER_ENTRY)
+
+static void name_cache_resize(
+    IN struct nfs41_name_cache *cache,
+    IN uint32_t size_mb)
+{
+    const size_t size = (size_t)size_mb * 1024 * 1024;
+    struct list_entry *pos;
+    uint32_t excess;
+
+    cache->arena.limit = max(size / 8, NAME_ARENA_CHUNK);
+    cache->max_entries = (uint32_t)min((size - size / 8) / SIZE_PER_ENTRY,
+        NAME_POOL_MAX_SLABS * NAME_POOL_SLAB_ENTRIES);
+    cache->max_delegations = cache->max_entries / 2;
+    name_index_resize(cache);
+
+    if (cache->entries <= cache->max_entries)
+        return;
+
+    /* shrinking; unlink the oldest entries over the limit.  their slabs
+     * stay allocated, but their attributes and arena blocks are freed,
+     * and scavenging will reuse them before anything else */
+    excess = cache->entries - cache->max_entries;
+    pos = cache->exp_entries.prev;
+    while (excess-- && pos != &cache->exp_entries) {
+        struct name_cache_entry *entry = name_entry(pos);
+        pos = pos->prev;
+        name_cache_unlink(cache, entry);
+    }
+}
 
 int nfs41_name_cache_create(
     OUT struct nfs41_name_cache **cache_out)
@@ -797,9 +1742,6 @@ int nfs41_name_cache_create(
     struct nfs41_name_cache *cache;
     int status = NO_ERROR;
 
-    DPRINTF(NCLVL1, ("nfs41_name_cache_create() with %ld entries\n",
-        (long)NAME_CACHE_MAX_ENTRIES));
-
     /* allocate the cache */
     cache = calloc(1, sizeof(struct nfs41_name_cache));
     if (cache == NULL) {
@@ -809,37 +1751,79 @@ int nfs41_name_cache_create(
 
     list_init(&cache->exp_entries);
     cache->expiration = NAME_CACHE_EXPIRATION;
-    cache->max_entries = NAME_CACHE_MAX_ENTRIES;
-    cache->max_delegations = NAME_CACHE_MAX_ENTRIES / 2;
+    cache->negative = TRUE;
+    name_cache_resize(cache, NAME_CACHE_DEFAULT_MB);
     InitializeSRWLock(&cache->lock);
 
-    /* allocate a pool of entries */
-    cache->pool = calloc(cache->max_entries, NAME_ENTRY_SIZE);
-    if (cache->pool == NULL) {
+    DPRINTF(NCLVL1, ("nfs41_name_cache_create() with %ld entries\n",
+        (long)cache->max_entries));
+
+    /* name_cache_resize() allocated the path index */
+    if (cache->index == NULL) {
         status = GetLastError();
         goto out_err_cache;
     }
 
     /* initialize the attribute cache */
-    status = attr_cache_init(&cache->attributes, cache->max_entries);
+    status = attr_cache_init(&cache->attributes);
     if (status)
-        goto out_err_pool;
+        goto out_err_index;
 
     *cache_out = cache;
 out:
     return status;
 
-out_err_pool:
-    free(cache->pool);
+out_err_index:
+    free(cache->index);
 out_err_cache:
     free(cache);
     goto out;
 }
 
+void nfs41_name_cache_configure(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_name_cache_config *config)
+{
+    DPRINTF(1, ("nfs41_name_cache_configure(timeo=%d, timeo_max=%d, "
+        "size_mb=%d, negative=%d)\n", (int)config->timeo,
+        (int)config->timeo_max, (int)config->size_mb,
+        (int)config->negative));
+
+    name_cache_write_lock(cache);
+
+    /* the cache is shared by every mount of this server; options that
+     * a mount didn't give leave the other mounts' settings alone */
+    if (config->timeo != NAME_CACHE_CONFIG_UNSET) {
+        if (config->timeo == 0 && cache->root)
+            name_cache_unlink(cache, cache->root);
+        cache->expiration = config->timeo;
+        cache->attributes.timeo = config->timeo;
+    }
+    if (config->timeo_max != NAME_CACHE_CONFIG_UNSET)
+        cache->attributes.timeo_max = config->timeo_max;
+    cache->attributes.timeo_max = max(cache->attributes.timeo_max,
+        cache->attributes.timeo);
+    if (config->negative != NAME_CACHE_CONFIG_UNSET)
+        cache->negative = config->negative ? TRUE : FALSE;
+    if (config->size_mb != NAME_CACHE_CONFIG_UNSET)
+        name_cache_resize(cache,
+            min(max(config->size_mb, 1), NAME_CACHE_MAX_MB));
+
+    name_cache_write_unlock(cache);
+}
+
+uint32_t nfs41_name_cache_expiration(
+    IN struct nfs41_name_cache *cache)
+{
+    return cache->expiration;
+}
+
 int nfs41_name_cache_free(
     IN struct nfs41_name_cache **cache_out)
 {
     struct nfs41_name_cache *cache = *cache_out;
+    struct name_index *index, *retired;
+    uint32_t i;
     int status = NO_ERROR;
 
     DPRINTF(NCLVL1, ("nfs41_name_cache_free()\n"));
@@ -847,8 +1831,15 @@ int nfs41_name_cache_free(
     /* free the attribute cache */
     attr_cache_free(&cache->attributes);
 
-    /* free the name entry pool */
-    free(cache->pool);
+    /* free the name entry slabs, name arena and path index */
+    for (i = 0; i < NAME_POOL_MAX_SLABS && cache->slabs[i]; i++)
+        free(cache->slabs[i]);
+    for (i = 0; i < cache->arena.chunk_count; i++)
+        free(cache->arena.chunks[i]);
+    for (index = cache->index; index; index = retired) {
+        retired = index->retired;
+        free(index);
+    }
     free(cache);
     *cache_out = NULL;
     return status;
@@ -858,9 +1849,14 @@ static __inline void copy_fh(
     OUT nfs41_fh *dst,
     IN OPTIONAL const struct name_cache_entry *src)
 {
-    if (src)
-        fh_copy(dst, &src->fh);
-    else
+    if (src) {
+        /* bounded, since an optimistic reader may see torn lengths */
+        dst->fileid = src->fileid;
+        dst->superblock = src->superblock;
+        dst->len = min(src->fh_len, NFS4_FHSIZE);
+        memcpy(dst->fh, src->data +
+            min(src->component_len, NFS41_MAX_COMPONENT_LEN), dst->len);
+    } else
         dst->len = 0;
 }
 
@@ -874,27 +1870,34 @@ int nfs41_name_cache_lookup(
     OUT OPTIONAL nfs41_file_info *info_out,
     OUT OPTIONAL bool_t *is_negative)
 {
+    struct name_cache_read read = { 0 };
     struct name_cache_entry *parent, *target;
-    const char *path_pos = path;
+    struct attr_cache_entry *attributes;
+    const char *path_pos;
+    bool_t negative;
     int status;
 
-    AcquireSRWLockShared(&cache->lock);
+    do {
+        name_cache_read_begin(cache, &read);
+        path_pos = path;
+        negative = FALSE;
 
-    if (!name_cache_enabled(cache)) {
-        status = ERROR_NOT_SUPPORTED;
-        goto out_unlock;
-    }
+        if (!name_cache_enabled(cache)) {
+            status = ERROR_NOT_SUPPORTED;
+            continue;
+        }
 
-    status = name_cache_lookup(cache, 1, path, path_end,
-        &path_pos, &parent, &target, is_negative);
+        status = name_cache_lookup(cache, 1, path, path_end,
+            &path_pos, &parent, &target, &negative);
 
-    if (parent_out) copy_fh(parent_out, parent);
-    if (target_out) copy_fh(target_out, target);
-    if (info_out && target && target->attributes)
-        copy_attrs(info_out, target->attributes);
+        if (parent_out) copy_fh(parent_out, parent);
+        if (target_out) copy_fh(target_out, target);
+        attributes = target ? target->attributes : NULL;
+        if (info_out && attributes)
+            copy_attrs(&cache->attributes, info_out, attributes);
+    } while (name_cache_read_retry(cache, &read));
 
-out_unlock:
-    ReleaseSRWLockShared(&cache->lock);
+    if (is_negative && negative && cache->negative) *is_negative = TRUE;
     if (remaining_path_out) *remaining_path_out = path_pos;
     return status;
 }
@@ -904,28 +1907,29 @@ int nfs41_attr_cache_lookup(
     IN uint64_t fileid,
     OUT nfs41_file_info *info_out)
 {
+    struct attr_cache_read read = { 0 };
     struct attr_cache_entry *entry;
-    int status = NO_ERROR;
+    int status;
 
     DPRINTF(NCLVL1, ("--> nfs41_attr_cache_lookup(%llu)\n", fileid));
 
-    AcquireSRWLockShared(&cache->lock);
+    do {
+        attr_cache_read_begin(cache, fileid, &read);
+        status = NO_ERROR;
 
-    if (!name_cache_enabled(cache)) {
-        status = ERROR_NOT_SUPPORTED;
-        goto out_unlock;
-    }
-
-    entry = attr_cache_search(&cache->attributes, fileid);
-    if (entry == NULL || attr_cache_entry_expired(entry)) {
-        status = ERROR_FILE_NOT_FOUND;
-        goto out_unlock;
-    }
+        if (!name_cache_enabled(cache)) {
+            status = ERROR_NOT_SUPPORTED;
+            continue;
+        }
 
-    copy_attrs(info_out, entry);
+        entry = attr_cache_search(&cache->attributes, fileid);
+        if (entry == NULL || attr_cache_entry_expired(entry)) {
+            status = ERROR_FILE_NOT_FOUND;
+            continue;
+        }
 
-out_unlock:
-    ReleaseSRWLockShared(&cache->lock);
+        copy_attrs(&cache->attributes, info_out, entry);
+    } while (attr_cache_read_retry(cache, fileid, &read));
 
     DPRINTF(NCLVL1, ("<-- nfs41_attr_cache_lookup() returning %d\n", status));
     return status;
@@ -941,7 +1945,7 @@ int nfs41_attr_cache_update(
 
     DPRINTF(NCLVL1, ("--> nfs41_attr_cache_update(%llu)\n", fileid));
 
-    AcquireSRWLockExclusive(&cache->lock);
+    name_cache_write_lock(cache);
 
     if (!name_cache_enabled(cache)) {
         status = ERROR_NOT_SUPPORTED;
@@ -954,10 +1958,10 @@ int nfs41_attr_cache_update(
         goto out_unlock;
     }
 
-    attr_cache_update(entry, info, OPEN_DELEGATE_NONE);
+    attr_cache_update(&cache->attributes, entry, info, OPEN_DELEGATE_NONE);
 
 out_unlock:
-    ReleaseSRWLockExclusive(&cache->lock);
+    name_cache_write_unlock(cache);
 
     DPRINTF(NCLVL1, ("<-- nfs41_attr_cache_update() returning %d\n", status));
     return status;
@@ -978,7 +1982,7 @@ int nfs41_name_cache_insert(
     DPRINTF(NCLVL1, ("--> nfs41_name_cache_insert('%.*s')\n",
         name->name + name->len - path, path));
 
-    AcquireSRWLockExclusive(&cache->lock);
+    name_cache_write_lock(cache);
 
     if (!name_cache_enabled(cache)) {
         status = ERROR_NOT_SUPPORTED;
@@ -1025,7 +2029,7 @@ int nfs41_name_cache_insert(
         goto out_err_update;
 
 out_unlock:
-    ReleaseSRWLockExclusive(&cache->lock);
+    name_cache_write_unlock(cache);
 
     DPRINTF(NCLVL1, ("<-- nfs41_name_cache_insert() returning %d\n",
         status));
@@ -1043,7 +2047,8 @@ out_err_deleg:
         status = attr_cache_find_or_create(&cache->attributes,
             info->fileid, &attributes);
         if (status == NO_ERROR) {
-            attr_cache_update(attributes, info, delegation);
+            attr_cache_update(&cache->attributes, attributes,
+                info, delegation);
             cache->delegations++;
         }
         else
@@ -1052,6 +2057,21 @@ out_err_deleg:
     goto out_unlock;
 }
 
+/* release the reference from name_cache_entry_update() */
+static void name_cache_delegation_release(
+    IN struct nfs41_name_cache *cache,
+    IN struct attr_cache_entry *attributes)
+{
+    if (attributes->delegated) {
+        attr_cache_write_begin(&cache->attributes, attributes->fileid);
+        attributes->delegated = FALSE;
+        attr_cache_write_end(&cache->attributes, attributes->fileid);
+        attr_cache_entry_deref(&cache->attributes, attributes);
+        EASSERT(cache->delegations > 0);
+        cache->delegations--;
+    }
+}
+
 int nfs41_name_cache_delegreturn(
     IN struct nfs41_name_cache *cache,
     IN uint64_t fileid,
@@ -1065,7 +2085,7 @@ int nfs41_name_cache_delegreturn(
     DPRINTF(NCLVL1, ("--> nfs41_name_cache_delegreturn(%llu, '%s')\n",
         fileid, path));
 
-    AcquireSRWLockExclusive(&cache->lock);
+    name_cache_write_lock(cache);
 
     if (!name_cache_enabled(cache)) {
         status = ERROR_NOT_SUPPORTED;
@@ -1076,7 +2096,8 @@ int nfs41_name_cache_delegreturn(
         name->name + name->len, NULL, &parent, &target, NULL);
     if (status == NO_ERROR) {
         /* put the name cache entry back on the exp_entries list */
-        list_add_head(&cache->exp_entries, &target->exp_entry);
+        if (list_empty(&target->exp_entry))
+            list_add_head(&cache->exp_entries, &target->exp_entry);
         name_cache_entry_updated(cache, target);
 
         attributes = target->attributes;
@@ -1089,23 +2110,196 @@ int nfs41_name_cache_delegreturn(
         status = ERROR_FILE_NOT_FOUND;
         goto out_unlock;
     }
-
-    /* release the reference from name_cache_entry_update() */
-    if (attributes->delegated) {
-        attributes->delegated = FALSE;
-        attr_cache_entry_deref(&cache->attributes, attributes);
-        EASSERT(cache->delegations > 0);
-        cache->delegations--;
-    }
+    name_cache_delegation_release(cache, attributes);
     status = NO_ERROR;
 
 out_unlock:
-    ReleaseSRWLockExclusive(&cache->lock);
+    name_cache_write_unlock(cache);
 
     DPRINTF(NCLVL1, ("<-- nfs41_name_cache_delegreturn() returning %d\n", status));
     return status;
 }
 
+int nfs41_name_cache_dir_delegreturn(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_fh *dir)
+{
+    struct name_cache_entry **slot;
+    struct attr_cache_entry *attributes;
+    int status;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_dir_delegreturn(%llu)\n",
+        dir->fileid));
+
+    name_cache_write_lock(cache);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+
+    /* look for the entry by fileid, wherever renames have moved it */
+    slot = name_cache_dir_deleg_find(cache, dir->superblock, dir->fileid);
+    if (slot) {
+        struct name_cache_entry *target = *slot;
+        name_cache_dir_deleg_forget(cache, target);
+        name_cache_entry_updated(cache, target);
+
+        attributes = target->attributes;
+    } else {
+        /* the entry is gone, but its attributes may still be held */
+        attributes = attr_cache_search(&cache->attributes, dir->fileid);
+    }
+
+    if (attributes == NULL) {
+        status = ERROR_FILE_NOT_FOUND;
+        goto out_unlock;
+    }
+    name_cache_delegation_release(cache, attributes);
+    status = NO_ERROR;
+
+out_unlock:
+    name_cache_write_unlock(cache);
+
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_dir_delegreturn() returning %d\n",
+        status));
+    return status;
+}
+
+int nfs41_name_cache_dir_path(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_fh *dir,
+    OUT nfs41_abs_path *path)
+{
+    struct name_cache_entry **slot, *entry;
+    const uint32_t end = NFS41_MAX_PATH_LEN - 1; /* room for the null */
+    uint32_t pos = end;
+    int status = NO_ERROR;
+
+    AcquireSRWLockShared(&cache->lock);
+
+    slot = name_cache_dir_deleg_find(cache, dir->superblock, dir->fileid);
+    if (slot == NULL) {
+        status = ERROR_FILE_NOT_FOUND;
+        goto out_unlock;
+    }
+
+    /* build the path from the end, one '\\component' per parent;
+     * the root itself has an empty path */
+    for (entry = *slot; entry != cache->root; entry = entry->parent) {
+        if (entry == NULL) { /* no longer in the tree */
+            status = ERROR_FILE_NOT_FOUND;
+            goto out_unlock;
+        }
+        if (pos < entry->component_len + 1u) {
+            status = ERROR_BUFFER_OVERFLOW;
+            goto out_unlock;
+        }
+        pos -= entry->component_len;
+        memcpy(path->path + pos, entry->data, entry->component_len);
+        path->path[--pos] = '\\';
+    }
+
+    path->len = (unsigned short)(end - pos);
+    memmove(path->path, path->path + pos, path->len);
+    path->path[path->len] = '\0';
+
+out_unlock:
+    ReleaseSRWLockShared(&cache->lock);
+    return status;
+}
+
+int nfs41_name_cache_dir_delegate(
+    IN struct nfs41_name_cache *cache,
+    IN const char *path,
+    IN const nfs41_component *name,
+    IN const nfs41_fh *dir,
+    IN bool_t hold_attributes)
+{
+    struct name_cache_entry *target;
+    int status;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_dir_delegate('%s', %d)\n",
+        path, hold_attributes));
+
+    name_cache_write_lock(cache);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+
+    status = name_cache_lookup(cache, 0, path,
+        name->name + name->len, NULL, NULL, &target, NULL);
+    if (status)
+        goto out_unlock;
+
+    /* make sure the path still leads to the delegated directory */
+    if (target->attributes == NULL || target->fileid != dir->fileid ||
+        target->superblock != dir->superblock) {
+        status = ERROR_FILE_NOT_FOUND;
+        goto out_unlock;
+    }
+
+    /* keep the directory and its children from expiring */
+    if (!target->dir_delegated) {
+        if (cache->dir_delegation_count >= NAME_CACHE_DIR_DELEGATIONS) {
+            status = ERROR_TOO_MANY_OPEN_FILES;
+            goto out_unlock;
+        }
+        cache->dir_delegations[cache->dir_delegation_count++] = target;
+        target->dir_delegated = 1;
+    }
+    list_remove(&target->exp_entry);
+
+    /* hold the directory's attributes too, if CB_NOTIFY will tell us
+     * when they change; released by nfs41_name_cache_dir_delegreturn() */
+    if (hold_attributes && !target->attributes->delegated &&
+        cache->delegations < cache->max_delegations) {
+        attr_cache_write_begin(&cache->attributes, target->attributes->fileid);
+        target->attributes->delegated = TRUE;
+        attr_cache_write_end(&cache->attributes, target->attributes->fileid);
+        attr_cache_entry_ref(&cache->attributes, target->attributes);
+        cache->delegations++;
+    }
+
+out_unlock:
+    name_cache_write_unlock(cache);
+
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_dir_delegate() returning %d\n",
+        status));
+    return status;
+}
+
+int nfs41_name_cache_unlink(
+    IN struct nfs41_name_cache *cache,
+    IN const char *path,
+    IN const nfs41_component *name)
+{
+    struct name_cache_entry *target;
+    int status;
+
+    DPRINTF(NCLVL1, ("--> nfs41_name_cache_unlink('%s')\n", path));
+
+    name_cache_write_lock(cache);
+
+    if (!name_cache_enabled(cache)) {
+        status = ERROR_NOT_SUPPORTED;
+        goto out_unlock;
+    }
+
+    status = name_cache_lookup(cache, 0, path,
+        name->name + name->len, NULL, NULL, &target, NULL);
+    if (status == NO_ERROR)
+        name_cache_unlink(cache, target);
+
+out_unlock:
+    name_cache_write_unlock(cache);
+
+    DPRINTF(NCLVL1, ("<-- nfs41_name_cache_unlink() returning %d\n", status));
+    return status;
+}
+
 int nfs41_name_cache_remove(
     IN struct nfs41_name_cache *cache,
     IN const char *path,
@@ -1119,7 +2313,7 @@ int nfs41_name_cache_remove(
 
     DPRINTF(NCLVL1, ("--> nfs41_name_cache_remove('%s')\n", path));
 
-    AcquireSRWLockExclusive(&cache->lock);
+    name_cache_write_lock(cache);
 
     if (!name_cache_enabled(cache)) {
         status = ERROR_NOT_SUPPORTED;
@@ -1139,15 +2333,18 @@ int nfs41_name_cache_remove(
     if (status == ERROR_FILE_NOT_FOUND)
         goto out_attributes;
 
-    if (target->attributes)
+    if (target->attributes) {
+        attr_cache_write_begin(&cache->attributes, target->attributes->fileid);
         target->attributes->numlinks--;
+        attr_cache_write_end(&cache->attributes, target->attributes->fileid);
+    }
 
     /* make this a negative entry and unlink children */
     name_cache_entry_update(cache, target, NULL, NULL, OPEN_DELEGATE_NONE);
     name_cache_unlink_children_recursive(cache, target);
 
 out_unlock:
-    ReleaseSRWLockExclusive(&cache->lock);
+    name_cache_write_unlock(cache);
 
     DPRINTF(NCLVL1, ("<-- nfs41_name_cache_remove() returning %d\n", status));
     return status;
@@ -1157,8 +2354,11 @@ out_attributes:
      * regardless of a failure to find the target entry */
     DPRINTF(NCLVL1, ("nfs41_name_cache_remove: need to find attributes for '%s'\n", path));
     attributes = attr_cache_search(&cache->attributes, fileid);
-    if (attributes)
+    if (attributes) {
+        attr_cache_write_begin(&cache->attributes, fileid);
         attributes->numlinks--;
+        attr_cache_write_end(&cache->attributes, fileid);
+    }
     goto out_unlock;
 }
 
@@ -1178,7 +2378,7 @@ int nfs41_name_cache_rename(
     DPRINTF(NCLVL1, ("--> nfs41_name_cache_rename('%s' to '%s')\n",
         src_path, dst_path));
 
-    AcquireSRWLockExclusive(&cache->lock);
+    name_cache_write_lock(cache);
 
     if (!name_cache_enabled(cache)) {
         status = ERROR_NOT_SUPPORTED;
@@ -1236,13 +2436,18 @@ int nfs41_name_cache_rename(
 
         /* move the src entry under dst_parent */
         name_cache_remove(src, src_parent);
-        name_cache_entry_rename(src, dst_name);
-        name_cache_insert(src, dst_parent);
+        if (name_cache_entry_rename(cache, src, dst_name))
+            name_cache_unlink(cache, src);
+        else
+            name_cache_insert(src, dst_parent);
 
         if (existing) {
             /* recycle 'existing' as the negative entry 'src' */
-            name_cache_entry_rename(existing, src_name);
-            name_cache_insert(existing, src_parent);
+            if (name_cache_entry_rename(cache, existing, src_name)) {
+                name_cache_unlink(cache, existing);
+                existing = NULL;
+            } else
+                name_cache_insert(existing, src_parent);
         }
         src = existing;
     }
@@ -1263,7 +2468,7 @@ int nfs41_name_cache_rename(
     name_cache_unlink_children_recursive(cache, src);
 
 out_unlock:
-    ReleaseSRWLockExclusive(&cache->lock);
+    name_cache_write_unlock(cache);
 
     DPRINTF(NCLVL1, ("<-- nfs41_name_cache_rename() returning %d\n", status));
     return status;
@@ -1288,7 +2493,7 @@ out_unlock:
  */
 #define MAX_PUTFH_PER_COMPOUND 64
 
-static bool_t get_path_fhs(
+static int path_fhs_search(
     IN struct nfs41_name_cache *cache,
     IN nfs41_abs_path *path,
     IN OUT const char **path_pos,
@@ -1304,13 +2509,11 @@ static bool_t get_path_fhs(
 
     *count = 0;
 
-    AcquireSRWLockShared(&cache->lock);
-
     /* look up the parent of the first component */
     status = name_cache_lookup(cache, 1, path->path,
         *path_pos, NULL, NULL, &target, NULL);
     if (status)
-        goto out_unlock;
+        goto out;
 
     for (i = 0; i < max_components; i++) {
         files[i].path = path;
@@ -1326,15 +2529,35 @@ static bool_t get_path_fhs(
                 status = ERROR_FILE_NOT_FOUND;
             else
                 status = ERROR_PATH_NOT_FOUND;
-            goto out_unlock;
+            goto out;
         }
-        /* make copies for use outside of cache->lock */
-        fh_copy(&files[i].fh, &target->fh);
+        /* make copies for use outside of the read section */
+        copy_fh(&files[i].fh, target);
         (*count)++;
     }
+out:
+    return status;
+}
+
+static bool_t get_path_fhs(
+    IN struct nfs41_name_cache *cache,
+    IN nfs41_abs_path *path,
+    IN OUT const char **path_pos,
+    IN uint32_t max_components,
+    OUT nfs41_path_fh *files,
+    OUT uint32_t *count)
+{
+    struct name_cache_read read = { 0 };
+    const char *path_start = *path_pos;
+    int status;
+
+    do {
+        name_cache_read_begin(cache, &read);
+        *path_pos = path_start;
+        status = path_fhs_search(cache, path, path_pos,
+            max_components, files, count);
+    } while (name_cache_read_retry(cache, &read));
 
-out_unlock:
-    ReleaseSRWLockShared(&cache->lock);
     return *count && status == 0;
 }
 
@@ -1394,14 +2617,14 @@ static int delete_stale_component(
     DPRINTF(NCLVL1, ("--> delete_stale_component('%s')\n",
         component->name));
 
-    AcquireSRWLockExclusive(&cache->lock);
+    name_cache_write_lock(cache);
 
     status = name_cache_lookup(cache, 0, path->path,
         component->name + component->len, NULL, NULL, &target, NULL);
     if (status == NO_ERROR)
         name_cache_unlink(cache, target);
 
-    ReleaseSRWLockExclusive(&cache->lock);
+    name_cache_write_unlock(cache);
 
     DPRINTF(NCLVL1, ("<-- delete_stale_component() returning %d\n", status));
     return status;
@@ -51,9 +51,27 @@ int nfs41_attr_cache_update(
 
 
 /* name cache */
+/* the cache is shared by every mount of a server, so a mount only
+ * changes the options it was given; the rest are NAME_CACHE_CONFIG_UNSET */
+#define NAME_CACHE_CONFIG_UNSET UINT32_MAX
+
+typedef struct __nfs41_name_cache_config {
+    uint32_t    timeo;      /* seconds; 0 disables the cache */
+    uint32_t    timeo_max;  /* seconds, for attributes that don't change */
+    uint32_t    size_mb;
+    uint32_t    negative;   /* cache failed lookups */
+} nfs41_name_cache_config;
+
 int nfs41_name_cache_create(
     OUT struct nfs41_name_cache **cache_out);
 
+void nfs41_name_cache_configure(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_name_cache_config *config);
+
+uint32_t nfs41_name_cache_expiration(
+    IN struct nfs41_name_cache *cache);
+
 int nfs41_name_cache_free(
     IN OUT struct nfs41_name_cache **cache_out);
 
@@ -82,6 +100,33 @@ int nfs41_name_cache_delegreturn(
     IN const char *path,
     IN const nfs41_component *name);
 
+/* hold a directory's entry, and its children, while we have a
+ * directory delegation; released by nfs41_name_cache_dir_delegreturn() */
+int nfs41_name_cache_dir_delegate(
+    IN struct nfs41_name_cache *cache,
+    IN const char *path,
+    IN const nfs41_component *name,
+    IN const nfs41_fh *dir,
+    IN bool_t hold_attributes);
+
+/* a delegated directory is found by its fileid and superblock, since
+ * it may have been renamed since nfs41_name_cache_dir_delegate() */
+int nfs41_name_cache_dir_delegreturn(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_fh *dir);
+
+/* the current path of a delegated directory */
+int nfs41_name_cache_dir_path(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_fh *dir,
+    OUT nfs41_abs_path *path);
+
+/* forget a name without caching a negative entry for it */
+int nfs41_name_cache_unlink(
+    IN struct nfs41_name_cache *cache,
+    IN const char *path,
+    IN const nfs41_component *name);
+
 int nfs41_name_cache_remove(
     IN struct nfs41_name_cache *cache,
     IN const char *path,
@@ -104,17 +104,32 @@ typedef struct __nfs41_delegation_state {
     nfs41_path_fh parent;
     nfs41_path_fh file;
     struct list_entry client_entry; /* entry in nfs41_client.delegations */
+    struct list_entry stateid_entry; /* entry in client_state.delegations_by_stateid */
+    struct list_entry fh_entry; /* entry in client_state.delegations_by_fh */
+    struct list_entry fileid_entry; /* entry in client_state.delegations_by_fileid */
     __declspec(align(8)) volatile LONG ref_count;
+    __declspec(align(8)) volatile LONGLONG last_used; /* tick count of last lookup */
 
     enum delegation_status status;
     SRWLOCK lock;
     CONDITION_VARIABLE cond;
+    uint32_t heat; /* recent lookups, decaying with time since last_used */
 
     bool_t revoked; /* for recovery, accessed under client.state.lock */
 
     HANDLE srv_open; /* for rdbss cache invalidation */
 } nfs41_delegation_state;
 
+typedef struct __nfs41_dir_delegation {
+    stateid4 stateid;
+    nfs41_abs_path path;
+    nfs41_path_fh file;
+    struct list_entry client_entry; /* entry in nfs41_client.dir_delegations */
+    bitmap4 notification; /* changes the server agreed to send CB_NOTIFY for */
+    bitmap4 child_attributes; /* attributes those notifications carry */
+    enum delegation_status status;
+} nfs41_dir_delegation;
+
 typedef struct __nfs41_lock_state {
     struct list_entry open_entry; /* entry in nfs41_open_state.locks */
     uint64_t offset;
@@ -142,6 +157,7 @@ typedef struct __nfs41_open_state {
     state_owner4 owner;
     struct __pnfs_layout_state *layout;
     struct list_entry client_entry; /* entry in nfs41_client.opens */
+    struct list_entry fileid_entry; /* entry in client_state.opens_by_fileid */
     SRWLOCK lock;
     __declspec(align(8)) volatile LONG ref_count;
     uint32_t share_access;
@@ -167,6 +183,27 @@ typedef struct __nfs41_open_state {
         CRITICAL_SECTION lock;
     } ea;
 
+    struct { /* buffered writes, see nfs41_write_behind_flush() */
+        struct list_entry ranges; /* sorted and non-overlapping */
+        uint64_t change; /* change attribute as of the last flush */
+        uint64_t size; /* set locally under a write delegation */
+        bool_t resize; /* size is waiting for the next flush */
+        bool_t discard; /* file is being removed, see
+                           nfs41_write_behind_discard_prepare() */
+        uint32_t bytes;
+        SRWLOCK lock;
+    } write_behind;
+
+    struct { /* sequential read detection, see read_ahead_update() */
+        struct list_entry pages; /* prefetched or in-flight */
+        uint64_t next; /* offset expected from a sequential reader */
+        uint64_t end; /* end of the last page read ahead */
+        uint64_t eof; /* lowest eof seen, or NFS4_UINT64_MAX */
+        uint32_t window; /* in pages */
+        SRWLOCK lock;
+        CONDITION_VARIABLE cond;
+    } read_ahead;
+
     HANDLE srv_open; /* for data cache invalidation */
 } nfs41_open_state;
 
@@ -189,10 +226,40 @@ typedef struct __nfs41_rpc_clnt {
     bool_t needcb;
 } nfs41_rpc_clnt;
 
+/* hash index over client state, with a lock per bucket; lookups by
+ * stateid, filehandle or fileid only take the lock of their bucket,
+ * instead of client_state.lock and a walk over the whole list */
+#define STATE_INDEX_BUCKETS 2048
+
+struct state_bucket {
+    SRWLOCK lock;
+    struct list_entry head;
+};
+
+struct state_index {
+    struct state_bucket buckets[STATE_INDEX_BUCKETS];
+};
+
+static __inline struct state_bucket* state_index_bucket(
+    IN struct state_index *index,
+    IN uint32_t hash)
+{
+    return &index->buckets[hash & (STATE_INDEX_BUCKETS - 1)];
+}
+
 struct client_state {
     struct list_entry opens; /* list of associated nfs41_open_state */
     struct list_entry delegations; /* list of associated delegations */
+    struct list_entry dir_delegations; /* list of nfs41_dir_delegation */
+    uint32_t dir_delegation_count;
+    bool_t dir_delegation_unsupported;
+    /* protects the lists, and is taken before any bucket lock when
+     * adding or removing state from the indexes */
     CRITICAL_SECTION lock;
+    struct state_index opens_by_fileid;
+    struct state_index delegations_by_stateid;
+    struct state_index delegations_by_fh;
+    struct state_index delegations_by_fileid;
 };
 
 typedef struct __nfs41_client {
@@ -222,15 +289,20 @@ typedef struct __nfs41_client {
 } nfs41_client;
 
 #define NFS41_MAX_NUM_SLOTS NFS41_MAX_RPC_REQS
+#define NFS41_SLOT_BITMAP_WORDS ((NFS41_MAX_NUM_SLOTS + 31) / 32)
+/* slots are claimed and released with interlocked bit operations
+ * on used_slots; only threads that find the table full take
+ * waiters_lock to queue up for a slot */
 typedef struct __nfs41_slot_table {
-    uint32_t seq_nums[NFS41_MAX_NUM_SLOTS];
-    uint32_t used_slots[NFS41_MAX_NUM_SLOTS];
-    uint32_t max_slots;
-    uint32_t highest_used;
-    uint32_t num_used;
-    ULONGLONG target_delay;
-    CRITICAL_SECTION lock;
-    CONDITION_VARIABLE cond;
+    uint32_t seq_nums[NFS41_MAX_NUM_SLOTS]; /* owned by the slot holder */
+    volatile LONG used_slots[NFS41_SLOT_BITMAP_WORDS];
+    volatile LONG max_slots;
+    volatile LONG highest_used;
+    volatile LONG num_used;
+    volatile LONG num_waiters;
+    volatile LONGLONG target_delay;
+    SRWLOCK waiters_lock;
+    struct list_entry waiters; /* FIFO of slot_waiter */
 } nfs41_slot_table;
 
 /*
@@ -274,6 +346,22 @@ typedef struct __nfs41_cb_session {
     uint32_t cb_slotid;
 } nfs41_cb_session;
 
+/* adaptive READ/WRITE transfer sizing; nfs41_session_io_sample() feeds
+ * it the latency of each compound, and nfs41_session_io_tuning() picks
+ * the chunk size and number of chunks in flight for a request */
+#define NFS41_IO_TUNE_CLASSES 8 /* latency floors by power-of-2 size */
+typedef struct __nfs41_io_tuner {
+    SRWLOCK lock;
+    uint32_t inflight;      /* transfers to keep in flight */
+    uint32_t delay;         /* smoothed latency over the floor, percent */
+    uint64_t rtt_min[NFS41_IO_TUNE_CLASSES]; /* latency floor, usec */
+    uint64_t bandwidth;     /* smoothed throughput, bytes/sec */
+    uint64_t samples;
+    uint64_t window_start;  /* usec */
+    uint64_t window_bytes;
+    uint32_t window_samples;
+} nfs41_io_tuner;
+
 typedef struct __nfs41_session {
     nfs41_client *client;
     unsigned char session_id[NFS4_SESSIONID_SIZE];
@@ -288,6 +376,8 @@ typedef struct __nfs41_session {
     bool_t isValidState;
     uint32_t flags;
     nfs41_cb_session cb_session;
+    nfs41_io_tuner read_tuner;
+    nfs41_io_tuner write_tuner;
 } nfs41_session;
 
 /* nfs41_root reference counting:
@@ -406,6 +496,21 @@ int nfs41_session_bad_slot(
     IN nfs41_session *session,
     IN OUT struct __nfs41_sequence_args *args);
 
+void nfs41_session_io_sample(
+    IN nfs41_session *session,
+    IN bool_t write,
+    IN uint32_t bytes,
+    IN uint64_t start,
+    IN uint64_t end);
+
+void nfs41_session_io_tuning(
+    IN nfs41_session *session,
+    IN bool_t write,
+    IN uint32_t max_size,
+    IN uint64_t length,
+    OUT uint32_t *size_out,
+    OUT uint32_t *inflight_out);
+
 
 /* nfs41_server.c */
 void nfs41_server_list_init();
@@ -458,6 +563,38 @@ int nfs41_client_renew(
 void nfs41_client_free(
     IN nfs41_client *client);
 
+uint32_t state_hash(
+    IN const void *key,
+    IN uint32_t len);
+
+void state_index_add(
+    IN struct state_index *index,
+    IN uint32_t hash,
+    IN struct list_entry *entry);
+
+void state_index_remove(
+    IN struct state_index *index,
+    IN uint32_t hash,
+    IN struct list_entry *entry);
+
+static __inline uint32_t stateid_hash(
+    IN const stateid4 *stateid)
+{
+    return state_hash(stateid->other, NFS4_STATEID_OTHER);
+}
+
+static __inline uint32_t fh_hash(
+    IN const nfs41_fh *fh)
+{
+    return state_hash(fh->fh, fh->len);
+}
+
+static __inline uint32_t fileid_hash(
+    IN uint64_t fileid)
+{
+    return state_hash(&fileid, sizeof(fileid));
+}
+
 static __inline nfs41_server* client_server(
     IN nfs41_client *client)
 {
@@ -139,9 +139,44 @@ struct cb_recall_res {
     enum_t                  status;
 };
 
+/* generic notify4, shared by CB_NOTIFY and CB_NOTIFY_DEVICEID */
+struct notify4 {
+    bitmap4                 mask;
+    char                    *list;
+    uint32_t                len;
+};
+
 /* OP_CB_NOTIFY */
+enum notify_type4 {
+    NOTIFY4_CHANGE_CHILD_ATTRS      = 0,
+    NOTIFY4_CHANGE_DIR_ATTRS        = 1,
+    NOTIFY4_REMOVE_ENTRY            = 2,
+    NOTIFY4_ADD_ENTRY               = 3,
+    NOTIFY4_RENAME_ENTRY            = 4,
+    NOTIFY4_CHANGE_COOKIE_VERIFIER  = 5
+};
+struct notify_entry4 {
+    char                    name[NFS41_MAX_COMPONENT_LEN+1];
+    uint32_t                name_len;
+    fattr4                  attrs;
+};
+struct notify_dir4 {
+    enum notify_type4       type;
+    /* the removed, added or changed entry; the new name for rename */
+    struct notify_entry4    entry;
+    /* NOTIFY4_RENAME_ENTRY: the old name */
+    struct notify_entry4    old_entry;
+    /* NOTIFY4_ADD_ENTRY and _RENAME_ENTRY: the new entry's cookie */
+    uint64_t                cookie;
+    bool_t                  has_cookie;
+};
 struct cb_notify_args {
-    uint32_t                target_highest_slotid;
+    stateid4                stateid;
+    nfs41_fh                fh;
+    struct notify4          *notify_list;
+    uint32_t                notify_count;
+    struct notify_dir4      *change_list;
+    uint32_t                change_count;
 };
 
 struct cb_notify_res {
@@ -158,8 +193,21 @@ struct cb_push_deleg_res {
 };
 
 /* OP_CB_RECALL_ANY */
+enum {
+    RCA4_TYPE_MASK_RDATA_DLG        = 0,
+    RCA4_TYPE_MASK_WDATA_DLG        = 1,
+    RCA4_TYPE_MASK_DIR_DLG          = 2,
+    RCA4_TYPE_MASK_FILE_LAYOUT      = 3,
+    RCA4_TYPE_MASK_BLK_LAYOUT       = 4,
+    RCA4_TYPE_MASK_OBJ_LAYOUT_MIN   = 8,
+    RCA4_TYPE_MASK_OBJ_LAYOUT_MAX   = 9,
+    RCA4_TYPE_MASK_OTHER_LAYOUT_MIN = 12,
+    RCA4_TYPE_MASK_OTHER_LAYOUT_MAX = 15,
+};
+
 struct cb_recall_any_args {
-    uint32_t                target_highest_slotid;
+    uint32_t                objects_to_keep;
+    bitmap4                 type_mask;
 };
 
 struct cb_recall_any_res {
@@ -204,11 +252,6 @@ struct notify_deviceid4 {
     enum pnfs_layout_type   layouttype;
     bool_t                  immediate;
 };
-struct notify4 {
-    bitmap4                 mask;
-    char                    *list;
-    uint32_t                len;
-};
 struct cb_notify_deviceid_args {
     struct notify4          *notify_list;
     uint32_t                notify_count;
@@ -230,6 +273,8 @@ union cb_op_args {
     struct cb_sequence_args sequence;
     struct cb_getattr_args  getattr;
     struct cb_recall_args   recall;
+    struct cb_notify_args   notify;
+    struct cb_recall_any_args recall_any;
     struct cb_notify_deviceid_args notify_deviceid;
 };
 struct cb_argop {
@@ -255,6 +300,8 @@ union cb_op_res {
     struct cb_sequence_res  sequence;
     struct cb_getattr_res   getattr;
     struct cb_recall_res    recall;
+    struct cb_notify_res    notify;
+    struct cb_recall_any_res recall_any;
     struct cb_notify_deviceid_res notify_deviceid;
 };
 struct cb_resop {
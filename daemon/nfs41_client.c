@@ -108,6 +108,50 @@ static int update_exchangeid_res(
         &exchangeid->server_owner);
 }
 
+/* client state indexes */
+static void state_index_init(
+    OUT struct state_index *index)
+{
+    uint32_t i;
+    for (i = 0; i < STATE_INDEX_BUCKETS; i++) {
+        InitializeSRWLock(&index->buckets[i].lock);
+        list_init(&index->buckets[i].head);
+    }
+}
+
+uint32_t state_hash(
+    IN const void *key,
+    IN uint32_t len)
+{
+    const unsigned char *p = (const unsigned char*)key;
+    uint32_t i, hash = 2166136261u;
+    for (i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+void state_index_add(
+    IN struct state_index *index,
+    IN uint32_t hash,
+    IN struct list_entry *entry)
+{
+    struct state_bucket *bucket = state_index_bucket(index, hash);
+    AcquireSRWLockExclusive(&bucket->lock);
+    list_add_tail(&bucket->head, entry);
+    ReleaseSRWLockExclusive(&bucket->lock);
+}
+
+void state_index_remove(
+    IN struct state_index *index,
+    IN uint32_t hash,
+    IN struct list_entry *entry)
+{
+    struct state_bucket *bucket = state_index_bucket(index, hash);
+    AcquireSRWLockExclusive(&bucket->lock);
+    list_remove(entry);
+    ReleaseSRWLockExclusive(&bucket->lock);
+}
+
 int nfs41_client_create(
     IN nfs41_rpc_clnt *rpc,
     IN const client_owner4 *owner,
@@ -134,7 +178,12 @@ int nfs41_client_create(
 
     list_init(&client->state.opens);
     list_init(&client->state.delegations);
+    list_init(&client->state.dir_delegations);
     InitializeCriticalSection(&client->state.lock);
+    state_index_init(&client->state.opens_by_fileid);
+    state_index_init(&client->state.delegations_by_stateid);
+    state_index_init(&client->state.delegations_by_fh);
+    state_index_init(&client->state.delegations_by_fileid);
 
     //initialize a lock used to protect access to client id and client id seq#
     InitializeSRWLock(&client->exid_lock);
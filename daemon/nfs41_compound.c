@@ -28,6 +28,7 @@
 #include "recovery.h"
 #include "name_cache.h"
 #include "daemon_debug.h"
+#include "util.h"
 #include "rpc/rpc.h"
 #include "rpc/auth_sspi.h"
 
@@ -134,6 +135,34 @@ out:
     return status;
 }
 
+/* feed the latency of READ and WRITE compounds to the session's
+ * transfer size tuning */
+static void compound_io_sample(
+    IN nfs41_session *session,
+    IN const nfs41_compound *compound,
+    IN uint64_t start,
+    IN uint64_t end)
+{
+    uint32_t i;
+
+    for (i = 0; i < compound->res.resarray_count; i++) {
+        const nfs_resop4 *res = &compound->res.resarray[i];
+        if (res->op == OP_READ) {
+            const nfs41_read_res *read_res = (const nfs41_read_res*)res->res;
+            if (read_res->status == NFS4_OK)
+                nfs41_session_io_sample(session, FALSE,
+                    read_res->resok4.data_len, start, end);
+        } else if (res->op == OP_WRITE) {
+            const nfs41_write_res *write_res = (const nfs41_write_res*)res->res;
+            const nfs41_write_args *write_args =
+                (const nfs41_write_args*)compound->args.argarray[i].arg;
+            if (write_res->status == NFS4_OK)
+                nfs41_session_io_sample(session, TRUE,
+                    write_args->data_len, start, end);
+        }
+    }
+}
+
 int compound_encode_send_decode(
     nfs41_session *session,
     nfs41_compound *compound,
@@ -145,13 +174,17 @@ int compound_encode_send_decode(
     uint32_t saved_sec_flavor;
     AUTH *saved_auth;
     int op1 = compound->args.argarray[0].op;
+    uint64_t start;
 
 retry:
     /* send compound */
     retry_count++;
     set_expected_res(compound);
+    start = util_getusec();
     status = nfs41_send_compound(session->client->rpc,
         (char *)&compound->args, (char *)&compound->res);
+    if (status == 0 && compound->res.status == NFS4_OK)
+        compound_io_sample(session, compound, start, util_getusec());
     // bump sequence number if sequence op succeeded.
     if (compound->res.resarray_count > 0 && 
             compound->res.resarray[0].op == OP_SEQUENCE) {
@@ -45,6 +45,7 @@
 /* nfs41_dg.num_worker_threads sets the actual number of worker threads */
 #define MAX_NUM_THREADS 1024
 #define DEFAULT_NUM_THREADS 128
+#define DEFAULT_WRITE_DELEGATION_MB 64
 DWORD NFS41D_VERSION = 0;
 
 static const char FILE_NETCONFIG[] = "C:\\etc\\netconfig";
@@ -55,6 +56,7 @@ nfs41_daemon_globals nfs41_dg = {
     .default_gid = NFS_GROUP_NOGROUP_GID,
     .num_worker_threads = DEFAULT_NUM_THREADS,
     .crtdbgmem_flags = NFS41D_GLOBALS_CRTDBGMEM_FLAGS_NOT_SET,
+    .write_delegation_max = DEFAULT_WRITE_DELEGATION_MB * 1024 * 1024,
 };
 
 
@@ -281,11 +283,15 @@ static void PrintUsage(const wchar_t *argv0)
         "\t--uid <non-zero value>\n"
         "\t--gid <non-zero value>\n"
         "\t--numworkerthreads <value-between 16 and %d>\n"
+        "\t--writebehind <max buffered megabytes, 0 to disable>\n"
+        "\t--writedelegation <max megabytes buffered under write "
+            "delegations, default %d, 0 to disable>\n"
+        "\t--readahead <max prefetched megabytes, 0 to disable>\n"
 #ifdef _DEBUG
         "\t--crtdbgmem <'allocmem'|'leakcheck'|'delayfree',\n"
             "\t\t'all', 'none' or 'default'>\n"
 #endif /* _DEBUG */
-        , argv0, MAX_NUM_THREADS);
+        , argv0, MAX_NUM_THREADS, DEFAULT_WRITE_DELEGATION_MB);
 }
 
 static
@@ -399,6 +405,39 @@ bool_t parse_cmdlineargs(int argc, wchar_t *argv[], nfsd_args *out)
                     return FALSE;
                 }
             }
+            else if (!wcscmp(argv[i], L"--writebehind")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for --writebehind\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                nfs41_dg.write_behind_max =
+                    (uint64_t)wcstoul(argv[i], NULL, 0) * 1024 * 1024;
+            }
+            else if (!wcscmp(argv[i], L"--writedelegation")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for --writedelegation\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                nfs41_dg.write_delegation_max =
+                    (uint64_t)wcstoul(argv[i], NULL, 0) * 1024 * 1024;
+            }
+            else if (!wcscmp(argv[i], L"--readahead")) {
+                ++i;
+                if (i >= argc) {
+                    (void)fprintf(stderr,
+                        "%S: Missing value for --readahead\n",
+                        argv[0]);
+                    return FALSE;
+                }
+                nfs41_dg.read_ahead_max =
+                    (uint64_t)wcstoul(argv[i], NULL, 0) * 1024 * 1024;
+            }
             /*
              * -Debug/-debug might be passed as first option in a
              * Release build to switch nfsd to debug mode
@@ -41,6 +41,10 @@ typedef struct __nfs41_daemon_globals {
     ssize_t num_worker_threads;
     int crtdbgmem_flags;
     char nfs41_nii_name[256];
+    uint64_t write_behind_max; /* bytes, 0 disables write-behind */
+    uint64_t write_delegation_max; /* bytes, 0 disables write-behind
+                                    * under write delegations */
+    uint64_t read_ahead_max; /* bytes, 0 disables read-ahead */
 } nfs41_daemon_globals;
 
 #define NFS41D_GLOBALS_CRTDBGMEM_FLAGS_NOT_SET (-1)
@@ -590,6 +590,87 @@ out:
     return status;
 }
 
+/* reclaim a batch of opens with CLAIM_PREVIOUS in a single compound.
+ * the server stops processing at the first failure, so each entry gets
+ * its own status, and entries that weren't reached get NFS4ERR_DELAY
+ * for the caller to resend */
+int nfs41_open_reclaim(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN OUT nfs41_open_reclaim_args *reclaims)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[1 + 2 * NFS41_RECLAIM_BATCH];
+    nfs_resop4 resops[1 + 2 * NFS41_RECLAIM_BATCH];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args[NFS41_RECLAIM_BATCH];
+    nfs41_putfh_res putfh_res[NFS41_RECLAIM_BATCH];
+    nfs41_op_open_args open_args[NFS41_RECLAIM_BATCH];
+    nfs41_op_open_res open_res[NFS41_RECLAIM_BATCH];
+    open_claim4 claim[NFS41_RECLAIM_BATCH];
+    uint32_t i, j;
+
+    EASSERT(count > 0 && count <= NFS41_RECLAIM_BATCH);
+
+    compound_init(&compound, argops, resops, "open_reclaim");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 1);
+
+    /* SEQUENCE; { PUTFH(file); OPEN(CLAIM_PREVIOUS) }... */
+    for (i = 0; i < count; i++) {
+        compound_add_op(&compound, OP_PUTFH, &putfh_args[i], &putfh_res[i]);
+        putfh_args[i].file = reclaims[i].file;
+        putfh_args[i].in_recovery = 0;
+
+        claim[i].claim = CLAIM_PREVIOUS;
+        claim[i].u.prev.delegate_type = reclaims[i].delegation.type;
+
+        compound_add_op(&compound, OP_OPEN, &open_args[i], &open_res[i]);
+        ZeroMemory(&open_args[i], sizeof(nfs41_op_open_args));
+        open_args[i].seqid = 0;
+        open_args[i].share_access = reclaims[i].access;
+        open_args[i].share_deny = reclaims[i].deny;
+        open_args[i].owner = reclaims[i].owner;
+        open_args[i].openhow.opentype = OPEN4_NOCREATE;
+        open_args[i].claim = &claim[i];
+        open_res[i].resok4.stateid = &reclaims[i].stateid;
+        open_res[i].resok4.delegation = &reclaims[i].delegation;
+
+        reclaims[i].status = NFS4ERR_DELAY;
+    }
+
+    status = compound_encode_send_decode(session, &compound, FALSE);
+    if (status)
+        goto out;
+
+    /* failures in SEQUENCE apply to the whole batch */
+    if (compound.res.resarray_count < 2) {
+        status = compound_error(compound.res.status);
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        j = 1 + 2 * i;
+        if (j >= compound.res.resarray_count)
+            break;
+        if (putfh_res[i].status) {
+            reclaims[i].status = putfh_res[i].status;
+            break;
+        }
+        if (j + 1 >= compound.res.resarray_count)
+            break;
+        reclaims[i].status = open_res[i].status;
+        if (reclaims[i].status)
+            break;
+    }
+    compound_error(compound.res.status);
+out:
+    return status;
+}
+
 int nfs41_create(
     IN nfs41_session *session,
     IN uint32_t type,
@@ -1021,6 +1102,92 @@ out:
     return status;
 }
 
+/* send a batch of LOCKs for the same open in a single compound.  only
+ * the first LOCK uses the given stateid; the rest use the current
+ * stateid (seqid=1, other=0) to refer to the lock stateid it returns.
+ * as with nfs41_open_reclaim(), entries that weren't reached get
+ * NFS4ERR_DELAY */
+int nfs41_lock_reclaim(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN state_owner4 *owner,
+    IN bool_t reclaim,
+    IN uint32_t count,
+    IN OUT nfs41_lock_reclaim_args *locks,
+    IN OUT stateid_arg *stateid)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[2 + NFS41_RECLAIM_BATCH];
+    nfs_resop4 resops[2 + NFS41_RECLAIM_BATCH];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+    nfs41_lock_args lock_args[NFS41_RECLAIM_BATCH];
+    nfs41_lock_res lock_res[NFS41_RECLAIM_BATCH];
+    stateid_arg current = { 0 };
+    uint32_t i;
+
+    EASSERT(count > 0 && count <= NFS41_RECLAIM_BATCH);
+
+    compound_init(&compound, argops, resops, "lock_reclaim");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = file;
+    putfh_args.in_recovery = 0;
+
+    current.stateid.seqid = 1;
+    current.type = STATEID_SPECIAL;
+
+    for (i = 0; i < count; i++) {
+        compound_add_op(&compound, OP_LOCK, &lock_args[i], &lock_res[i]);
+        lock_args[i].locktype = locks[i].type;
+        lock_args[i].reclaim = reclaim;
+        lock_args[i].offset = locks[i].offset;
+        lock_args[i].length = locks[i].length;
+        if (i > 0 || stateid->type == STATEID_LOCK) {
+            lock_args[i].locker.new_lock_owner = 0;
+            lock_args[i].locker.u.lock_owner.lock_stateid =
+                i > 0 ? &current : stateid;
+            lock_args[i].locker.u.lock_owner.lock_seqid = 0; /* ignored */
+        } else {
+            lock_args[i].locker.new_lock_owner = 1;
+            lock_args[i].locker.u.open_owner.open_seqid = 0; /* ignored */
+            lock_args[i].locker.u.open_owner.open_stateid = stateid;
+            lock_args[i].locker.u.open_owner.lock_seqid = 0; /* ignored */
+            lock_args[i].locker.u.open_owner.lock_owner = owner;
+        }
+        lock_res[i].u.resok4.lock_stateid = &stateid->stateid;
+        lock_res[i].u.denied.owner.owner_len = NFS4_OPAQUE_LIMIT;
+
+        locks[i].status = NFS4ERR_DELAY;
+    }
+
+    status = compound_encode_send_decode(session, &compound, FALSE);
+    if (status)
+        goto out;
+
+    /* failures in SEQUENCE or PUTFH apply to the whole batch */
+    if (compound.res.resarray_count < 3) {
+        status = compound_error(compound.res.status);
+        goto out;
+    }
+
+    for (i = 0; i < count && 2 + i < compound.res.resarray_count; i++) {
+        locks[i].status = lock_res[i].status;
+        if (locks[i].status)
+            break;
+        stateid->type = STATEID_LOCK; /* returning a lock stateid */
+    }
+    compound_error(compound.res.status);
+out:
+    return status;
+}
+
 int nfs41_unlock(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1821,6 +1988,117 @@ out:
     return status;
 }
 
+/* return several delegations in a single compound:
+ * SEQUENCE; { PUTFH(file); DELEGRETURN }...
+ * like nfs41_open_reclaim(), each entry gets its own status, and entries
+ * after the first failure get NFS4ERR_DELAY.  this never attempts
+ * recovery; the caller can fall back to nfs41_delegreturn() for those */
+int nfs41_delegreturn_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN OUT nfs41_delegreturn_batch_args *returns)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[1 + 2 * NFS41_DELEGRETURN_BATCH];
+    nfs_resop4 resops[1 + 2 * NFS41_DELEGRETURN_BATCH];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args[NFS41_DELEGRETURN_BATCH];
+    nfs41_putfh_res putfh_res[NFS41_DELEGRETURN_BATCH];
+    nfs41_delegreturn_args dr_args[NFS41_DELEGRETURN_BATCH];
+    nfs41_delegreturn_res dr_res[NFS41_DELEGRETURN_BATCH];
+    nfs41_path_fh *file;
+    uint32_t i, j;
+
+    EASSERT(count > 0 && count <= NFS41_DELEGRETURN_BATCH);
+
+    compound_init(&compound, argops, resops, "delegreturn_batch");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    for (i = 0; i < count; i++) {
+        compound_add_op(&compound, OP_PUTFH, &putfh_args[i], &putfh_res[i]);
+        putfh_args[i].file = returns[i].file;
+        putfh_args[i].in_recovery = 0;
+
+        compound_add_op(&compound, OP_DELEGRETURN, &dr_args[i], &dr_res[i]);
+        dr_args[i].stateid = &returns[i].stateid;
+
+        returns[i].status = NFS4ERR_DELAY;
+    }
+
+    status = compound_encode_send_decode(session, &compound, FALSE);
+    if (status)
+        goto out;
+
+    /* failures in SEQUENCE apply to the whole batch */
+    if (compound.res.resarray_count < 2) {
+        status = compound_error(compound.res.status);
+        goto out;
+    }
+
+    for (i = 0; i < count; i++) {
+        j = 1 + 2 * i;
+        if (j >= compound.res.resarray_count)
+            break;
+        if (putfh_res[i].status) {
+            returns[i].status = putfh_res[i].status;
+            break;
+        }
+        if (j + 1 >= compound.res.resarray_count)
+            break;
+        returns[i].status = dr_res[i].status;
+        if (returns[i].status)
+            break;
+
+        file = returns[i].file;
+        AcquireSRWLockShared(&file->path->lock);
+        nfs41_name_cache_delegreturn(session_name_cache(session),
+            file->fh.fileid, file->path->path, &file->name);
+        ReleaseSRWLockShared(&file->path->lock);
+    }
+    compound_error(compound.res.status);
+out:
+    return status;
+}
+
+int nfs41_get_dir_delegation(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN nfs41_get_dir_delegation_args *args,
+    OUT nfs41_get_dir_delegation_res *res)
+{
+    int status;
+    nfs41_compound compound;
+    nfs_argop4 argops[3];
+    nfs_resop4 resops[3];
+    nfs41_sequence_args sequence_args;
+    nfs41_sequence_res sequence_res;
+    nfs41_putfh_args putfh_args;
+    nfs41_putfh_res putfh_res;
+
+    compound_init(&compound, argops, resops, "get_dir_delegation");
+
+    compound_add_op(&compound, OP_SEQUENCE, &sequence_args, &sequence_res);
+    nfs41_session_sequence(&sequence_args, session, 0);
+
+    compound_add_op(&compound, OP_PUTFH, &putfh_args, &putfh_res);
+    putfh_args.file = dir;
+    putfh_args.in_recovery = 0;
+
+    compound_add_op(&compound, OP_GET_DIR_DELEGATION, args, res);
+
+    status = compound_encode_send_decode(session, &compound, TRUE);
+    if (status)
+        goto out;
+
+    compound_error(status = compound.res.status);
+out:
+    return status;
+}
+
 enum nfsstat4 nfs41_fs_locations(
     IN nfs41_session *session,
     IN nfs41_path_fh *parent,
@@ -381,6 +381,46 @@ typedef struct __nfs41_delegreturn_res {
     uint32_t                status;
 } nfs41_delegreturn_res;
 
+/* for nfs41_delegreturn_batch(); up to NFS41_DELEGRETURN_BATCH
+ * delegations are returned in a single compound */
+#define NFS41_DELEGRETURN_BATCH 16
+
+typedef struct __nfs41_delegreturn_batch_args {
+    nfs41_path_fh           *file;
+    stateid_arg             stateid;
+    uint32_t                status; /* out */
+} nfs41_delegreturn_batch_args;
+
+
+/* OP_GET_DIR_DELEGATION */
+enum gddrnf4_status {
+    GDD4_OK                 = 0,
+    GDD4_UNAVAIL            = 1
+};
+
+typedef struct __nfs41_get_dir_delegation_args {
+    bool_t                  signal_deleg_avail;
+    bitmap4                 notification_types;
+    nfstime4                child_attr_delay;
+    nfstime4                dir_attr_delay;
+    bitmap4                 child_attributes;
+    bitmap4                 dir_attributes;
+} nfs41_get_dir_delegation_args;
+
+typedef struct __nfs41_get_dir_delegation_res {
+    uint32_t                status;
+    /* case NFS4_OK: */
+    enum gddrnf4_status     gdd_status;
+    /* case GDD4_OK: */
+    unsigned char           cookieverf[NFS4_VERIFIER_SIZE];
+    stateid4                stateid;
+    bitmap4                 notification;
+    bitmap4                 child_attributes;
+    bitmap4                 dir_attributes;
+    /* case GDD4_UNAVAIL: */
+    bool_t                  will_signal_deleg_avail;
+} nfs41_get_dir_delegation_res;
+
 
 /* OP_LINK */
 typedef struct __nfs41_link_args {
@@ -674,6 +714,20 @@ typedef struct __nfs41_op_open_res {
     nfs41_op_open_res_ok    resok4;
 } nfs41_op_open_res;
 
+/* state recovery packs up to NFS41_RECLAIM_BATCH reclaims
+ * into a single compound; see nfs41_open_reclaim() */
+#define NFS41_RECLAIM_BATCH 16
+
+typedef struct __nfs41_open_reclaim_args {
+    nfs41_path_fh           *file;
+    state_owner4            *owner;
+    uint32_t                access;
+    uint32_t                deny;
+    stateid4                stateid; /* out */
+    open_delegation4        delegation; /* in: type to reclaim; out */
+    uint32_t                status; /* out */
+} nfs41_open_reclaim_args;
+
 
 /* OP_OPENATTR */
 typedef struct __nfs41_openattr_args {
@@ -717,10 +771,19 @@ typedef struct __nfs41_readdir_entry {
     uint64_t                cookie;
     uint32_t                name_len;
     uint32_t                next_entry_offset;
+    uint32_t                fh_len; /* if FATTR4_WORD0_FILEHANDLE was requested */
     nfs41_file_info         attr_info;
     char                    name[1];
 } nfs41_readdir_entry;
 
+/* the filehandle's bytes follow the name, so entries only carry
+ * what the server sent */
+#define readdir_entry_fh(entry) \
+    ((unsigned char*)(entry)->name + (entry)->name_len)
+#define readdir_entry_size(entry) \
+    ((uint32_t)FIELD_OFFSET(nfs41_readdir_entry, name) + \
+        (entry)->name_len + (entry)->fh_len)
+
 typedef struct __nfs41_readdir_list {
     bool_t                  has_entries;
     uint32_t                entries_len;
@@ -1053,6 +1116,11 @@ int nfs41_open(
     OUT open_delegation4 *delegation,
     OUT OPTIONAL nfs41_file_info *info);
 
+int nfs41_open_reclaim(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN OUT nfs41_open_reclaim_args *reclaims);
+
 int nfs41_create(
     IN nfs41_session *session,
     IN uint32_t type,
@@ -1109,6 +1177,22 @@ int nfs41_lock(
     IN bool_t try_recovery,
     IN OUT stateid_arg *stateid);
 
+typedef struct __nfs41_lock_reclaim_args {
+    uint32_t                type;
+    uint64_t                offset;
+    uint64_t                length;
+    uint32_t                status; /* out */
+} nfs41_lock_reclaim_args;
+
+int nfs41_lock_reclaim(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN state_owner4 *owner,
+    IN bool_t reclaim,
+    IN uint32_t count,
+    IN OUT nfs41_lock_reclaim_args *locks,
+    IN OUT stateid_arg *stateid);
+
 int nfs41_unlock(
     IN nfs41_session *session,
     IN nfs41_path_fh *file,
@@ -1217,6 +1301,17 @@ int nfs41_delegreturn(
     IN stateid_arg *stateid,
     IN bool_t try_recovery);
 
+int nfs41_delegreturn_batch(
+    IN nfs41_session *session,
+    IN uint32_t count,
+    IN OUT nfs41_delegreturn_batch_args *returns);
+
+int nfs41_get_dir_delegation(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *dir,
+    IN nfs41_get_dir_delegation_args *args,
+    OUT nfs41_get_dir_delegation_res *res);
+
 enum nfsstat4 nfs41_fs_locations(
     IN nfs41_session *session,
     IN nfs41_path_fh *parent,
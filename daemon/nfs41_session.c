@@ -36,46 +36,111 @@
 #define MAX_SLOTS_DELAY 2000 /* in milliseconds */
 
 
-/* predicate for nfs41_slot_table.cond */
-static int slot_table_avail(
+/* a thread waiting in nfs41_session_get_slot() for a free slot; the
+ * thread that frees a slot claims it on behalf of the first waiter */
+typedef struct __slot_waiter {
+    struct list_entry entry; /* position in nfs41_slot_table.waiters */
+    CONDITION_VARIABLE cond;
+    uint32_t slotid;
+    bool_t granted;
+} slot_waiter;
+
+/* claim the lowest free slot below max_slots */
+static bool_t slot_table_claim(
+    IN nfs41_slot_table *table,
+    OUT uint32_t *slotid)
+{
+    const uint32_t max_slots = (uint32_t)table->max_slots;
+    uint32_t word;
+    unsigned long bit;
+    LONG free_bits;
+
+    for (word = 0; word * 32 < max_slots; word++) {
+        for (;;) {
+            free_bits = ~table->used_slots[word];
+            if (max_slots - word * 32 < 32)
+                free_bits &= (1L << (max_slots - word * 32)) - 1;
+            if (!_BitScanForward(&bit, (unsigned long)free_bits))
+                break;
+            /* lost the race for this bit; rescan the word */
+            if (InterlockedBitTestAndSet(&table->used_slots[word], bit))
+                continue;
+
+            InterlockedIncrement(&table->num_used);
+            *slotid = word * 32 + bit;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* highest slotid currently in use, for SEQUENCE.sa_highest_slotid */
+static uint32_t slot_table_highest(
     IN const nfs41_slot_table *table)
 {
-    return table->num_used < table->max_slots;
+    unsigned long bit;
+    int word;
+
+    for (word = NFS41_SLOT_BITMAP_WORDS - 1; word >= 0; word--)
+        if (_BitScanReverse(&bit, (unsigned long)table->used_slots[word]))
+            return word * 32 + bit;
+    return 0;
+}
+
+/* hand free slots to queued threads, first come first served */
+static void slot_table_grant(
+    IN nfs41_slot_table *table)
+{
+    slot_waiter *waiter;
+
+    AcquireSRWLockExclusive(&table->waiters_lock);
+    while (!list_empty(&table->waiters)) {
+        waiter = list_container(table->waiters.next, slot_waiter, entry);
+        if (!slot_table_claim(table, &waiter->slotid))
+            break;
+        list_remove(&waiter->entry);
+        InterlockedDecrement(&table->num_waiters);
+        waiter->granted = TRUE;
+        WakeConditionVariable(&waiter->cond);
+    }
+    ReleaseSRWLockExclusive(&table->waiters_lock);
 }
 
 /* session slot mechanism */
 static void init_slot_table(nfs41_slot_table *table) 
 {
     uint32_t i;
-    EnterCriticalSection(&table->lock);
-    table->max_slots = NFS41_MAX_NUM_SLOTS;
-    for (i = 0; i < NFS41_MAX_NUM_SLOTS; i++) {
+    for (i = 0; i < NFS41_MAX_NUM_SLOTS; i++)
         table->seq_nums[i] = 1;
-        table->used_slots[i] = 0;
-    }
-    table->highest_used = table->num_used = 0;
-    table->target_delay = 0;
+    for (i = 0; i < NFS41_SLOT_BITMAP_WORDS; i++)
+        InterlockedExchange(&table->used_slots[i], 0);
+    InterlockedExchange(&table->highest_used, 0);
+    InterlockedExchange(&table->num_used, 0);
+    InterlockedExchange64(&table->target_delay, 0);
+    InterlockedExchange(&table->max_slots, NFS41_MAX_NUM_SLOTS);
 
     /* wake any threads waiting on a slot */
-    if (slot_table_avail(table))
-        WakeAllConditionVariable(&table->cond);
-    LeaveCriticalSection(&table->lock);
+    if (table->num_waiters)
+        slot_table_grant(table);
 }
 
 static void resize_slot_table(
     IN nfs41_slot_table *table,
     IN uint32_t target_highest_slotid)
 {
+    LONG old_max;
+
     if (target_highest_slotid >= NFS41_MAX_NUM_SLOTS)
         target_highest_slotid = NFS41_MAX_NUM_SLOTS - 1;
 
-    if (table->max_slots != target_highest_slotid + 1) {
+    old_max = InterlockedExchange(&table->max_slots,
+        (LONG)target_highest_slotid + 1);
+    if (old_max != (LONG)target_highest_slotid + 1) {
         DPRINTF(2, ("updated max_slots %u to %u\n",
-            table->max_slots, target_highest_slotid + 1));
-        table->max_slots = target_highest_slotid + 1;
+            old_max, target_highest_slotid + 1));
 
-        if (slot_table_avail(table))
-            WakeAllConditionVariable(&table->cond);
+        if (old_max < (LONG)target_highest_slotid + 1 && table->num_waiters)
+            slot_table_grant(table);
     }
 }
 
@@ -87,17 +152,17 @@ void nfs41_session_bump_seq(
     nfs41_slot_table *table = &session->table;
 
     AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
 
+    /* only the holder of the slot touches its seqid */
     if (slotid < NFS41_MAX_NUM_SLOTS)
         table->seq_nums[slotid]++;
 
     /* adjust max_slots in response to changes in target_highest_slotid,
      * but not immediately after a CB_RECALL_SLOT or NFS4ERR_BADSLOT error */
-    if (table->target_delay <= GetTickCount64())
+    if ((ULONGLONG)InterlockedCompareExchange64(&table->target_delay, 0, 0)
+        <= GetTickCount64())
         resize_slot_table(table, target_highest_slotid);
 
-    LeaveCriticalSection(&table->lock);
     ReleaseSRWLockShared(&session->client->session_lock);
 }
 
@@ -108,29 +173,22 @@ void nfs41_session_free_slot(
     nfs41_slot_table *table = &session->table;
 
     AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
 
     /* flag the slot as unused */
-    if (slotid < NFS41_MAX_NUM_SLOTS && table->used_slots[slotid]) {
-        table->used_slots[slotid] = 0;
-        table->num_used--;
+    if (slotid < NFS41_MAX_NUM_SLOTS &&
+        InterlockedBitTestAndReset(&table->used_slots[slotid / 32],
+            slotid % 32)) {
+        InterlockedDecrement(&table->num_used);
+
+        /* pass it on to the first thread waiting on a slot */
+        if (table->num_waiters)
+            slot_table_grant(table);
     }
     /* update highest_used if necessary */
-    if (slotid == table->highest_used) {
-        EASSERT_MSG((table->highest_used < NFS41_MAX_NUM_SLOTS),
-            ("table->highest_used=%lu\n",
-            (unsigned long)table->highest_used));
-        while (table->highest_used && !table->used_slots[table->highest_used])
-            table->highest_used--;
-    }
+    InterlockedExchange(&table->highest_used, slot_table_highest(table));
     DPRINTF(3, ("freeing slot#=%d used=%d highest=%d\n",
         slotid, table->num_used, table->highest_used));
 
-    /* wake any threads waiting on a slot */
-    if (slot_table_avail(table))
-        WakeAllConditionVariable(&table->cond);
-
-    LeaveCriticalSection(&table->lock);
     ReleaseSRWLockShared(&session->client->session_lock);
 }
 
@@ -141,30 +199,37 @@ void nfs41_session_get_slot(
     OUT uint32_t *highest)
 {
     nfs41_slot_table *table = &session->table;
-    uint32_t i;
+    slot_waiter waiter;
 
     AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
-
-    /* wait for an available slot */
-    while (!slot_table_avail(table))
-        SleepConditionVariableCS(&table->cond, &table->lock, INFINITE);
-
-    for (i = 0; i < table->max_slots; i++) {
-        if (table->used_slots[i])
-            continue;
 
-        table->used_slots[i] = 1;
-        table->num_used++;
-        if (i > table->highest_used)
-            table->highest_used = i;
-
-        *slot = i;
-        *seqid = table->seq_nums[i];
-        *highest = table->highest_used;
-        break;
+    /* don't jump the queue if others are already waiting */
+    if (table->num_waiters || !slot_table_claim(table, slot)) {
+        InitializeConditionVariable(&waiter.cond);
+        waiter.granted = FALSE;
+
+        AcquireSRWLockExclusive(&table->waiters_lock);
+        list_add_tail(&table->waiters, &waiter.entry);
+        InterlockedIncrement(&table->num_waiters);
+
+        /* a slot may have been freed before we were queued */
+        if (table->waiters.next == &waiter.entry &&
+            slot_table_claim(table, &waiter.slotid)) {
+            list_remove(&waiter.entry);
+            InterlockedDecrement(&table->num_waiters);
+            waiter.granted = TRUE;
+        }
+        while (!waiter.granted)
+            SleepConditionVariableSRW(&waiter.cond,
+                &table->waiters_lock, INFINITE, 0);
+        ReleaseSRWLockExclusive(&table->waiters_lock);
+
+        *slot = waiter.slotid;
     }
-    LeaveCriticalSection(&table->lock);
+    *seqid = table->seq_nums[*slot];
+    *highest = slot_table_highest(table);
+    InterlockedExchange(&table->highest_used, *highest);
+
     ReleaseSRWLockShared(&session->client->session_lock);
 
     DPRINTF(2, ("session 0x%p: using slot#=%d with seq#=%d highest=%d\n",
@@ -178,10 +243,9 @@ int nfs41_session_recall_slot(
     nfs41_slot_table *table = &session->table;
 
     AcquireSRWLockShared(&session->client->session_lock);
-    EnterCriticalSection(&table->lock);
     resize_slot_table(table, target_highest_slotid);
-    table->target_delay = GetTickCount64() + MAX_SLOTS_DELAY;
-    LeaveCriticalSection(&table->lock);
+    InterlockedExchange64(&table->target_delay,
+        GetTickCount64() + MAX_SLOTS_DELAY);
     ReleaseSRWLockShared(&session->client->session_lock);
 
     return NFS4_OK;
@@ -200,12 +264,11 @@ int nfs41_session_bad_slot(
     }
 
     /* avoid using any slots >= bad_slotid */
-    EnterCriticalSection(&table->lock);
-    if (table->max_slots > args->sa_slotid) {
+    if ((uint32_t)table->max_slots > args->sa_slotid) {
         resize_slot_table(table, args->sa_slotid);
-        table->target_delay = GetTickCount64() + MAX_SLOTS_DELAY;
+        InterlockedExchange64(&table->target_delay,
+            GetTickCount64() + MAX_SLOTS_DELAY);
     }
-    LeaveCriticalSection(&table->lock);
 
     /* get a new slot */
     nfs41_session_free_slot(session, args->sa_slotid);
@@ -282,6 +345,141 @@ static unsigned int WINAPI renew_session_thread(void *args)
     return 0;
 }
 
+/* adaptive transfer sizing */
+#define IO_TUNE_MIN_SIZE        (64 * 1024)
+#define IO_TUNE_MAX_INFLIGHT    16
+#define IO_TUNE_INIT_INFLIGHT   4
+#define IO_TUNE_WINDOW_SAMPLES  16
+#define IO_TUNE_DELAY_LOW       125 /* percent of the latency floor */
+#define IO_TUNE_DELAY_HIGH      150
+
+static void io_tuner_init(
+    IN nfs41_io_tuner *tuner)
+{
+    InitializeSRWLock(&tuner->lock);
+    tuner->inflight = IO_TUNE_INIT_INFLIGHT;
+    tuner->delay = 100;
+}
+
+static uint32_t io_tuner_class(
+    IN uint32_t bytes)
+{
+    uint32_t c = 0;
+    while (c < NFS41_IO_TUNE_CLASSES - 1 &&
+            ((uint64_t)IO_TUNE_MIN_SIZE << c) < bytes)
+        c++;
+    return c;
+}
+
+/* once per window: grow the number of transfers in flight while
+ * latency stays near its floor and throughput doesn't drop, and
+ * shrink it as soon as latency shows that requests are queueing */
+static void io_tuner_adjust(
+    IN nfs41_io_tuner *tuner,
+    IN bool_t write,
+    IN uint64_t now)
+{
+    const uint64_t elapsed = max(now - tuner->window_start, 1);
+    const uint64_t bandwidth = tuner->window_bytes * 1000000 / elapsed;
+    const uint32_t inflight = tuner->inflight;
+    uint32_t c;
+
+    if (tuner->delay > IO_TUNE_DELAY_HIGH) {
+        if (tuner->inflight > 1)
+            tuner->inflight--;
+    } else if (tuner->delay < IO_TUNE_DELAY_LOW &&
+            bandwidth >= tuner->bandwidth) {
+        if (tuner->inflight < IO_TUNE_MAX_INFLIGHT)
+            tuner->inflight++;
+    }
+    tuner->bandwidth = tuner->bandwidth ?
+        (3 * tuner->bandwidth + bandwidth) / 4 : bandwidth;
+
+    /* let the floors creep up, so a slower path is eventually accepted */
+    for (c = 0; c < NFS41_IO_TUNE_CLASSES; c++)
+        tuner->rtt_min[c] += tuner->rtt_min[c] / 64;
+
+    if (tuner->inflight != inflight)
+        DPRINTF(1, ("io tuner(%s): inflight %u -> %u, delay=%u%%, "
+            "bandwidth=%llu B/s, samples=%llu\n", write ? "write" : "read",
+            inflight, tuner->inflight, tuner->delay,
+            tuner->bandwidth, tuner->samples));
+
+    tuner->window_bytes = 0;
+    tuner->window_samples = 0;
+}
+
+void nfs41_session_io_sample(
+    IN nfs41_session *session,
+    IN bool_t write,
+    IN uint32_t bytes,
+    IN uint64_t start,
+    IN uint64_t end)
+{
+    nfs41_io_tuner *tuner = write ? &session->write_tuner : &session->read_tuner;
+    const uint64_t elapsed = max(end - start, 1);
+    const uint32_t c = io_tuner_class(bytes);
+
+    if (bytes == 0)
+        return;
+
+    AcquireSRWLockExclusive(&tuner->lock);
+    tuner->samples++;
+
+    /* compare latency against the floor for transfers of this size */
+    if (tuner->rtt_min[c] == 0 || elapsed < tuner->rtt_min[c])
+        tuner->rtt_min[c] = elapsed;
+    tuner->delay = (uint32_t)((7 * (uint64_t)tuner->delay +
+        min(elapsed * 100 / tuner->rtt_min[c], 1000)) / 8);
+
+    if (tuner->window_samples++ == 0)
+        tuner->window_start = start;
+    tuner->window_bytes += bytes;
+    if (tuner->window_samples >= IO_TUNE_WINDOW_SAMPLES)
+        io_tuner_adjust(tuner, write, end);
+    ReleaseSRWLockExclusive(&tuner->lock);
+}
+
+/* a request that fits in max_size, which comes from the negotiated
+ * ca_maxrequestsize/ca_maxresponsesize, goes out as a single transfer.
+ * larger ones are spread over the chosen number of transfers in flight,
+ * with transfers no smaller than IO_TUNE_MIN_SIZE and no larger than
+ * max_size */
+void nfs41_session_io_tuning(
+    IN nfs41_session *session,
+    IN bool_t write,
+    IN uint32_t max_size,
+    IN uint64_t length,
+    OUT uint32_t *size_out,
+    OUT uint32_t *inflight_out)
+{
+    nfs41_io_tuner *tuner = write ? &session->write_tuner : &session->read_tuner;
+    uint64_t size;
+    uint32_t inflight;
+
+    AcquireSRWLockShared(&tuner->lock);
+    inflight = tuner->inflight;
+    ReleaseSRWLockShared(&tuner->lock);
+
+    /* splitting would only add round trips, and turn a FILE_SYNC4 WRITE
+     * into UNSTABLE4 WRITEs and a COMMIT */
+    if (length <= max_size) {
+        *size_out = max_size;
+        *inflight_out = inflight;
+        return;
+    }
+
+    /* round up to a multiple of 4k */
+    size = ((length + inflight - 1) / inflight + 4095) & ~4095ULL;
+    if (size < IO_TUNE_MIN_SIZE)
+        size = IO_TUNE_MIN_SIZE;
+    if (size > max_size)
+        size = max_size;
+
+    *size_out = (uint32_t)size;
+    *inflight_out = inflight;
+}
+
 /* session creation */
 static int session_alloc(
     IN nfs41_client *client,
@@ -300,11 +498,14 @@ static int session_alloc(
     session->renew.cancel_event = INVALID_HANDLE_VALUE;
     session->isValidState = FALSE;
 
-    InitializeCriticalSection(&session->table.lock);
-    InitializeConditionVariable(&session->table.cond);
+    InitializeSRWLock(&session->table.waiters_lock);
+    list_init(&session->table.waiters);
 
     init_slot_table(&session->table);
 
+    io_tuner_init(&session->read_tuner);
+    io_tuner_init(&session->write_tuner);
+
     //initialize session lock
     InitializeSRWLock(&client->session_lock);
 
@@ -444,7 +645,6 @@ void nfs41_session_free(
         session->client->rpc->is_valid_session = FALSE;
         nfs41_destroy_session(session);
     }
-    DeleteCriticalSection(&session->table.lock);
     ReleaseSRWLockExclusive(&session->client->session_lock);
 
 #ifdef NFS41_DRIVER_WORKAROUND_FOR_GETATTR_AFTER_CLOSE_HACKS
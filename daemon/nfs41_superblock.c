@@ -26,6 +26,7 @@
 #include "nfs41.h"
 #include "nfs41_ops.h"
 #include "from_kernel.h"
+#include "readdir.h"
 #include "util.h"
 
 
@@ -244,8 +245,10 @@ void nfs41_superblock_list_free(
 
     DPRINTF(SBLVL, ("nfs41_superblock_list_free()\n"));
 
-    list_for_each_tmp(entry, tmp, &superblocks->head)
+    list_for_each_tmp(entry, tmp, &superblocks->head) {
+        nfs41_readdir_cache_forget(superblock_entry(entry));
         free(superblock_entry(entry));
+    }
 }
 
 
@@ -236,6 +236,8 @@ typedef struct __nfs41_file_info {
     char                    *owner;
     char                    *owner_group;
     uint32_t                aclsupport;
+    nfs41_fh                *fh; /* for FATTR4_WORD0_FILEHANDLE; only set
+                                  * by callers that request it */
 
     /* Buffers */
     char owner_buf[NFS4_FATTR4_OWNER_LIMIT+1];
@@ -1798,6 +1798,11 @@ static bool_t decode_file_attrs(
             if (!xdr_bool(xdr, &info->case_preserving))
                 return FALSE;
         }
+        if (attrs->attrmask.arr[0] & FATTR4_WORD0_FILEHANDLE) {
+            nfs41_fh tmp, *fh = info->fh ? info->fh : &tmp;
+            if (!xdr_fh(xdr, fh))
+                return FALSE;
+        }
         if (attrs->attrmask.arr[0] & FATTR4_WORD0_FILEID) {
             if (!xdr_u_hyper(xdr, &info->fileid))
                 return FALSE;
@@ -2266,6 +2271,8 @@ static bool_t decode_read_res_ok(
     if (!xdr_bool(xdr, &res->eof))
         return FALSE;
 
+    /* res->data points at the upcall buffer, and xdr_rec reads large
+     * opaques from the socket straight into it */
     return xdr_bytes(xdr, (char **)&data, &res->data_len, NFS41_MAX_FILEIO_SIZE);
 }
 
@@ -2332,6 +2339,7 @@ static bool_t decode_readdir_entry(
     unsigned char *nameptr = &name[0];
     uint32_t name_len, entry_len;
     fattr4 attrs = { 0 };
+    nfs41_fh fh;
 
     /* decode into temporaries so we can determine if there's enough
      * room in the buffer for this entry */
@@ -2363,19 +2371,31 @@ static bool_t decode_readdir_entry(
         entry->cookie = cookie;
         entry->name_len = name_len;
 
-        if (it->has_next_entry)
-            entry->next_entry_offset = entry_len + name_len;
-        else
-            entry->next_entry_offset = 0;
-
         xdrmem_create(&fattr_xdr, (char *)attrs.attr_vals, attrs.attr_vals_len, XDR_DECODE);
+        /* decode the filehandle attribute on the side; only its bytes
+         * are kept, after the name */
+        fh.len = 0;
+        entry->attr_info.fh = &fh;
         if (!(decode_file_attrs(&fattr_xdr, &attrs, &entry->attr_info)))
             entry->attr_info.rdattr_error = NFS4ERR_BADXDR;
+        entry->attr_info.fh = NULL;
         bitmap4_cpy(&entry->attr_info.attrmask, &attrs.attrmask);
         StringCchCopyA(entry->name, name_len, (STRSAFE_LPCSTR)name);
 
-        it->buf_pos += (size_t)entry_len + name_len;
-        it->remaining_len -= entry_len + name_len;
+        /* the entry is still usable without a filehandle that won't fit */
+        entry->fh_len = 0;
+        if (entry_len + name_len + fh.len <= it->remaining_len) {
+            entry->fh_len = fh.len;
+            (void)memcpy(readdir_entry_fh(entry), fh.fh, fh.len);
+        }
+
+        if (it->has_next_entry)
+            entry->next_entry_offset = readdir_entry_size(entry);
+        else
+            entry->next_entry_offset = 0;
+
+        it->buf_pos += readdir_entry_size(entry);
+        it->remaining_len -= readdir_entry_size(entry);
         it->last_entry_offset = &entry->next_entry_offset;
     }
     else if (it->last_entry_offset)
@@ -2832,6 +2852,81 @@ static bool_t decode_op_free_stateid(
 }
 
 
+/*
+ * OP_GET_DIR_DELEGATION
+ */
+static bool_t encode_op_get_dir_delegation(
+    XDR *xdr,
+    nfs_argop4 *argop)
+{
+    nfs41_get_dir_delegation_args *args =
+        (nfs41_get_dir_delegation_args*)argop->arg;
+
+    if (unexpected_op(argop->op, OP_GET_DIR_DELEGATION))
+        return FALSE;
+
+    if (!xdr_bool(xdr, &args->signal_deleg_avail))
+        return FALSE;
+
+    if (!xdr_bitmap4(xdr, &args->notification_types))
+        return FALSE;
+
+    if (!xdr_nfstime4(xdr, &args->child_attr_delay))
+        return FALSE;
+
+    if (!xdr_nfstime4(xdr, &args->dir_attr_delay))
+        return FALSE;
+
+    if (!xdr_bitmap4(xdr, &args->child_attributes))
+        return FALSE;
+
+    return xdr_bitmap4(xdr, &args->dir_attributes);
+}
+
+static bool_t decode_op_get_dir_delegation(
+    XDR *xdr,
+    nfs_resop4 *resop)
+{
+    nfs41_get_dir_delegation_res *res =
+        (nfs41_get_dir_delegation_res*)resop->res;
+
+    if (unexpected_op(resop->op, OP_GET_DIR_DELEGATION))
+        return FALSE;
+
+    if (!xdr_u_int32_t(xdr, &res->status))
+        return FALSE;
+
+    if (res->status)
+        return TRUE;
+
+    if (!xdr_enum(xdr, (enum_t*)&res->gdd_status))
+        return FALSE;
+
+    switch (res->gdd_status) {
+    case GDD4_OK:
+        if (!xdr_opaque(xdr, (char*)res->cookieverf, NFS4_VERIFIER_SIZE))
+            return FALSE;
+
+        if (!xdr_stateid4(xdr, &res->stateid))
+            return FALSE;
+
+        if (!xdr_bitmap4(xdr, &res->notification))
+            return FALSE;
+
+        if (!xdr_bitmap4(xdr, &res->child_attributes))
+            return FALSE;
+
+        return xdr_bitmap4(xdr, &res->dir_attributes);
+    case GDD4_UNAVAIL:
+        return xdr_bool(xdr, &res->will_signal_deleg_avail);
+    default:
+        eprintf("decode_op_get_dir_delegation: status %d not "
+            "supported.\n", res->gdd_status);
+        return FALSE;
+    }
+}
+
+
 /*
  * OP_TEST_STATEID
  */
@@ -2871,6 +2966,17 @@ static bool_t decode_op_test_stateid(
 /*
  * OP_WRITE
  */
+static bool_t xdr_opaque_pad(
+    XDR *xdr,
+    uint32_t len)
+{
+    static const char zero[BYTES_PER_XDR_UNIT] = { 0 };
+    const uint32_t pad = (BYTES_PER_XDR_UNIT - len % BYTES_PER_XDR_UNIT)
+        % BYTES_PER_XDR_UNIT;
+
+    return pad == 0 || XDR_PUTBYTES(xdr, zero, pad);
+}
+
 static bool_t encode_op_write(
     XDR *xdr,
     nfs_argop4 *argop)
@@ -2890,7 +2996,18 @@ static bool_t encode_op_write(
     if (!xdr_u_int32_t(xdr, &args->stable))
         return FALSE;
 
-    return xdr_bytes(xdr, (char **)&data, &args->data_len, NFS41_MAX_FILEIO_SIZE);
+    if (args->data_len > NFS41_MAX_FILEIO_SIZE)
+        return FALSE;
+
+    if (!xdr_u_int32_t(xdr, &args->data_len))
+        return FALSE;
+
+    /* send the payload from the caller's buffer instead of copying it
+     * into the record; it stays valid until the call returns */
+    if (!xdrrec_putbytes_ref(xdr, (const char *)data, args->data_len))
+        return FALSE;
+
+    return xdr_opaque_pad(xdr, args->data_len);
 }
 
 static bool_t xdr_write_verf(
@@ -3611,7 +3728,7 @@ static const op_table_entry g_op_table[] = {
     { encode_op_create_session, decode_op_create_session }, /* OP_CREATE_SESSION = 43 */
     { encode_op_destroy_session, decode_op_destroy_session }, /* OP_DESTROY_SESSION = 44 */
     { encode_op_free_stateid, decode_op_free_stateid }, /* OP_FREE_STATEID = 45 */
-    { NULL, NULL }, /* OP_GET_DIR_DELEGATION = 46 */
+    { encode_op_get_dir_delegation, decode_op_get_dir_delegation }, /* OP_GET_DIR_DELEGATION = 46 */
     { encode_op_getdeviceinfo, decode_op_getdeviceinfo }, /* OP_GETDEVICEINFO = 47 */
     { NULL, NULL }, /* OP_GETDEVICELIST = 48 */
     { encode_op_layoutcommit, decode_op_layoutcommit }, /* OP_LAYOUTCOMMIT = 49 */
@@ -3633,6 +3750,24 @@ static const op_table_entry* op_table_find(uint32_t op)
 }
 
 
+/* decode a fattr4 that arrived outside of a compound, like the
+ * entry attributes in CB_NOTIFY */
+bool_t nfs_decode_file_attrs(
+    fattr4 *attrs,
+    nfs41_file_info *info)
+{
+    XDR attr_xdr;
+
+    xdrmem_create(&attr_xdr, (char*)attrs->attr_vals,
+        attrs->attr_vals_len, XDR_DECODE);
+    if (!decode_file_attrs(&attr_xdr, attrs, info))
+        return FALSE;
+
+    bitmap4_cpy(&info->attrmask, &attrs->attrmask);
+    return TRUE;
+}
+
+
 /*
  * COMPOUND
  */
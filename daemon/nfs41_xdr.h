@@ -27,6 +27,8 @@
 bool_t nfs_encode_compound(XDR *xdr, caddr_t *args);
 bool_t nfs_decode_compound(XDR *xdr, caddr_t *res);
 
+bool_t nfs_decode_file_attrs(fattr4 *attrs, nfs41_file_info *info);
+
 void nfsacl41_free(nfsacl41 *acl);
 
 #endif /* !__NFS41_NFS_XDR_H__ */
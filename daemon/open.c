@@ -29,6 +29,7 @@
 #include "nfs41_ops.h"
 #include "nfs41_daemon.h"
 #include "delegation.h"
+#include "readwrite.h"
 #include "from_kernel.h"
 #include "daemon_debug.h"
 #include "upcall.h"
@@ -79,7 +80,14 @@ static int create_open_state(
     state->ref_count = 1; /* will be released in |cleanup_close()| */
     list_init(&state->locks.list);
     list_init(&state->client_entry);
+    list_init(&state->fileid_entry);
     InitializeCriticalSection(&state->locks.lock);
+    list_init(&state->write_behind.ranges);
+    InitializeSRWLock(&state->write_behind.lock);
+    list_init(&state->read_ahead.pages);
+    state->read_ahead.eof = NFS4_UINT64_MAX;
+    InitializeSRWLock(&state->read_ahead.lock);
+    InitializeConditionVariable(&state->read_ahead.cond);
 
     state->ea.list = INVALID_HANDLE_VALUE;
     InitializeCriticalSection(&state->ea.lock);
@@ -113,6 +121,9 @@ static void open_state_free(
     EASSERT(waitSRWlock(&state->lock) == TRUE);
     EASSERT(waitSRWlock(&state->path.lock) == TRUE);
 
+    nfs41_write_behind_free(state);
+    nfs41_read_ahead_free(state);
+
     /* free associated lock state */
     list_for_each_tmp(entry, tmp, &state->locks.list)
         free(list_container(entry, nfs41_lock_state, open_entry));
@@ -278,6 +289,8 @@ static void client_state_add(
 
     EnterCriticalSection(&client->state.lock);
     list_add_tail(&client->state.opens, &state->client_entry);
+    state_index_add(&client->state.opens_by_fileid,
+        fileid_hash(state->file.fh.fileid), &state->fileid_entry);
     LeaveCriticalSection(&client->state.lock);
 }
 
@@ -288,6 +301,8 @@ static void client_state_remove(
 
     EnterCriticalSection(&client->state.lock);
     list_remove(&state->client_entry);
+    state_index_remove(&client->state.opens_by_fileid,
+        fileid_hash(state->file.fh.fileid), &state->fileid_entry);
     LeaveCriticalSection(&client->state.lock);
 }
 
@@ -1162,9 +1177,19 @@ static int do_nfs41_close(nfs41_open_state *state)
 
 static int handle_close(void *deamon_context, nfs41_upcall *upcall)
 {
-    int status = NFS4_OK, rm_status = NFS4_OK;
+    int status = NFS4_OK, rm_status = NFS4_OK, flush_status = NO_ERROR;
     close_upcall_args *args = &upcall->args.close;
     nfs41_open_state *state = upcall->state_ref;
+    bool_t discard = FALSE;
+
+    /* send any buffered writes before CLOSE; a failure is reported in
+     * the reply, since the data is lost with the open state.  a file
+     * that is about to be removed under a write delegation keeps them
+     * until we know whether REMOVE succeeded */
+    if (args->remove && !args->renamed)
+        discard = nfs41_write_behind_discard_prepare(state);
+    if (!discard)
+        flush_status = nfs41_write_behind_flush(state);
 
     /* return associated file layouts if necessary */
     if (state->type == NF4REG)
@@ -1196,6 +1221,11 @@ retry_delete:
             name, state->file.fh.fileid);
         if (rm_status) {
 			if (rm_status == NFS4ERR_FILE_OPEN) {
+				/* the writes can't be sent after CLOSE */
+				if (discard) {
+					flush_status = nfs41_write_behind_discard(state, FALSE);
+					discard = FALSE;
+				}
 				status = do_nfs41_close(state);
 				if (!status) {
 					state->do_close = 0;
@@ -1206,6 +1236,9 @@ retry_delete:
                 nfs_error_string(rm_status)));
             rm_status = nfs_to_windows_error(rm_status, ERROR_INTERNAL_ERROR);
         }
+        if (discard)
+            flush_status = nfs41_write_behind_discard(state,
+                rm_status == NFS4_OK);
     }
 
     if (state->do_close) {
@@ -1215,10 +1248,11 @@ out:
     /* remove from the client's list of state for recovery */
     client_state_remove(state);
 
-    if (status || !rm_status)
+    if (status)
         return status;
-    else
+    if (rm_status)
         return rm_status;
+    return flush_status;
 }
 
 static void cleanup_close(nfs41_upcall *upcall)
@@ -31,6 +31,8 @@
 
 #define file_layout_entry(pos) list_container(pos, pnfs_file_layout, layout.entry)
 
+typedef uint32_t (WINAPI *pnfs_io_thread_fn)(void*);
+
 typedef struct __pnfs_io_pattern {
     struct __pnfs_io_thread *threads;
     nfs41_root              *root;
@@ -42,9 +44,16 @@ typedef struct __pnfs_io_pattern {
     uint64_t                offset_end;
     uint32_t                count;
     uint32_t                default_lease;
+
+    /* completion of units handed to the io pool */
+    pnfs_io_thread_fn       thread_fn;
+    volatile LONG           pending;
+    volatile LONG           status; /* most severe pnfs_status */
+    HANDLE                  done;
 } pnfs_io_pattern;
 
 typedef struct __pnfs_io_thread {
+    io_pool_work            work; /* queued on the io pool */
     nfs41_write_verf        verf;
     pnfs_io_pattern         *pattern;
     pnfs_file_layout        *layout;
@@ -62,7 +71,11 @@ typedef struct __pnfs_io_unit {
     uint32_t                serverid;
 } pnfs_io_unit;
 
-typedef uint32_t (WINAPI *pnfs_io_thread_fn)(void*);
+
+/* units run on the daemon's io pool, which grows on demand to
+ * PNFS_IO_WORKERS_PER_SERVER for each data server in the largest
+ * device seen, up to IO_POOL_MAX_WORKERS */
+#define PNFS_IO_WORKERS_PER_SERVER  2
 
 
 static enum pnfs_status stripe_next_unit(
@@ -299,8 +312,9 @@ static enum pnfs_status stripe_next_unit(
     const uint32_t stripe_count = layout->device->stripes.count;
     uint64_t sui = stripe_unit_number(layout, *position, unit_size);
 
-    /* advance to the desired stripeid */
-    sui += abs(stripeid - stripe_index(layout, sui, stripe_count));
+    /* advance to the desired stripeid, which may be in the next stripe */
+    sui += (stripeid + stripe_count -
+        stripe_index(layout, sui, stripe_count)) % stripe_count;
 
     io->offset = stripe_unit_offset(layout, sui, unit_size);
     if (io->offset < *position) /* don't start before position */
@@ -366,30 +380,41 @@ static enum pnfs_status thread_data_server(
     return PNFS_SUCCESS;
 }
 
-static enum pnfs_status pattern_join(
-    IN HANDLE *threads,
-    IN DWORD count)
+static void pattern_complete(
+    IN pnfs_io_thread *thread,
+    IN enum pnfs_status status)
 {
-    DWORD status;
-    /* WaitForMultipleObjects() supports a maximum of 64 objects */
-    while (count) {
-        const DWORD n = min(count, MAXIMUM_WAIT_OBJECTS);
-        status = WaitForMultipleObjects(n, threads, TRUE, INFINITE);
-        if (status != WAIT_OBJECT_0)
-            return PNFSERR_RESOURCES;
-
-        count -= n;
-        threads += n;
-    }
-    return PNFS_SUCCESS;
+    pnfs_io_pattern *pattern = thread->pattern;
+    LONG prev;
+
+    /* keep track of the most severe error returned by a thread */
+    do {
+        prev = pattern->status;
+        if ((LONG)status <= prev)
+            break;
+    } while (InterlockedCompareExchange(&pattern->status,
+        (LONG)status, prev) != prev);
+
+    /* the pattern may be freed as soon as the event is set */
+    if (InterlockedDecrement(&pattern->pending) == 0)
+        SetEvent(pattern->done);
+}
+
+static void pattern_work(
+    IN io_pool_work *work)
+{
+    pnfs_io_thread *thread = list_container(work, pnfs_io_thread, work);
+
+    pattern_complete(thread, (enum pnfs_status)
+        thread->pattern->thread_fn(thread));
 }
 
 static enum pnfs_status pattern_fork(
     IN pnfs_io_pattern *pattern,
     IN pnfs_io_thread_fn thread_fn)
 {
-    HANDLE *threads;
-    uint32_t i;
+    pnfs_io_thread *thread;
+    uint32_t i, servers = 0;
     enum pnfs_status status = PNFS_SUCCESS;
 
     if (pattern->count == 0)
@@ -401,40 +426,37 @@ static enum pnfs_status pattern_fork(
         goto out;
     }
 
-    /* create a thread for each unit that has actual io */
-    threads = calloc(pattern->count, sizeof(HANDLE));
-    if (threads == NULL) {
+    pattern->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (pattern->done == NULL) {
+        eprintf("CreateEvent() failed with %d\n", GetLastError());
         status = PNFSERR_RESOURCES;
         goto out;
     }
-
-    for (i = 0; i < pattern->count; i++) {
-        threads[i] = (HANDLE)_beginthreadex(NULL, 0,
-            thread_fn, &pattern->threads[i], 0, NULL);
-        if (threads[i] == NULL) {
-            eprintf("_beginthreadex() failed with %d\n", GetLastError());
-            pattern->count = i; /* join any threads already started */
-            break;
-        }
-    }
-
-    /* wait on all threads to finish */
-    status = pattern_join(threads, pattern->count);
-    if (status) {
-        eprintf("pattern_join() failed with '%s'\n", pnfs_error_string(status));
-        goto out;
-    }
+    pattern->thread_fn = thread_fn;
+    pattern->pending = pattern->count;
+    pattern->status = PNFS_SUCCESS;
+
+    /* queue every unit but the first, which runs on this thread */
+    for (i = 1; i < pattern->count; i++)
+        servers = max(servers, pattern->threads[i].layout->device->servers.count);
+    for (i = 1; i < pattern->count; i++)
+        io_pool_queue(&pattern->threads[i].work, pattern_work,
+            min(pattern->count - 1, servers * PNFS_IO_WORKERS_PER_SERVER));
+
+    thread = &pattern->threads[0];
+    pattern_complete(thread, (enum pnfs_status)thread_fn(thread));
 
-    for (i = 0; i < pattern->count; i++) {
-        /* keep track of the most severe error returned by a thread */
-        DWORD exitcode;
-        if (GetExitCodeThread(threads[i], &exitcode))
-            status = max(status, (enum pnfs_status)exitcode);
-
-        CloseHandle(threads[i]);
-    }
+    /* help out with any units the pool hasn't gotten to yet */
+    for (i = 1; i < pattern->count; i++) {
+        thread = &pattern->threads[i];
+        if (io_pool_cancel(&thread->work))
+            pattern_complete(thread, (enum pnfs_status)thread_fn(thread));
+    }
 
-    free(threads);
+    /* wait for the pool to finish the rest */
+    WaitForSingleObject(pattern->done, INFINITE);
+    CloseHandle(pattern->done);
+    status = (enum pnfs_status)pattern->status;
 out:
     return status;
 }
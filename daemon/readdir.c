@@ -27,6 +27,11 @@
 #include <string.h>
 #include "from_kernel.h"
 #include "nfs41_ops.h"
+#include "nfs41_callback.h"
+#include "nfs41_xdr.h"
+#include "name_cache.h"
+#include "delegation.h"
+#include "readdir.h"
 #include "daemon_debug.h"
 #include "upcall.h"
 #include "util.h"
@@ -622,6 +627,7 @@ static int readdir_add_dots(
             goto out;
         }
         entry->cookie = COOKIE_DOT;
+        entry->fh_len = 0;
         entry->name_len = 2;
         StringCbCopyA(entry->name, entry->name_len, ".");
         entry->next_entry_offset = entry_len + entry->name_len;
@@ -656,6 +662,7 @@ static int readdir_add_dots(
             goto out;
         }
         entry->cookie = COOKIE_DOTDOT;
+        entry->fh_len = 0;
         entry->name_len = 3;
         StringCbCopyA(entry->name, entry->name_len, "..");
         entry->next_entry_offset = entry_len + entry->name_len;
@@ -673,6 +680,679 @@ out:
     return status;
 }
 
+/* directory listing cache
+ *
+ *   Explorer and build tools list the same directories over and over.
+ * the pages that READDIR returns for a directory are appended to a
+ * listing as they arrive, as long as each page picks up at the cookie
+ * where the last one ended.  a query whose cookie falls inside a listing
+ * is then answered from memory, while the directory's change attribute
+ * (usually from the attribute cache) matches the one the listing was
+ * built under.  listings also expire with the name cache, because the
+ * attributes of each entry aren't covered by the directory's change
+ * attribute.
+ *   once a listing has answered DIR_CACHE_DELEG_HITS queries, we ask
+ * for a delegation on the directory.  while we hold one whose CB_NOTIFY
+ * covers the entries' attributes, the listing doesn't expire; instead,
+ * nfs41_readdir_notify() applies each change to it in place */
+#define DIR_CACHE_MAX_LISTINGS      64
+#define DIR_CACHE_MAX_LISTING_SIZE  (4*1024*1024)
+#define DIR_CACHE_DELEG_HITS        2
+
+struct dir_listing {
+    struct list_entry       entry; /* in dir_cache.listings, by last use */
+    /* the cache is shared by all servers, and fsids and fileids are only
+     * unique within a server; superblocks belong to a single server */
+    const nfs41_superblock  *superblock;
+    uint64_t                fileid;
+    uint64_t                change;
+    util_reltimestamp       expiration;
+    unsigned char           verf[NFS4_VERIFIER_SIZE];
+    unsigned char           *entries;
+    uint32_t                entries_len;
+    uint32_t                last_offset; /* of the last entry in entries */
+    bool_t                  eof; /* entries hold the whole directory */
+    uint32_t                hits; /* queries answered from the start */
+    bool_t                  deleg_requested;
+};
+
+static struct dir_cache {
+    SRWLOCK                 lock;
+    struct list_entry       listings;
+    uint32_t                count;
+} dir_cache = {
+    SRWLOCK_INIT,
+    { &dir_cache.listings, &dir_cache.listings },
+    0
+};
+
+#define dir_listing_entry(pos) list_container(pos, struct dir_listing, entry)
+
+static __inline uint32_t dir_entry_size(
+    IN const nfs41_readdir_entry *entry)
+{
+    return readdir_entry_size(entry);
+}
+
+static void dir_listing_free(
+    IN struct dir_listing *listing)
+{
+    list_remove(&listing->entry);
+    dir_cache.count--;
+    free(listing->entries);
+    free(listing);
+}
+
+static struct dir_listing* dir_listing_search(
+    IN const nfs41_fh *dir)
+{
+    struct list_entry *pos;
+    struct dir_listing *listing;
+
+    list_for_each(pos, &dir_cache.listings) {
+        listing = dir_listing_entry(pos);
+        if (listing->fileid == dir->fileid &&
+            listing->superblock == dir->superblock)
+            return listing;
+    }
+    return NULL;
+}
+
+void nfs41_readdir_cache_forget(
+    IN const nfs41_superblock *superblock)
+{
+    struct list_entry *pos, *tmp;
+
+    AcquireSRWLockExclusive(&dir_cache.lock);
+    list_for_each_tmp(pos, tmp, &dir_cache.listings) {
+        struct dir_listing *listing = dir_listing_entry(pos);
+        if (listing->superblock == superblock)
+            dir_listing_free(listing);
+    }
+    ReleaseSRWLockExclusive(&dir_cache.lock);
+}
+
+/* find a listing that's still valid for the given change attribute;
+ * a listing held by a directory delegation doesn't expire */
+static struct dir_listing* dir_listing_find(
+    IN const nfs41_path_fh *file,
+    IN uint64_t change,
+    IN bool_t held)
+{
+    struct dir_listing *listing = dir_listing_search(&file->fh);
+    if (listing == NULL)
+        return NULL;
+
+    if (listing->change != change ||
+        (!held && UTIL_GETRELTIME() > listing->expiration)) {
+        DPRINTF(2, ("dir_listing_find(%llu): dropping stale listing\n",
+            file->fh.fileid));
+        dir_listing_free(listing);
+        return NULL;
+    }
+    /* move it to the front */
+    list_remove(&listing->entry);
+    list_add_head(&dir_cache.listings, &listing->entry);
+    return listing;
+}
+
+/* copy the entries that follow cookie out of a cached listing */
+static bool_t dir_cache_read(
+    IN const nfs41_path_fh *file,
+    IN uint64_t change,
+    IN bool_t held,
+    IN OUT nfs41_readdir_cookie *cookie,
+    OUT unsigned char *entries,
+    IN OUT uint32_t *entries_len,
+    OUT bool_t *eof_out,
+    OUT bool_t *hot_out)
+{
+    struct dir_listing *listing;
+    nfs41_readdir_entry *src, *dst = NULL;
+    uint32_t pos = 0, copied = 0, size;
+    bool_t end = FALSE, hit = FALSE;
+
+    AcquireSRWLockExclusive(&dir_cache.lock);
+
+    listing = dir_listing_find(file, change, held);
+    if (listing == NULL || listing->entries_len == 0)
+        goto out;
+
+    if (cookie->cookie == 0 && !held && !listing->deleg_requested &&
+        ++listing->hits >= DIR_CACHE_DELEG_HITS) {
+        /* the directory is listed often enough to ask for a delegation */
+        listing->deleg_requested = TRUE;
+        *hot_out = TRUE;
+    }
+
+    if (cookie->cookie) {
+        /* start after the entry with this cookie */
+        if (memcmp(cookie->verf, listing->verf, NFS4_VERIFIER_SIZE))
+            goto out;
+        for (;;) {
+            src = (nfs41_readdir_entry*)(listing->entries + pos);
+            if (src->cookie == cookie->cookie)
+                break;
+            if (src->next_entry_offset == 0)
+                goto out;
+            pos += src->next_entry_offset;
+        }
+        if (src->next_entry_offset == 0) {
+            /* nothing follows it; the directory may not have been
+             * listed that far yet */
+            if (!listing->eof)
+                goto out;
+            *entries_len = 0;
+            *eof_out = TRUE;
+            hit = TRUE;
+            goto out;
+        }
+        pos += src->next_entry_offset;
+    }
+
+    /* copy whole entries while they fit */
+    for (;;) {
+        src = (nfs41_readdir_entry*)(listing->entries + pos);
+        size = dir_entry_size(src);
+        if (copied + size > *entries_len)
+            break;
+
+        dst = (nfs41_readdir_entry*)(entries + copied);
+        (void)memcpy(dst, src, size);
+        /* owner strings point into the entry's own buffers */
+        if (dst->attr_info.owner)
+            dst->attr_info.owner = dst->attr_info.owner_buf;
+        if (dst->attr_info.owner_group)
+            dst->attr_info.owner_group = dst->attr_info.owner_group_buf;
+        dst->next_entry_offset = size;
+        copied += size;
+
+        if (src->next_entry_offset == 0) {
+            end = TRUE;
+            break;
+        }
+        pos += src->next_entry_offset;
+    }
+    if (dst == NULL)
+        goto out;
+
+    *eof_out = end && listing->eof;
+    dst->next_entry_offset = 0;
+    *entries_len = copied;
+    (void)memcpy(cookie->verf, listing->verf, NFS4_VERIFIER_SIZE);
+    hit = TRUE;
+out:
+    ReleaseSRWLockExclusive(&dir_cache.lock);
+    if (hit) {
+        DPRINTF(2, ("dir_cache_read(%llu): served %u bytes after cookie "
+            "%llu, eof=%d\n", file->fh.fileid, *entries_len,
+            cookie->cookie, *eof_out));
+    }
+    return hit;
+}
+
+/* add a page of entries that started after start_cookie to the
+ * directory's listing */
+static void dir_cache_append(
+    IN const nfs41_path_fh *file,
+    IN uint64_t change,
+    IN bool_t held,
+    IN uint32_t timeout,
+    IN uint64_t start_cookie,
+    IN const nfs41_readdir_cookie *cookie,
+    IN const unsigned char *entries,
+    IN uint32_t entries_len,
+    IN bool_t eof)
+{
+    struct dir_listing *listing;
+    nfs41_readdir_entry *last;
+    unsigned char *tmp;
+    uint32_t pos;
+
+    AcquireSRWLockExclusive(&dir_cache.lock);
+
+    listing = dir_listing_find(file, change, held);
+    if (start_cookie == 0) {
+        if (listing)
+            goto out; /* already started */
+
+        if (dir_cache.count == DIR_CACHE_MAX_LISTINGS)
+            dir_listing_free(dir_listing_entry(dir_cache.listings.prev));
+
+        listing = calloc(1, sizeof(struct dir_listing));
+        if (listing == NULL)
+            goto out;
+        listing->superblock = file->fh.superblock;
+        listing->fileid = file->fh.fileid;
+        listing->change = change;
+        listing->expiration = UTIL_GETRELTIME() + timeout;
+        (void)memcpy(listing->verf, cookie->verf, NFS4_VERIFIER_SIZE);
+        list_add_head(&dir_cache.listings, &listing->entry);
+        dir_cache.count++;
+    } else {
+        /* only extend a listing at its end */
+        if (listing == NULL || listing->eof || listing->entries_len == 0)
+            goto out;
+        last = (nfs41_readdir_entry*)(listing->entries + listing->last_offset);
+        if (last->cookie != start_cookie ||
+            memcmp(listing->verf, cookie->verf, NFS4_VERIFIER_SIZE))
+            goto out;
+    }
+
+    if (entries_len) {
+        if (listing->entries_len + entries_len > DIR_CACHE_MAX_LISTING_SIZE) {
+            dir_listing_free(listing);
+            goto out;
+        }
+        tmp = realloc(listing->entries, listing->entries_len + entries_len);
+        if (tmp == NULL) {
+            dir_listing_free(listing);
+            goto out;
+        }
+        listing->entries = tmp;
+        (void)memcpy(listing->entries + listing->entries_len,
+            entries, entries_len);
+
+        /* chain the old last entry to the new page, then find the new one */
+        pos = listing->entries_len;
+        if (pos) {
+            last = (nfs41_readdir_entry*)(listing->entries + listing->last_offset);
+            last->next_entry_offset = pos - listing->last_offset;
+        }
+        for (;;) {
+            last = (nfs41_readdir_entry*)(listing->entries + pos);
+            if (last->next_entry_offset == 0)
+                break;
+            pos += last->next_entry_offset;
+        }
+        listing->last_offset = pos;
+        listing->entries_len += entries_len;
+    }
+    listing->eof = eof;
+out:
+    ReleaseSRWLockExclusive(&dir_cache.lock);
+}
+
+/* whether attributes in mask include all of those in required */
+static bool_t attrmask_covers(
+    IN const bitmap4 *mask,
+    IN const bitmap4 *required)
+{
+    uint32_t i, need;
+    for (i = 0; i < required->count; i++) {
+        need = required->arr[i];
+        if (i == 0)
+            need &= ~FATTR4_WORD0_RDATTR_ERROR;
+        if (need & ~(i < mask->count ? mask->arr[i] : 0))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static nfs41_readdir_entry* dir_listing_lookup(
+    IN struct dir_listing *listing,
+    IN const char *name,
+    OUT uint32_t *pos_out,
+    OUT uint32_t *prev_out)
+{
+    nfs41_readdir_entry *entry;
+    uint32_t pos = 0, prev = 0;
+
+    if (listing->entries_len == 0)
+        return NULL;
+    for (;;) {
+        entry = (nfs41_readdir_entry*)(listing->entries + pos);
+        if (strcmp(entry->name, name) == 0)
+            break;
+        if (entry->next_entry_offset == 0)
+            return NULL;
+        prev = pos;
+        pos += entry->next_entry_offset;
+    }
+    *pos_out = pos;
+    *prev_out = prev;
+    return entry;
+}
+
+static void dir_listing_remove(
+    IN struct dir_listing *listing,
+    IN const char *name)
+{
+    nfs41_readdir_entry *entry;
+    uint32_t pos, prev, size;
+
+    entry = dir_listing_lookup(listing, name, &pos, &prev);
+    if (entry == NULL)
+        return;
+
+    if (entry->next_entry_offset == 0) {
+        /* the last entry; its predecessor ends the listing now */
+        listing->entries_len = pos;
+        listing->last_offset = prev;
+        if (pos)
+            ((nfs41_readdir_entry*)(listing->entries + prev))->next_entry_offset = 0;
+    } else {
+        /* entries are contiguous, so move the rest of them down */
+        size = entry->next_entry_offset;
+        memmove(listing->entries + pos, listing->entries + pos + size,
+            listing->entries_len - pos - size);
+        listing->entries_len -= size;
+        listing->last_offset -= size;
+    }
+}
+
+static bool_t dir_listing_add(
+    IN struct dir_listing *listing,
+    IN const struct notify_dir4 *change,
+    IN const nfs41_file_info *info,
+    IN const nfs41_fh *fh)
+{
+    const nfs41_readdir_entry *first;
+    nfs41_readdir_entry *entry;
+    unsigned char *tmp;
+    uint32_t size, fh_len = 0;
+
+    /* an entry can only go at the end of a complete listing, and needs
+     * a cookie and the same attributes as the entries already there */
+    if (!listing->eof || !change->has_cookie || listing->entries_len == 0)
+        return FALSE;
+    first = (const nfs41_readdir_entry*)listing->entries;
+    if (!attrmask_covers(&info->attrmask, &first->attr_info.attrmask))
+        return FALSE;
+
+    if (bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_FILEHANDLE))
+        fh_len = fh->len;
+    size = (uint32_t)FIELD_OFFSET(nfs41_readdir_entry, name) +
+        change->entry.name_len + 1 + fh_len;
+    if (listing->entries_len + size > DIR_CACHE_MAX_LISTING_SIZE)
+        return FALSE;
+    tmp = realloc(listing->entries, listing->entries_len + size);
+    if (tmp == NULL)
+        return FALSE;
+    listing->entries = tmp;
+
+    entry = (nfs41_readdir_entry*)(listing->entries + listing->entries_len);
+    ZeroMemory(entry, size);
+    entry->cookie = change->cookie;
+    entry->name_len = change->entry.name_len + 1;
+    (void)memcpy(entry->name, change->entry.name, change->entry.name_len);
+    entry->fh_len = fh_len;
+    (void)memcpy(readdir_entry_fh(entry), fh->fh, fh_len);
+    (void)memcpy(&entry->attr_info, info, sizeof(nfs41_file_info));
+
+    ((nfs41_readdir_entry*)(listing->entries + listing->last_offset))->
+        next_entry_offset = listing->entries_len - listing->last_offset;
+    listing->last_offset = listing->entries_len;
+    listing->entries_len += size;
+    return TRUE;
+}
+
+static bool_t dir_listing_update(
+    IN struct dir_listing *listing,
+    IN const char *name,
+    IN const nfs41_file_info *info)
+{
+    nfs41_readdir_entry *entry;
+    uint32_t pos, prev;
+
+    entry = dir_listing_lookup(listing, name, &pos, &prev);
+    if (entry == NULL) /* fine if it hasn't been listed yet */
+        return !listing->eof;
+
+    if (!attrmask_covers(&info->attrmask, &entry->attr_info.attrmask))
+        return FALSE;
+    (void)memcpy(&entry->attr_info, info, sizeof(nfs41_file_info));
+    return TRUE;
+}
+
+/* apply a CB_NOTIFY change to the directory's listing */
+static void dir_cache_notify(
+    IN const nfs41_fh *dir,
+    IN const struct notify_dir4 *change,
+    IN const nfs41_file_info *info,
+    IN const nfs41_fh *fh)
+{
+    struct dir_listing *listing;
+    bool_t applied = TRUE;
+
+    AcquireSRWLockExclusive(&dir_cache.lock);
+
+    listing = dir_listing_search(dir);
+    if (listing == NULL)
+        goto out;
+
+    switch (change->type) {
+    case NOTIFY4_REMOVE_ENTRY:
+        dir_listing_remove(listing, change->entry.name);
+        break;
+    case NOTIFY4_RENAME_ENTRY:
+        dir_listing_remove(listing, change->old_entry.name);
+        /* fall through */
+    case NOTIFY4_ADD_ENTRY:
+        /* the new entry may replace one of the same name */
+        dir_listing_remove(listing, change->entry.name);
+        applied = dir_listing_add(listing, change, info, fh);
+        break;
+    case NOTIFY4_CHANGE_CHILD_ATTRS:
+        applied = dir_listing_update(listing, change->entry.name, info);
+        break;
+    case NOTIFY4_CHANGE_DIR_ATTRS:
+        /* the listing now matches the directory's new change attribute */
+        if (bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_CHANGE))
+            listing->change = info->change;
+        break;
+    default:
+        /* NOTIFY4_CHANGE_COOKIE_VERIFIER: the cookies are no good */
+        applied = FALSE;
+        break;
+    }
+
+    if (!applied) {
+        DPRINTF(2, ("dir_cache_notify(%llu): dropping listing after "
+            "change %d\n", dir->fileid, change->type));
+        dir_listing_free(listing);
+    }
+out:
+    ReleaseSRWLockExclusive(&dir_cache.lock);
+}
+
+/* add the entries of a READDIR page to the name and attribute caches, so
+ * the lookups and getattrs that usually follow a listing are hits */
+static void readdir_cache_entries(
+    IN nfs41_open_state *state,
+    IN const unsigned char *entries,
+    IN uint32_t entries_len)
+{
+    struct nfs41_name_cache *cache = session_name_cache(state->session);
+    nfs41_superblock *superblock = state->file.fh.superblock;
+    nfs41_readdir_entry *entry;
+    nfs41_abs_path path;
+    nfs41_component name;
+    nfs41_fh fh;
+    uint32_t pos = 0;
+
+    while (pos < entries_len) {
+        entry = (nfs41_readdir_entry*)(entries + pos);
+
+        /* skip entries without a filehandle, and those on another
+         * filesystem, since they need their own superblock */
+        if (entry->fh_len && entry->attr_info.rdattr_error == NFS4_OK &&
+            (entry->attr_info.attrmask.arr[0] & FATTR4_WORD0_FILEID) &&
+            (entry->attr_info.attrmask.arr[0] & FATTR4_WORD0_FSID) &&
+            entry->attr_info.fsid.major == superblock->fsid.major &&
+            entry->attr_info.fsid.minor == superblock->fsid.minor) {
+            name.name = entry->name;
+            name.len = (unsigned short)entry->name_len - 1;
+
+            if (format_abs_path(state->file.path, &name, &path) == NO_ERROR) {
+                name.name = path.path + path.len - name.len;
+                fh.len = entry->fh_len;
+                (void)memcpy(fh.fh, readdir_entry_fh(entry), fh.len);
+                fh.fileid = entry->attr_info.fileid;
+                fh.superblock = superblock;
+
+                nfs41_name_cache_insert(cache, path.path, &name, &fh,
+                    &entry->attr_info, NULL, OPEN_DELEGATE_NONE);
+            }
+        }
+
+        if (entry->next_entry_offset == 0)
+            break;
+        pos += entry->next_entry_offset;
+    }
+}
+
+static void readdir_notify_remove(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_abs_path *dir_path,
+    IN const struct notify_entry4 *entry)
+{
+    nfs41_abs_path path;
+    nfs41_component name = { entry->name, (unsigned short)entry->name_len };
+
+    /* leave a negative entry; the delegation keeps it valid */
+    if (format_abs_path(dir_path, &name, &path) == NO_ERROR) {
+        name.name = path.path + path.len - name.len;
+        nfs41_name_cache_remove(cache, path.path, &name, 0, NULL);
+    }
+}
+
+static void readdir_notify_add(
+    IN struct nfs41_name_cache *cache,
+    IN const nfs41_abs_path *dir_path,
+    IN const nfs41_fh *dir,
+    IN const struct notify_entry4 *entry,
+    IN const nfs41_file_info *info,
+    IN const nfs41_fh *entry_fh)
+{
+    nfs41_abs_path path;
+    nfs41_component name = { entry->name, (unsigned short)entry->name_len };
+    nfs41_fh fh;
+
+    if (format_abs_path(dir_path, &name, &path))
+        return;
+    name.name = path.path + path.len - name.len;
+
+    if (bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_FILEHANDLE) &&
+        bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_FILEID) &&
+        bitmap_isset(&info->attrmask, 0, FATTR4_WORD0_FSID) &&
+        info->fsid.major == dir->superblock->fsid.major &&
+        info->fsid.minor == dir->superblock->fsid.minor) {
+        fh_copy(&fh, entry_fh);
+        fh.fileid = info->fileid;
+        fh.superblock = dir->superblock;
+        nfs41_name_cache_insert(cache, path.path, &name, &fh,
+            info, NULL, OPEN_DELEGATE_NONE);
+    } else {
+        /* without a filehandle, just drop any negative entry */
+        nfs41_name_cache_unlink(cache, path.path, &name);
+    }
+}
+
+void nfs41_readdir_notify(
+    IN struct nfs41_name_cache *cache,
+    IN OPTIONAL const nfs41_abs_path *path,
+    IN const nfs41_fh *dir,
+    IN struct notify_dir4 *change)
+{
+    nfs41_file_info info = { 0 };
+    nfs41_fh fh = { 0 };
+
+    /* attributes of the added or changed entry, or of the directory */
+    info.fh = &fh;
+    if (!nfs_decode_file_attrs(&change->entry.attrs, &info))
+        bitmap4_clear(&info.attrmask);
+    info.fh = NULL;
+
+    DPRINTF(2, ("nfs41_readdir_notify('%s', %d, '%s')\n",
+        path ? path->path : "?", change->type, change->entry.name));
+
+    /* the name cache is by path, so names are only updated with one */
+    switch (change->type) {
+    case NOTIFY4_REMOVE_ENTRY:
+        if (path)
+            readdir_notify_remove(cache, path, &change->entry);
+        break;
+    case NOTIFY4_RENAME_ENTRY:
+        if (path) {
+            readdir_notify_remove(cache, path, &change->old_entry);
+            readdir_notify_add(cache, path, dir, &change->entry, &info, &fh);
+        }
+        break;
+    case NOTIFY4_ADD_ENTRY:
+        if (path)
+            readdir_notify_add(cache, path, dir, &change->entry, &info, &fh);
+        break;
+    case NOTIFY4_CHANGE_CHILD_ATTRS:
+        if (bitmap_isset(&info.attrmask, 0, FATTR4_WORD0_FILEID))
+            nfs41_attr_cache_update(cache, info.fileid, &info);
+        break;
+    case NOTIFY4_CHANGE_DIR_ATTRS:
+        nfs41_attr_cache_update(cache, dir->fileid, &info);
+        break;
+    default:
+        break;
+    }
+
+    dir_cache_notify(dir, change, &info, &fh);
+}
+
+/* fetch entries after state->cookie, from the listing cache if possible */
+static int readdir_fetch(
+    IN nfs41_open_state *state,
+    IN bitmap4 *attr_request,
+    OUT unsigned char *entries,
+    IN OUT uint32_t *entries_len,
+    OUT bool_t *eof_out)
+{
+    nfs41_file_info info = { 0 };
+    const uint64_t start_cookie = state->cookie.cookie;
+    const uint32_t timeout = nfs41_name_cache_expiration(
+        session_name_cache(state->session));
+    bool_t cacheable = FALSE, held = FALSE, hot = FALSE, hit;
+    int status;
+
+    if (timeout && nfs41_cached_getattr(state->session,
+            &state->file, &info) == NO_ERROR &&
+        (info.attrmask.arr[0] & FATTR4_WORD0_CHANGE)) {
+        cacheable = TRUE;
+        held = nfs41_delegation_dir_listing(state->session->client,
+            &state->file.fh);
+        hit = dir_cache_read(&state->file, info.change, held,
+            &state->cookie, entries, entries_len, eof_out, &hot);
+        if (hot) {
+            /* ask for the delegation with the attributes we list */
+            bitmap4 child_attributes;
+            bitmap4_cpy(&child_attributes, attr_request);
+            child_attributes.arr[0] &= ~FATTR4_WORD0_RDATTR_ERROR;
+            child_attributes.arr[0] |= FATTR4_WORD0_FILEHANDLE |
+                FATTR4_WORD0_FSID | FATTR4_WORD0_FILEID;
+            nfs41_delegation_dir_request(state->session,
+                &state->file, &child_attributes);
+        }
+        if (hit)
+            return NO_ERROR;
+    }
+
+    /* with the name cache enabled, ask for each entry's filehandle and
+     * fsid too, so the entries can go into the name cache */
+    if (timeout)
+        attr_request->arr[0] |= FATTR4_WORD0_FILEHANDLE | FATTR4_WORD0_FSID;
+
+    status = nfs41_readdir(state->session, &state->file,
+        attr_request, &state->cookie, entries, entries_len, eof_out);
+    if (status)
+        goto out;
+
+    if (timeout)
+        readdir_cache_entries(state, entries, *entries_len);
+    if (cacheable)
+        dir_cache_append(&state->file, info.change, held, timeout,
+            start_cookie, &state->cookie, entries, *entries_len, *eof_out);
+out:
+    return status;
+}
+
 static int handle_readdir(void *deamon_context, nfs41_upcall *upcall)
 {
     int status;
@@ -747,9 +1427,8 @@ fetch_entries:
         } else {
             DPRINTF(2, ("calling nfs41_readdir with cookie %llu\n",
                 state->cookie.cookie));
-            status = nfs41_readdir(state->session, &state->file,
-                &attr_request, &state->cookie, entry_buf + dots_len,
-                &entry_buf_len, &eof);
+            status = readdir_fetch(state, &attr_request,
+                entry_buf + dots_len, &entry_buf_len, &eof);
             if (status) {
                 DPRINTF(1, ("nfs41_readdir failed with '%s'\n",
                     nfs_error_string(status)));
@@ -765,6 +1444,7 @@ fetch_entries:
         /* use LOOKUP for single files */
         nfs41_readdir_entry *entry = (nfs41_readdir_entry*)entry_buf;
         entry->cookie = 0;
+        entry->fh_len = 0;
         entry->name_len = (uint32_t)strlen(args->filter) + 1;
         StringCbCopyA(entry->name, entry->name_len, args->filter);
         entry->next_entry_offset = 0;
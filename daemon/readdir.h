@@ -0,0 +1,45 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * Olga Kornievskaia <aglo@umich.edu>
+ * Casey Bodley <cbodley@umich.edu>
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+#ifndef __NFS41_DAEMON_READDIR_H__
+#define __NFS41_DAEMON_READDIR_H__ 1
+
+#include "nfs41.h"
+
+
+struct nfs41_name_cache;
+struct notify_dir4; /* from nfs41_callback.h */
+
+/* apply a change from CB_NOTIFY, under a directory delegation, to the
+ * directory's entries in the name cache and to its cached listing;
+ * a listing that can't be updated in place is dropped */
+void nfs41_readdir_notify(
+    IN struct nfs41_name_cache *cache,
+    IN OPTIONAL const nfs41_abs_path *path,
+    IN const nfs41_fh *dir,
+    IN struct notify_dir4 *change);
+
+/* drop the cached listings of a superblock that's being freed */
+void nfs41_readdir_cache_forget(
+    IN const nfs41_superblock *superblock);
+
+#endif /* !__NFS41_DAEMON_READDIR_H__ */
@@ -24,7 +24,9 @@
 #include <stdio.h>
 
 #include "nfs41_ops.h"
+#include "nfs41_daemon.h"
 #include "name_cache.h"
+#include "readwrite.h"
 #include "upcall.h"
 #include "daemon_debug.h"
 #include "util.h"
@@ -33,6 +35,12 @@
 /* number of times to retry on write/commit verifier mismatch */
 #define MAX_WRITE_RETRIES 6
 
+/* maximum number of chunks the mds read/write pipeline keeps in flight */
+#define MAX_CHUNKS_IN_FLIGHT 16
+
+/* maximum read-ahead window, in units of the read size */
+#define READ_AHEAD_MAX_PAGES 8
+
 
 const stateid4 special_read_stateid = {0xffffffff, 
     {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}};
@@ -55,7 +63,233 @@ out:
     return status;
 }
 
+/* chunked io pipeline for read_from_mds() and write_to_mds() */
+struct rw_chunk {
+    uint64_t offset;
+    unsigned char *buffer;
+    uint32_t length;
+    uint32_t bytes_done;
+    bool_t pending; /* needs to be sent on the next pipeline run */
+    bool_t sent;
+    bool_t eof;
+    enum stable_how4 committed;
+    nfs41_write_verf verf;
+    int status;
+};
+
+struct rw_pipeline;
+typedef void (*rw_chunk_fn)(
+    IN struct rw_pipeline *pipeline,
+    IN stateid_arg *stateid,
+    IN OUT struct rw_chunk *chunk);
+
+/* sends chunks alongside the caller, from the io pool */
+struct rw_pipeline_helper {
+    io_pool_work work;
+    struct rw_pipeline *pipeline;
+};
+
+struct rw_pipeline {
+    nfs41_session *session;
+    nfs41_path_fh *file;
+    const stateid_arg *stateid;
+    rw_chunk_fn send;
+    enum stable_how4 stable; /* for writes */
+    nfs41_file_info *info; /* for single FILE_SYNC4 writes */
+    struct rw_chunk *chunks;
+    LONG count;
+    LONG inflight; /* most chunks to send at once */
+    volatile LONG next; /* index of the next chunk to send */
+    volatile LONG stop; /* lowest chunk that saw an error or eof */
+    struct rw_pipeline_helper helpers[MAX_CHUNKS_IN_FLIGHT - 1];
+    LONG busy; /* helpers queued or running */
+    SRWLOCK lock; /* for busy */
+    CONDITION_VARIABLE cond;
+};
+
+static int rw_pipeline_alloc(
+    IN struct rw_pipeline *pipeline,
+    IN nfs41_open_state *state,
+    IN const stateid_arg *stateid,
+    IN rw_chunk_fn send,
+    IN LONG count)
+{
+    ZeroMemory(pipeline, sizeof(struct rw_pipeline));
+    pipeline->session = state->session;
+    pipeline->file = &state->file;
+    pipeline->stateid = stateid;
+    pipeline->send = send;
+    pipeline->count = count;
+    pipeline->inflight = MAX_CHUNKS_IN_FLIGHT;
+    pipeline->chunks = calloc(max(count, 1), sizeof(struct rw_chunk));
+    if (pipeline->chunks == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    return NO_ERROR;
+}
+
+static int rw_pipeline_init(
+    IN struct rw_pipeline *pipeline,
+    IN nfs41_upcall *upcall,
+    IN const stateid_arg *stateid,
+    IN rw_chunk_fn send,
+    IN uint32_t chunk_size,
+    IN uint32_t inflight)
+{
+    readwrite_upcall_args *args = &upcall->args.rw;
+    LONG i;
+    int status;
+
+    status = rw_pipeline_alloc(pipeline, upcall->state_ref, stateid, send,
+        (args->len + chunk_size - 1) / chunk_size);
+    if (status)
+        return status;
+
+    pipeline->inflight = min(inflight, MAX_CHUNKS_IN_FLIGHT);
+    for (i = 0; i < pipeline->count; i++) {
+        struct rw_chunk *chunk = &pipeline->chunks[i];
+        const ULONG reloffset = i * chunk_size;
+        chunk->offset = args->offset + reloffset;
+        chunk->buffer = args->buffer + reloffset;
+        chunk->length = min(args->len - reloffset, chunk_size);
+    }
+    return NO_ERROR;
+}
+
+static void rw_pipeline_stop(
+    IN struct rw_pipeline *pipeline,
+    IN LONG index)
+{
+    LONG stop = pipeline->stop;
+    while (index < stop) {
+        const LONG prev = InterlockedCompareExchange(
+            &pipeline->stop, index, stop);
+        if (prev == stop)
+            break;
+        stop = prev;
+    }
+}
+
+static void rw_pipeline_send(
+    IN struct rw_pipeline *pipeline)
+{
+    stateid_arg stateid;
+    LONG i;
+
+    /* recovery may update the stateid, so each thread gets a copy */
+    memcpy(&stateid, pipeline->stateid, sizeof(stateid));
+
+    while ((i = InterlockedIncrement(&pipeline->next) - 1) < pipeline->count) {
+        struct rw_chunk *chunk = &pipeline->chunks[i];
+
+        /* nothing past an error or eof can be returned */
+        if (i > pipeline->stop)
+            break;
+        if (!chunk->pending)
+            continue;
+
+        chunk->pending = FALSE;
+        chunk->sent = TRUE;
+        chunk->status = NO_ERROR;
+        chunk->bytes_done = 0;
+        pipeline->send(pipeline, &stateid, chunk);
+        if (chunk->status || chunk->eof)
+            rw_pipeline_stop(pipeline, i);
+    }
+}
+
+static void rw_pipeline_helper_done(
+    IN struct rw_pipeline *pipeline)
+{
+    AcquireSRWLockExclusive(&pipeline->lock);
+    if (--pipeline->busy == 0)
+        WakeConditionVariable(&pipeline->cond);
+    ReleaseSRWLockExclusive(&pipeline->lock);
+}
+
+static void rw_pipeline_helper(
+    IN io_pool_work *work)
+{
+    struct rw_pipeline *pipeline =
+        list_container(work, struct rw_pipeline_helper, work)->pipeline;
+
+    rw_pipeline_send(pipeline);
+    rw_pipeline_helper_done(pipeline);
+}
+
+/* send all pending chunks concurrently, with at most one sender per
+ * free session slot; the calling thread sends chunks too, and helpers
+ * come from the io pool */
+static void rw_pipeline_run(
+    IN struct rw_pipeline *pipeline)
+{
+    nfs41_slot_table *table = &pipeline->session->table;
+    LONG i, count = 0;
+
+    for (i = 0; i < pipeline->count; i++)
+        if (pipeline->chunks[i].pending)
+            count++;
+
+    if (count > table->max_slots - table->num_used)
+        count = table->max_slots - table->num_used;
+    if (count > pipeline->inflight)
+        count = pipeline->inflight;
+
+    pipeline->next = 0;
+    pipeline->stop = pipeline->count;
+
+    count = max(count - 1, 0);
+    InitializeSRWLock(&pipeline->lock);
+    InitializeConditionVariable(&pipeline->cond);
+    pipeline->busy = count;
+    for (i = 0; i < count; i++) {
+        pipeline->helpers[i].pipeline = pipeline;
+        io_pool_queue(&pipeline->helpers[i].work,
+            rw_pipeline_helper, IO_POOL_MAX_WORKERS);
+    }
+
+    rw_pipeline_send(pipeline);
+
+    /* the chunks are all spoken for; take back helpers that haven't
+     * started, and wait for the rest */
+    for (i = 0; i < count; i++)
+        if (io_pool_cancel(&pipeline->helpers[i].work))
+            rw_pipeline_helper_done(pipeline);
+
+    AcquireSRWLockExclusive(&pipeline->lock);
+    while (pipeline->busy)
+        SleepConditionVariableSRW(&pipeline->cond,
+            &pipeline->lock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&pipeline->lock);
+}
+
+static void rw_pipeline_free(
+    IN struct rw_pipeline *pipeline)
+{
+    free(pipeline->chunks);
+}
+
+
 /* NFS41_READ */
+static void read_chunk(
+    IN struct rw_pipeline *pipeline,
+    IN stateid_arg *stateid,
+    IN OUT struct rw_chunk *chunk)
+{
+    /* fill in the rest of a short read before moving on */
+    while (chunk->bytes_done < chunk->length) {
+        uint32_t bytes_read = 0;
+        chunk->status = nfs41_read(pipeline->session, pipeline->file,
+            stateid, chunk->offset + chunk->bytes_done,
+            chunk->length - chunk->bytes_done,
+            chunk->buffer + chunk->bytes_done, &bytes_read, &chunk->eof);
+        if (chunk->status)
+            break;
+        chunk->bytes_done += bytes_read;
+        if (chunk->eof)
+            break;
+    }
+}
+
 static int read_from_mds(
     IN nfs41_upcall *upcall,
     IN stateid_arg *stateid)
@@ -63,45 +297,61 @@ static int read_from_mds(
     nfs41_session *session = upcall->state_ref->session;
     nfs41_path_fh *file = &upcall->state_ref->file;
     readwrite_upcall_args *args = &upcall->args.rw;
-    int status = 0;
-    bool_t eof;
-    unsigned char *p = args->buffer;
-    ULONG to_rcv = args->len, reloffset = 0, len = 0;
-    const uint32_t maxreadsize = max_read_size(session, &file->fh);
+    struct rw_pipeline pipeline;
+    int status;
+    ULONG len = 0;
+    LONG i;
+    uint32_t readsize, inflight;
+
+    /* chunk size and concurrency adapt to the session's measured
+     * latency and throughput, within the negotiated maximum */
+    nfs41_session_io_tuning(session, FALSE, max_read_size(session, &file->fh),
+        args->len, &readsize, &inflight);
 
-    if (to_rcv > maxreadsize) {
-        DPRINTF(1, ("handle_nfs41_read: reading %d in chunks of %d\n",
-            to_rcv, maxreadsize));
+    if (args->len > readsize) {
+        DPRINTF(1, ("handle_nfs41_read: reading %d in chunks of %d, "
+            "%d at a time\n", args->len, readsize, inflight));
     }
 
-    while(to_rcv > 0) {
-        uint32_t bytes_read = 0, chunk = min(to_rcv, maxreadsize);
+    status = rw_pipeline_init(&pipeline, upcall, stateid,
+        read_chunk, readsize, inflight);
+    if (status)
+        goto out;
 
-        status = nfs41_read(session, file, stateid, args->offset + reloffset, chunk, 
-                p, &bytes_read, &eof);
-        if (status == NFS4ERR_OPENMODE && !len) {
-            stateid->type = STATEID_SPECIAL;
-            stateid4_cpy(&stateid->stateid, &special_read_stateid);
-            continue;
-        } else if (status && !len) {
-            status = nfs_to_windows_error(status, ERROR_NET_WRITE_FAULT);
-            goto out;
-        }
+retry_read:
+    for (i = 0; i < pipeline.count; i++)
+        pipeline.chunks[i].pending = TRUE;
+
+    rw_pipeline_run(&pipeline);
 
-        p += bytes_read;
-        to_rcv -= bytes_read;
-        len += bytes_read;
-        args->offset += bytes_read;
-        if (status) {
-            status = NO_ERROR;
+    /* out_len is the contiguous prefix of data that was read */
+    for (i = 0; i < pipeline.count; i++) {
+        struct rw_chunk *chunk = &pipeline.chunks[i];
+        if (!chunk->sent)
+            break;
+
+        len += chunk->bytes_done;
+        if (chunk->status) {
+            if (chunk->status == NFS4ERR_OPENMODE && !len &&
+                    stateid->type != STATEID_SPECIAL) {
+                stateid->type = STATEID_SPECIAL;
+                stateid4_cpy(&stateid->stateid, &special_read_stateid);
+                goto retry_read;
+            }
+            if (!len)
+                status = nfs_to_windows_error(chunk->status,
+                    ERROR_NET_WRITE_FAULT);
             break;
         }
-        if (eof) {
+        if (chunk->eof) {
             if (!len)
                 status = ERROR_HANDLE_EOF;
             break;
         }
     }
+    args->offset += len;
+
+    rw_pipeline_free(&pipeline);
 out:
     args->out_len = len;
     return status;
@@ -137,12 +387,293 @@ out:
     return status;
 }
 
+/* read-ahead: with nfsd --readahead, sequential NFS41_READs on an open
+ * state prefetch the following pages in the background, with a window
+ * that doubles on each sequential read up to READ_AHEAD_MAX_PAGES */
+typedef struct __read_ahead_page {
+    struct list_entry entry;
+    io_pool_work work;
+    nfs41_open_state *state;
+    uint64_t offset;
+    uint64_t change; /* change attribute when the READ was sent */
+    uint32_t length;
+    uint32_t bytes_read;
+    int status;
+    bool_t eof;
+    bool_t ready;
+    bool_t orphan; /* invalidated while pending; freed by its work */
+    unsigned char *buffer;
+} read_ahead_page;
+
+#define page_entry(pos) list_container(pos, read_ahead_page, entry)
+
+/* total bytes allocated for read-ahead over all open states */
+static volatile LONGLONG read_ahead_bytes = 0;
+
+static void read_ahead_page_free(
+    IN read_ahead_page *page)
+{
+    InterlockedAdd64(&read_ahead_bytes, -(LONGLONG)page->length);
+    free(page->buffer);
+    free(page);
+}
+
+/* called with read_ahead.lock held exclusive */
+static void read_ahead_invalidate_locked(
+    IN nfs41_open_state *state)
+{
+    struct list_entry *entry, *tmp;
+
+    list_for_each_tmp(entry, tmp, &state->read_ahead.pages) {
+        read_ahead_page *page = page_entry(entry);
+        list_remove(&page->entry);
+        if (page->ready)
+            read_ahead_page_free(page);
+        else
+            page->orphan = TRUE;
+    }
+    state->read_ahead.window = 0;
+    state->read_ahead.end = 0;
+    state->read_ahead.eof = NFS4_UINT64_MAX;
+}
+
+void nfs41_read_ahead_invalidate(
+    IN nfs41_open_state *state)
+{
+    if (state->type != NF4REG)
+        return;
+
+    AcquireSRWLockExclusive(&state->read_ahead.lock);
+    read_ahead_invalidate_locked(state);
+    ReleaseSRWLockExclusive(&state->read_ahead.lock);
+}
+
+void nfs41_read_ahead_free(
+    IN nfs41_open_state *state)
+{
+    /* every pending page holds a reference on the open state */
+    read_ahead_invalidate_locked(state);
+}
+
+static void read_ahead_work(
+    IN io_pool_work *work)
+{
+    read_ahead_page *page = list_container(work, read_ahead_page, work);
+    nfs41_open_state *state = page->state;
+    stateid_arg stateid;
+    bool_t eof = FALSE, orphan;
+    int status = NO_ERROR;
+
+    nfs41_open_stateid_arg(state, &stateid);
+
+    /* nobody looks at the page until it's ready */
+    while (page->bytes_read < page->length && !eof) {
+        uint32_t bytes_read = 0;
+        status = nfs41_read(state->session, &state->file, &stateid,
+            page->offset + page->bytes_read, page->length - page->bytes_read,
+            page->buffer + page->bytes_read, &bytes_read, &eof);
+        if (status)
+            break;
+        page->bytes_read += bytes_read;
+    }
+
+    AcquireSRWLockExclusive(&state->read_ahead.lock);
+    page->status = status;
+    page->eof = eof;
+    page->ready = TRUE;
+    orphan = page->orphan;
+    if (!orphan && eof)
+        state->read_ahead.eof = page->offset + page->bytes_read;
+    WakeAllConditionVariable(&state->read_ahead.cond);
+    ReleaseSRWLockExclusive(&state->read_ahead.lock);
+
+    if (orphan)
+        read_ahead_page_free(page);
+    nfs41_open_state_deref(state);
+}
+
+/* copy whatever prefix of the range is covered by read-ahead, waiting
+ * on any pages still in flight; returns the number of bytes copied */
+static ULONG read_ahead_copy(
+    IN nfs41_open_state *state,
+    IN uint64_t offset,
+    IN ULONG length,
+    OUT unsigned char *buffer,
+    OUT bool_t *eof_out)
+{
+    nfs41_file_info info = { 0 };
+    struct list_entry *entry;
+    read_ahead_page *page;
+    ULONG copied = 0;
+
+    *eof_out = FALSE;
+
+    if (state->type != NF4REG || list_empty(&state->read_ahead.pages))
+        return 0;
+
+    /* pages are only good for the change attribute they were read at */
+    if (nfs41_attr_cache_lookup(session_name_cache(state->session),
+            state->file.fh.fileid, &info))
+        info.change = 0;
+
+    AcquireSRWLockExclusive(&state->read_ahead.lock);
+    while (copied < length) {
+        const uint64_t pos = offset + copied;
+        uint32_t n;
+
+        page = NULL;
+        list_for_each(entry, &state->read_ahead.pages) {
+            read_ahead_page *p = page_entry(entry);
+            if (p->offset <= pos && pos < p->offset + p->length) {
+                page = p;
+                break;
+            }
+        }
+        if (page == NULL)
+            break;
+
+        if (!page->ready) {
+            /* read it ourselves if no worker has picked it up yet */
+            if (io_pool_cancel(&page->work)) {
+                ReleaseSRWLockExclusive(&state->read_ahead.lock);
+                read_ahead_work(&page->work);
+                AcquireSRWLockExclusive(&state->read_ahead.lock);
+            } else {
+                SleepConditionVariableSRW(&state->read_ahead.cond,
+                    &state->read_ahead.lock, INFINITE, 0);
+            }
+            /* the page may have been invalidated, so search again */
+            continue;
+        }
+
+        if (page->status || page->change != info.change) {
+            DPRINTF(1, ("read_ahead_copy: discarding read-ahead for '%s'\n",
+                state->path.path));
+            read_ahead_invalidate_locked(state);
+            break;
+        }
+
+        if (pos >= page->offset + page->bytes_read) {
+            *eof_out = page->eof;
+            break;
+        }
+
+        n = (uint32_t)min(page->offset + page->bytes_read - pos,
+            length - copied);
+        memcpy(buffer + copied, page->buffer + (pos - page->offset), n);
+        copied += n;
+
+        /* sequential readers won't come back for this page */
+        if (pos + n == page->offset + page->bytes_read) {
+            *eof_out = page->eof;
+            list_remove(&page->entry);
+            read_ahead_page_free(page);
+            if (*eof_out)
+                break;
+        }
+    }
+    ReleaseSRWLockExclusive(&state->read_ahead.lock);
+
+    if (copied)
+        DPRINTF(2, ("read_ahead_copy: copied %lu of %lu bytes at offset "
+            "%llu\n", copied, length, offset));
+    return copied;
+}
+
+/* track sequential access, and send READs ahead of the reader */
+static void read_ahead_update(
+    IN nfs41_open_state *state,
+    IN uint64_t offset,
+    IN ULONG length)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    nfs41_file_info info = { 0 };
+    const uint32_t page_size = max_read_size(state->session, &state->file.fh);
+    uint64_t start, end;
+
+    if (nfs41_dg.read_ahead_max == 0 || state->type != NF4REG)
+        return;
+
+    AcquireSRWLockExclusive(&state->read_ahead.lock);
+
+    if (offset != state->read_ahead.next) {
+        /* random access; throw away anything we read ahead */
+        read_ahead_invalidate_locked(state);
+        state->read_ahead.next = offset + length;
+        goto out_unlock;
+    }
+    state->read_ahead.next = offset + length;
+
+    if (state->read_ahead.window == 0)
+        state->read_ahead.window = 1;
+    else if (state->read_ahead.window < READ_AHEAD_MAX_PAGES)
+        state->read_ahead.window *= 2;
+
+    if (nfs41_attr_cache_lookup(session_name_cache(state->session),
+            state->file.fh.fileid, &info) || info.change == 0)
+        goto out_unlock;
+
+    start = max(state->read_ahead.end, offset + length);
+    end = min(offset + length + (uint64_t)state->read_ahead.window * page_size,
+        state->read_ahead.eof);
+
+    while (start < end) {
+        read_ahead_page *page;
+
+        if ((uint64_t)read_ahead_bytes + page_size > nfs41_dg.read_ahead_max)
+            break;
+
+        page = calloc(1, sizeof(read_ahead_page));
+        if (page == NULL)
+            break;
+        page->buffer = malloc(page_size);
+        if (page->buffer == NULL) {
+            free(page);
+            break;
+        }
+        page->state = state;
+        page->offset = start;
+        page->length = page_size;
+        page->change = info.change;
+        InterlockedAdd64(&read_ahead_bytes, page->length);
+
+        nfs41_open_state_ref(state); /* released by read_ahead_work() */
+        list_add_tail(&state->read_ahead.pages, &page->entry);
+        io_pool_queue(&page->work, read_ahead_work, IO_POOL_MAX_WORKERS);
+
+        start += page_size;
+        state->read_ahead.end = start;
+    }
+out_unlock:
+    ReleaseSRWLockExclusive(&state->read_ahead.lock);
+}
+
 static int handle_read(void *daemon_context, nfs41_upcall *upcall)
 {
     readwrite_upcall_args *args = &upcall->args.rw;
     stateid_arg stateid;
-    ULONG pnfs_bytes_read = 0;
-    int status = NO_ERROR;
+    const uint64_t offset = args->offset;
+    const ULONG length = args->len;
+    ULONG pnfs_bytes_read = 0, cached_bytes_read;
+    bool_t eof;
+    int status;
+
+    /* buffered writes, through any open of the file, must reach the
+     * server before we read */
+    status = nfs41_write_behind_flush_file(upcall->state_ref, TRUE);
+    if (status)
+        goto out;
+
+    /* serve what we can from read-ahead, and read the rest */
+    cached_bytes_read = read_ahead_copy(upcall->state_ref,
+        offset, length, args->buffer, &eof);
+    if (cached_bytes_read == length || eof) {
+        status = cached_bytes_read ? NO_ERROR : ERROR_HANDLE_EOF;
+        goto out_read_ahead;
+    }
+    args->offset += cached_bytes_read;
+    args->buffer += cached_bytes_read;
+    args->len -= cached_bytes_read;
 
     nfs41_open_stateid_arg(upcall->state_ref, &stateid);
 
@@ -150,7 +681,7 @@ static int handle_read(void *daemon_context, nfs41_upcall *upcall)
     status = read_from_pnfs(upcall, &stateid);
 
     if (status == NO_ERROR || status == ERROR_HANDLE_EOF)
-        goto out;
+        goto out_read_ahead;
 
     if (args->out_len) {
         pnfs_bytes_read = args->out_len;
@@ -165,12 +696,74 @@ static int handle_read(void *daemon_context, nfs41_upcall *upcall)
     status = read_from_mds(upcall, &stateid);
 
     args->out_len += pnfs_bytes_read;
+out_read_ahead:
+    if (cached_bytes_read) {
+        /* report a short read rather than an error */
+        args->out_len += cached_bytes_read;
+        status = NO_ERROR;
+    }
+    read_ahead_update(upcall->state_ref, offset, length);
 out:
     return status;
 }
 
 
 /* NFS41_WRITE */
+static void write_chunk(
+    IN struct rw_pipeline *pipeline,
+    IN stateid_arg *stateid,
+    IN OUT struct rw_chunk *chunk)
+{
+    /* on write verifier mismatch, retry N times before failing */
+    uint32_t retries = MAX_WRITE_RETRIES;
+
+    chunk->committed = FILE_SYNC4;
+    while (chunk->bytes_done < chunk->length) {
+        uint32_t bytes_written = 0;
+        chunk->status = nfs41_write(pipeline->session, pipeline->file,
+            stateid, chunk->buffer + chunk->bytes_done,
+            chunk->length - chunk->bytes_done,
+            chunk->offset + chunk->bytes_done, pipeline->stable,
+            &bytes_written, &chunk->verf, pipeline->info);
+        if (chunk->status)
+            break;
+        chunk->bytes_done += bytes_written;
+
+        /* a short write must finish under the same verifier */
+        if (!verify_write(&chunk->verf, &chunk->committed)) {
+            if (retries-- == 0) {
+                chunk->status = NFS4ERR_IO;
+                break;
+            }
+            chunk->committed = FILE_SYNC4;
+            chunk->bytes_done = 0;
+        }
+    }
+}
+
+/* mark any chunks whose writes were lost for resending, based on the
+ * verifier returned by COMMIT; returns TRUE if there are any */
+static bool_t write_pipeline_verify(
+    IN struct rw_pipeline *pipeline,
+    IN LONG count,
+    IN nfs41_write_verf *verf)
+{
+    bool_t lost = FALSE;
+    LONG i;
+
+    for (i = 0; i < count; i++) {
+        struct rw_chunk *chunk = &pipeline->chunks[i];
+        if (chunk->committed != UNSTABLE4)
+            continue;
+        memcpy(verf->expected, chunk->verf.expected, NFS4_VERIFIER_SIZE);
+        if (!verify_commit(verf)) {
+            chunk->pending = TRUE;
+            lost = TRUE;
+        }
+    }
+    return lost;
+}
+
 static int write_to_mds(
     IN nfs41_upcall *upcall,
     IN stateid_arg *stateid)
@@ -178,73 +771,90 @@ static int write_to_mds(
     nfs41_session *session = upcall->state_ref->session;
     nfs41_path_fh *file = &upcall->state_ref->file;
     readwrite_upcall_args *args = &upcall->args.rw;
+    struct rw_pipeline pipeline;
     nfs41_write_verf verf;
-    enum stable_how4 stable, committed;
-    unsigned char *p;
-    const uint32_t maxwritesize = max_write_size(session, &file->fh);
-    uint32_t to_send, reloffset, len;
+    enum stable_how4 committed;
+    uint32_t writesize, inflight;
+    uint32_t len, count;
+    LONG i;
     int status = 0;
     /* on write verifier mismatch, retry N times before failing */
     uint32_t retries = MAX_WRITE_RETRIES;
     nfs41_file_info info = { 0 };
 
-retry_write:
-    p = args->buffer;
-    to_send = args->len;
-    reloffset = 0;
-    len = 0;
-    stable = to_send <= maxwritesize ? FILE_SYNC4 : UNSTABLE4;
-    committed = FILE_SYNC4;
-
-    if (to_send > maxwritesize) {
-        DPRINTF(1, ("handle_nfs41_write: writing %d in chunks of %d\n",
-            to_send, maxwritesize));
+    nfs41_session_io_tuning(session, TRUE, max_write_size(session, &file->fh),
+        args->len, &writesize, &inflight);
+
+    if (args->len > writesize) {
+        DPRINTF(1, ("handle_nfs41_write: writing %d in chunks of %d, "
+            "%d at a time\n", args->len, writesize, inflight));
     }
 
-    while(to_send > 0) {
-        uint32_t bytes_written = 0, chunk = min(to_send, maxwritesize);
+    status = rw_pipeline_init(&pipeline, upcall, stateid,
+        write_chunk, writesize, inflight);
+    if (status) {
+        args->out_len = 0;
+        return status;
+    }
+    pipeline.stable = pipeline.count <= 1 ? FILE_SYNC4 : UNSTABLE4;
+    if (pipeline.stable == FILE_SYNC4)
+        pipeline.info = &info;
 
-        status = nfs41_write(session, file, stateid, p, chunk,
-            args->offset + reloffset, stable, &bytes_written, &verf, &info);
-        if (status && !len)
-            goto out;
-        p += bytes_written;
-        to_send -= bytes_written;
-        len += bytes_written;
-        reloffset += bytes_written;
-        if (status) {
-            status = 0;
+    for (i = 0; i < pipeline.count; i++)
+        pipeline.chunks[i].pending = TRUE;
+
+retry_write:
+    rw_pipeline_run(&pipeline);
+
+    /* out_len is the contiguous prefix of data that was written */
+    len = 0;
+    committed = FILE_SYNC4;
+    for (i = 0; i < pipeline.count; i++) {
+        struct rw_chunk *chunk = &pipeline.chunks[i];
+        if (!chunk->sent)
+            break;
+
+        len += chunk->bytes_done;
+        if (chunk->bytes_done)
+            committed = min(committed, chunk->committed);
+        if (chunk->status) {
+            status = chunk->status;
+            i++;
             break;
         }
-        if (!verify_write(&verf, &committed)) {
-            if (retries--) goto retry_write;
-            goto out_verify_failed;
-        }
     }
+    count = i; /* chunks covered by len */
+    if (status) {
+        if (!len)
+            goto out;
+        status = 0; /* report the partial write */
+    }
+
     if (committed != FILE_SYNC4) {
         DPRINTF(1, ("sending COMMIT for offset=%d and len=%d\n", args->offset, len));
         status = nfs41_commit(session, file, args->offset, len, 1, &verf, &info);
         if (status)
             goto out;
 
-        if (!verify_commit(&verf)) {
+        /* resend only the chunks whose writes were lost */
+        if (write_pipeline_verify(&pipeline, (LONG)count, &verf)) {
             if (retries--) goto retry_write;
             goto out_verify_failed;
         }
-    } else if (stable == UNSTABLE4) {
-		nfs41_file_info info;
-        bitmap4 attr_request; 
+    } else if (pipeline.stable == UNSTABLE4) {
+        bitmap4 attr_request;
         nfs41_superblock_getattr_mask(file->fh.superblock, &attr_request);
-		status = nfs41_getattr(session, file, &attr_request, &info);
-		if (status)
-			goto out;
-	}
+        status = nfs41_getattr(session, file, &attr_request, &info);
+        if (status)
+            goto out;
+    }
 
     EASSERT((info.attrmask.count > 0) &&
         (info.attrmask.arr[0] & FATTR4_WORD0_CHANGE));
     args->ctime = info.change;
 
 out:
+    rw_pipeline_free(&pipeline);
     args->out_len = len;
     return nfs_to_windows_error(status, ERROR_NET_WRITE_FAULT);
 
@@ -254,6 +864,562 @@ out_verify_failed:
     goto out;
 }
 
+/* write-behind: with nfsd --writebehind, small writes are buffered per
+ * open state and merged into non-overlapping ranges of up to wsize, then
+ * sent as UNSTABLE writes with a single COMMIT on flush.
+ *
+ * a write delegation guarantees that no other client can see the file
+ * until it's recalled, so under one the writes are buffered even without
+ * --writebehind, and truncation and the size and mtime they imply are
+ * kept in the attribute cache (which also answers CB_GETATTR).  the data
+ * reaches the server on recall or return (delegation_flush_writes()), on
+ * close, or when the memory cap is hit */
+typedef struct __write_behind_range {
+    struct list_entry entry;
+    uint64_t offset;
+    uint32_t length;
+    unsigned char *buffer;
+} write_behind_range;
+
+#define range_entry(pos) list_container(pos, write_behind_range, entry)
+
+/* total bytes buffered over all open states */
+static volatile LONGLONG write_behind_bytes = 0;
+
+static void write_behind_range_free(
+    IN nfs41_open_state *state,
+    IN write_behind_range *range)
+{
+    list_remove(&range->entry);
+    state->write_behind.bytes -= range->length;
+    InterlockedAdd64(&write_behind_bytes, -(LONGLONG)range->length);
+    free(range->buffer);
+    free(range);
+}
+
+/* called with write_behind.lock held, so a recall that marks the
+ * delegation DELEGATION_RETURNING after this check can't flush the open
+ * until the caller is done buffering */
+static bool_t write_behind_delegated(
+    IN nfs41_open_state *state)
+{
+    nfs41_delegation_state *deleg;
+    bool_t delegated = FALSE;
+
+    AcquireSRWLockShared(&state->lock);
+    deleg = state->delegation.state;
+    if (deleg) {
+        AcquireSRWLockShared(&deleg->lock);
+        delegated = deleg->status == DELEGATION_GRANTED &&
+            deleg->state.type == OPEN_DELEGATE_WRITE;
+        ReleaseSRWLockShared(&deleg->lock);
+    }
+    ReleaseSRWLockShared(&state->lock);
+    return delegated;
+}
+
+/* update the cached size, change and mtime as the server would on WRITE
+ * or SETATTR; called with write_behind.lock held exclusive */
+static int write_behind_update_attrs(
+    IN nfs41_open_state *state,
+    IN uint64_t size,
+    IN bool_t truncate)
+{
+    nfs41_file_info info = { 0 };
+    int status;
+
+    status = nfs41_attr_cache_lookup(session_name_cache(state->session),
+        state->file.fh.fileid, &info);
+    if (status)
+        return status;
+
+    if (!truncate)
+        size = max(size, info.size);
+    ZeroMemory(&info.attrmask, sizeof(info.attrmask));
+    info.attrmask.count = 2;
+    info.attrmask.arr[0] = FATTR4_WORD0_SIZE | FATTR4_WORD0_CHANGE;
+    info.attrmask.arr[1] = FATTR4_WORD1_TIME_MODIFY;
+    info.size = size;
+    /* the change attribute must move for CB_GETATTR, see rfc5661 10.4.3 */
+    info.change = state->write_behind.change =
+        max(info.change, state->write_behind.change) + 1;
+    get_nfs_time(&info.time_modify);
+
+    return nfs41_attr_cache_update(session_name_cache(state->session),
+        state->file.fh.fileid, &info);
+}
+
+/* drop or trim buffered writes past a new end of file */
+static void write_behind_truncate(
+    IN nfs41_open_state *state,
+    IN uint64_t size)
+{
+    struct list_entry *entry, *tmp;
+
+    list_for_each_tmp(entry, tmp, &state->write_behind.ranges) {
+        write_behind_range *range = range_entry(entry);
+        if (range->offset >= size) {
+            write_behind_range_free(state, range);
+        } else if (range->offset + range->length > size) {
+            const uint32_t trim = (uint32_t)
+                (range->offset + range->length - size);
+            range->length -= trim;
+            state->write_behind.bytes -= trim;
+            InterlockedAdd64(&write_behind_bytes, -(LONGLONG)trim);
+        }
+    }
+}
+
+/* send a size set locally under a write delegation.  the buffered ranges
+ * were trimmed to it, so it goes out before them */
+static int write_behind_flush_size(
+    IN nfs41_open_state *state)
+{
+    nfs41_file_info info = { 0 };
+    stateid_arg stateid;
+    int status;
+
+    nfs41_open_stateid_arg(state, &stateid);
+
+    info.size = state->write_behind.size;
+    info.attrmask.count = 1;
+    info.attrmask.arr[0] = FATTR4_WORD0_SIZE;
+
+    DPRINTF(1, ("write_behind_flush: setting size=%llu\n", info.size));
+
+    status = nfs41_setattr(state->session, &state->file, &stateid, &info);
+    if (status)
+        return status;
+
+    state->write_behind.resize = FALSE;
+
+    /* update the last offset for LAYOUTCOMMIT */
+    AcquireSRWLockExclusive(&state->lock);
+    state->pnfs_last_offset = info.size ? info.size - 1 : 0;
+    ReleaseSRWLockExclusive(&state->lock);
+
+    if (info.attrmask.count > 0 &&
+        (info.attrmask.arr[0] & FATTR4_WORD0_CHANGE))
+        state->write_behind.change = info.change;
+    return NO_ERROR;
+}
+
+/* called with write_behind.lock held exclusive */
+static int write_behind_flush_locked(
+    IN nfs41_open_state *state)
+{
+    struct rw_pipeline pipeline;
+    struct list_entry *entry, *tmp;
+    stateid_arg stateid;
+    nfs41_write_verf verf;
+    nfs41_file_info info = { 0 };
+    enum stable_how4 committed;
+    uint64_t first, last;
+    /* on write verifier mismatch, retry N times before failing */
+    uint32_t retries = MAX_WRITE_RETRIES;
+    LONG i, count = 0;
+    int status;
+
+    if (state->write_behind.resize) {
+        status = write_behind_flush_size(state);
+        if (status)
+            return status;
+    }
+
+    list_for_each(entry, &state->write_behind.ranges)
+        count++;
+    if (count == 0)
+        return NO_ERROR;
+
+    nfs41_open_stateid_arg(state, &stateid);
+
+    status = rw_pipeline_alloc(&pipeline, state, &stateid, write_chunk, count);
+    if (status)
+        return status;
+    pipeline.stable = UNSTABLE4;
+
+    i = 0;
+    list_for_each(entry, &state->write_behind.ranges) {
+        write_behind_range *range = range_entry(entry);
+        struct rw_chunk *chunk = &pipeline.chunks[i++];
+        chunk->offset = range->offset;
+        chunk->buffer = range->buffer;
+        chunk->length = range->length;
+        chunk->pending = TRUE;
+    }
+    first = pipeline.chunks[0].offset;
+    last = pipeline.chunks[count-1].offset + pipeline.chunks[count-1].length;
+
+    DPRINTF(1, ("write_behind_flush: writing %d ranges for offset=%llu "
+        "len=%llu\n", count, first, last - first));
+
+retry_write:
+    rw_pipeline_run(&pipeline);
+
+    committed = FILE_SYNC4;
+    for (i = 0; i < count; i++) {
+        struct rw_chunk *chunk = &pipeline.chunks[i];
+        if (chunk->status) {
+            status = chunk->status;
+            goto out;
+        }
+        committed = min(committed, chunk->committed);
+    }
+
+    if (committed != FILE_SYNC4) {
+        /* a count of 0 commits everything from the offset on */
+        status = nfs41_commit(state->session, &state->file, first,
+            last - first > UINT32_MAX ? 0 : (uint32_t)(last - first),
+            1, &verf, &info);
+        if (status)
+            goto out;
+
+        if (write_pipeline_verify(&pipeline, count, &verf)) {
+            if (retries--) goto retry_write;
+            status = NFS4ERR_IO;
+            goto out;
+        }
+    } else {
+        bitmap4 attr_request;
+        nfs41_superblock_getattr_mask(state->file.fh.superblock, &attr_request);
+        status = nfs41_getattr(state->session, &state->file,
+            &attr_request, &info);
+        if (status)
+            goto out;
+    }
+
+    if (info.attrmask.count > 0 &&
+        (info.attrmask.arr[0] & FATTR4_WORD0_CHANGE))
+        state->write_behind.change = info.change;
+
+    list_for_each_tmp(entry, tmp, &state->write_behind.ranges)
+        write_behind_range_free(state, range_entry(entry));
+out:
+    rw_pipeline_free(&pipeline);
+    return status;
+}
+
+int nfs41_write_behind_flush(
+    IN nfs41_open_state *state)
+{
+    int status;
+
+    if (state->type != NF4REG)
+        return NO_ERROR;
+
+    AcquireSRWLockExclusive(&state->write_behind.lock);
+    status = write_behind_flush_locked(state);
+    ReleaseSRWLockExclusive(&state->write_behind.lock);
+
+    if (status) {
+        eprintf("nfs41_write_behind_flush('%s') failed with '%s'\n",
+            state->path.path, nfs_error_string(status));
+        status = nfs_to_windows_error(status, ERROR_NET_WRITE_FAULT);
+    }
+    return status;
+}
+
+struct write_behind_file {
+    const nfs41_superblock *superblock;
+    uint64_t fileid;
+    bool_t delegated;
+};
+
+static int write_behind_file_cmp(const struct list_entry *entry, const void *value)
+{
+    const struct write_behind_file *file = (const struct write_behind_file*)value;
+    nfs41_open_state *open = list_container(entry,
+        nfs41_open_state, fileid_entry);
+
+    if (open->type != NF4REG || open->file.fh.fileid != file->fileid ||
+        open->file.fh.superblock != file->superblock)
+        return -1;
+    if (list_empty(&open->write_behind.ranges) && !open->write_behind.resize)
+        return -1;
+    if (!file->delegated && write_behind_delegated(open))
+        return -1;
+    return 0;
+}
+
+int nfs41_write_behind_flush_file(
+    IN nfs41_open_state *state,
+    IN bool_t delegated)
+{
+    struct client_state *client_state = &state->session->client->state;
+    struct write_behind_file file;
+    struct state_bucket *bucket;
+    struct list_entry *entry;
+    nfs41_open_state *open;
+    int status = NO_ERROR;
+
+    if (state->type != NF4REG)
+        return NO_ERROR;
+
+    file.superblock = state->file.fh.superblock;
+    file.fileid = state->file.fh.fileid;
+    file.delegated = delegated;
+
+    /* other opens of the file may hold writes that this one must see */
+    bucket = state_index_bucket(&client_state->opens_by_fileid,
+        fileid_hash(file.fileid));
+    for (;;) {
+        AcquireSRWLockShared(&bucket->lock);
+        entry = list_search(&bucket->head, &file, write_behind_file_cmp);
+        open = entry ? list_container(entry,
+            nfs41_open_state, fileid_entry) : NULL;
+        if (open)
+            nfs41_open_state_ref(open);
+        ReleaseSRWLockShared(&bucket->lock);
+
+        if (open == NULL)
+            break;
+
+        /* stop on error, rather than retrying the same open forever */
+        status = nfs41_write_behind_flush(open);
+        nfs41_open_state_deref(open);
+        if (status)
+            break;
+    }
+    return status;
+}
+
+void nfs41_write_behind_free(
+    IN nfs41_open_state *state)
+{
+    struct list_entry *entry, *tmp;
+
+    if (state->write_behind.bytes)
+        eprintf("nfs41_write_behind_free('%s'): discarding %u bytes "
+            "of buffered writes\n", state->path.path,
+            state->write_behind.bytes);
+    if (state->write_behind.resize)
+        eprintf("nfs41_write_behind_free('%s'): discarding size %llu\n",
+            state->path.path, state->write_behind.size);
+
+    list_for_each_tmp(entry, tmp, &state->write_behind.ranges)
+        write_behind_range_free(state, range_entry(entry));
+    state->write_behind.resize = FALSE;
+}
+
+bool_t nfs41_write_behind_resize(
+    IN nfs41_open_state *state,
+    IN uint64_t size,
+    OUT uint64_t *ctime)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    bool_t absorbed = FALSE;
+
+    if (state->type != NF4REG || nfs41_dg.write_delegation_max == 0)
+        return FALSE;
+
+    AcquireSRWLockExclusive(&state->write_behind.lock);
+    if (!write_behind_delegated(state))
+        goto out;
+
+    /* without cached attributes, GETATTR would ask the server */
+    if (write_behind_update_attrs(state, size, TRUE))
+        goto out;
+
+    write_behind_truncate(state, size);
+    state->write_behind.size = size;
+    state->write_behind.resize = TRUE;
+
+    DPRINTF(2, ("nfs41_write_behind_resize('%s'): size=%llu\n",
+        state->path.path, size));
+
+    *ctime = state->write_behind.change;
+    absorbed = TRUE;
+out:
+    ReleaseSRWLockExclusive(&state->write_behind.lock);
+    return absorbed;
+}
+
+bool_t nfs41_write_behind_discard_prepare(
+    IN nfs41_open_state *state)
+{
+    nfs41_file_info info = { 0 };
+    bool_t prepared = FALSE;
+
+    if (state->type != NF4REG)
+        return FALSE;
+
+    AcquireSRWLockExclusive(&state->write_behind.lock);
+    if (!write_behind_delegated(state))
+        goto out;
+
+    /* the data stays reachable through any other links */
+    if (nfs41_attr_cache_lookup(session_name_cache(state->session),
+            state->file.fh.fileid, &info) || info.numlinks > 1)
+        goto out;
+
+    /* set under the open's lock for open_write_behind_cmp() */
+    AcquireSRWLockExclusive(&state->lock);
+    state->write_behind.discard = TRUE;
+    ReleaseSRWLockExclusive(&state->lock);
+    prepared = TRUE;
+out:
+    ReleaseSRWLockExclusive(&state->write_behind.lock);
+    return prepared;
+}
+
+int nfs41_write_behind_discard(
+    IN nfs41_open_state *state,
+    IN bool_t removed)
+{
+    struct list_entry *entry, *tmp;
+
+    AcquireSRWLockExclusive(&state->write_behind.lock);
+    AcquireSRWLockExclusive(&state->lock);
+    state->write_behind.discard = FALSE;
+    ReleaseSRWLockExclusive(&state->lock);
+
+    if (removed) {
+        if (state->write_behind.bytes)
+            DPRINTF(1, ("nfs41_write_behind_discard('%s'): dropping %u "
+                "bytes\n", state->path.path, state->write_behind.bytes));
+
+        list_for_each_tmp(entry, tmp, &state->write_behind.ranges)
+            write_behind_range_free(state, range_entry(entry));
+        state->write_behind.resize = FALSE;
+    }
+    ReleaseSRWLockExclusive(&state->write_behind.lock);
+
+    /* the file is still there, so its data has to reach the server; the
+     * delegation was returned before REMOVE, so this uses the open
+     * stateid */
+    return removed ? NO_ERROR : nfs41_write_behind_flush(state);
+}
+
+/* returns TRUE if the write was buffered (or its flush failed), and
+ * FALSE if it should be sent to the server */
+static bool_t write_behind_buffer(
+    IN nfs41_upcall *upcall,
+    OUT int *status_out)
+{
+    extern nfs41_daemon_globals nfs41_dg;
+    nfs41_open_state *state = upcall->state_ref;
+    readwrite_upcall_args *args = &upcall->args.rw;
+    struct list_entry *entry, *tmp, *next;
+    write_behind_range *range;
+    const uint64_t end = args->offset + args->len;
+    uint64_t first = args->offset, last = end;
+    uint64_t limit = nfs41_dg.write_behind_max;
+    bool_t overlap = FALSE, buffered = FALSE, delegated = FALSE;
+    int status = NO_ERROR;
+
+    if (state->type != NF4REG)
+        goto out;
+
+    AcquireSRWLockExclusive(&state->write_behind.lock);
+
+    if (nfs41_dg.write_delegation_max && write_behind_delegated(state)) {
+        delegated = TRUE;
+        limit = max(limit, nfs41_dg.write_delegation_max);
+    }
+
+    /* large writes go straight to the server, after anything buffered */
+    if (limit == 0 || args->len == 0 ||
+        args->len > max_write_size(state->session, &state->file.fh))
+        goto out_flush;
+
+    /* find the range of any adjacent or overlapping entries */
+    list_for_each(entry, &state->write_behind.ranges) {
+        range = range_entry(entry);
+        if (range->offset > end || range->offset + range->length < args->offset)
+            continue;
+        if (range->offset < end && range->offset + range->length > args->offset)
+            overlap = TRUE;
+        first = min(first, range->offset);
+        last = max(last, range->offset + range->length);
+    }
+    if (last - first > max_write_size(state->session, &state->file.fh)) {
+        /* too big to merge; keep adjacent ranges separate, but don't
+         * split an overlapping write across ranges */
+        if (overlap) {
+            status = write_behind_flush_locked(state);
+            if (status)
+                goto out_unlock;
+        }
+        first = args->offset;
+        last = end;
+    }
+
+    /* flush on hitting the memory cap, then write through if this open
+     * alone can't make enough room */
+    if ((uint64_t)write_behind_bytes + args->len > limit) {
+        status = write_behind_flush_locked(state);
+        if (status)
+            goto out_unlock;
+        if ((uint64_t)write_behind_bytes + args->len > limit)
+            goto out_unlock;
+        first = args->offset;
+        last = end;
+    }
+
+    /* replies to buffered writes carry the last known change attribute */
+    if (state->write_behind.change == 0) {
+        nfs41_file_info info = { 0 };
+        if (nfs41_attr_cache_lookup(session_name_cache(state->session),
+                state->file.fh.fileid, &info) == NO_ERROR)
+            state->write_behind.change = info.change;
+        if (state->write_behind.change == 0)
+            goto out_flush;
+    }
+
+    range = calloc(1, sizeof(write_behind_range));
+    if (range == NULL) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out_unlock;
+    }
+    range->buffer = malloc((size_t)(last - first));
+    if (range->buffer == NULL) {
+        free(range);
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto out_unlock;
+    }
+    range->offset = first;
+    range->length = (uint32_t)(last - first);
+
+    /* absorb the ranges being merged, and find the insertion point */
+    next = &state->write_behind.ranges;
+    list_for_each_tmp(entry, tmp, &state->write_behind.ranges) {
+        write_behind_range *old = range_entry(entry);
+        if (old->offset >= first && old->offset + old->length <= last) {
+            memcpy(range->buffer + (old->offset - first),
+                old->buffer, old->length);
+            write_behind_range_free(state, old);
+        } else if (old->offset > first && next == &state->write_behind.ranges)
+            next = entry;
+    }
+    memcpy(range->buffer + (args->offset - first), args->buffer, args->len);
+    list_add(&range->entry, next->prev, next);
+    state->write_behind.bytes += range->length;
+    InterlockedAdd64(&write_behind_bytes, range->length);
+
+    /* nobody else can see the file, so the server needn't be asked */
+    if (delegated)
+        (void)write_behind_update_attrs(state, end, FALSE);
+
+    args->ctime = state->write_behind.change;
+    args->out_len = args->len;
+    buffered = TRUE;
+    goto out_unlock;
+
+out_flush:
+    status = write_behind_flush_locked(state);
+out_unlock:
+    ReleaseSRWLockExclusive(&state->write_behind.lock);
+    if (status) {
+        eprintf("write_behind_buffer('%s') failed with '%s'\n",
+            state->path.path, nfs_error_string(status));
+        status = nfs_to_windows_error(status, ERROR_NET_WRITE_FAULT);
+        buffered = TRUE;
+    }
+out:
+    *status_out = status;
+    return buffered;
+}
+
 static int write_to_pnfs(
     IN nfs41_upcall *upcall,
     IN stateid_arg *stateid)
@@ -287,6 +1453,16 @@ static int handle_write(void *daemon_context, nfs41_upcall *upcall)
     uint32_t pnfs_bytes_written = 0;
     int status;
 
+    /* anything read ahead on this open may now be stale */
+    nfs41_read_ahead_invalidate(upcall->state_ref);
+
+    args->buffered = FALSE;
+    if (write_behind_buffer(upcall, &status)) {
+        /* tell the driver, so FlushFileBuffers() knows to upcall */
+        args->buffered = status == NO_ERROR;
+        goto out;
+    }
+
     nfs41_open_stateid_arg(upcall->state_ref, &stateid);
 
 #ifdef PNFS_ENABLE_WRITE
@@ -317,6 +1493,8 @@ static int marshall_rw(unsigned char *buffer, uint32_t *length, nfs41_upcall *up
     status = safe_write(&buffer, length, &args->out_len, sizeof(args->out_len));
     if (status) goto out;
     status = safe_write(&buffer, length, &args->ctime, sizeof(args->ctime));
+    if (status) goto out;
+    status = safe_write(&buffer, length, &args->buffered, sizeof(args->buffered));
 out:
     return status;
 }
@@ -334,3 +1512,15 @@ const nfs41_upcall_op nfs41_op_write = {
     .marshall = marshall_rw,
     .arg_size = sizeof(readwrite_upcall_args)
 };
+
+
+/* NFS41_FLUSH */
+static int handle_flush(void *daemon_context, nfs41_upcall *upcall)
+{
+    return nfs41_write_behind_flush_file(upcall->state_ref, TRUE);
+}
+
+const nfs41_upcall_op nfs41_op_flush = {
+    .handle = handle_flush,
+    .arg_size = 0
+};
@@ -0,0 +1,80 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * Olga Kornievskaia <aglo@umich.edu>
+ * Casey Bodley <cbodley@umich.edu>
+ * Roland Mainz <roland.mainz@nrubsig.org>
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+#ifndef __NFS41_DAEMON_READWRITE_H__
+#define __NFS41_DAEMON_READWRITE_H__ 1
+
+#include "nfs41.h"
+
+
+/* write-behind buffering of NFS41_WRITE upcalls; enabled with the
+ * nfsd --writebehind option, which caps the memory used for it.  while
+ * the open holds a write delegation, writes and size changes are also
+ * kept locally, up to the nfsd --writedelegation cap */
+
+/* send any buffered writes for the open to the server; must be called
+ * before any operation that depends on the file's data or size */
+int nfs41_write_behind_flush(
+    IN nfs41_open_state *state);
+
+/* flush every open of the same file; with delegated == FALSE, skips opens
+ * under a write delegation, whose cached attributes are kept current */
+int nfs41_write_behind_flush_file(
+    IN nfs41_open_state *state,
+    IN bool_t delegated);
+
+/* discard any buffered writes when the open state is freed */
+void nfs41_write_behind_free(
+    IN nfs41_open_state *state);
+
+/* under a write delegation, set the file's size locally and send it with
+ * the next flush; returns FALSE if the caller should send SETATTR */
+bool_t nfs41_write_behind_resize(
+    IN nfs41_open_state *state,
+    IN uint64_t size,
+    OUT uint64_t *ctime);
+
+/* before removing a delegated file, hold on to its buffered writes
+ * instead of flushing them when the delegation is returned; returns
+ * FALSE if they still need to be flushed now */
+bool_t nfs41_write_behind_discard_prepare(
+    IN nfs41_open_state *state);
+
+/* after nfs41_write_behind_discard_prepare(), drop the buffered writes
+ * if the file was removed, or flush them if REMOVE failed */
+int nfs41_write_behind_discard(
+    IN nfs41_open_state *state,
+    IN bool_t removed);
+
+
+/* read-ahead of sequential NFS41_READ upcalls; enabled with the
+ * nfsd --readahead option, which caps the memory used for it */
+
+/* discard any read-ahead for the open, after it writes or truncates */
+void nfs41_read_ahead_invalidate(
+    IN nfs41_open_state *state);
+
+/* discard any read-ahead when the open state is freed */
+void nfs41_read_ahead_free(
+    IN nfs41_open_state *state);
+
+#endif /* !__NFS41_DAEMON_READWRITE_H__ */
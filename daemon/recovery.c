@@ -21,6 +21,7 @@
  */
 
 #include <time.h>
+#include <process.h> /* for _beginthreadex() */
 
 #include "recovery.h"
 #include "delegation.h"
@@ -136,6 +137,18 @@ void nfs41_recover_sequence_flags(
 
 
 /* client state recovery for server reboot or lease expiration */
+
+/* called on the first NFS4ERR_NO_GRACE; with parallel recovery, only
+ * the thread that clears the grace flag sends RECLAIM_COMPLETE */
+static void recovery_grace_over(
+    IN nfs41_session *session,
+    IN OUT volatile LONG *grace)
+{
+    /* send RECLAIM_COMPLETE before any out-of-grace recovery */
+    if (InterlockedCompareExchange(grace, FALSE, TRUE) == TRUE)
+        nfs41_reclaim_complete(session);
+}
+
 static int recover_open_grace(
     IN nfs41_session *session,
     IN nfs41_path_fh *parent,
@@ -200,13 +213,26 @@ out:
     return status;
 }
 
-static int recover_open(
+/* how many reclaims fit in a compound, given the server's limit
+ * on operations and the operations needed for each */
+static uint32_t reclaim_batch_size(
     IN nfs41_session *session,
+    IN uint32_t ops_per_reclaim,
+    IN uint32_t fixed_ops)
+{
+    const uint32_t max_ops = session->fore_chan_attrs.ca_maxoperations;
+    uint32_t count = NFS41_RECLAIM_BATCH;
+
+    if (max_ops > fixed_ops && (max_ops - fixed_ops) / ops_per_reclaim < count)
+        count = (max_ops - fixed_ops) / ops_per_reclaim;
+    return count ? count : 1;
+}
+
+/* decide whether the open needs a new stateid; if not, returns NFS4_OK */
+static int recover_open_delegated(
     IN nfs41_open_state *open,
-    IN OUT bool_t *grace)
+    OUT open_delegation4 *delegation)
 {
-    open_delegation4 delegation = { 0 };
-    stateid4 stateid = { 0 };
     int status = NFS4ERR_BADHANDLE;
 
     /* check for an associated delegation */
@@ -216,7 +242,7 @@ static int recover_open(
         if (deleg->revoked) {
             /* reclaim the delegation along with the open */
             AcquireSRWLockShared(&deleg->lock);
-            delegation.type = deleg->state.type;
+            delegation->type = deleg->state.type;
             ReleaseSRWLockShared(&deleg->lock);
         } else if (deleg->state.recalled) {
             /* we'll need an open stateid regardless */
@@ -228,7 +254,57 @@ static int recover_open(
         }
     }
     ReleaseSRWLockExclusive(&open->lock);
+    return status;
+}
 
+/* save the results of a successful reclaim.  a new delegation is
+ * registered right away, unless granted_out is given; parallel
+ * recovery can't take client_state.lock from its threads */
+static void recover_open_update(
+    IN nfs41_session *session,
+    IN nfs41_open_state *open,
+    IN const stateid4 *stateid,
+    IN open_delegation4 *delegation,
+    OUT OPTIONAL open_delegation4 *granted_out)
+{
+    AcquireSRWLockExclusive(&open->lock);
+    /* update the open stateid */
+    stateid4_cpy(&open->stateid, stateid);
+    open->do_close = TRUE;
+
+    if (open->delegation.state) {
+        nfs41_delegation_state *deleg = open->delegation.state;
+        if (deleg->revoked) {
+            /* update delegation state */
+            AcquireSRWLockExclusive(&deleg->lock);
+            if (delegation->type != OPEN_DELEGATE_READ &&
+                delegation->type != OPEN_DELEGATE_WRITE) {
+                eprintf("recover_open() got delegation type %u, "
+                    "expected %u\n", delegation->type, deleg->state.type);
+            } else {
+                nfs41_delegation_reclaimed(session->client, deleg, delegation);
+                deleg->revoked = FALSE;
+            }
+            ReleaseSRWLockExclusive(&deleg->lock);
+        }
+    } else if (granted_out) /* let the caller register it */
+        open_delegation4_cpy(granted_out, delegation);
+    else /* granted a new delegation? */
+        nfs41_delegation_granted(session, &open->parent, &open->file,
+            delegation, FALSE, &open->delegation.state);
+    ReleaseSRWLockExclusive(&open->lock);
+}
+
+static int recover_open(
+    IN nfs41_session *session,
+    IN nfs41_open_state *open,
+    IN OUT volatile LONG *grace)
+{
+    open_delegation4 delegation = { 0 };
+    stateid4 stateid = { 0 };
+    int status;
+
+    status = recover_open_delegated(open, &delegation);
     if (status == NFS4_OK) /* use existing delegation */
         goto out;
 
@@ -236,11 +312,8 @@ static int recover_open(
         status = recover_open_grace(session, &open->parent, &open->file,
             &open->owner, open->share_access, open->share_deny,
             &stateid, &delegation);
-        if (status == NFS4ERR_NO_GRACE) {
-            *grace = FALSE;
-            /* send RECLAIM_COMPLETE before any out-of-grace recovery */
-            nfs41_reclaim_complete(session);
-        }
+        if (status == NFS4ERR_NO_GRACE)
+            recovery_grace_over(session, grace);
     }
     if (!*grace) {
         status = recover_open_no_grace(session, &open->parent, &open->file,
@@ -251,42 +324,62 @@ static int recover_open(
     if (status)
         goto out;
 
-    AcquireSRWLockExclusive(&open->lock);
-    /* update the open stateid */
-    stateid4_cpy(&open->stateid, &stateid);
-    open->do_close = TRUE;
+    recover_open_update(session, open, &stateid, &delegation, NULL);
+out:
+    return status;
+}
 
-    if (open->delegation.state) {
-        nfs41_delegation_state *deleg = open->delegation.state;
-        if (deleg->revoked) {
-            /* update delegation state */
-            AcquireSRWLockExclusive(&deleg->lock);
-            if (delegation.type != OPEN_DELEGATE_READ &&
-                delegation.type != OPEN_DELEGATE_WRITE) {
-                eprintf("recover_open() got delegation type %u, "
-                    "expected %u\n", delegation.type, deleg->state.type);
-            } else {
-                open_delegation4_cpy(&deleg->state, &delegation);
-                deleg->revoked = FALSE;
+/* send a batch of lock reclaims for the open, resending any that the
+ * server didn't get to.  called with open->lock held */
+static int recover_lock_batch(
+    IN nfs41_session *session,
+    IN nfs41_open_state *open,
+    IN OUT volatile LONG *grace,
+    IN uint32_t count,
+    IN OUT nfs41_lock_reclaim_args *locks,
+    IN OUT stateid_arg *stateid)
+{
+    uint32_t sent = 0, i;
+    bool_t reclaim;
+    int status = NFS4_OK;
+
+    while (sent < count) {
+        /* once the grace period is over, attempt
+         * out-of-grace recovery with normal LOCKs */
+        reclaim = *grace ? TRUE : FALSE;
+        status = nfs41_lock_reclaim(session, &open->file, &open->owner,
+            reclaim, count - sent, locks + sent, stateid);
+        if (status)
+            break;
+
+        /* skip past the ones that were processed; like recover_open(),
+         * errors other than NO_GRACE aren't retried */
+        for (i = sent; i < count; i++) {
+            if (locks[i].status == NFS4ERR_DELAY)
+                break;
+            if (locks[i].status == NFS4ERR_NO_GRACE && reclaim) {
+                recovery_grace_over(session, grace);
+                break; /* resend it as a normal LOCK */
             }
-            ReleaseSRWLockExclusive(&deleg->lock);
         }
-    } else /* granted a new delegation? */
-        nfs41_delegation_granted(session, &open->parent, &open->file,
-            &delegation, FALSE, &open->delegation.state);
-    ReleaseSRWLockExclusive(&open->lock);
-out:
+        if (i == sent && locks[i].status != NFS4ERR_NO_GRACE)
+            break; /* no progress */
+        sent = i;
+    }
     return status;
 }
 
 static int recover_locks(
     IN nfs41_session *session,
     IN nfs41_open_state *open,
-    IN OUT bool_t *grace)
+    IN OUT volatile LONG *grace)
 {
+    nfs41_lock_reclaim_args locks[NFS41_RECLAIM_BATCH];
+    const uint32_t max_count = reclaim_batch_size(session, 1, 2);
     stateid_arg stateid;
     struct list_entry *entry;
     nfs41_lock_state *lock;
+    uint32_t count = 0;
     int status = NFS4_OK;
 
     AcquireSRWLockExclusive(&open->lock);
@@ -297,31 +390,27 @@ static int recover_locks(
     stateid.open = open;
     stateid.delegation = NULL;
 
-    /* recover any locks for this open */
+    /* recover any locks for this open, several per compound */
     list_for_each(entry, &open->locks.list) {
         lock = list_container(entry, nfs41_lock_state, open_entry);
         if (lock->delegated)
             continue;
 
-        if (*grace) {
-            status = nfs41_lock(session, &open->file, &open->owner, 
-                lock->exclusive ? WRITE_LT : READ_LT, lock->offset, 
-                lock->length, TRUE, FALSE, &stateid);
-            if (status == NFS4ERR_NO_GRACE) {
-                *grace = FALSE;
-                /* send RECLAIM_COMPLETE before any out-of-grace recovery */
-                nfs41_reclaim_complete(session);
-            }
-        }
-        if (!*grace) {
-            /* attempt out-of-grace recovery with a normal LOCK */
-            status = nfs41_lock(session, &open->file, &open->owner, 
-                lock->exclusive ? WRITE_LT : READ_LT, lock->offset, 
-                lock->length, FALSE, FALSE, &stateid);
-        }
+        locks[count].type = lock->exclusive ? WRITE_LT : READ_LT;
+        locks[count].offset = lock->offset;
+        locks[count].length = lock->length;
+        if (++count < max_count)
+            continue;
+
+        status = recover_lock_batch(session, open,
+            grace, count, locks, &stateid);
+        count = 0;
         if (status == NFS4ERR_BADSESSION)
             break;
     }
+    if (count && status != NFS4ERR_BADSESSION)
+        status = recover_lock_batch(session, open,
+            grace, count, locks, &stateid);
 
     if (status != NFS4ERR_BADSESSION) {
         /* if we got a lock stateid back, save the lock with the open */
@@ -339,7 +428,7 @@ static int recover_locks(
 static int recover_delegation_want(
     IN nfs41_session *session,
     IN nfs41_delegation_state *deleg,
-    IN OUT bool_t *grace)
+    IN OUT volatile LONG *grace)
 {
     deleg_claim4 claim;
     open_delegation4 delegation = { 0 };
@@ -362,11 +451,8 @@ static int recover_delegation_want(
 
         status = nfs41_want_delegation(session, &deleg->file, &claim, 
             want_flags, FALSE, &delegation);
-        if (status == NFS4ERR_NO_GRACE) {
-            *grace = FALSE;
-            /* send RECLAIM_COMPLETE before any out-of-grace recovery */
-            nfs41_reclaim_complete(session);
-        }
+        if (status == NFS4ERR_NO_GRACE)
+            recovery_grace_over(session, grace);
     }
     if (!*grace) {
         /* attempt out-of-grace recovery with with CLAIM_DELEG_PREV_FH */
@@ -385,7 +471,7 @@ static int recover_delegation_want(
         eprintf("recover_delegation_want() got delegation type %u, "
             "expected %u\n", delegation.type, deleg->state.type);
     } else {
-        open_delegation4_cpy(&deleg->state, &delegation);
+        nfs41_delegation_reclaimed(session->client, deleg, &delegation);
         deleg->revoked = FALSE;
     }
     ReleaseSRWLockExclusive(&deleg->lock);
@@ -397,7 +483,7 @@ out:
 static int recover_delegation_open(
     IN nfs41_session *session,
     IN nfs41_delegation_state *deleg,
-    IN OUT bool_t *grace)
+    IN OUT volatile LONG *grace)
 {
     state_owner4 owner;
     open_delegation4 delegation = { 0 };
@@ -424,11 +510,8 @@ static int recover_delegation_open(
     if (*grace) {
         status = recover_open_grace(session, &deleg->parent, &deleg->file,
             &owner, access, deny, &stateid.stateid, &delegation);
-        if (status == NFS4ERR_NO_GRACE) {
-            *grace = FALSE;
-            /* send RECLAIM_COMPLETE before any out-of-grace recovery */
-            nfs41_reclaim_complete(session);
-        }
+        if (status == NFS4ERR_NO_GRACE)
+            recovery_grace_over(session, grace);
     }
     if (!*grace) {
         status = recover_open_no_grace(session, &deleg->parent, &deleg->file,
@@ -444,7 +527,7 @@ static int recover_delegation_open(
         eprintf("recover_delegation_open() got delegation type %u, "
             "expected %u\n", delegation.type, deleg->state.type);
     } else {
-        open_delegation4_cpy(&deleg->state, &delegation);
+        nfs41_delegation_reclaimed(session->client, deleg, &delegation);
         deleg->revoked = FALSE;
     }
     ReleaseSRWLockExclusive(&deleg->lock);
@@ -461,8 +544,8 @@ out:
 static int recover_delegation(
     IN nfs41_session *session,
     IN nfs41_delegation_state *deleg,
-    IN OUT bool_t *grace,
-    IN OUT bool_t *want_supported)
+    IN OUT volatile LONG *grace,
+    IN OUT volatile LONG *want_supported)
 {
     int status;
 
@@ -485,6 +568,208 @@ static int recover_delegation(
     return status;
 }
 
+/* parallel recovery: the opens and delegations to recover are split
+ * into batches, and a pool of threads sends them over the session's
+ * slots concurrently.  the caller holds client_state.lock throughout,
+ * so the threads must not take it */
+#define RECOVERY_MAX_THREADS 8
+
+struct recovery_item {
+    nfs41_open_state *open;
+    nfs41_delegation_state *deleg;
+    open_delegation4 granted; /* new delegation for the caller to register */
+    int status;
+};
+
+struct recovery_pool;
+typedef int (*recovery_batch_fn)(
+    IN struct recovery_pool *pool,
+    IN struct recovery_item *items,
+    IN uint32_t count);
+
+struct recovery_pool {
+    nfs41_session *session;
+    struct recovery_item *items;
+    uint32_t count;
+    uint32_t batch;
+    recovery_batch_fn recover;
+    volatile LONG next; /* index of the next batch to claim */
+    volatile LONG grace;
+    volatile LONG want_supported;
+    volatile LONG status; /* NFS4ERR_BADSESSION stops all threads */
+};
+
+static unsigned int WINAPI recovery_thread(void *args)
+{
+    struct recovery_pool *pool = (struct recovery_pool*)args;
+    uint32_t first, count;
+    int status;
+
+    while (pool->status != NFS4ERR_BADSESSION) {
+        first = (uint32_t)InterlockedExchangeAdd(&pool->next, pool->batch);
+        if (first >= pool->count)
+            break;
+        count = min(pool->batch, pool->count - first);
+
+        status = pool->recover(pool, pool->items + first, count);
+        if (status == NFS4ERR_BADSESSION)
+            InterlockedExchange(&pool->status, status);
+    }
+    return 0;
+}
+
+static int recovery_pool_run(
+    IN struct recovery_pool *pool,
+    IN recovery_batch_fn recover,
+    IN uint32_t batch)
+{
+    HANDLE threads[RECOVERY_MAX_THREADS];
+    uint32_t i, count;
+
+    pool->recover = recover;
+    pool->batch = batch;
+    pool->next = 0;
+
+    /* one thread per slot, and no more than there are batches;
+     * the calling thread counts as one of them */
+    count = min(RECOVERY_MAX_THREADS, (uint32_t)pool->session->table.max_slots);
+    count = min(count, (pool->count + batch - 1) / batch);
+
+    for (i = 0; i + 1 < count; i++) {
+        threads[i] = (HANDLE)_beginthreadex(NULL, 0,
+            recovery_thread, pool, 0, NULL);
+        if (threads[i] == NULL) {
+            eprintf("recovery_pool_run: _beginthreadex() failed %d\n",
+                GetLastError());
+            break; /* carry on with the threads we have */
+        }
+    }
+    recovery_thread(pool);
+
+    if (i) {
+        WaitForMultipleObjects(i, threads, TRUE, INFINITE);
+        while (i--)
+            CloseHandle(threads[i]);
+    }
+    return pool->status;
+}
+
+/* reclaim a batch of opens.  during the grace period they're sent
+ * together with nfs41_open_reclaim(), after it one at a time */
+static int recover_open_batch(
+    IN struct recovery_pool *pool,
+    IN struct recovery_item *items,
+    IN uint32_t count)
+{
+    nfs41_session *session = pool->session;
+    nfs41_open_reclaim_args reclaims[NFS41_RECLAIM_BATCH];
+    struct recovery_item *pending[NFS41_RECLAIM_BATCH];
+    nfs41_open_state *open;
+    uint32_t i, n = 0, sent = 0;
+    int status = NFS4_OK;
+
+    for (i = 0; i < count; i++) {
+        open = items[i].open;
+        ZeroMemory(&reclaims[n], sizeof(nfs41_open_reclaim_args));
+        items[i].status = recover_open_delegated(open, &reclaims[n].delegation);
+        if (items[i].status == NFS4_OK) /* use existing delegation */
+            continue;
+
+        reclaims[n].file = &open->file;
+        reclaims[n].owner = &open->owner;
+        reclaims[n].access = open->share_access;
+        reclaims[n].deny = open->share_deny;
+        pending[n++] = &items[i];
+    }
+
+    while (sent < n && pool->grace) {
+        status = nfs41_open_reclaim(session, n - sent, reclaims + sent);
+        if (status)
+            break;
+
+        for (i = sent; i < n; i++) {
+            if (reclaims[i].status == NFS4ERR_DELAY)
+                break; /* not processed; resend it */
+            if (reclaims[i].status == NFS4ERR_NO_GRACE) {
+                recovery_grace_over(session, &pool->grace);
+                break; /* retry it out of grace */
+            }
+            pending[i]->status = reclaims[i].status;
+            if (reclaims[i].status == NFS4_OK)
+                recover_open_update(session, pending[i]->open,
+                    &reclaims[i].stateid, &reclaims[i].delegation,
+                    &pending[i]->granted);
+        }
+        if (i == sent && reclaims[i].status == NFS4ERR_DELAY)
+            break; /* no progress */
+        sent = i;
+    }
+
+    if (status) {
+        /* the whole batch failed */
+        for (i = sent; i < n; i++)
+            pending[i]->status = status;
+        goto out;
+    }
+
+    for (i = sent; i < n; i++) {
+        open = pending[i]->open;
+        if (pool->grace) {
+            /* fall back to a separate compound for each */
+            pending[i]->status = recover_open_grace(session, &open->parent,
+                &open->file, &open->owner, open->share_access,
+                open->share_deny, &reclaims[i].stateid,
+                &reclaims[i].delegation);
+            if (pending[i]->status == NFS4ERR_NO_GRACE)
+                recovery_grace_over(session, &pool->grace);
+        }
+        if (!pool->grace)
+            pending[i]->status = recover_open_no_grace(session, &open->parent,
+                &open->file, &open->owner, open->share_access,
+                open->share_deny, &reclaims[i].stateid,
+                &reclaims[i].delegation);
+
+        if (pending[i]->status == NFS4ERR_BADSESSION) {
+            status = NFS4ERR_BADSESSION;
+            break;
+        }
+        if (pending[i]->status == NFS4_OK)
+            recover_open_update(session, open, &reclaims[i].stateid,
+                &reclaims[i].delegation, &pending[i]->granted);
+    }
+out:
+    return status;
+}
+
+static int recover_lock_items(
+    IN struct recovery_pool *pool,
+    IN struct recovery_item *items,
+    IN uint32_t count)
+{
+    uint32_t i;
+    int status = NFS4_OK;
+
+    for (i = 0; i < count && status != NFS4ERR_BADSESSION; i++)
+        if (items[i].status == NFS4_OK)
+            status = recover_locks(pool->session,
+                items[i].open, &pool->grace);
+    return status;
+}
+
+static int recover_delegation_items(
+    IN struct recovery_pool *pool,
+    IN struct recovery_item *items,
+    IN uint32_t count)
+{
+    uint32_t i;
+    int status = NFS4_OK;
+
+    for (i = 0; i < count && status != NFS4ERR_BADSESSION; i++)
+        status = recover_delegation(pool->session, items[i].deleg,
+            &pool->grace, &pool->want_supported);
+    return status;
+}
+
 int nfs41_recover_client_state(
     IN nfs41_session *session,
     IN nfs41_client *client)
@@ -492,13 +777,20 @@ int nfs41_recover_client_state(
     const struct cb_layoutrecall_args recall = { PNFS_LAYOUTTYPE_FILE,
         PNFS_IOMODE_ANY, TRUE, { PNFS_RETURN_ALL } };
     struct client_state *state = &session->client->state;
+    struct recovery_pool pool = { 0 };
+    struct recovery_item *item;
     struct list_entry *entry;
     nfs41_open_state *open;
     nfs41_delegation_state *deleg;
-    bool_t grace = TRUE;
-    bool_t want_supported = TRUE;
+    uint32_t opens = 0, delegations = 0, i;
+    uint64_t start, opens_done, locks_done, delegations_done;
     int status = NFS4_OK;
 
+    pool.session = session;
+    pool.grace = TRUE;
+    pool.want_supported = TRUE;
+    start = util_getusec();
+
     EnterCriticalSection(&state->lock);
 
     /* flag all delegations as revoked until successful recovery;
@@ -507,41 +799,84 @@ int nfs41_recover_client_state(
     list_for_each(entry, &state->delegations) {
         deleg = list_container(entry, nfs41_delegation_state, client_entry);
         deleg->revoked = TRUE;
+        delegations++;
+    }
+    list_for_each(entry, &state->opens)
+        opens++;
+
+    /* the lists can't change while we hold state->lock, so the
+     * threads can work from an array of their entries */
+    pool.items = calloc(max(opens, delegations) + 1,
+        sizeof(struct recovery_item));
+    if (pool.items == NULL) {
+        status = ERROR_NOT_ENOUGH_MEMORY;
+        goto unlock;
     }
 
     /* recover each of the client's opens and associated delegations */
-    list_for_each(entry, &state->opens) {
-        open = list_container(entry, nfs41_open_state, client_entry);
-        status = recover_open(session, open, &grace);
-        if (status == NFS4_OK)
-            status = recover_locks(session, open, &grace);
-        if (status == NFS4ERR_BADSESSION)
-            goto unlock;
+    pool.count = 0;
+    list_for_each(entry, &state->opens)
+        pool.items[pool.count++].open =
+            list_container(entry, nfs41_open_state, client_entry);
+
+    status = recovery_pool_run(&pool, recover_open_batch,
+        reclaim_batch_size(session, 2, 1));
+    opens_done = util_getusec();
+    if (status == NFS4ERR_BADSESSION)
+        goto unlock;
+
+    /* register any new delegations granted by out-of-grace opens */
+    for (i = 0; i < pool.count; i++) {
+        item = &pool.items[i];
+        if (item->status || (item->granted.type != OPEN_DELEGATE_READ &&
+                item->granted.type != OPEN_DELEGATE_WRITE))
+            continue;
+        open = item->open;
+        AcquireSRWLockExclusive(&open->lock);
+        if (open->delegation.state == NULL)
+            nfs41_delegation_granted(session, &open->parent, &open->file,
+                &item->granted, FALSE, &open->delegation.state);
+        ReleaseSRWLockExclusive(&open->lock);
     }
 
+    /* with the open stateids in place, recover their locks */
+    status = recovery_pool_run(&pool, recover_lock_items, 4);
+    locks_done = util_getusec();
+    if (status == NFS4ERR_BADSESSION)
+        goto unlock;
+
     /* recover delegations that weren't associated with any opens */
+    pool.count = 0;
     list_for_each(entry, &state->delegations) {
         deleg = list_container(entry, nfs41_delegation_state, client_entry);
-        if (deleg->revoked) {
-            status = recover_delegation(session,
-                deleg, &grace, &want_supported);
-            if (status == NFS4ERR_BADSESSION)
-                goto unlock;
-        }
+        if (deleg->revoked)
+            pool.items[pool.count++].deleg = deleg;
     }
+    status = recovery_pool_run(&pool, recover_delegation_items, 1);
+    delegations_done = util_getusec();
+    if (status == NFS4ERR_BADSESSION)
+        goto unlock;
+
+    DPRINTF(1, ("nfs41_recover_client_state: recovered %u opens in %llums, "
+        "their locks in %llums, and %u delegations in %llums\n", opens,
+        (opens_done - start) / 1000, (locks_done - opens_done) / 1000,
+        pool.count, (delegations_done - locks_done) / 1000));
 
     /* return any delegations that were reclaimed as 'recalled' */
     status = nfs41_client_delegation_recovery(client);
 unlock:
     LeaveCriticalSection(&state->lock);
+    free(pool.items);
 
     /* revoke all of the client's layouts */
     pnfs_file_layout_recall(client, &recall);
 
-    if (grace && status != NFS4ERR_BADSESSION) {
+    if (pool.grace && status != NFS4ERR_BADSESSION) {
         /* send reclaim_complete, but don't fail on errors */
         nfs41_reclaim_complete(session);
     }
+    DPRINTF(1, ("nfs41_recover_client_state: finished in %llums with %d\n",
+        (util_getusec() - start) / 1000, status));
     return status;
 }
 
@@ -643,8 +978,8 @@ void nfs41_client_state_revoked(
     stateid_arg *stateids = NULL;
     uint32_t *statuses = NULL;
     uint32_t i, count;
-    bool_t grace = TRUE;
-    bool_t want_supported = TRUE;
+    LONG grace = TRUE;
+    LONG want_supported = TRUE;
 
     EnterCriticalSection(&clientstate->lock);
 
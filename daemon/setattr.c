@@ -27,6 +27,7 @@
 #include "nfs41_ops.h"
 #include "delegation.h"
 #include "name_cache.h"
+#include "readwrite.h"
 #include "upcall.h"
 #include "util.h"
 #include "daemon_debug.h"
@@ -502,6 +503,24 @@ static int handle_setattr(void *daemon_context, nfs41_upcall *upcall)
     setattr_upcall_args *args = &upcall->args.setattr;
     int status;
 
+    /* under a write delegation, size changes wait for the next flush */
+    if ((args->set_class == FileEndOfFileInformation ||
+            args->set_class == FileAllocationInformation) &&
+            args->buf_len == sizeof(LONGLONG) &&
+            nfs41_write_behind_resize(args->state,
+                ((PLARGE_INTEGER)args->buf)->QuadPart, &args->ctime)) {
+        nfs41_read_ahead_invalidate(args->state);
+        status = NO_ERROR;
+        goto out;
+    }
+
+    /* buffered writes could otherwise land after a truncate, rename,
+     * or timestamp change */
+    status = nfs41_write_behind_flush(args->state);
+    if (status)
+        goto out;
+    nfs41_read_ahead_invalidate(args->state);
+
     switch (args->set_class) {
     case FileBasicInformation:
         status = handle_nfs41_setattr(daemon_context, args);
@@ -525,7 +544,7 @@ static int handle_setattr(void *daemon_context, nfs41_upcall *upcall)
         status = ERROR_NOT_SUPPORTED;
         break;
     }
-
+out:
     return status;
 }
 
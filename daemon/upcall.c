@@ -47,6 +47,7 @@ extern const nfs41_upcall_op nfs41_op_symlink;
 extern const nfs41_upcall_op nfs41_op_volume;
 extern const nfs41_upcall_op nfs41_op_getacl;
 extern const nfs41_upcall_op nfs41_op_setacl;
+extern const nfs41_upcall_op nfs41_op_flush;
 
 /* |_nfs41_opcodes| and |g_upcall_op_table| must be in sync! */
 static const nfs41_upcall_op *g_upcall_op_table[] = {
@@ -69,6 +70,7 @@ static const nfs41_upcall_op *g_upcall_op_table[] = {
     &nfs41_op_volume,
     &nfs41_op_getacl,
     &nfs41_op_setacl,
+    &nfs41_op_flush,
     NULL,
     NULL
 };
@@ -177,8 +179,9 @@ int upcall_parse(
     op = g_upcall_op_table[upcall_upcode];
 
     if (op) {
-        /* |NFS41_UNMOUNT| has 0 payload */
-        if (upcall_upcode != NFS41_UNMOUNT) {
+        /* |NFS41_UNMOUNT| and |NFS41_FLUSH| have 0 payload */
+        if ((upcall_upcode != NFS41_UNMOUNT) &&
+            (upcall_upcode != NFS41_FLUSH)) {
             EASSERT_MSG(op->arg_size >= sizeof(void*),
                 ("upcall->opcode=%u\n", (unsigned int)upcall_upcode));
         }
@@ -38,6 +38,10 @@ typedef struct __mount_upcall_args {
     DWORD       wsize;
     DWORD       use_nfspubfh;
     DWORD       lease_time;
+    DWORD       ac_timeo;
+    DWORD       ac_max;
+    DWORD       namecache_mb;
+    DWORD       negcache;
     FILE_FS_ATTRIBUTE_INFORMATION FsAttrs;
 } mount_upcall_args;
 
@@ -78,6 +82,7 @@ typedef struct __readwrite_upcall_args {
     ULONG len;
     ULONG out_len;
     ULONGLONG ctime;
+    BOOLEAN buffered; /* by write-behind, see nfs41_Flush() in the driver */
 } readwrite_upcall_args;
 
 typedef struct __lock_upcall_args {
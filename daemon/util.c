@@ -24,6 +24,7 @@
 #include <strsafe.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <process.h>
 #include <wincrypt.h> /* for Crypt*() functions */
 
 #include "daemon_debug.h"
@@ -690,6 +691,86 @@ bool_t waitSRWlock(PSRWLOCK srwlock)
     return srw_locked;
 }
 
+static struct io_pool {
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+    struct list_entry queue;
+    uint32_t queued;
+    uint32_t idle;
+    uint32_t workers;
+} io_pool = {
+    SRWLOCK_INIT,
+    CONDITION_VARIABLE_INIT,
+    { &io_pool.queue, &io_pool.queue },
+    0, 0, 0
+};
+
+static unsigned int WINAPI io_pool_worker(void *args)
+{
+    io_pool_work *work;
+
+    for (;;) {
+        AcquireSRWLockExclusive(&io_pool.lock);
+        io_pool.idle++;
+        while (list_empty(&io_pool.queue))
+            SleepConditionVariableSRW(&io_pool.cond,
+                &io_pool.lock, INFINITE, 0);
+        io_pool.idle--;
+        work = list_container(io_pool.queue.next, io_pool_work, entry);
+        list_remove(&work->entry);
+        io_pool.queued--;
+        ReleaseSRWLockExclusive(&io_pool.lock);
+
+        work->fn(work);
+    }
+    return 0;
+}
+
+void io_pool_queue(
+    IN io_pool_work *work,
+    IN io_pool_work_fn fn,
+    IN uint32_t max_workers)
+{
+    HANDLE thread;
+
+    work->fn = fn;
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    list_add_tail(&io_pool.queue, &work->entry);
+    io_pool.queued++;
+
+    if (max_workers > IO_POOL_MAX_WORKERS)
+        max_workers = IO_POOL_MAX_WORKERS;
+    if (io_pool.queued > io_pool.idle && io_pool.workers < max_workers) {
+        thread = (HANDLE)_beginthreadex(NULL, 0, io_pool_worker, NULL, 0, NULL);
+        if (thread == NULL) {
+            /* the submitter still runs whatever isn't picked up */
+            eprintf("io_pool_queue: _beginthreadex() failed with %d\n",
+                GetLastError());
+        } else {
+            CloseHandle(thread);
+            io_pool.workers++;
+        }
+    }
+    ReleaseSRWLockExclusive(&io_pool.lock);
+    WakeConditionVariable(&io_pool.cond);
+}
+
+bool_t io_pool_cancel(
+    IN io_pool_work *work)
+{
+    bool_t cancelled = FALSE;
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    if (!list_empty(&work->entry)) {
+        list_remove(&work->entry);
+        io_pool.queued--;
+        cancelled = TRUE;
+    }
+    ReleaseSRWLockExclusive(&io_pool.lock);
+    return cancelled;
+}
+
 /*
  * |waitcriticalsection()| - Wait for other threads using the
  * CRITICAL_SECTION (usually used before disposing (e.g.
@@ -28,6 +28,7 @@
 
 #include "nfs41_types.h"
 #include "from_kernel.h"
+#include "list.h"
 
 extern DWORD NFS41D_VERSION;
 struct __nfs41_session;
@@ -48,6 +49,17 @@ enum stable_how4;
     (((signed long long)(t1))-((signed long long)(t2)))
 typedef ULONGLONG util_reltimestamp;
 
+/* monotonic clock in microseconds, for latency measurements */
+static __inline uint64_t util_getusec(void)
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000ULL +
+        (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000ULL /
+        (uint64_t)freq.QuadPart;
+}
+
 /*
  * LargeInteger.QuadPart value to indicate a time value was not
  * available
@@ -347,6 +359,31 @@ BOOL subcmd_readcmdoutput(subcmd_popen_context *pinfo, char *buff, size_t buff_s
 bool_t waitSRWlock(PSRWLOCK srwlock);
 bool_t waitcriticalsection(LPCRITICAL_SECTION cs);
 
+/* io pool: long-lived worker threads shared by pnfs i/o, the mds
+ * read/write pipeline and read-ahead, so that none of them has to
+ * create a thread per request */
+#define IO_POOL_MAX_WORKERS 64
+
+typedef struct __io_pool_work io_pool_work;
+typedef void (*io_pool_work_fn)(IN io_pool_work *work);
+
+struct __io_pool_work {
+    struct list_entry entry; /* in the pool's queue until started */
+    io_pool_work_fn fn;
+};
+
+/* queue work for the pool, starting another worker if none are idle
+ * and the pool has fewer than max_workers */
+void io_pool_queue(
+    IN io_pool_work *work,
+    IN io_pool_work_fn fn,
+    IN uint32_t max_workers);
+
+/* take back work that no worker has started yet; returns TRUE if the
+ * caller now has to run it, FALSE if it already started */
+bool_t io_pool_cancel(
+    IN io_pool_work *work);
+
 bool getwinntversionnnumbers(DWORD *MajorVersionPtr, DWORD *MinorVersionPtr, DWORD *BuildNumberPtr);
 
 #endif /* !__NFS41_DAEMON_UTIL_H__ */
@@ -116,6 +116,10 @@ xdr_rpc_gss_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 	int		start, end, conf_state;
 	bool_t		xdr_stat;
 
+	/* the arguments are read back and overwritten below, so they
+	 * can't be sent by reference */
+	xdrrec_setnoref(xdrs);
+
 	/* Skip databody length. */
 	start = XDR_GETPOS(xdrs);
 	XDR_SETPOS(xdrs, start + 4);
@@ -104,6 +104,10 @@ xdr_rpc_sspi_wrap_data(XDR *xdrs, xdrproc_t xdr_func, caddr_t xdr_ptr,
 	bool_t xdr_stat;
 
     log_debug("in xdr_rpc_sspi_wrap_data()");
+
+	/* the arguments are read back and overwritten below, so they
+	 * can't be sent by reference */
+	xdrrec_setnoref(xdrs);
 
     /* Skip databody length. */
 	start = XDR_GETPOS(xdrs);
@@ -133,6 +133,34 @@ static struct clnt_ops *clnt_vc_ops(void);
 static bool_t time_not_ok(struct timeval *);
 static int read_vc(void *, void *, int);
 static int write_vc(void *, char *, int);
+static int write_vc_gather(void *, struct xdrrec_iov *, int);
+
+/*
+ * Calls in flight on a connection.  The sender registers a ct_call
+ * under its xid before the request goes out and then sleeps on
+ * cc_cv; the receive thread reads the header of every incoming
+ * record, looks the xid up in ct_calls[] and wakes exactly that
+ * caller, which decodes the rest of the reply itself.
+ */
+#define CT_XID_HASH_SIZE	256	/* power of two */
+#define CT_XID_HASH(xid)	((xid) & (CT_XID_HASH_SIZE - 1))
+
+/* poll interval of the receive thread, bounds clnt_destroy() latency */
+#define CT_RX_POLL_MS		100
+
+enum ct_call_state {
+	CT_CALL_WAITING = 0,	/* request sent, reply not seen yet */
+	CT_CALL_REPLY,		/* reply header read, caller owns ct_rxdrs */
+	CT_CALL_FAILED		/* receive side died, see cc_error */
+};
+
+struct ct_call {
+	struct ct_call	*cc_next;	/* xid hash chain */
+	u_int32_t	cc_xid;
+	enum ct_call_state cc_state;
+	cond_t		cc_cv;		/* signalled by the receive thread */
+	struct rpc_err	cc_error;
+};
 
 struct ct_data {
 	int		ct_fd;		/* connection's fd */
@@ -140,15 +168,27 @@ struct ct_data {
 	struct timeval	ct_wait;	/* wait interval in milliseconds */
 	bool_t          ct_waitset;	/* wait set by clnt_control? */
 	struct netbuf	ct_addr;	/* remote addr */
-	struct rpc_err	ct_error;
+	struct rpc_err	ct_error;	/* last call's, protected by ct_lock */
+	struct rpc_err	ct_tx_error;	/* send side, protected by the fd lock */
 	union {
 		char	ct_mcallc[MCALL_MSG_SIZE];	/* marshalled callmsg */
 		u_int32_t ct_mcalli;
 	} ct_u;
 	u_int		ct_mpos;	/* pos after marshal */
-	XDR		ct_xdrs;	/* XDR stream */
-    struct rpc_msg reply_msg;
-    bool_t use_stored_reply_msg;
+	XDR		ct_xdrs;	/* XDR stream, send side */
+	XDR		ct_rxdrs;	/* same stream, receive side */
+
+	/* receive side, protected by ct_lock */
+	mutex_t		ct_lock;
+	struct ct_call	*ct_calls[CT_XID_HASH_SIZE];
+	u_int		ct_ncalls;
+	struct ct_call	*ct_rx_owner;	/* call decoding from ct_rxdrs */
+	ULONGLONG	ct_rx_deadline;	/* ct_rx_owner's, 0 if there is none */
+	cond_t		ct_rx_cv;	/* signalled when ct_rx_owner clears */
+	bool_t		ct_rx_dead;	/* receive thread has exited */
+	struct rpc_err	ct_rx_error;	/* why it exited */
+	HANDLE		ct_rx_thread;
+	volatile bool_t	ct_rx_shutdown;
 };
 
 /*
@@ -157,11 +197,11 @@ struct ct_data {
  *      user may create more than one CLIENT handle with the same fd behind
  *      it.  Therfore, we allocate an array of flags (vc_fd_locks), protected
  *      by the clnt_fd_lock mutex, and an array (vc_cv) of condition variables
- *      similarly protected.  Vc_fd_lock[fd] == 1 => a call is active on some
- *      CLIENT handle created for that fd.
- *      The current implementation holds locks across the entire RPC and reply.
- *      Yes, this is silly, and as soon as this code is proven to work, this
- *      should be the first thing fixed.  One step at a time.
+ *      similarly protected.  Vc_fd_lock[fd] == 1 => a record is being
+ *      written on some CLIENT handle created for that fd.
+ *      The lock only covers marshalling and sending the call; replies
+ *      are demultiplexed by the receive thread (see struct ct_call), so
+ *      any number of calls may be outstanding on one connection.
  */
 static int      *vc_fd_locks;
 extern mutex_t  clnt_fd_lock;
@@ -213,158 +253,216 @@ static const char __no_mem_str[] = "out of memory";
 #define TIRPCDbgLeave()
 #endif /* DEBUG_TIRPC_CB_DEADLOCKS */
 
-/* callback thread */
-#define CALLBACK_TIMEOUT 5000
+/*
+ * Pending call table.  All of these are called with ct_lock held,
+ * except ct_call_register(), ct_call_cancel() and ct_rx_release().
+ */
+static bool_t
+ct_call_register(struct ct_data *ct, struct ct_call *call)
+{
+	struct ct_call **head = &ct->ct_calls[CT_XID_HASH(call->cc_xid)];
+	bool_t registered;
+
+	mutex_lock(&ct->ct_lock);
+	registered = !ct->ct_rx_dead;
+	if (registered) {
+		call->cc_next = *head;
+		*head = call;
+		ct->ct_ncalls++;
+	} else
+		call->cc_error = ct->ct_rx_error;
+	mutex_unlock(&ct->ct_lock);
+	return registered;
+}
+
+static struct ct_call *
+ct_call_unhash(struct ct_data *ct, u_int32_t xid)
+{
+	struct ct_call **prev = &ct->ct_calls[CT_XID_HASH(xid)];
+	struct ct_call *call;
+
+	for (call = *prev; call != NULL; prev = &call->cc_next,
+	    call = call->cc_next) {
+		if (call->cc_xid == xid) {
+			*prev = call->cc_next;
+			ct->ct_ncalls--;
+			return call;
+		}
+	}
+	return NULL;
+}
+
+static void
+ct_rx_release(struct ct_data *ct)
+{
+	mutex_lock(&ct->ct_lock);
+	ct->ct_rx_deadline = 0;
+	ct->ct_rx_owner = NULL;
+	cond_signal(&ct->ct_rx_cv);
+	mutex_unlock(&ct->ct_lock);
+}
+
+/* the request never made it out, forget about its reply */
+static void
+ct_call_cancel(struct ct_data *ct, struct ct_call *call)
+{
+	mutex_lock(&ct->ct_lock);
+	if (ct_call_unhash(ct, call->cc_xid) == NULL &&
+	    call->cc_state == CT_CALL_REPLY) {
+		ct->ct_rx_owner = NULL;
+		cond_signal(&ct->ct_rx_cv);
+	}
+	mutex_unlock(&ct->ct_lock);
+}
+
+static void
+ct_call_fail_all(struct ct_data *ct)
+{
+	struct ct_call *call;
+	int i;
+
+	ct->ct_rx_dead = TRUE;
+	for (i = 0; i < CT_XID_HASH_SIZE; i++) {
+		while ((call = ct->ct_calls[i]) != NULL) {
+			ct->ct_calls[i] = call->cc_next;
+			call->cc_state = CT_CALL_FAILED;
+			call->cc_error = ct->ct_rx_error;
+			cond_signal(&call->cc_cv);
+		}
+	}
+	ct->ct_ncalls = 0;
+}
+
+/* backchannel call: decode, hand to cb_fn and send the reply */
 #define	RQCRED_SIZE	400	/* this size is excessive */
-static unsigned int WINAPI clnt_cb_thread(void *args) 
+static void
+clnt_vc_process_cb(CLIENT *cl, struct rpc_msg *call_msg)
 {
-    int status = NO_ERROR;
-    CLIENT *cl = (CLIENT *)args;
 	struct ct_data *ct = (struct ct_data *) cl->cl_private;
 	XDR *xdrs = &(ct->ct_xdrs);
-    long saved_timeout_sec = ct->ct_wait.tv_sec;
-    long saved_timeout_usec = ct->ct_wait.tv_usec;
-    struct rpc_msg reply_msg;
-    char cred_area[2 * MAX_AUTH_BYTES + RQCRED_SIZE];
+	XDR *rxdrs = &(ct->ct_rxdrs);
+	struct rpc_msg reply_msg;
+	char cred_area[2 * MAX_AUTH_BYTES + RQCRED_SIZE];
+	cb_req header;
+	void *res = NULL;
+	int status;
 
-    (void)fprintf(stderr/*stdout*/,
-        "%04lx: cb: Callback thread running\n", (long)GetCurrentThreadId());
+	call_msg->rm_call.cb_cred.oa_base = cred_area;
+	call_msg->rm_call.cb_verf.oa_base = &(cred_area[MAX_AUTH_BYTES]);
+	if (!xdr_getcallbody(rxdrs, call_msg)) {
+		(void)fprintf(stderr,
+			"%04lx: cb: xdr_getcallbody failed\n",
+			(long)GetCurrentThreadId());
+		return;
+	}
+	(void)fprintf(stdout, "%04lx: cb: callbody: rpcvers=%d cb_prog=%d "
+		"cb_vers=%d cb_proc=%d\n",
+		(long)GetCurrentThreadId(),
+		(int)call_msg->rm_call.cb_rpcvers,
+		(int)call_msg->rm_call.cb_prog,
+		(int)call_msg->rm_call.cb_vers,
+		(int)call_msg->rm_call.cb_proc);
+	header.rq_prog = call_msg->rm_call.cb_prog;
+	header.rq_vers = call_msg->rm_call.cb_vers;
+	header.rq_proc = call_msg->rm_call.cb_proc;
+	header.xdr = rxdrs;
+	status = (*cl->cb_fn)(cl->cb_args, &header, &res);
+	if (status) {
+		(void)fprintf(stderr, "%04lx: cb: callback function failed "
+			"with %d\n", (long)GetCurrentThreadId(), status);
+	}
 
-#ifdef DEBUG_TIRPC_CB_DEADLOCKS
-    int cond_wait_timed_fails;
-    DWORD lasterr;
+	acquire_fd_lock(ct->ct_fd);
+	xdrs->x_op = XDR_ENCODE;
+	reply_msg.rm_xid = call_msg->rm_xid;
+	(void)fprintf(stdout, "%04lx: cb: replying to xid=%x\n",
+		(long)GetCurrentThreadId(), (int)call_msg->rm_xid);
+	reply_msg.rm_direction = REPLY;
+	reply_msg.rm_reply.rp_stat = MSG_ACCEPTED;
+	reply_msg.acpted_rply.ar_verf = _null_auth;
+	reply_msg.acpted_rply.ar_stat = status;
+	reply_msg.acpted_rply.ar_results.where = NULL;
+	reply_msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
+	xdr_replymsg(xdrs, &reply_msg);
+	if (!status) {
+		(*cl->cb_xdr)(xdrs, res); /* encode the results */
+		xdrs->x_op = XDR_FREE;
+		(*cl->cb_xdr)(xdrs, res); /* free the results */
+	}
+	if (! xdrrec_endofrecord(xdrs, 1)) {
+		(void)fprintf(stderr, "%04lx: cb: failed to send REPLY\n",
+			(long)GetCurrentThreadId());
+	}
+	release_fd_lock(ct->ct_fd, mask);
+}
 
-loop_restart:
-#endif /* DEBUG_TIRPC_CB_DEADLOCKS */
-    while(1) {
-        cb_req header;
-        void *res = NULL;
+/*
+ * Receive thread, one per connection.  Reads the xid of each record
+ * and passes ownership of ct_rxdrs to the matching caller; it does
+ * not look at the next record until that caller has decoded its
+ * reply and called ct_rx_release().  Replies nobody waits for any
+ * more (timed out calls) are skipped.  Backchannel calls are served
+ * right here, so cb_fn must not issue RPCs on this connection.
+ */
+static bool_t
+clnt_vc_rx_record(CLIENT *cl)
+{
+	struct ct_data *ct = (struct ct_data *) cl->cl_private;
+	XDR *rxdrs = &(ct->ct_rxdrs);
+	struct rpc_msg msg;
+	struct ct_call *call;
 
-#ifdef DEBUG_TIRPC_CB_DEADLOCKS
-        TIRPCDbgEnter();
-#endif /* DEBUG_TIRPC_CB_DEADLOCKS */
-        mutex_lock(&clnt_fd_lock);
-#ifdef DEBUG_TIRPC_CB_DEADLOCKS
-        cond_wait_timed_fails = 0;
-#endif /* DEBUG_TIRPC_CB_DEADLOCKS */
-	    while (vc_fd_locks[ct->ct_fd] ||
-                !ct->use_stored_reply_msg ||
-                (ct->use_stored_reply_msg && ct->reply_msg.rm_direction != CALL)) {
-            if (cl->shutdown)
-                break;
-	    if (!cond_wait_timed(&vc_cv[ct->ct_fd], &clnt_fd_lock,
-                CALLBACK_TIMEOUT)) {
-#ifdef DEBUG_TIRPC_CB_DEADLOCKS
-                lasterr = GetLastError();
-                if (cond_wait_timed_fails++ > 2) {
-                    mutex_unlock(&clnt_fd_lock);
-                    (void)fprintf(stdout,
-                        "%04lx: cb: possible deadlockm, lasterr=%d\n",
-                        (long)GetCurrentThreadId(), (int)lasterr);
-                    goto loop_restart;
-                }
-#endif /* DEBUG_TIRPC_CB_DEADLOCKS */
-                if (!vc_fd_locks[ct->ct_fd])
-                    break;
-	    }
+	rxdrs->x_op = XDR_DECODE;
+	if (!xdrrec_skiprecord(rxdrs) || !xdr_getxiddir(rxdrs, &msg))
+		return (FALSE);
+
+	if (msg.rm_direction == CALL) {
+		if (cl->cb_fn != NULL)
+			clnt_vc_process_cb(cl, &msg);
+		return (TRUE);
 	}
-	vc_fd_locks[ct->ct_fd] = 1;
-	mutex_unlock(&clnt_fd_lock);
+	if (msg.rm_direction != REPLY)
+		return (TRUE);
 
-        if (cl->shutdown) {
-            (void)fprintf(stdout,
-                "%04lx: cb: callback received shutdown signal\n",
-                (long)GetCurrentThreadId());
-            release_fd_lock(ct->ct_fd, mask);
-            goto out;
-        }
-
-        saved_timeout_sec = ct->ct_wait.tv_sec;
-        saved_timeout_usec = ct->ct_wait.tv_usec;
-        xdrs->x_op = XDR_DECODE;
-        if (ct->use_stored_reply_msg && ct->reply_msg.rm_direction == CALL) {
-            goto process_rpc_call;
-        } else if (!ct->use_stored_reply_msg) {
-            ct->ct_wait.tv_sec = ct->ct_wait.tv_usec = 0;
-            __xdrrec_setnonblock(xdrs, 0);
-		    if (!xdrrec_skiprecord(xdrs))
-                goto skip_process;
-            if (!xdr_getxiddir(xdrs, &ct->reply_msg)) {
-                goto skip_process;
-            }
-            if (ct->reply_msg.rm_direction == CALL) {
-                goto process_rpc_call;
-            } else {
-                if (ct->reply_msg.rm_direction == REPLY)
-                    ct->use_stored_reply_msg = TRUE;
-                goto skip_setlastfrag;
-            }
-        } else {
-            goto skip_setlastfrag;
-        }
-process_rpc_call:
-        //call to get call headers
-        ct->use_stored_reply_msg = FALSE;
-        ct->reply_msg.rm_call.cb_cred.oa_base = cred_area;
-        ct->reply_msg.rm_call.cb_verf.oa_base = &(cred_area[MAX_AUTH_BYTES]);
-        if (!xdr_getcallbody(xdrs, &ct->reply_msg)) {
-            (void)fprintf(stderr,
-                "%04lx: cb: xdr_getcallbody failed\n",
-                (long)GetCurrentThreadId());
-            goto skip_process;
-        } else
-            (void)fprintf(stdout, "%04lx: cb: callbody: rpcvers=%d cb_prog=%d cb_vers=%d cb_proc=%d\n",
-                (long)GetCurrentThreadId(),
-                (int)ct->reply_msg.rm_call.cb_rpcvers,
-                (int)ct->reply_msg.rm_call.cb_prog,
-                (int)ct->reply_msg.rm_call.cb_vers,
-                (int)ct->reply_msg.rm_call.cb_proc);
-        header.rq_prog = ct->reply_msg.rm_call.cb_prog;
-        header.rq_vers = ct->reply_msg.rm_call.cb_vers;
-        header.rq_proc = ct->reply_msg.rm_call.cb_proc;
-        header.xdr = xdrs;
-        status = (*cl->cb_fn)(cl->cb_args, &header, &res);
-        if (status) {
-            (void)fprintf(stderr, "%04lx: cb: callback function failed with %d\n",
-                (long)GetCurrentThreadId(), status);
-        }
+	mutex_lock(&ct->ct_lock);
+	call = ct_call_unhash(ct, msg.rm_xid);
+	if (call != NULL) {
+		call->cc_state = CT_CALL_REPLY;
+		ct->ct_rx_owner = call;
+		cond_signal(&call->cc_cv);
+		while (ct->ct_rx_owner != NULL)
+			cond_wait(&ct->ct_rx_cv, &ct->ct_lock);
+	}
+	mutex_unlock(&ct->ct_lock);
+	return (TRUE);
+}
 
-        xdrs->x_op = XDR_ENCODE;
-        __xdrrec_setblock(xdrs);
-        reply_msg.rm_xid = ct->reply_msg.rm_xid;
-        (void)fprintf(stdout, "%04lx: cb: replying to xid=%x\n",
-            (long)GetCurrentThreadId(),
-            (int)ct->reply_msg.rm_xid);
-        ct->reply_msg.rm_xid = 0;
-        reply_msg.rm_direction = REPLY;
-        reply_msg.rm_reply.rp_stat = MSG_ACCEPTED;
-        reply_msg.acpted_rply.ar_verf = _null_auth;
-        reply_msg.acpted_rply.ar_stat = status;
-        reply_msg.acpted_rply.ar_results.where = NULL;
-        reply_msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
-        xdr_replymsg(xdrs, &reply_msg);
-        if (!status) {
-            (*cl->cb_xdr)(xdrs, res); /* encode the results */
-            xdrs->x_op = XDR_FREE;
-            (*cl->cb_xdr)(xdrs, res); /* free the results */
-        }
-        if (! xdrrec_endofrecord(xdrs, 1)) {
-            (void)fprintf(stderr, "%04lx: cb: failed to send REPLY\n",
-                (long)GetCurrentThreadId());
-        }
-skip_process:
-        ct->reply_msg.rm_direction = -1;
-        xdrrec_setlastfrag(xdrs);
-skip_setlastfrag:
-        ct->ct_wait.tv_sec = saved_timeout_sec;
-        ct->ct_wait.tv_usec = saved_timeout_usec;
-        release_fd_lock(ct->ct_fd, mask);
-#ifdef DEBUG_TIRPC_CB_DEADLOCKS
-        TIRPCDbgLeave();
-#endif /* DEBUG_TIRPC_CB_DEADLOCKS */
-    }
-out:
-    return status;
+static unsigned int WINAPI
+clnt_vc_rx_thread(void *args)
+{
+	CLIENT *cl = (CLIENT *)args;
+	struct ct_data *ct = (struct ct_data *) cl->cl_private;
+	bool_t more;
+
+	do {
+		more = FALSE;
+		TIRPCDbgEnter();
+		more = clnt_vc_rx_record(cl);
+		TIRPCDbgLeave();
+	} while (more);
+
+	mutex_lock(&ct->ct_lock);
+	if (ct->ct_rx_error.re_status == RPC_SUCCESS)
+		ct->ct_rx_error.re_status = RPC_CANTRECV;
+	ct_call_fail_all(ct);
+	mutex_unlock(&ct->ct_lock);
+
+	if (!ct->ct_rx_shutdown)
+		(void)fprintf(stderr, "%04lx: rx: receive thread exiting, "
+			"status=%d errno=%d\n", (long)GetCurrentThreadId(),
+			(int)ct->ct_rx_error.re_status,
+			(int)ct->ct_rx_error.re_errno);
+	return 0;
 }
 /*
  * Create a client handle for a connection.
@@ -416,7 +514,10 @@ clnt_vc_create(fd, raddr, prog, vers, sendsz, recvsz, cb_xdr, cb_fn, cb_args)
 		rpc_createerr.cf_error.re_errno = errno;
 		goto err;
 	}
-	ct->ct_addr.buf = NULL;
+	memset(ct, 0, sizeof(*ct));
+	ct->ct_rx_thread = INVALID_HANDLE_VALUE;
+	mutex_init(&ct->ct_lock, 0);
+	cond_init(&ct->ct_rx_cv, 0, (void *) 0);
 #ifndef _WIN32
 	sigfillset(&newmask);
 	thr_sigsetmask(SIG_SETMASK, &newmask, &mask);
@@ -495,7 +596,6 @@ clnt_vc_create(fd, raddr, prog, vers, sendsz, recvsz, cb_xdr, cb_fn, cb_args)
 	memcpy(ct->ct_addr.buf, raddr->buf, raddr->len);
 	ct->ct_addr.len = raddr->len;
 	ct->ct_addr.maxlen = raddr->maxlen;
-    ct->use_stored_reply_msg = FALSE;
 
 	/*
 	 * Initialize call message
@@ -532,23 +632,34 @@ clnt_vc_create(fd, raddr, prog, vers, sendsz, recvsz, cb_xdr, cb_fn, cb_args)
 	recvsz = __rpc_get_t_size(si.si_af, si.si_proto, (int)recvsz);
 	xdrrec_create(&(ct->ct_xdrs), sendsz, recvsz,
 	    cl->cl_private, read_vc, write_vc);
+	xdrrec_setwritev(&(ct->ct_xdrs), write_vc_gather);
+	/*
+	 * Senders and the receive thread use the two halves of one
+	 * RECSTREAM, but each needs its own x_op.
+	 */
+	ct->ct_rxdrs = ct->ct_xdrs;
 
-    if (cb_xdr && cb_fn && cb_args) {
-        cl->cb_xdr = cb_xdr;
-        cl->cb_fn = cb_fn;
-        cl->cb_args = cb_args;
-        cl->cb_thread = (HANDLE)_beginthreadex(NULL,
-            0, clnt_cb_thread, cl, 0, NULL);
-        if (cl->cb_thread == INVALID_HANDLE_VALUE) {
-            (void)fprintf(stderr, "%04lx: _beginthreadex() failed %d\n",
-                (long)GetCurrentThreadId(),
-                GetLastError());
-            goto err;
-        } else
-            fprintf(stdout, "%04lx: started the callback thread %04lx\n",
-                (long)GetCurrentThreadId(), (long)GetThreadId(cl->cb_thread));
-    } else
-        cl->cb_thread = INVALID_HANDLE_VALUE;
+	if (cb_xdr && cb_fn && cb_args) {
+		cl->cb_xdr = cb_xdr;
+		cl->cb_fn = cb_fn;
+		cl->cb_args = cb_args;
+	} else
+		cl->cb_fn = NULL;
+	cl->cb_thread = INVALID_HANDLE_VALUE;
+
+	ct->ct_rx_thread = (HANDLE)_beginthreadex(NULL,
+		0, clnt_vc_rx_thread, cl, 0, NULL);
+	if (ct->ct_rx_thread == INVALID_HANDLE_VALUE ||
+	    ct->ct_rx_thread == NULL) {
+		(void)fprintf(stderr, "%04lx: _beginthreadex() failed %d\n",
+			(long)GetCurrentThreadId(),
+			GetLastError());
+		ct->ct_rx_thread = INVALID_HANDLE_VALUE;
+		XDR_DESTROY(&(ct->ct_xdrs));
+		goto err;
+	}
+	fprintf(stdout, "%04lx: started the receive thread %04lx\n",
+		(long)GetCurrentThreadId(), (long)GetThreadId(ct->ct_rx_thread));
 	return (cl);
 
 err:
@@ -576,18 +687,20 @@ clnt_vc_call(cl, proc, xdr_args, args_ptr, xdr_results, results_ptr, timeout)
 {
 	struct ct_data *ct = (struct ct_data *) cl->cl_private;
 	XDR *xdrs = &(ct->ct_xdrs);
-	u_int32_t x_id;
+	XDR *rxdrs = &(ct->ct_rxdrs);
+	struct ct_call call;
+	struct rpc_msg reply_msg;
 	u_int32_t *msg_x_id = &ct->ct_u.ct_mcalli;    /* yuk */
-	bool_t shipnow;
-	static int refreshes = 2;
-    u_int seq = (u_int)-1;
-    time_t start_send, time_now;
+	bool_t shipnow, rejected;
+	int refreshes = 2;
+	u_int seq = (u_int)-1;
+	ULONGLONG now, deadline;
 #ifndef _WIN32
 	sigset_t mask, newmask;
 #else
 	/* XXX Need Windows signal/event stuff XXX */
 #endif
-    enum clnt_stat status = RPC_SYSTEMERROR;
+	enum clnt_stat status = RPC_SYSTEMERROR;
 
 	TIRPCDbgEnter();
 
@@ -600,166 +713,140 @@ clnt_vc_call(cl, proc, xdr_args, args_ptr, xdr_results, results_ptr, timeout)
 	/* XXX Need Windows signal/event stuff XXX */
 #endif
 
-    acquire_fd_lock(ct->ct_fd);
-
-	if (!ct->ct_waitset) {
-		/* If time is not within limits, we ignore it. */
-		if (time_not_ok(&timeout) == FALSE)
-			ct->ct_wait = timeout;
-	}
+	/*
+	 * ct_wait only changes through clnt_control(), other callers on
+	 * the handle may use different timeouts at the same time
+	 */
+	if (ct->ct_waitset || time_not_ok(&timeout))
+		timeout = ct->ct_wait;
 
 	shipnow =
 	    (xdr_results == NULL && timeout.tv_sec == 0
 	    && timeout.tv_usec == 0) ? FALSE : TRUE;
 
+	cond_init(&call.cc_cv, 0, (void *) 0);
+
 call_again:
-    __xdrrec_setblock(xdrs);
+	acquire_fd_lock(ct->ct_fd);
 	xdrs->x_op = XDR_ENCODE;
-	ct->ct_error.re_status = RPC_SUCCESS;
-	x_id = ntohl(--(*msg_x_id));
+	ct->ct_tx_error.re_status = RPC_SUCCESS;
+	call.cc_error.re_status = RPC_SUCCESS;
+	call.cc_state = CT_CALL_WAITING;
+	call.cc_xid = ntohl(--(*msg_x_id));
+
+	/* register before sending, the reply can beat us back */
+	if (shipnow && !ct_call_register(ct, &call)) {
+		release_fd_lock(ct->ct_fd, mask);
+		goto out;
+	}
 
 	if ((! XDR_PUTBYTES(xdrs, ct->ct_u.ct_mcallc, ct->ct_mpos)) ||
 	    (! XDR_PUTINT32(xdrs, (int32_t *)&proc)) ||
 	    (! AUTH_MARSHALL(cl->cl_auth, xdrs, &seq)) ||
 	    (! AUTH_WRAP(cl->cl_auth, xdrs, xdr_args, args_ptr))) {
-		if (ct->ct_error.re_status == RPC_SUCCESS)
-			ct->ct_error.re_status = RPC_CANTENCODEARGS;
+		if (ct->ct_tx_error.re_status == RPC_SUCCESS)
+			ct->ct_tx_error.re_status = RPC_CANTENCODEARGS;
 		(void)xdrrec_endofrecord(xdrs, TRUE);
-        goto out;
+		call.cc_error = ct->ct_tx_error;
+		release_fd_lock(ct->ct_fd, mask);
+		if (shipnow)
+			ct_call_cancel(ct, &call);
+		goto out;
 	}
 
 	if (! xdrrec_endofrecord(xdrs, shipnow)) {
-        ct->ct_error.re_status = RPC_CANTSEND;
-        goto out;
+		ct->ct_tx_error.re_status = RPC_CANTSEND;
+		call.cc_error = ct->ct_tx_error;
+		release_fd_lock(ct->ct_fd, mask);
+		if (shipnow)
+			ct_call_cancel(ct, &call);
+		goto out;
 	}
+	release_fd_lock(ct->ct_fd, mask);
 	if (! shipnow) {
-		release_fd_lock(ct->ct_fd, mask);
 		status = RPC_SUCCESS;
 		goto out_status;
 	}
 
-#ifdef NO_CB_4_KRB5P
-    if (cl->cb_thread != INVALID_HANDLE_VALUE)
-        release_fd_lock(ct->ct_fd, mask);
-#endif
 	/*
-	 * Keep receiving until we get a valid transaction id
+	 * Wait for the receive thread to hand us the reply
 	 */
+	deadline = GetTickCount64() + (ULONGLONG)timeout.tv_sec * 1000 +
+	    timeout.tv_usec / 1000;
+	mutex_lock(&ct->ct_lock);
+	while (call.cc_state == CT_CALL_WAITING) {
+		now = GetTickCount64();
+		if (now >= deadline) {
+			(void)ct_call_unhash(ct, call.cc_xid);
+			call.cc_error.re_status = RPC_TIMEDOUT;
+			break;
+		}
+		(void)cond_wait_timed(&call.cc_cv, &ct->ct_lock,
+		    (DWORD)(deadline - now));
+	}
+	if (call.cc_state == CT_CALL_REPLY)
+		ct->ct_rx_deadline = deadline;
+	mutex_unlock(&ct->ct_lock);
+	if (call.cc_state != CT_CALL_REPLY)
+		goto out;
 
-    time(&start_send);
-	while (TRUE) {
-#ifdef NO_CB_4_KRB5P
-        if (cl->cb_thread != INVALID_HANDLE_VALUE) {
-            mutex_lock(&clnt_fd_lock);
-	        while ((vc_fd_locks[ct->ct_fd]) ||
-                    (ct->reply_msg.rm_xid && ct->reply_msg.rm_xid != x_id))
-		        cond_wait(&vc_cv[ct->ct_fd], &clnt_fd_lock);
-	        vc_fd_locks[ct->ct_fd] = 1;
-	        mutex_unlock(&clnt_fd_lock);
-        }
-#endif
-        __xdrrec_setnonblock(xdrs, 0);
-        xdrs->x_op = XDR_DECODE;
-		ct->reply_msg.acpted_rply.ar_verf = _null_auth;
-		ct->reply_msg.acpted_rply.ar_results.where = NULL;
-		ct->reply_msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
-        if (!ct->use_stored_reply_msg) {
-		    if (!xdrrec_skiprecord(xdrs)) {
-                if (ct->ct_error.re_status != RPC_CANTRECV) {
-                    time(&time_now);
-                    if (time_now - start_send >= timeout.tv_sec) {
-                        ct->ct_error.re_status = RPC_TIMEDOUT;
-                        goto out;
-                    }
-#ifdef NO_CB_4_KRB5P
-                    if (cl->cb_thread != INVALID_HANDLE_VALUE)  
-#endif
-			            release_fd_lock(ct->ct_fd, mask);
-                    SwitchToThread();
-			        continue;
-                }
-                goto out;
-		    }
-            if (!xdr_getxiddir(xdrs, &ct->reply_msg)) {
-			    if (ct->ct_error.re_status == RPC_SUCCESS) {
-#ifdef NO_CB_4_KRB5P
-                    if (cl->cb_thread != INVALID_HANDLE_VALUE)  
-#endif
-                        release_fd_lock(ct->ct_fd, mask);
-                    SwitchToThread();
-                    continue;
-                }
-                goto out;
-            } 
-
-            if (ct->reply_msg.rm_direction != REPLY) {
-                if (cl->cb_thread == INVALID_HANDLE_VALUE) {
-                    ct->reply_msg.rm_xid = 0;
-                } else {
-                    ct->use_stored_reply_msg = TRUE;
-                }
-                release_fd_lock(ct->ct_fd, mask);
-                SwitchToThread();
-                continue;
-            }
-        }
-		if (ct->reply_msg.rm_xid == x_id) {
-            ct->use_stored_reply_msg = FALSE;
-            ct->reply_msg.rm_xid = 0;
-            if (!xdr_getreplyunion(xdrs, &ct->reply_msg))
-                goto out;
-			break;
-        }
-        else {
-            time(&time_now);
-            if (time_now - start_send >= timeout.tv_sec) {
-                ct->ct_error.re_status = RPC_TIMEDOUT;
-                goto out;
-            }
-            ct->use_stored_reply_msg = TRUE;
-#ifdef NO_CB_4_KRB5P
-            if (cl->cb_thread != INVALID_HANDLE_VALUE)  
-#endif
-                release_fd_lock(ct->ct_fd, mask);
-            SwitchToThread();
-        }
+	/*
+	 * We own ct_rxdrs until ct_rx_release(), process header
+	 */
+	rxdrs->x_op = XDR_DECODE;
+	reply_msg.rm_xid = call.cc_xid;
+	reply_msg.rm_direction = REPLY;
+	reply_msg.acpted_rply.ar_verf = _null_auth;
+	reply_msg.acpted_rply.ar_results.where = NULL;
+	reply_msg.acpted_rply.ar_results.proc = (xdrproc_t)xdr_void;
+	if (!xdr_getreplyunion(rxdrs, &reply_msg)) {
+		call.cc_error.re_status = RPC_CANTDECODERES;
+		goto out_release;
 	}
 
+	_seterr_reply(&reply_msg, &call.cc_error);
+	rejected = (call.cc_error.re_status != RPC_SUCCESS);
+	if (!rejected) {
+		if (! AUTH_VALIDATE(cl->cl_auth,
+		    &reply_msg.acpted_rply.ar_verf, seq)) {
+			call.cc_error.re_status = RPC_AUTHERROR;
+			call.cc_error.re_why = AUTH_INVALIDRESP;
+		}
+		else if (! AUTH_UNWRAP(cl->cl_auth, rxdrs, xdr_results,
+		    results_ptr, seq)) {
+			if (call.cc_error.re_status == RPC_SUCCESS)
+				call.cc_error.re_status = RPC_CANTDECODERES;
+		}
+	}
+	/* free verifier ... */
+	if (reply_msg.acpted_rply.ar_verf.oa_base != NULL) {
+		rxdrs->x_op = XDR_FREE;
+		(void)xdr_opaque_auth(rxdrs, &(reply_msg.acpted_rply.ar_verf));
+	}
+	if (!rejected && call.cc_error.re_status != RPC_SUCCESS)
+		goto out_release;
+	ct_rx_release(ct);
+
 	/*
-	 * process header
+	 * maybe our credentials need to be refreshed ... only after
+	 * ct_rxdrs is released, refreshing may call us recursively
 	 */
-	_seterr_reply(&ct->reply_msg, &(ct->ct_error));
-	if (ct->ct_error.re_status == RPC_SUCCESS) {
-		if (! AUTH_VALIDATE(cl->cl_auth,
-		    &ct->reply_msg.acpted_rply.ar_verf, seq)) {
-			ct->ct_error.re_status = RPC_AUTHERROR;
-			ct->ct_error.re_why = AUTH_INVALIDRESP;
-        }
-        else if (! AUTH_UNWRAP(cl->cl_auth, xdrs, xdr_results, results_ptr, seq)) {
-			if (ct->ct_error.re_status == RPC_SUCCESS)
-				ct->ct_error.re_status = RPC_CANTDECODERES;
-		}
-		/* free verifier ... */
-		if (ct->reply_msg.acpted_rply.ar_verf.oa_base != NULL) {
-			xdrs->x_op = XDR_FREE;
-			(void)xdr_opaque_auth(xdrs,
-			    &(ct->reply_msg.acpted_rply.ar_verf));
-		}
-	}  /* end successful completion */
-	else {
-		if (ct->reply_msg.acpted_rply.ar_verf.oa_base != NULL) {
-			xdrs->x_op = XDR_FREE;
-			(void)xdr_opaque_auth(xdrs,
-			    &(ct->reply_msg.acpted_rply.ar_verf));
-		}
-		/* maybe our credentials need to be refreshed ... */
-		if (refreshes-- > 0 && AUTH_REFRESH(cl->cl_auth, &ct->reply_msg))
-			goto call_again;
-	}  /* end of unsuccessful completion */
-    ct->reply_msg.rm_direction = -1;
+	if (rejected && refreshes-- > 0 &&
+	    AUTH_REFRESH(cl->cl_auth, &reply_msg))
+		goto call_again;
+	goto out;
+
+out_release:
+	/* a short read mid-reply kills the connection, report that */
+	if (ct->ct_rx_error.re_status != RPC_SUCCESS)
+		call.cc_error = ct->ct_rx_error;
+	ct_rx_release(ct);
 out:
-    status = ct->ct_error.re_status;
-	release_fd_lock(ct->ct_fd, mask);
+	/* callers share the handle, clnt_geterr() reports the last one */
+	mutex_lock(&ct->ct_lock);
+	ct->ct_error = call.cc_error;
+	mutex_unlock(&ct->ct_lock);
+	status = call.cc_error.re_status;
 out_status:
 	TIRPCDbgLeave();
 	return status;
@@ -776,7 +863,9 @@ clnt_vc_geterr(cl, errp)
 	assert(errp != NULL);
 
 	ct = (struct ct_data *) cl->cl_private;
+	mutex_lock(&ct->ct_lock);
 	*errp = ct->ct_error;
+	mutex_unlock(&ct->ct_lock);
 }
 
 static bool_t
@@ -978,25 +1067,26 @@ clnt_vc_destroy(cl)
 #else
 	/* XXX Need Windows signal/event stuff XXX */
 #endif
+	/*
+	 * Stop the receive thread first, it may need the fd lock
+	 * to answer a backchannel call
+	 */
+	if (ct->ct_rx_thread != INVALID_HANDLE_VALUE) {
+		DWORD status;
+		fprintf(stdout, "%04lx: sending shutdown to receive thread %04lx\n",
+			(long)GetCurrentThreadId(), (long)GetThreadId(ct->ct_rx_thread));
+		ct->ct_rx_shutdown = TRUE;
+		status = WaitForSingleObjectEx(ct->ct_rx_thread, INFINITE, FALSE);
+		assert(status == WAIT_OBJECT_0);
+		(void)CloseHandle(ct->ct_rx_thread);
+		fprintf(stdout, "%04lx: terminated receive thread\n",
+			(long)GetCurrentThreadId());
+	}
+
 	mutex_lock(&clnt_fd_lock);
 	while (vc_fd_locks[ct_fd])
 		cond_wait(&vc_cv[ct_fd], &clnt_fd_lock);
 
-    if (cl->cb_thread != INVALID_HANDLE_VALUE) {
-        int status;
-        fprintf(stdout, "%04lx: sending shutdown to callback thread %04lx\n",
-            (long)GetCurrentThreadId(), (long)GetThreadId(cl->cb_thread));
-        cl->shutdown = 1;
-        cond_signal(&vc_cv[ct_fd]);
-        mutex_unlock(&clnt_fd_lock);
-        status = WaitForSingleObjectEx(cl->cb_thread, INFINITE, FALSE);
-        assert(status == WAIT_OBJECT_0);
-        fprintf(stdout, "%04lx: terminated callback thread\n", (long)GetCurrentThreadId());
-        mutex_lock(&clnt_fd_lock);
-        while (vc_fd_locks[ct_fd])
-            cond_wait(&vc_cv[ct_fd], &clnt_fd_lock);
-    }
-
 	if (ct->ct_closeit && ct->ct_fd != -1) {
 		(void)wintirpc_close(ct->ct_fd);
 		ct->ct_fd = -1;
@@ -1032,25 +1122,43 @@ read_vc(ctp, buf, len)
 	*/
 	struct ct_data *ct = (struct ct_data *)ctp;
 	struct pollfd fd;
-	int milliseconds = ct->ct_wait.tv_usec;
 
 	if (len == 0)
 		return (0);
+	/* a failed read leaves the stream in the middle of a record */
+	if (ct->ct_rx_error.re_status != RPC_SUCCESS)
+		return (-1);
 	fd.fd = wintirpc_fd2sockethandle(ct->ct_fd);
 	fd.events = POLLIN;
 	for (;;) {
-		switch (poll(&fd, 1, milliseconds)) {
+		switch (poll(&fd, 1, CT_RX_POLL_MS)) {
 		case 0:
-			ct->ct_error.re_status = RPC_TIMEDOUT;
-			return (-1);
+			if (ct->ct_rx_shutdown) {
+				ct->ct_rx_error.re_status = RPC_CANTRECV;
+				ct->ct_rx_error.re_errno = WSAESHUTDOWN;
+				return (-1);
+			}
+			/*
+			 * The receive thread waits for the next record as
+			 * long as it takes; pending calls time out on their
+			 * own in clnt_vc_call().  Only a caller that stalls
+			 * in the middle of its reply gives up here, which
+			 * takes the connection down with it.
+			 */
+			if (ct->ct_rx_deadline != 0 &&
+			    GetTickCount64() >= ct->ct_rx_deadline) {
+				ct->ct_rx_error.re_status = RPC_TIMEDOUT;
+				return (-1);
+			}
+			continue;
 
 		case SOCKET_ERROR:
 			errno = WSAGetLastError();
 			if (errno == WSAEINTR)
 				continue;
-			ct->ct_error.re_status = RPC_CANTRECV;
-			ct->ct_error.re_errno = errno;
-			return (-2);
+			ct->ct_rx_error.re_status = RPC_CANTRECV;
+			ct->ct_rx_error.re_errno = errno;
+			return (-1);
 		}
 		break;
 	}
@@ -1061,14 +1169,14 @@ read_vc(ctp, buf, len)
 	switch (len) {
 	case 0:
 		/* premature eof */
-		ct->ct_error.re_errno = WSAECONNRESET;
-		ct->ct_error.re_status = RPC_CANTRECV;
+		ct->ct_rx_error.re_errno = WSAECONNRESET;
+		ct->ct_rx_error.re_status = RPC_CANTRECV;
 		len = -1;  /* it's really an error */
 		break;
 
 	case SOCKET_ERROR:
-		ct->ct_error.re_errno = errno;
-		ct->ct_error.re_status = RPC_CANTRECV;
+		ct->ct_rx_error.re_errno = errno;
+		ct->ct_rx_error.re_status = RPC_CANTRECV;
 		break;
 	}
 	return (len);
@@ -1085,14 +1193,39 @@ write_vc(ctp, buf, len)
 
 	for (cnt = len; cnt > 0; cnt -= i, buf += i) {
 	    if ((i = (int)wintirpc_send(ct->ct_fd, buf, (size_t)cnt, 0)) == SOCKET_ERROR) {
-		ct->ct_error.re_errno = WSAGetLastError();
-		ct->ct_error.re_status = RPC_CANTSEND;
+		ct->ct_tx_error.re_errno = WSAGetLastError();
+		ct->ct_tx_error.re_status = RPC_CANTSEND;
 		return (-1);
 	    }
 	}
 	return (len);
 }
 
+static int
+write_vc_gather(ctp, iov, count)
+	void *ctp;
+	struct xdrrec_iov *iov;
+	int count;
+{
+	struct ct_data *ct = (struct ct_data *)ctp;
+	WSABUF bufs[XDRREC_MAX_IOV];
+	wintirpc_ssize_t sent;
+	int i;
+
+	/* flush_out_refs() resends whatever a partial send left over */
+	for (i = 0; i < count; i++) {
+		bufs[i].buf = iov[i].iov_base;
+		bufs[i].len = iov[i].iov_len;
+	}
+	if ((sent = wintirpc_sendv(ct->ct_fd, bufs, (DWORD)count, 0))
+	    == SOCKET_ERROR) {
+		ct->ct_tx_error.re_errno = WSAGetLastError();
+		ct->ct_tx_error.re_status = RPC_CANTSEND;
+		return (-1);
+	}
+	return ((int)sent);
+}
+
 static struct clnt_ops *
 clnt_vc_ops()
 {
@@ -326,6 +326,16 @@ wintirpc_ssize_t wintirpc_send(int s, const char *buf, size_t len, int flags)
 	return send(_get_osfhandle(s), buf, (int)len, flags);
 }
 
+wintirpc_ssize_t wintirpc_sendv(int s, WSABUF *bufs, DWORD count, int flags)
+{
+	DWORD sent = 0;
+
+	if (WSASend(_get_osfhandle(s), bufs, count, &sent, (DWORD)flags,
+		NULL, NULL) == SOCKET_ERROR)
+		return SOCKET_ERROR;
+	return (wintirpc_ssize_t)sent;
+}
+
 wintirpc_ssize_t wintirpc_sendto(int s, const char *buf, size_t len, int flags,
 	const struct sockaddr *to, socklen_t tolen)
 {
@@ -77,6 +77,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <rpc/types.h>
 #include <rpc/xdr.h>
@@ -124,6 +125,27 @@ static const struct  xdr_ops xdrrec_ops = {
 
 #define LAST_FRAG ((u_int32_t)(1 << 31))
 
+/*
+ * When the input buffer is empty, requests for at least this many bytes
+ * are read from the transport directly into the caller's memory.
+ */
+#define DIRECT_READ_MIN 4096
+
+/*
+ * Most bytes fill_input_buf() asks the transport for at once.  The part
+ * of a large opaque that arrives in the same fill as the header before
+ * it is still copied out of the input buffer, so the fill is kept small
+ * to bound that copy; the rest of the opaque is read directly.  Large
+ * replies that are decoded item by item, like READDIR, take more reads.
+ */
+#define FILL_READ_MAX (2 * DIRECT_READ_MIN)
+
+/*
+ * Smallest buffer xdrrec_putbytes_ref() sends in place; anything less
+ * is cheaper to copy.
+ */
+#define DIRECT_WRITE_MIN 4096
+
 typedef struct rec_strm {
 	char *tcp_handle;
 	/*
@@ -135,6 +157,19 @@ typedef struct rec_strm {
 	char *out_boundry;	/* data cannot up to this address */
 	u_int32_t *frag_header;	/* beginning of curren fragment */
 	bool_t frag_sent;	/* true if buffer sent in middle of record */
+	/*
+	 * caller buffers sent in place of out_base bytes, see
+	 * xdrrec_putbytes_ref(); all belong to the current fragment
+	 */
+	int (*writevit)(void *, struct xdrrec_iov *, int);
+	struct {
+		u_int at;	/* offset in out_base to send it before */
+		char *base;
+		u_int len;
+	} out_refs[XDRREC_MAX_REFS];
+	u_int out_nrefs;
+	u_int out_reflen;	/* sum of out_refs[].len */
+	bool_t out_noref;	/* copy them instead, see xdrrec_setnoref() */
 	/*
 	 * in-coming bits
 	 */
@@ -160,8 +195,10 @@ typedef struct rec_strm {
 
 static u_int	fix_buf_size(u_int);
 static bool_t	flush_out(RECSTREAM *, bool_t);
+static bool_t	flush_out_refs(RECSTREAM *);
 static bool_t	fill_input_buf(RECSTREAM *);
 static bool_t	get_input_bytes(RECSTREAM *, char *, u_int);
+static bool_t	get_input_bytes_direct(RECSTREAM *, char *, size_t, size_t *);
 static bool_t	set_input_fragment(RECSTREAM *);
 static bool_t	skip_input_bytes(RECSTREAM *, u_int);
 static bool_t	realloc_stream(RECSTREAM *, u_int);
@@ -225,6 +262,10 @@ xdrrec_create(xdrs, sendsize, recvsize, tcp_handle, readit, writeit)
 	rstrm->out_finger += sizeof(u_int32_t);
 	rstrm->out_boundry += sendsize;
 	rstrm->frag_sent = FALSE;
+	rstrm->writevit = NULL;
+	rstrm->out_nrefs = 0;
+	rstrm->out_reflen = 0;
+	rstrm->out_noref = FALSE;
 	rstrm->in_size = recvsize;
 	rstrm->in_boundry = rstrm->in_base;
 	rstrm->in_finger = (rstrm->in_boundry += recvsize);
@@ -361,6 +402,7 @@ xdrrec_getpos(xdrs)
 
 		case XDR_ENCODE:
 			pos += PtrToLong(rstrm->out_finger) - PtrToLong(rstrm->out_base);
+			pos += rstrm->out_reflen;
 			break;
 
 		case XDR_DECODE:
@@ -388,6 +430,9 @@ xdrrec_setpos(xdrs, pos)
 		switch (xdrs->x_op) {
 
 		case XDR_ENCODE:
+			/* can't seek across referenced caller buffers */
+			if (rstrm->out_nrefs)
+				break;
 			newpos = rstrm->out_finger - delta;
 			if ((newpos > (char *)(void *)(rstrm->frag_header)) &&
 				(newpos < rstrm->out_boundry)) {
@@ -483,6 +528,71 @@ xdrrec_destroy(xdrs)
  * Exported routines to manage xdr records
  */
 
+/*
+ * Give the stream a gather writer, which lets xdrrec_putbytes_ref()
+ * send caller buffers in place instead of copying them into out_base.
+ * The writer returns the number of bytes it sent, which may be less
+ * than asked for, or -1 on error.
+ */
+void
+xdrrec_setwritev(xdrs, writevit)
+	XDR *xdrs;
+	int (*writevit)(void *, struct xdrrec_iov *, int);
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+	rstrm->writevit = writevit;
+}
+
+/*
+ * Like XDR_PUTBYTES(), but large buffers on an xdrrec stream with a
+ * gather writer are only referenced, and go out with the rest of the
+ * fragment in one vectored write.  The buffer must stay valid until
+ * xdrrec_endofrecord().  Falls back to XDR_PUTBYTES() on other streams.
+ */
+bool_t
+xdrrec_putbytes_ref(xdrs, addr, len)
+	XDR *xdrs;
+	const char *addr;
+	u_int len;
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	if (xdrs->x_ops != &xdrrec_ops || xdrs->x_op != XDR_ENCODE ||
+	    rstrm->writevit == NULL || rstrm->out_noref ||
+	    len < DIRECT_WRITE_MIN)
+		return (XDR_PUTBYTES(xdrs, addr, len));
+
+	if (rstrm->out_nrefs == XDRREC_MAX_REFS) {
+		rstrm->frag_sent = TRUE;
+		if (! flush_out(rstrm, FALSE))
+			return (FALSE);
+	}
+	rstrm->out_refs[rstrm->out_nrefs].at = (u_int)(
+	    PtrToUlong(rstrm->out_finger) - PtrToUlong(rstrm->out_base));
+	rstrm->out_refs[rstrm->out_nrefs].base = (char *)addr;
+	rstrm->out_refs[rstrm->out_nrefs].len = len;
+	rstrm->out_nrefs++;
+	rstrm->out_reflen += len;
+	return (TRUE);
+}
+
+/*
+ * Make xdrrec_putbytes_ref() copy until the end of the current record.
+ * For encoders that seek back over what they encoded, or read it back
+ * with XDR_INLINE(), such as the RPCSEC_GSS integrity and privacy
+ * wrappers; neither can cross a referenced buffer.  A no-op on other
+ * streams.
+ */
+void
+xdrrec_setnoref(xdrs)
+	XDR *xdrs;
+{
+	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
+
+	if (xdrs->x_ops == &xdrrec_ops)
+		rstrm->out_noref = TRUE;
+}
+
 /*
  * Before reading (deserializing from the stream, one should always call
  * this procedure to guarantee proper record alignment.
@@ -561,7 +671,8 @@ xdrrec_endofrecord(xdrs, sendnow)
 	RECSTREAM *rstrm = (RECSTREAM *)(xdrs->x_private);
 	u_long len;  /* fragment length */
 
-	if (sendnow || rstrm->frag_sent ||
+	rstrm->out_noref = FALSE;
+	if (sendnow || rstrm->frag_sent || rstrm->out_nrefs ||
 		(PtrToUlong(rstrm->out_finger) + sizeof(u_int32_t) >=
 		PtrToUlong(rstrm->out_boundry))) {
 		rstrm->frag_sent = FALSE;
@@ -696,7 +807,10 @@ flush_out(rstrm, eor)
 	u_int32_t len = (u_int32_t)(PtrToUlong(rstrm->out_finger) - 
 		PtrToUlong(rstrm->frag_header) - sizeof(u_int32_t));
 
+	len += rstrm->out_reflen;
 	*(rstrm->frag_header) = htonl(len | eormask);
+	if (rstrm->out_nrefs)
+		return (flush_out_refs(rstrm));
 	len = (u_int32_t)(PtrToUlong(rstrm->out_finger) - 
 	    PtrToUlong(rstrm->out_base));
 	if ((*(rstrm->writeit))(rstrm->tcp_handle, rstrm->out_base, (int)len)
@@ -707,6 +821,56 @@ flush_out(rstrm, eor)
 	return (TRUE);
 }
 
+static bool_t  /* sends out_base interleaved with the referenced buffers */
+flush_out_refs(rstrm)
+	RECSTREAM *rstrm;
+{
+	struct xdrrec_iov iov[XDRREC_MAX_IOV];
+	u_int i, n = 0, pos = 0, first = 0;
+	u_int32_t len;
+	int sent;
+
+	for (i = 0; i < rstrm->out_nrefs; i++) {
+		if (rstrm->out_refs[i].at > pos) {
+			iov[n].iov_base = rstrm->out_base + pos;
+			iov[n].iov_len = rstrm->out_refs[i].at - pos;
+			pos = rstrm->out_refs[i].at;
+			n++;
+		}
+		iov[n].iov_base = rstrm->out_refs[i].base;
+		iov[n].iov_len = rstrm->out_refs[i].len;
+		n++;
+	}
+	len = (u_int32_t)(PtrToUlong(rstrm->out_finger) -
+	    PtrToUlong(rstrm->out_base));
+	if (len > pos) {
+		iov[n].iov_base = rstrm->out_base + pos;
+		iov[n].iov_len = len - pos;
+		n++;
+	}
+
+	rstrm->out_nrefs = 0;
+	rstrm->out_reflen = 0;
+	while (first < n) {
+		sent = (*(rstrm->writevit))(rstrm->tcp_handle,
+		    &iov[first], (int)(n - first));
+		if (sent <= 0)
+			return (FALSE);
+		/* skip whatever went out, and resend the rest */
+		while (first < n && (u_int)sent >= iov[first].iov_len) {
+			sent -= (int)iov[first].iov_len;
+			first++;
+		}
+		if (first < n) {
+			iov[first].iov_base += sent;
+			iov[first].iov_len -= (u_int)sent;
+		}
+	}
+	rstrm->frag_header = (u_int32_t *)(void *)rstrm->out_base;
+	rstrm->out_finger = (char *)rstrm->out_base + sizeof(u_int32_t);
+	return (TRUE);
+}
+
 static bool_t  /* knows nothing about records!  Only about input buffers */
 fill_input_buf(rstrm)
 	RECSTREAM *rstrm;
@@ -722,6 +886,8 @@ fill_input_buf(rstrm)
 	i = (u_int32_t)(PtrToUlong(rstrm->in_boundry) % BYTES_PER_XDR_UNIT);
 	where += i;
 	len = (u_int32_t)(rstrm->in_size - i);
+	if (len > FILL_READ_MAX)
+		len = FILL_READ_MAX;
 	if ((len = (*(rstrm->readit))(rstrm->tcp_handle, where, len)) == -1)
 		return (FALSE);
 	rstrm->in_finger = where;
@@ -730,6 +896,30 @@ fill_input_buf(rstrm)
 	return (TRUE);
 }
 
+static bool_t  /* knows nothing about records!  Only about input buffers */
+get_input_bytes_direct(rstrm, addr, len, nread)
+	RECSTREAM *rstrm;
+	char *addr;
+	size_t len;
+	size_t *nread;
+{
+	char *where;
+	int n;
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+	if ((n = (*(rstrm->readit))(rstrm->tcp_handle, addr, (int)len)) == -1)
+		return (FALSE);
+	/* the input buffer is empty; keep its alignment in step with
+	 * the stream, as fill_input_buf() would */
+	where = rstrm->in_base;
+	where += (u_int32_t)((PtrToUlong(rstrm->in_boundry) + n) %
+	    BYTES_PER_XDR_UNIT);
+	rstrm->in_finger = rstrm->in_boundry = where;
+	*nread = (size_t)n;
+	return (TRUE);
+}
+
 static bool_t  /* knows nothing about records!  Only about input buffers */
 get_input_bytes(rstrm, addr, in_len)
 	RECSTREAM *rstrm;
@@ -751,6 +941,16 @@ get_input_bytes(rstrm, addr, in_len)
 		current = (ssize_t)PtrToLong(rstrm->in_boundry) -
 		    (ssize_t)PtrToLong(rstrm->in_finger);
 		if (current == 0) {
+			if (len >= DIRECT_READ_MIN) {
+				/* read large opaques (like READ payloads) straight
+				 * into the caller's buffer instead of staging them */
+				if (! get_input_bytes_direct(rstrm, addr, len,
+				    &current))
+					return (FALSE);
+				addr += current;
+				len -= current;
+				continue;
+			}
 			if (! fill_input_buf(rstrm))
 				return (FALSE);
 			continue;
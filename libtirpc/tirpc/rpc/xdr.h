@@ -356,6 +356,18 @@ extern void   xdrrec_create(XDR *, u_int, u_int, void *,
 extern bool_t xdrrec_endofrecord(XDR *, int);
 extern int32_t *xdrrec_getoutbase(XDR *);
 
+/* gather writes of caller buffers for tcp */
+#define XDRREC_MAX_REFS 4	/* referenced buffers per fragment */
+#define XDRREC_MAX_IOV (2 * XDRREC_MAX_REFS + 1)
+struct xdrrec_iov {
+	char	*iov_base;
+	u_int	iov_len;
+};
+extern void   xdrrec_setwritev(XDR *,
+			    int (*)(void *, struct xdrrec_iov *, int));
+extern bool_t xdrrec_putbytes_ref(XDR *, const char *, u_int);
+extern void   xdrrec_setnoref(XDR *);
+
 /* move to beginning of next record */
 extern bool_t xdrrec_skiprecord(XDR *);
 extern void xdrrec_setlastfrag(XDR *);
@@ -148,6 +148,8 @@ int wintirpc_bind(int s, const struct sockaddr *name, socklen_t namelen);
 int wintirpc_connect(int s, const struct sockaddr *name, socklen_t namelen);
 wintirpc_ssize_t wintirpc_send(int s, const char *buf, size_t len,
     int flags);
+wintirpc_ssize_t wintirpc_sendv(int s, WSABUF *bufs, DWORD count,
+    int flags);
 wintirpc_ssize_t wintirpc_sendto(int s, const char *buf, size_t len,
     int flags, const struct sockaddr *to, socklen_t tolen);
 wintirpc_ssize_t wintirpc_recv(int socket, void *buffer, size_t length,
@@ -110,6 +110,13 @@ void PrintMountUsage(LPWSTR pProcess)
         "\tnocache\tturns off rdbss caching\n"
         "\ttimebasedcoherency\tturns on time-based coherency\n"
         "\tnotimebasedcoherency\tturns off time-based coherency (default, due to bugs)\n"
+        "\tac_timeo=#\tseconds to cache names and attributes (default 30,\n"
+            "\t\t0 turns off the name cache)\n"
+        "\tac_max=#\tseconds that attributes of unchanged files may be\n"
+            "\t\tcached for (defaults to ac_timeo)\n"
+        "\tnamecache_mb=#\tsize of the name and attribute cache in MB (default 32)\n"
+        "\tnegcache\tcache failed lookups (default)\n"
+        "\tnonegcache\tdon't cache failed lookups\n"
         "\twsize=#\twrite buffer size in bytes\n"
         "\tcreatemode=\tspecify default POSIX permission mode\n"
             "\t\tfor new files created on the NFS share.\n"
@@ -604,6 +604,7 @@ const char *opcode2string(int opcode)
     case NFS41_VOLUME_QUERY: return "NFS41_VOLUME_QUERY";
     case NFS41_ACL_QUERY: return "NFS41_ACL_QUERY";
     case NFS41_ACL_SET: return "NFS41_ACL_SET";
+    case NFS41_FLUSH: return "NFS41_FLUSH";
     default: return "UNKNOWN";
     }
 }
@@ -206,11 +206,16 @@ typedef struct _updowncall_entry {
             DWORD wsize;
             DWORD lease_time;
             DWORD use_nfspubfh;
+            DWORD ac_timeo;
+            DWORD ac_max;
+            DWORD namecache_mb;
+            DWORD negcache;
         } Mount;
         struct {
             PMDL MdlAddress;
             ULONGLONG offset;
             PRX_CONTEXT rxcontext;
+            BOOLEAN buffered; /* the daemon is holding the write back */
         } ReadWrite;
         struct {
             LONGLONG offset;
@@ -313,6 +318,9 @@ DECLARE_CONST_UNICODE_STRING(EMPTY_STRING, L"");
 #define MOUNT_CONFIG_RW_SIZE_MAX        1048576
 #define MAX_SEC_FLAVOR_LEN              12
 #define UPCALL_TIMEOUT_DEFAULT          50  /* in seconds */
+#define MOUNT_CONFIG_AC_TIMEO_MAX       86400 /* in seconds */
+#define MOUNT_CONFIG_NAMECACHE_MB_MIN   1
+#define MOUNT_CONFIG_NAMECACHE_MB_MAX   1024
 
 typedef struct _NFS41_MOUNT_CONFIG {
     BOOLEAN use_nfspubfh;
@@ -322,6 +330,10 @@ typedef struct _NFS41_MOUNT_CONFIG {
     BOOLEAN write_thru;
     BOOLEAN nocache;
     BOOLEAN timebasedcoherency;
+    DWORD ac_timeo;
+    DWORD ac_max;
+    DWORD namecache_mb;
+    DWORD negcache;
     WCHAR srv_buffer[SERVER_NAME_BUFFER_SIZE];
     UNICODE_STRING SrvName; /* hostname, or hostname@port */
     WCHAR mntpt_buffer[NFS41_SYS_MAX_PATH_LEN];
@@ -449,6 +461,7 @@ typedef struct _NFS41_FCB {
     DWORD                   owner_group_local_gid; /* owner group mapped into local gid */
 #endif /* NFS41_DRIVER_FEATURE_LOCAL_UIDGID_IN_NFSV3ATTRIBUTES */
     ULONGLONG               changeattr;
+    LONG                    buffered_writes; /* since the last nfs41_Flush() */
 } NFS41_FCB, *PNFS41_FCB;
 #define NFS41GetFcbExtension(pFcb)      \
         (((pFcb) == NULL) ? NULL : (PNFS41_FCB)((pFcb)->Context))
@@ -735,7 +748,7 @@ static NTSTATUS marshal_nfs41_mount(
         goto out;
     }
     header_len = *len + length_as_utf8(entry->u.Mount.srv_name) +
-        length_as_utf8(entry->u.Mount.root) + 4 * sizeof(DWORD);
+        length_as_utf8(entry->u.Mount.root) + 8 * sizeof(DWORD);
     if (header_len > buf_len) {
         status = STATUS_INSUFFICIENT_RESOURCES;
         goto out;
@@ -751,22 +764,42 @@ static NTSTATUS marshal_nfs41_mount(
     RtlCopyMemory(tmp, &entry->u.Mount.wsize, sizeof(DWORD));
     tmp += sizeof(DWORD);
     RtlCopyMemory(tmp, &entry->u.Mount.use_nfspubfh, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.ac_timeo, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.ac_max, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.namecache_mb, sizeof(DWORD));
+    tmp += sizeof(DWORD);
+    RtlCopyMemory(tmp, &entry->u.Mount.negcache, sizeof(DWORD));
 
     *len = header_len;
 
 #ifdef DEBUG_MARSHAL_DETAIL
     DbgP("marshal_nfs41_mount: server name='%wZ' mount point='%wZ' "
-         "sec_flavor='%s' rsize=%d wsize=%d use_nfspubfh=%d\n",
+         "sec_flavor='%s' rsize=%d wsize=%d use_nfspubfh=%d "
+         "ac_timeo=%d ac_max=%d namecache_mb=%d negcache=%d\n",
 	 entry->u.Mount.srv_name, entry->u.Mount.root,
          secflavorop2name(entry->u.Mount.sec_flavor),
          (int)entry->u.Mount.rsize, (int)entry->u.Mount.wsize,
-         (int)entry->u.Mount.use_nfspubfh);
+         (int)entry->u.Mount.use_nfspubfh,
+         (int)entry->u.Mount.ac_timeo, (int)entry->u.Mount.ac_max,
+         (int)entry->u.Mount.namecache_mb, (int)entry->u.Mount.negcache);
 #endif
 out:
     return status;
 }
 
 static NTSTATUS marshal_nfs41_unmount(
+    nfs41_updowncall_entry *entry,
+    unsigned char *buf,
+    ULONG buf_len,
+    ULONG *len) 
+{
+    return marshal_nfs41_header(entry, buf, buf_len, len);
+}
+
+static NTSTATUS marshal_nfs41_flush(
     nfs41_updowncall_entry *entry,
     unsigned char *buf,
     ULONG buf_len,
@@ -1585,6 +1618,9 @@ static NTSTATUS handle_upcall(
     case NFS41_ACL_SET:
         status = marshal_nfs41_setacl(entry, pbOut, cbOut, len);
         break;
+    case NFS41_FLUSH:
+        status = marshal_nfs41_flush(entry, pbOut, cbOut, len);
+        break;
     default:
         status = STATUS_INVALID_PARAMETER;
         print_error("Unknown nfs41 ops %d\n", entry->opcode);
@@ -1878,9 +1914,11 @@ static NTSTATUS unmarshal_nfs41_rw(
     RtlCopyMemory(&cur->buf_len, *buf, sizeof(cur->buf_len));
     *buf += sizeof(cur->buf_len);
     RtlCopyMemory(&cur->ChangeTime, *buf, sizeof(ULONGLONG));
+    *buf += sizeof(ULONGLONG);
+    RtlCopyMemory(&cur->u.ReadWrite.buffered, *buf, sizeof(BOOLEAN));
 #ifdef DEBUG_MARSHAL_DETAIL_RW
-    DbgP("unmarshal_nfs41_rw: returned len %lu ChangeTime %llu\n",
-        cur->buf_len, cur->ChangeTime);
+    DbgP("unmarshal_nfs41_rw: returned len %lu ChangeTime %llu buffered %d\n",
+        cur->buf_len, cur->ChangeTime, cur->u.ReadWrite.buffered);
 #endif
 #if 1
     /* 08/27/2010: it looks like we really don't need to call 
@@ -2884,6 +2922,10 @@ static NTSTATUS nfs41_mount(
     entry->u.Mount.rsize = config->ReadSize;
     entry->u.Mount.wsize = config->WriteSize;
     entry->u.Mount.use_nfspubfh = config->use_nfspubfh;
+    entry->u.Mount.ac_timeo = config->ac_timeo;
+    entry->u.Mount.ac_max = config->ac_max;
+    entry->u.Mount.namecache_mb = config->namecache_mb;
+    entry->u.Mount.negcache = config->negcache;
     entry->u.Mount.sec_flavor = sec_flavor;
     entry->u.Mount.FsAttrs = FsAttrs;
 
@@ -2923,6 +2965,11 @@ static void nfs41_MountConfig_InitDefaults(
     Config->write_thru = FALSE;
     Config->nocache = FALSE;
     Config->timebasedcoherency = FALSE; /* disabled by default because of bugs */
+    /* the daemon picks the name cache defaults */
+    Config->ac_timeo = NFS41_MOUNT_OPTION_UNSET;
+    Config->ac_max = NFS41_MOUNT_OPTION_UNSET;
+    Config->namecache_mb = NFS41_MOUNT_OPTION_UNSET;
+    Config->negcache = NFS41_MOUNT_OPTION_UNSET;
     Config->SrvName.Length = 0;
     Config->SrvName.MaximumLength = SERVER_NAME_BUFFER_SIZE;
     Config->SrvName.Buffer = Config->srv_buffer;
@@ -3086,6 +3133,33 @@ static NTSTATUS nfs41_MountConfig_ParseOptions(
             status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
                 TRUE, &Config->timebasedcoherency);
         }
+        else if (wcsncmp(L"negcache", Name, NameLen) == 0) {
+            BOOLEAN negcache;
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                FALSE, &negcache);
+            if (status == STATUS_SUCCESS)
+                Config->negcache = negcache;
+        }
+        else if (wcsncmp(L"nonegcache", Name, NameLen) == 0) {
+            BOOLEAN negcache;
+            status = nfs41_MountConfig_ParseBoolean(Option, &usValue,
+                TRUE, &negcache);
+            if (status == STATUS_SUCCESS)
+                Config->negcache = negcache;
+        }
+        else if (wcsncmp(L"ac_timeo", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->ac_timeo, 0, MOUNT_CONFIG_AC_TIMEO_MAX);
+        }
+        else if (wcsncmp(L"ac_max", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->ac_max, 0, MOUNT_CONFIG_AC_TIMEO_MAX);
+        }
+        else if (wcsncmp(L"namecache_mb", Name, NameLen) == 0) {
+            status = nfs41_MountConfig_ParseDword(Option, &usValue,
+                &Config->namecache_mb, MOUNT_CONFIG_NAMECACHE_MB_MIN,
+                MOUNT_CONFIG_NAMECACHE_MB_MAX);
+        }
         else if (wcsncmp(L"timeout", Name, NameLen) == 0) {
             status = nfs41_MountConfig_ParseDword(Option, &usValue,
                 &Config->timeout, UPCALL_TIMEOUT_DEFAULT,
@@ -3603,6 +3677,10 @@ static NTSTATUS nfs41_CreateVNetRoot(
         "write_thru=%d, "
         "nocache=%d "
         "timebasedcoherency=%d "
+        "ac_timeo=%d "
+        "ac_max=%d "
+        "namecache_mb=%d "
+        "negcache=%d "
         "timeout=%d "
         "createmode.use_nfsv3attrsea_mode=%d "
         "Config->createmode.mode=0o%o "
@@ -3614,6 +3692,10 @@ static NTSTATUS nfs41_CreateVNetRoot(
         Config->write_thru?1:0,
         Config->nocache?1:0,
         Config->timebasedcoherency?1:0,
+        (int)Config->ac_timeo,
+        (int)Config->ac_max,
+        (int)Config->namecache_mb,
+        (int)Config->negcache,
         Config->timeout,
         Config->createmode.use_nfsv3attrsea_mode?1:0,
         Config->createmode.mode);
@@ -4800,10 +4882,42 @@ out:
 static NTSTATUS nfs41_Flush(
     IN OUT PRX_CONTEXT RxContext)
 {
+    NTSTATUS status = STATUS_SUCCESS;
+    nfs41_updowncall_entry *entry;
+    __notnull PNFS41_FOBX nfs41_fobx = NFS41GetFobxExtension(RxContext->pFobx);
+    __notnull PNFS41_FCB nfs41_fcb = NFS41GetFcbExtension(RxContext->pFcb);
+    __notnull PMRX_SRV_OPEN SrvOpen = RxContext->pRelevantSrvOpen;
+    __notnull PNFS41_V_NET_ROOT_EXTENSION pVNetRootContext =
+        NFS41GetVNetRootExtension(SrvOpen->pVNetRoot);
+    __notnull PNFS41_NETROOT_EXTENSION pNetRootContext =
+        NFS41GetNetRootExtension(SrvOpen->pVNetRoot->pNetRoot);
+
     DbgP("nfs41_Flush: FileName='%wZ'\n",
         GET_ALREADY_PREFIXED_NAME_FROM_CONTEXT(RxContext));
 
-    return STATUS_SUCCESS;
+    /* the daemon may be holding back writes (nfsd --writebehind), so
+     * FlushFileBuffers() has to reach it; but only if a write to this
+     * file was held back since the last flush */
+    if (!InterlockedExchange(&nfs41_fcb->buffered_writes, 0))
+        goto out;
+
+    status = nfs41_UpcallCreate(NFS41_FLUSH, &nfs41_fobx->sec_ctx,
+        pVNetRootContext->session, nfs41_fobx->nfs41_open_state,
+        pNetRootContext->nfs41d_version, SrvOpen->pAlreadyPrefixedName, &entry);
+    if (status) goto out_restore;
+
+    status = nfs41_UpcallWaitForReply(entry, pVNetRootContext->timeout);
+    if (status) goto out_restore;
+
+    status = map_readwrite_errors(entry->status);
+    nfs41_UpcallDestroy(entry);
+    if (status) goto out_restore;
+out:
+    return status;
+out_restore:
+    /* the writes may still be held back; try again on the next flush */
+    InterlockedExchange(&nfs41_fcb->buffered_writes, 1);
+    goto out;
 }
 
 static NTSTATUS nfs41_DeallocateForFcb(
@@ -6877,6 +6991,8 @@ static NTSTATUS nfs41_Write(
         status = RxContext->CurrentIrp->IoStatus.Status = STATUS_SUCCESS;
         RxContext->IoStatusBlock.Information = entry->buf_len;
         nfs41_fcb->changeattr = entry->ChangeTime;
+        if (entry->u.ReadWrite.buffered)
+            InterlockedExchange(&nfs41_fcb->buffered_writes, 1);
 
         //re-enable write buffering
         if (!BooleanFlagOn(LowIoContext->ParamsFor.ReadWrite.Flags, 
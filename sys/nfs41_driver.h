@@ -59,6 +59,10 @@
  */
 #define NFS41_SYS_MAX_PATH_LEN          4096
 
+/* sent in NFS41_MOUNT for a name cache option that the mount didn't
+ * give, so the daemon doesn't override another mount's setting */
+#define NFS41_MOUNT_OPTION_UNSET        0xFFFFFFFF
+
 /* |_nfs41_opcodes| and |g_upcall_op_table| must be in sync! */
 typedef enum _nfs41_opcodes {
     NFS41_INVALID_OPCODE0,
@@ -80,6 +84,7 @@ typedef enum _nfs41_opcodes {
     NFS41_VOLUME_QUERY,
     NFS41_ACL_QUERY,
     NFS41_ACL_SET,
+    NFS41_FLUSH,
     NFS41_SHUTDOWN,
     NFS41_INVALID_OPCODE1
 } nfs41_opcodes;
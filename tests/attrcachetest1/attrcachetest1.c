@@ -0,0 +1,368 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * attrcachetest1.c - lookup benchmark for the attribute cache hash
+ * table in daemon/name_cache.c
+ *
+ * Caches 1k, 64k and 1M files with fileids that grow in small random
+ * steps, like inode numbers, and looks them all up by fileid in random
+ * order.  It times attr_cache_search() against an rb-tree of the same
+ * fileids, built from a copy of the attribute entry and tree that the
+ * cache used before the hash table, and counts how many entries each
+ * lookup compares.  Every compared entry is another cache line the
+ * lookup reads, so once the cache outgrows the cpu caches, that count
+ * is roughly the cache misses per lookup.  It also times the whole of
+ * nfs41_attr_cache_lookup(), which copies the attributes out.
+ *
+ * Every fileid must be found, with its own attributes, and a fileid
+ * that was never cached must not be.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: attrcachetest1 [lookups]
+ */
+
+#include "../../daemon/name_cache.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+
+/* stubs for what name_cache.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+int nfs_to_windows_error(int status, int default_error) { return default_error; }
+
+void compound_init(nfs41_compound *compound, nfs_argop4 *argops,
+    nfs_resop4 *resops, const char *tag) {}
+void compound_add_op(nfs41_compound *compound, uint32_t opnum,
+    void *arg, void *res) {}
+int compound_encode_send_decode(nfs41_session *session,
+    nfs41_compound *compound, bool_t try_recovery) { return NFS4ERR_IO; }
+void nfs41_session_sequence(nfs41_sequence_args *args,
+    nfs41_session *session, bool_t cachethis) {}
+
+/* same as daemon/util.c */
+bool_t next_component(const char *path, const char *path_end,
+    nfs41_component *component)
+{
+    const char *component_end;
+    component->name = next_non_delimiter(path, path_end);
+    component_end = next_delimiter(component->name, path_end);
+    component->len = (unsigned short)(component_end - component->name);
+    return component->len > 0;
+}
+
+bool_t is_last_component(const char *path, const char *path_end)
+{
+    path = next_delimiter(path, path_end);
+    return next_non_delimiter(path, path_end) == path_end;
+}
+
+
+/* the attribute entry and tree before the hash table */
+struct tree_entry {
+    RB_ENTRY(tree_entry)    rbnode;
+    struct list_entry       free_entry;
+    uint64_t                change;
+    uint64_t                size;
+    uint64_t                fileid;
+    int64_t                 time_access_s;
+    int64_t                 time_create_s;
+    int64_t                 time_modify_s;
+    uint32_t                time_access_ns;
+    uint32_t                time_create_ns;
+    uint32_t                time_modify_ns;
+    uint32_t                numlinks;
+    unsigned                mode : 30;
+    unsigned                hidden : 1;
+    unsigned                system : 1;
+    unsigned                archive : 1;
+    util_reltimestamp       expiration;
+    unsigned                ref_count : 26;
+    unsigned                type : 4;
+    unsigned                invalidated : 1;
+    unsigned                delegated : 1;
+    char                    owner[NFS4_FATTR4_OWNER_LIMIT+1];
+    char                    owner_group[NFS4_FATTR4_OWNER_LIMIT+1];
+};
+
+RB_HEAD(tree_attr, tree_entry);
+
+static int tree_cmp(struct tree_entry *lhs, struct tree_entry *rhs)
+{
+    return lhs->fileid < rhs->fileid ? -1 : lhs->fileid > rhs->fileid;
+}
+RB_GENERATE(tree_attr, tree_entry, rbnode, tree_cmp)
+
+static struct tree_entry* tree_search(
+    IN struct tree_attr *head,
+    IN uint64_t fileid)
+{
+    struct tree_entry tmp;
+    tmp.fileid = fileid;
+    return RB_FIND(tree_attr, head, &tmp);
+}
+
+
+#define MAX_FILES (1024 * 1024)
+#define DEFAULT_LOOKUPS 4000000
+#define CACHE_MB 512        /* enough for MAX_FILES */
+#define FILEID_BASE 1000
+
+static long failures = 0;
+
+static void test_fail(const char *msg, uint32_t files, uint64_t fileid)
+{
+    if (++failures <= 10)
+        (void)fprintf(stderr, "FAIL: %s (files=%u fileid=%llu)\n",
+            msg, files, (unsigned long long)fileid);
+}
+
+static uint32_t test_random(uint32_t *seed)
+{
+    /* xorshift32 */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static int insert_file(struct nfs41_name_cache *cache, uint64_t fileid)
+{
+    char path[32];
+    nfs41_component name;
+    nfs41_file_info info;
+    nfs41_fh fh;
+
+    name.len = (unsigned short)(sprintf(path, "\\f%llu",
+        (unsigned long long)fileid) - 1);
+    name.name = path + 1;
+
+    ZeroMemory(&fh, sizeof(fh));
+    fh.fileid = fileid;
+    fh.len = 28;
+    (void)memcpy(fh.fh, &fileid, sizeof(fileid));
+
+    ZeroMemory(&info, sizeof(info));
+    info.attrmask.count = 2;
+    info.attrmask.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE |
+        FATTR4_WORD0_SIZE | FATTR4_WORD0_FILEID;
+    info.attrmask.arr[1] = FATTR4_WORD1_NUMLINKS;
+    info.type = fileid == FILEID_BASE ? NF4DIR : NF4REG;
+    info.fileid = fileid;
+    info.change = fileid * 3;
+    info.size = fileid * 7;
+    info.numlinks = 1;
+
+    return nfs41_name_cache_insert(cache, fileid == FILEID_BASE ?
+        NULL : path, fileid == FILEID_BASE ? NULL : &name, &fh, &info,
+        NULL, OPEN_DELEGATE_NONE);
+}
+
+/* same as attr_cache_search(), counting the entries it compares */
+static uint32_t hash_compares(
+    IN struct attr_cache *cache,
+    IN uint64_t fileid)
+{
+    const struct attr_table *table = cache->table;
+    struct attr_cache_entry *entry;
+    uint32_t i, slot = attr_hash(fileid) & table->mask, count = 0;
+
+    for (i = 0; i <= table->mask; i++) {
+        entry = table->slots[slot];
+        if (entry == NULL)
+            break;
+        if (entry != &attr_tombstone) {
+            count++;
+            if (entry->fileid == fileid)
+                break;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    return count;
+}
+
+/* same as RB_FIND(), counting the entries it compares */
+static uint32_t tree_compares(
+    IN struct tree_attr *head,
+    IN uint64_t fileid)
+{
+    struct tree_entry *entry = RB_ROOT(head);
+    uint32_t count = 0;
+
+    while (entry) {
+        count++;
+        if (fileid < entry->fileid)
+            entry = RB_LEFT(entry, rbnode);
+        else if (fileid > entry->fileid)
+            entry = RB_RIGHT(entry, rbnode);
+        else
+            break;
+    }
+    return count;
+}
+
+static double elapsed_ns(const LARGE_INTEGER *start, uint32_t lookups)
+{
+    LARGE_INTEGER freq, end;
+    (void)QueryPerformanceCounter(&end);
+    (void)QueryPerformanceFrequency(&freq);
+    return (double)(end.QuadPart - start->QuadPart) * 1e9 /
+        (double)freq.QuadPart / lookups;
+}
+
+static void bench(uint32_t files, const uint64_t *fileids,
+    const uint32_t *order, uint32_t lookups)
+{
+    const nfs41_name_cache_config config = { 3600, 3600, CACHE_MB, FALSE };
+    struct nfs41_name_cache *cache;
+    struct tree_attr head = RB_INITIALIZER(&head);
+    struct tree_entry *pool;
+    struct attr_cache_entry *entry;
+    struct tree_entry *node;
+    nfs41_file_info info;
+    LARGE_INTEGER start;
+    double hash_ns, tree_ns, lookup_ns;
+    uint64_t hash_count = 0, tree_count = 0;
+    uintptr_t sink = 0;
+    uint32_t i;
+    int status;
+
+    pool = calloc(files, sizeof(struct tree_entry));
+    status = nfs41_name_cache_create(&cache);
+    if (status || pool == NULL) {
+        test_fail("out of memory", files, 0);
+        free(pool);
+        return;
+    }
+    nfs41_name_cache_configure(cache, &config);
+
+    for (i = 0; i < files; i++) {
+        status = insert_file(cache, fileids[i]);
+        if (status) {
+            test_fail("insert failed", files, fileids[i]);
+            goto out;
+        }
+        pool[i].fileid = fileids[i];
+        pool[i].change = fileids[i] * 3;
+        (void)RB_INSERT(tree_attr, &head, &pool[i]);
+    }
+
+    /* both must find every fileid, and only those */
+    for (i = 0; i < files; i++) {
+        entry = attr_cache_search(&cache->attributes, fileids[i]);
+        if (entry == NULL || entry->change != fileids[i] * 3)
+            test_fail("hash lookup", files, fileids[i]);
+        node = tree_search(&head, fileids[i]);
+        if (node == NULL || node->change != fileids[i] * 3)
+            test_fail("tree lookup", files, fileids[i]);
+        if (nfs41_attr_cache_lookup(cache, fileids[i], &info) != NO_ERROR ||
+                info.fileid != fileids[i] || info.size != fileids[i] * 7)
+            test_fail("attr cache lookup", files, fileids[i]);
+    }
+    if (attr_cache_search(&cache->attributes, fileids[files - 1] + 1))
+        test_fail("found a fileid that was never cached", files,
+            fileids[files - 1] + 1);
+
+    for (i = 0; i < files; i++) {
+        hash_count += hash_compares(&cache->attributes, fileids[i]);
+        tree_count += tree_compares(&head, fileids[i]);
+    }
+
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < lookups; i++)
+        sink += (uintptr_t)tree_search(&head, fileids[order[i % files]]);
+    tree_ns = elapsed_ns(&start, lookups);
+
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < lookups; i++)
+        sink += (uintptr_t)attr_cache_search(&cache->attributes,
+            fileids[order[i % files]]);
+    hash_ns = elapsed_ns(&start, lookups);
+
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < lookups; i++)
+        sink += (uintptr_t)nfs41_attr_cache_lookup(cache,
+            fileids[order[i % files]], &info);
+    lookup_ns = elapsed_ns(&start, lookups);
+
+    (void)printf("%8u %8.0f %8.1f %8.0f %8.1f %8.1fx %10.0f\n", files,
+        tree_ns, (double)tree_count / files, hash_ns,
+        (double)hash_count / files, hash_ns > 0.0 ? tree_ns / hash_ns : 0.0,
+        lookup_ns);
+    if (sink == 1) /* keep the lookups */
+        (void)printf("\n");
+out:
+    (void)nfs41_name_cache_free(&cache);
+    free(pool);
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t sizes[] = { 1024, 64 * 1024, MAX_FILES };
+    uint64_t *fileids;
+    uint32_t *order;
+    uint32_t i, j, tmp, lookups, seed = 1;
+    uint64_t fileid = FILEID_BASE;
+
+    lookups = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) :
+        DEFAULT_LOOKUPS;
+    fileids = malloc(MAX_FILES * sizeof(uint64_t));
+    order = malloc(MAX_FILES * sizeof(uint32_t));
+    if (lookups == 0 || fileids == NULL || order == NULL)
+        return EXIT_FAILURE;
+
+    /* like inode numbers; the first one is the root */
+    for (i = 0; i < MAX_FILES; i++) {
+        fileids[i] = fileid;
+        fileid += 1 + test_random(&seed) % 4;
+    }
+
+    (void)printf("%8s %8s %8s %8s %8s %9s %10s\n", "files", "tree ns",
+        "compares", "hash ns", "compares", "speedup", "lookup ns");
+    for (i = 0; i < ARRAYSIZE(sizes); i++) {
+        /* look every file up in random order */
+        for (j = 0; j < sizes[i]; j++)
+            order[j] = j;
+        for (j = sizes[i] - 1; j > 0; j--) {
+            const uint32_t k = test_random(&seed) % (j + 1);
+            tmp = order[j]; order[j] = order[k]; order[k] = tmp;
+        }
+        bench(sizes[i], fileids, order, lookups);
+    }
+    free(order);
+    free(fileids);
+
+    if (failures) {
+        (void)printf("attrcachetest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("attrcachetest1: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,425 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * cbnotifytest1.c - unit test for the CB_NOTIFY argument decoder in
+ * daemon/callback_xdr.c
+ *
+ * Encodes CB_NOTIFY arguments with libtirpc's xdrmem and feeds them to
+ * op_cb_notify_args().  A well-formed payload carrying every change
+ * type must decode to the expected names, cookies and attributes, in
+ * mask bit order and across several notify4 entries.  Malformed
+ * payloads (every truncation of a good one, unknown change types, an
+ * oversized bitmap, filehandle or name, a second nad_old_entry, and a
+ * change list shorter than its mask) must be rejected.  Every decode,
+ * good or bad, is followed by an XDR_FREE pass that must succeed.
+ *
+ * Needs no server; only the libtirpc xdr routines are linked in.
+ *
+ * Usage: cbnotifytest1
+ */
+
+#include "../../daemon/callback_xdr.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+
+/* stubs for what callback_xdr.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+void wintirpc_warnx(const char *format, ...) { (void)format; }
+
+/* same as daemon/nfs41_xdr.c */
+bool_t xdr_bitmap4(XDR *xdr, bitmap4 *bitmap)
+{
+    uint32_t i;
+
+    if (xdr->x_op == XDR_ENCODE) {
+        if (bitmap->count > 3)
+            return FALSE;
+        if (!xdr_u_int32_t(xdr, &bitmap->count))
+            return FALSE;
+    } else if (xdr->x_op == XDR_DECODE) {
+        if (!xdr_u_int32_t(xdr, &bitmap->count))
+            return FALSE;
+        if (bitmap->count > 3)
+            return FALSE;
+    } else
+        return FALSE;
+
+    for (i = 0; i < bitmap->count; i++)
+        if (!xdr_u_int32_t(xdr, &bitmap->arr[i]))
+            return FALSE;
+    return TRUE;
+}
+
+bool_t xdr_fattr4(XDR *xdr, fattr4 *fattr)
+{
+    unsigned char *attr_vals = fattr->attr_vals;
+
+    if (!xdr_bitmap4(xdr, &fattr->attrmask))
+        return FALSE;
+
+    return xdr_bytes(xdr, (char **)&attr_vals, &fattr->attr_vals_len, NFS4_OPAQUE_LIMIT);
+}
+
+
+#define BUFFER_SIZE 8192
+#define ATTR_MASK0 0x00100010   /* arbitrary; echoed back by the decoder */
+
+static long failures = 0;
+
+static void test_fail(const char *test, const char *msg)
+{
+    failures++;
+    (void)fprintf(stderr, "FAIL: %s: %s\n", test, msg);
+}
+
+/* encoders for the wire format the decoder expects */
+static bool_t encode_u32(XDR *xdr, uint32_t value)
+{
+    return xdr_u_int32_t(xdr, &value);
+}
+
+static bool_t encode_cookie(XDR *xdr, uint64_t cookie)
+{
+    return xdr_u_hyper(xdr, &cookie);
+}
+
+static bool_t encode_name(XDR *xdr, const char *name, uint32_t len)
+{
+    char *p = (char*)name;
+    return xdr_bytes(xdr, &p, &len, NFS4_OPAQUE_LIMIT);
+}
+
+/* notify_entry4; the attributes carry the length of the name */
+static bool_t encode_entry(XDR *xdr, const char *name)
+{
+    fattr4 attrs = { 0 };
+    uint32_t len = (uint32_t)strlen(name);
+
+    attrs.attrmask.count = 1;
+    attrs.attrmask.arr[0] = ATTR_MASK0;
+    attrs.attr_vals_len = sizeof(len);
+    memcpy(attrs.attr_vals, &len, sizeof(len));
+    return encode_name(xdr, name, len) && xdr_fattr4(xdr, &attrs);
+}
+
+static bool_t encode_entry_cookie(XDR *xdr, const char *name, uint64_t cookie)
+{
+    return encode_entry(xdr, name) && encode_cookie(xdr, cookie);
+}
+
+/* notify_add4 */
+static bool_t encode_add(XDR *xdr, const char *replaced, const char *name,
+    uint64_t cookie, const char *prev, bool_t last)
+{
+    bool_t result = encode_u32(xdr, replaced ? 1 : 0);
+    if (result && replaced)
+        result = encode_entry_cookie(xdr, replaced, 1);
+    result = result && encode_entry(xdr, name);
+    result = result && encode_u32(xdr, cookie ? 1 : 0);
+    if (result && cookie)
+        result = encode_cookie(xdr, cookie);
+    result = result && encode_u32(xdr, prev ? 1 : 0);
+    if (result && prev)
+        result = encode_entry_cookie(xdr, prev, 2);
+    return result && xdr_bool(xdr, &last);
+}
+
+static bool_t encode_verifier(XDR *xdr)
+{
+    char verf[NFS4_VERIFIER_SIZE * 2] = "oldverf0newverf0";
+    return xdr_opaque(xdr, verf, sizeof(verf));
+}
+
+/* stateid4, nfs_fh4 and the start of the notify4 array */
+static bool_t encode_header(XDR *xdr, uint32_t fh_len, uint32_t notify_count)
+{
+    stateid4 stateid = { 7, "stateid4othr" };
+    nfs41_fh fh = { 0 };
+
+    fh.len = fh_len;
+    memset(fh.fh, 0xfe, sizeof(fh.fh));
+    return xdr_u_int32_t(xdr, &stateid.seqid)
+        && xdr_opaque(xdr, (char*)stateid.other, NFS4_STATEID_OTHER)
+        && xdr_u_int32_t(xdr, &fh.len)
+        && xdr_opaque(xdr, (char*)fh.fh, min(fh.len, NFS4_FHSIZE))
+        && encode_u32(xdr, notify_count);
+}
+
+/* one notify4: its mask, then the changes already encoded in 'list';
+ * mask words past the second are zero */
+static bool_t encode_notify(XDR *xdr, uint32_t mask_count,
+    uint32_t mask0, uint32_t mask1, XDR *list)
+{
+    uint32_t len = xdr_getpos(list);
+    char *p = list->x_base;
+    uint32_t i;
+
+    /* bypass xdr_bitmap4(), which refuses to encode a count above 3 */
+    if (!encode_u32(xdr, mask_count))
+        return FALSE;
+    for (i = 0; i < mask_count; i++)
+        if (!encode_u32(xdr, i == 0 ? mask0 : i == 1 ? mask1 : 0))
+            return FALSE;
+    return xdr_bytes(xdr, &p, &len, NFS4_OPAQUE_LIMIT);
+}
+
+static bool_t decode(char *buffer, uint32_t len, struct cb_notify_args *args)
+{
+    XDR xdr;
+
+    ZeroMemory(args, sizeof(struct cb_notify_args));
+    xdrmem_create(&xdr, buffer, len, XDR_DECODE);
+    return op_cb_notify_args(&xdr, args);
+}
+
+/* a failed decode may stop before anything that needs freeing, in
+ * which case XDR_FREE can fail the same way; only check its result
+ * after a successful decode */
+static void decode_free(const char *test, struct cb_notify_args *args,
+    bool_t decoded)
+{
+    XDR xdr;
+
+    xdrmem_create(&xdr, NULL, 0, XDR_FREE);
+    if (!op_cb_notify_args(&xdr, args) && decoded)
+        test_fail(test, "XDR_FREE failed");
+    if (args->notify_list != NULL)
+        test_fail(test, "notify_list not freed");
+}
+
+static void check_entry(const char *test, const struct notify_entry4 *entry,
+    const char *name)
+{
+    uint32_t len = (uint32_t)strlen(name), attr_len;
+
+    if (entry->name_len != len || strcmp(entry->name, name) != 0) {
+        test_fail(test, "wrong name");
+        return;
+    }
+    memcpy(&attr_len, entry->attrs.attr_vals, sizeof(attr_len));
+    if (entry->attrs.attrmask.count != 1 ||
+        entry->attrs.attrmask.arr[0] != ATTR_MASK0 ||
+        entry->attrs.attr_vals_len != sizeof(attr_len) || attr_len != len)
+        test_fail(test, "wrong attributes");
+}
+
+static void check_change(const char *test, const struct notify_dir4 *change,
+    enum notify_type4 type, const char *name, uint64_t cookie)
+{
+    if (change->type != type) {
+        test_fail(test, "wrong change type");
+        return;
+    }
+    if (type != NOTIFY4_CHANGE_COOKIE_VERIFIER)
+        check_entry(test, &change->entry, name);
+    if (change->has_cookie != (cookie != 0) ||
+        (cookie && change->cookie != cookie))
+        test_fail(test, "wrong cookie");
+}
+
+
+/* one notify4 with every change type, decoded in mask bit order */
+static void test_all_types(void)
+{
+    const char *test = "all_types";
+    static char buffer[BUFFER_SIZE], changes[BUFFER_SIZE];
+    struct cb_notify_args args;
+    XDR xdr, list;
+    uint32_t len, i;
+    bool_t decoded;
+
+    xdrmem_create(&list, changes, sizeof(changes), XDR_ENCODE);
+    xdrmem_create(&xdr, buffer, sizeof(buffer), XDR_ENCODE);
+    if (!encode_entry(&list, "child") ||                    /* CHILD_ATTRS */
+        !encode_entry(&list, "") ||                         /* DIR_ATTRS */
+        !encode_entry_cookie(&list, "gone", 3) ||           /* REMOVE */
+        !encode_add(&list, NULL, "new", 42, "prev", TRUE) ||/* ADD */
+        !encode_entry_cookie(&list, "old", 4) ||            /* RENAME */
+        !encode_add(&list, "replaced", "renamed", 0, NULL, FALSE) ||
+        !encode_verifier(&list) ||                          /* VERIFIER */
+        !encode_header(&xdr, 16, 1) ||
+        !encode_notify(&xdr, 1, 0x3f, 0, &list)) {
+        test_fail(test, "encoding failed");
+        return;
+    }
+    len = xdr_getpos(&xdr);
+
+    decoded = decode(buffer, len, &args);
+    if (!decoded) {
+        test_fail(test, "decode failed");
+    } else if (args.stateid.seqid != 7 ||
+        memcmp(args.stateid.other, "stateid4othr", NFS4_STATEID_OTHER) ||
+        args.fh.len != 16 || args.fh.fh[15] != 0xfe) {
+        test_fail(test, "wrong stateid or filehandle");
+    } else if (args.notify_count != 1 || args.change_count != 6) {
+        test_fail(test, "wrong number of changes");
+    } else {
+        check_change(test, &args.change_list[0],
+            NOTIFY4_CHANGE_CHILD_ATTRS, "child", 0);
+        check_change(test, &args.change_list[1],
+            NOTIFY4_CHANGE_DIR_ATTRS, "", 0);
+        check_change(test, &args.change_list[2],
+            NOTIFY4_REMOVE_ENTRY, "gone", 0);
+        check_change(test, &args.change_list[3],
+            NOTIFY4_ADD_ENTRY, "new", 42);
+        check_change(test, &args.change_list[4],
+            NOTIFY4_RENAME_ENTRY, "renamed", 0);
+        check_entry(test, &args.change_list[4].old_entry, "old");
+        check_change(test, &args.change_list[5],
+            NOTIFY4_CHANGE_COOKIE_VERIFIER, NULL, 0);
+    }
+    decode_free(test, &args, decoded);
+
+    /* every truncation of a good payload must fail cleanly */
+    for (i = 0; i < len; i++) {
+        if (decode(buffer, i, &args))
+            test_fail("truncated", "decode succeeded");
+        decode_free("truncated", &args, FALSE);
+    }
+}
+
+/* changes spread over several notify4 entries keep their order */
+static void test_multiple_notify(void)
+{
+    const char *test = "multiple_notify";
+    static char buffer[BUFFER_SIZE], changes[3][BUFFER_SIZE];
+    struct cb_notify_args args;
+    XDR xdr, list[3];
+    bool_t decoded;
+
+    xdrmem_create(&list[0], changes[0], BUFFER_SIZE, XDR_ENCODE);
+    xdrmem_create(&list[1], changes[1], BUFFER_SIZE, XDR_ENCODE);
+    xdrmem_create(&list[2], changes[2], BUFFER_SIZE, XDR_ENCODE);
+    xdrmem_create(&xdr, buffer, sizeof(buffer), XDR_ENCODE);
+    if (!encode_add(&list[0], "a0", "a", 10, NULL, FALSE) ||
+        !encode_entry_cookie(&list[1], "b", 11) ||
+        !encode_add(&list[1], NULL, "c", 12, "b", TRUE) ||
+        !encode_header(&xdr, NFS4_FHSIZE, 3) ||
+        !encode_notify(&xdr, 1, 1 << NOTIFY4_ADD_ENTRY, 0, &list[0]) ||
+        !encode_notify(&xdr, 1, (1 << NOTIFY4_REMOVE_ENTRY) |
+            (1 << NOTIFY4_ADD_ENTRY), 0, &list[1]) ||
+        !encode_notify(&xdr, 0, 0, 0, &list[2])) {
+        test_fail(test, "encoding failed");
+        return;
+    }
+
+    decoded = decode(buffer, xdr_getpos(&xdr), &args);
+    if (!decoded) {
+        test_fail(test, "decode failed");
+    } else if (args.notify_count != 3 || args.change_count != 3) {
+        test_fail(test, "wrong number of changes");
+    } else {
+        check_change(test, &args.change_list[0], NOTIFY4_ADD_ENTRY, "a", 10);
+        check_change(test, &args.change_list[1], NOTIFY4_REMOVE_ENTRY, "b", 0);
+        check_change(test, &args.change_list[2], NOTIFY4_ADD_ENTRY, "c", 12);
+    }
+    decode_free(test, &args, decoded);
+}
+
+/* a payload with a single notify4 that must be rejected */
+static void expect_failure(const char *test, uint32_t fh_len,
+    uint32_t notify_count, uint32_t mask_count, uint32_t mask0,
+    uint32_t mask1, XDR *list)
+{
+    static char buffer[BUFFER_SIZE];
+    struct cb_notify_args args;
+    XDR xdr;
+
+    xdrmem_create(&xdr, buffer, sizeof(buffer), XDR_ENCODE);
+    if (!encode_header(&xdr, fh_len, notify_count) ||
+        !encode_notify(&xdr, mask_count, mask0, mask1, list)) {
+        test_fail(test, "encoding failed");
+        return;
+    }
+
+    if (decode(buffer, xdr_getpos(&xdr), &args))
+        test_fail(test, "decode succeeded");
+    decode_free(test, &args, FALSE);
+}
+
+static void test_malformed(void)
+{
+    static char changes[BUFFER_SIZE];
+    char long_name[NFS41_MAX_COMPONENT_LEN + 2];
+    XDR list;
+
+    /* a change type we can't skip over */
+    xdrmem_create(&list, changes, sizeof(changes), XDR_ENCODE);
+    (void)encode_entry(&list, "x");
+    expect_failure("unknown_type", 16, 1, 1,
+        1 << (NOTIFY4_CHANGE_COOKIE_VERIFIER + 1), 0, &list);
+    expect_failure("unknown_word", 16, 1, 2, 0, 1, &list);
+
+    /* limits on the containers */
+    expect_failure("bitmap_count", 16, 1, 4,
+        1 << NOTIFY4_CHANGE_CHILD_ATTRS, 0, &list);
+    expect_failure("fh_len", NFS4_FHSIZE + 1, 1, 1,
+        1 << NOTIFY4_CHANGE_CHILD_ATTRS, 0, &list);
+    expect_failure("notify_count", 16, CB_COMPOUND_MAX_OPERATIONS + 1, 1,
+        1 << NOTIFY4_CHANGE_CHILD_ATTRS, 0, &list);
+
+    /* the mask promises more changes than the list holds */
+    expect_failure("short_list", 16, 1, 1,
+        (1 << NOTIFY4_CHANGE_CHILD_ATTRS) | (1 << NOTIFY4_CHANGE_DIR_ATTRS),
+        0, &list);
+
+    /* a name longer than a component */
+    memset(long_name, 'n', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    xdrmem_create(&list, changes, sizeof(changes), XDR_ENCODE);
+    (void)encode_entry(&list, long_name);
+    expect_failure("long_name", 16, 1, 1,
+        1 << NOTIFY4_CHANGE_CHILD_ATTRS, 0, &list);
+
+    /* nad_old_entry<1> with two entries */
+    xdrmem_create(&list, changes, sizeof(changes), XDR_ENCODE);
+    (void)(encode_u32(&list, 2) &&
+        encode_entry_cookie(&list, "old1", 1) &&
+        encode_entry_cookie(&list, "old2", 2) &&
+        encode_entry(&list, "new") &&
+        encode_u32(&list, 0) && encode_u32(&list, 0) &&
+        encode_u32(&list, 0));
+    expect_failure("old_entry_count", 16, 1, 1,
+        1 << NOTIFY4_ADD_ENTRY, 0, &list);
+}
+
+int main(int argc, char *argv[])
+{
+    test_all_types();
+    test_multiple_notify();
+    test_malformed();
+
+    if (failures) {
+        (void)printf("cbnotifytest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("cbnotifytest1: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,380 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * clntvctest1.c - loopback test and benchmark for the reply demultiplexing
+ * in libtirpc/src/clnt_vc.c
+ *
+ * Runs a minimal RPC server on 127.0.0.1 in a thread of its own and
+ * connects one CLIENT handle to it, which all callers share the way the
+ * daemon shares its session connection.  The server answers the NULL
+ * procedure right away and PROC_SLOW after SLOW_MS.
+ *
+ * First checks the timeouts: a call that outlives its timeout must fail
+ * with RPC_TIMEDOUT without taking the connection down, and a caller
+ * with a short timeout must not cut short a concurrent call that has a
+ * longer one.  Then sends NULL calls from 1 to 32 threads and prints
+ * calls/s with the median and 99th percentile latency for each count.
+ *
+ * Links against the libtirpc DLL built by build.vc19.
+ *
+ * Usage: clntvctest1 [calls per thread count]
+ */
+
+#include <wintirpc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rpc/rpc.h>
+
+
+#define PROG 0x2000f41f
+#define VERS 1
+#define PROC_SLOW 1
+
+#define SLOW_MS 1500
+#define SHORT_MS 1000
+#define MAX_THREADS 32
+
+static long failures = 0;
+
+static void test_fail(const char *msg)
+{
+    (void)fprintf(stderr, "clntvctest1: %s\n", msg);
+    failures++;
+}
+
+static double now_us(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1000000.0 / (double)freq.QuadPart;
+}
+
+
+/* server: one connection, records of a single fragment */
+static SOCKET server_sock = INVALID_SOCKET;
+static CRITICAL_SECTION server_send_lock;
+
+static bool_t recv_all(SOCKET s, char *buf, int len)
+{
+    int n;
+    while (len > 0) {
+        n = recv(s, buf, len, 0);
+        if (n <= 0)
+            return FALSE;
+        buf += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+static void send_reply(SOCKET s, uint32_t xid)
+{
+    uint32_t rec[7];
+
+    rec[0] = htonl(0x80000000 | (sizeof(rec) - sizeof(rec[0])));
+    rec[1] = xid; /* still in network order */
+    rec[2] = htonl(REPLY);
+    rec[3] = htonl(MSG_ACCEPTED);
+    rec[4] = htonl(AUTH_NONE);
+    rec[5] = 0;
+    rec[6] = htonl(SUCCESS);
+
+    EnterCriticalSection(&server_send_lock);
+    (void)send(s, (const char *)rec, sizeof(rec), 0);
+    LeaveCriticalSection(&server_send_lock);
+}
+
+static unsigned __stdcall slow_reply_thread(void *args)
+{
+    Sleep(SLOW_MS);
+    send_reply(server_sock, (uint32_t)(ULONG_PTR)args);
+    return 0;
+}
+
+static unsigned __stdcall server_thread(void *args)
+{
+    SOCKET listener = (SOCKET)(ULONG_PTR)args;
+    char body[4096];
+    uint32_t marker, len, xid, proc;
+    HANDLE thread;
+    BOOL nodelay = TRUE;
+
+    server_sock = accept(listener, NULL, NULL);
+    if (server_sock == INVALID_SOCKET)
+        return 1;
+    /* like the client side, see wintirpc.c */
+    (void)setsockopt(server_sock, IPPROTO_TCP, TCP_NODELAY,
+        (const char *)&nodelay, sizeof(nodelay));
+
+    while (recv_all(server_sock, (char *)&marker, sizeof(marker))) {
+        len = ntohl(marker) & 0x7fffffff;
+        if (len < 6 * sizeof(uint32_t) || len > sizeof(body) ||
+            !recv_all(server_sock, body, (int)len))
+            break;
+        /* xid, direction, rpcvers, prog, vers, proc */
+        memcpy(&xid, body, sizeof(xid));
+        memcpy(&proc, body + 5 * sizeof(uint32_t), sizeof(proc));
+        if (ntohl(proc) == PROC_SLOW) {
+            thread = (HANDLE)_beginthreadex(NULL, 0, slow_reply_thread,
+                (void *)(ULONG_PTR)xid, 0, NULL);
+            if (thread)
+                CloseHandle(thread);
+        } else
+            send_reply(server_sock, xid);
+    }
+    closesocket(server_sock);
+    return 0;
+}
+
+static SOCKET server_listen(u_short *port)
+{
+    struct sockaddr_in sin;
+    int len = sizeof(sin);
+    SOCKET listener;
+
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) ||
+        getsockname(listener, (struct sockaddr *)&sin, &len) ||
+        listen(listener, 1)) {
+        closesocket(listener);
+        return INVALID_SOCKET;
+    }
+    *port = ntohs(sin.sin_port);
+    return listener;
+}
+
+static CLIENT *client_connect(u_short port)
+{
+    struct netconfig *nconf;
+    struct netbuf *addr;
+    char uaddr[32];
+    CLIENT *clnt = NULL;
+
+    nconf = getnetconfigent("tcp");
+    if (nconf == NULL)
+        return NULL;
+    (void)_snprintf(uaddr, sizeof(uaddr), "127.0.0.1.%u.%u",
+        port >> 8, port & 0xff);
+    addr = uaddr2taddr(nconf, uaddr);
+    if (addr) {
+        clnt = clnt_tli_create(RPC_ANYFD, nconf, addr, PROG, VERS,
+            0, 0, NULL, NULL, NULL);
+        freenetbuf(addr);
+    }
+    freenetconfigent(nconf);
+    return clnt;
+}
+
+
+/* callers */
+struct caller {
+    CLIENT *clnt;
+    u_long proc;
+    struct timeval timeout;
+    unsigned ncalls;
+    double *latency;
+    enum clnt_stat last;
+    unsigned errors;
+};
+
+static enum clnt_stat call_one(CLIENT *clnt, u_long proc, long timeout_ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return clnt_call(clnt, proc, (xdrproc_t)xdr_void, NULL,
+        (xdrproc_t)xdr_void, NULL, tv);
+}
+
+static unsigned __stdcall caller_thread(void *args)
+{
+    struct caller *c = (struct caller *)args;
+    double start;
+    unsigned i;
+
+    for (i = 0; i < c->ncalls; i++) {
+        start = now_us();
+        c->last = clnt_call(c->clnt, c->proc, (xdrproc_t)xdr_void, NULL,
+            (xdrproc_t)xdr_void, NULL, c->timeout);
+        if (c->latency)
+            c->latency[i] = now_us() - start;
+        if (c->last != RPC_SUCCESS)
+            c->errors++;
+    }
+    return 0;
+}
+
+static HANDLE caller_start(struct caller *c, CLIENT *clnt, u_long proc,
+    long timeout_ms, unsigned ncalls, double *latency)
+{
+    memset(c, 0, sizeof(*c));
+    c->clnt = clnt;
+    c->proc = proc;
+    c->timeout.tv_sec = timeout_ms / 1000;
+    c->timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    c->ncalls = ncalls;
+    c->latency = latency;
+    return (HANDLE)_beginthreadex(NULL, 0, caller_thread, c, 0, NULL);
+}
+
+static void caller_join(HANDLE thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+
+static void test_timeouts(CLIENT *clnt)
+{
+    struct caller slow;
+    HANDLE thread;
+    enum clnt_stat stat;
+    unsigned i;
+
+    /* a call that times out leaves the connection usable */
+    thread = caller_start(&slow, clnt, PROC_SLOW, SHORT_MS, 1, NULL);
+    for (i = 0; i < 100; i++)
+        if (call_one(clnt, NULLPROC, 5000) != RPC_SUCCESS)
+            break;
+    caller_join(thread);
+    if (i < 100)
+        test_fail("NULL call failed next to a timing out call");
+    if (slow.last != RPC_TIMEDOUT)
+        test_fail("slow call did not time out");
+
+    /* its reply arrives late and gets skipped */
+    Sleep(SLOW_MS);
+    if (call_one(clnt, NULLPROC, 5000) != RPC_SUCCESS)
+        test_fail("NULL call failed after a late reply");
+
+    /* a short timeout elsewhere does not apply to the slow call,
+     * nor does the connection sit idle long enough to give up */
+    thread = caller_start(&slow, clnt, PROC_SLOW, SLOW_MS * 3, 1, NULL);
+    Sleep(50);
+    stat = call_one(clnt, NULLPROC, SHORT_MS);
+    if (stat != RPC_SUCCESS)
+        test_fail("NULL call with a short timeout failed");
+    caller_join(thread);
+    if (slow.last != RPC_SUCCESS)
+        test_fail("slow call failed after another call's short timeout");
+    if (call_one(clnt, NULLPROC, 5000) != RPC_SUCCESS)
+        test_fail("NULL call failed after the slow call");
+}
+
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench(CLIENT *clnt, unsigned nthreads, unsigned total)
+{
+    struct caller callers[MAX_THREADS];
+    HANDLE threads[MAX_THREADS];
+    unsigned per_thread = total / nthreads, i, j, n = 0, errors = 0;
+    double *latency, start, elapsed;
+
+    latency = calloc((size_t)per_thread * nthreads, sizeof(double));
+    if (latency == NULL) {
+        test_fail("out of memory");
+        return;
+    }
+    start = now_us();
+    for (i = 0; i < nthreads; i++)
+        threads[i] = caller_start(&callers[i], clnt, NULLPROC, 5000,
+            per_thread, latency + (size_t)i * per_thread);
+    for (i = 0; i < nthreads; i++)
+        caller_join(threads[i]);
+    elapsed = now_us() - start;
+
+    for (i = 0; i < nthreads; i++) {
+        errors += callers[i].errors;
+        for (j = 0; j < per_thread; j++)
+            latency[n++] = latency[(size_t)i * per_thread + j];
+    }
+    qsort(latency, n, sizeof(double), compare_double);
+    (void)printf("%2u threads %9.0f calls/s  p50 %8.1f us  p99 %8.1f us\n",
+        nthreads, n / (elapsed / 1000000.0), latency[n / 2],
+        latency[n - 1 - n / 100]);
+    if (errors)
+        test_fail("NULL calls failed during the benchmark");
+    free(latency);
+}
+
+int main(int argc, char *argv[])
+{
+    WSADATA wsadata;
+    SOCKET listener;
+    HANDLE server;
+    CLIENT *clnt;
+    u_short port;
+    unsigned total = 20000, nthreads;
+
+    if (argc > 1)
+        total = (unsigned)strtoul(argv[1], NULL, 0);
+    if (total < MAX_THREADS)
+        total = MAX_THREADS;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsadata)) {
+        (void)fprintf(stderr, "clntvctest1: WSAStartup failed\n");
+        return 1;
+    }
+    InitializeCriticalSection(&server_send_lock);
+    listener = server_listen(&port);
+    if (listener == INVALID_SOCKET) {
+        (void)fprintf(stderr, "clntvctest1: no loopback listener\n");
+        return 1;
+    }
+    server = (HANDLE)_beginthreadex(NULL, 0, server_thread,
+        (void *)(ULONG_PTR)listener, 0, NULL);
+    clnt = client_connect(port);
+    if (server == NULL || clnt == NULL) {
+        (void)fprintf(stderr, "clntvctest1: no loopback connection\n");
+        return 1;
+    }
+
+    test_timeouts(clnt);
+    for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2)
+        bench(clnt, nthreads, total);
+
+    clnt_destroy(clnt);
+    caller_join(server);
+    closesocket(listener);
+    DeleteCriticalSection(&server_send_lock);
+    WSACleanup();
+
+    if (failures) {
+        (void)printf("clntvctest1: %ld failures\n", failures);
+        return 1;
+    }
+    (void)printf("clntvctest1: OK\n");
+    return 0;
+}
@@ -0,0 +1,482 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * dirdelegtest1.c - test for directory delegations in daemon/delegation.c
+ * and the name cache entries they hold in daemon/name_cache.c
+ *
+ * A stand-in server grants every GET_DIR_DELEGATION and records every
+ * DELEGRETURN.  The test plays the server's callback side, sending
+ * CB_NOTIFY, CB_RECALL and CB_RECALL_ANY to a client whose name cache
+ * holds a small tree:
+ *
+ * - a delegated directory that is renamed must still get its
+ *   notifications under its new path, and a recall must release its
+ *   entry there;
+ * - a delegated directory that drops out of the name cache must get
+ *   its notifications without a path, and still be returned;
+ * - CB_RECALL_ANY for directory delegations must return all but the
+ *   ones the server lets us keep, and must leave them alone when it
+ *   only asks for file delegations.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: dirdelegtest1
+ */
+
+#include "../../daemon/name_cache.c"
+#include "../../daemon/delegation.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* stubs for what name_cache.c and delegation.c link against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+const char* nfs_error_string(int status) { return "status"; }
+
+int nfs_to_windows_error(int status, int default_error) { return default_error; }
+
+void compound_init(nfs41_compound *compound, nfs_argop4 *argops,
+    nfs_resop4 *resops, const char *tag) {}
+void compound_add_op(nfs41_compound *compound, uint32_t opnum,
+    void *arg, void *res) {}
+int compound_encode_send_decode(nfs41_session *session,
+    nfs41_compound *compound, bool_t try_recovery) { return NFS4ERR_IO; }
+void nfs41_session_sequence(nfs41_sequence_args *args,
+    nfs41_session *session, bool_t cachethis) {}
+
+int nfs41_open(nfs41_session *session, nfs41_path_fh *parent,
+    nfs41_path_fh *file, state_owner4 *owner, open_claim4 *claim,
+    uint32_t allow, uint32_t deny, uint32_t create, uint32_t how_mode,
+    nfs41_file_info *createattrs, bool_t try_recovery, stateid4 *stateid,
+    open_delegation4 *delegation, nfs41_file_info *info) { return NFS4ERR_IO; }
+int nfs41_lock(nfs41_session *session, nfs41_path_fh *file,
+    state_owner4 *owner, uint32_t type, uint64_t offset, uint64_t length,
+    bool_t reclaim, bool_t try_recovery,
+    stateid_arg *stateid) { return NFS4ERR_IO; }
+int nfs41_setattr(nfs41_session *session, nfs41_path_fh *file,
+    stateid_arg *stateid, nfs41_file_info *info) { return NFS4ERR_IO; }
+int nfs41_delegpurge(nfs41_session *session) { return NFS4_OK; }
+int nfs41_delegreturn_batch(nfs41_session *session, uint32_t count,
+    nfs41_delegreturn_batch_args *returns) { return NFS4ERR_IO; }
+int nfs41_write_behind_flush(nfs41_open_state *state) { return NO_ERROR; }
+void nfs41_open_state_ref(nfs41_open_state *state) {}
+void nfs41_open_state_deref(nfs41_open_state *state) {}
+void nfs41_root_ref(nfs41_root *root) {}
+void nfs41_root_deref(nfs41_root *root) {}
+void nfs41_file_info_cpy(nfs41_file_info *dest,
+    const nfs41_file_info *src) { *dest = *src; }
+int safe_write(unsigned char **pos, uint32_t *remaining, void *dest,
+    uint32_t dest_len) { return ERROR_BUFFER_OVERFLOW; }
+void get_nfs_time(nfstime4 *nfs_time) { ZeroMemory(nfs_time, sizeof(*nfs_time)); }
+uint32_t state_hash(const void *key, uint32_t len) { return 0; }
+void state_index_add(struct state_index *index, uint32_t hash,
+    struct list_entry *entry) { list_add_tail(&index->buckets[0].head, entry); }
+void state_index_remove(struct state_index *index, uint32_t hash,
+    struct list_entry *entry) { list_remove(entry); }
+
+/* same as daemon/util.c */
+bool_t next_component(const char *path, const char *path_end,
+    nfs41_component *component)
+{
+    const char *component_end;
+    component->name = next_non_delimiter(path, path_end);
+    component_end = next_delimiter(component->name, path_end);
+    component->len = (unsigned short)(component_end - component->name);
+    return component->len > 0;
+}
+
+bool_t is_last_component(const char *path, const char *path_end)
+{
+    path = next_delimiter(path, path_end);
+    return next_non_delimiter(path, path_end) == path_end;
+}
+
+bool_t last_component(const char *path, const char *path_end,
+    nfs41_component *component)
+{
+    const char *component_end = prev_delimiter(path_end, path);
+    component->name = prev_non_delimiter(component_end, path);
+    component->name = prev_delimiter(component->name, path);
+    component->name = next_non_delimiter(component->name, component_end);
+    component->len = (unsigned short)(component_end - component->name);
+    return component->len > 0;
+}
+
+void abs_path_copy(nfs41_abs_path *dst, const nfs41_abs_path *src)
+{
+    dst->len = src->len;
+    StringCchCopyNA(dst->path, NFS41_MAX_PATH_LEN, src->path, dst->len);
+}
+
+void path_fh_init(nfs41_path_fh *file, nfs41_abs_path *path)
+{
+    file->path = path;
+    last_component(path->path, path->path + path->len, &file->name);
+}
+
+void fh_copy(nfs41_fh *dst, const nfs41_fh *src)
+{
+    dst->fileid = src->fileid;
+    dst->superblock = src->superblock;
+    dst->len = src->len;
+    memcpy(dst->fh, src->fh, dst->len);
+}
+
+
+/* the stand-in server */
+static struct {
+    volatile LONG           granted;
+    volatile LONG           returned;
+    stateid4                last_returned;
+} server_state;
+
+int nfs41_get_dir_delegation(nfs41_session *session, nfs41_path_fh *dir,
+    nfs41_get_dir_delegation_args *args, nfs41_get_dir_delegation_res *res)
+{
+    const LONG id = InterlockedIncrement(&server_state.granted);
+
+    /* grant whatever was asked for */
+    ZeroMemory(res, sizeof(*res));
+    res->status = NFS4_OK;
+    res->gdd_status = GDD4_OK;
+    res->stateid.seqid = 1;
+    (void)memcpy(res->stateid.other, &id, sizeof(id));
+    bitmap4_cpy(&res->notification, &args->notification_types);
+    bitmap4_cpy(&res->child_attributes, &args->child_attributes);
+    bitmap4_cpy(&res->dir_attributes, &args->dir_attributes);
+    return NFS4_OK;
+}
+
+int nfs41_delegreturn(nfs41_session *session, nfs41_path_fh *file,
+    stateid_arg *stateid, bool_t try_recovery)
+{
+    stateid4_cpy(&server_state.last_returned, &stateid->stateid);
+    MemoryBarrier();
+    InterlockedIncrement(&server_state.returned);
+    return NFS4_OK;
+}
+
+/* the paths CB_NOTIFY changes were applied under */
+static char notified_path[NFS41_MAX_PATH_LEN];
+static uint32_t notified;
+
+void nfs41_readdir_notify(struct nfs41_name_cache *cache,
+    const nfs41_abs_path *path, const nfs41_fh *dir,
+    struct notify_dir4 *change)
+{
+    (void)StringCchCopyA(notified_path, NFS41_MAX_PATH_LEN,
+        path ? path->path : "(none)");
+    notified++;
+}
+
+
+#define FH_LEN 28
+#define RETURN_WAIT_MS 5000
+
+static long failures = 0;
+
+static void test_fail(const char *msg, const char *detail)
+{
+    if (++failures <= 10)
+        (void)fprintf(stderr, "FAIL: %s (%s)\n", msg, detail);
+}
+
+static nfs41_superblock superblock;
+static nfs41_server server;
+static nfs41_root root;
+static nfs41_client client;
+static nfs41_session session;
+
+static void make_fh(uint64_t fileid, nfs41_fh *fh)
+{
+    ZeroMemory(fh, sizeof(nfs41_fh));
+    fh->fileid = fileid;
+    fh->superblock = &superblock;
+    fh->len = FH_LEN;
+    (void)memcpy(fh->fh, &fileid, sizeof(fileid));
+}
+
+static int insert(const char *path, uint64_t fileid, uint32_t type)
+{
+    const char *last = strrchr(path, '\\');
+    nfs41_component name;
+    nfs41_file_info info;
+    nfs41_fh fh;
+
+    name.name = last + 1;
+    name.len = (unsigned short)strlen(name.name);
+    make_fh(fileid, &fh);
+    ZeroMemory(&info, sizeof(info));
+    info.attrmask.count = 2;
+    info.attrmask.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE |
+        FATTR4_WORD0_FILEID;
+    info.attrmask.arr[1] = FATTR4_WORD1_NUMLINKS;
+    info.type = type;
+    info.fileid = fileid;
+    info.change = 1;
+    info.numlinks = 1;
+    if (path[1] == '\0') /* the root */
+        return nfs41_name_cache_insert(server.name_cache, NULL, NULL,
+            &fh, &info, NULL, OPEN_DELEGATE_NONE);
+    return nfs41_name_cache_insert(server.name_cache, path, &name,
+        &fh, &info, NULL, OPEN_DELEGATE_NONE);
+}
+
+static int client_setup(void)
+{
+    const nfs41_name_cache_config config = { 3600, 3600, 4, TRUE };
+    uint32_t i;
+
+    if (nfs41_name_cache_create(&server.name_cache))
+        return ERROR_OUTOFMEMORY;
+    nfs41_name_cache_configure(server.name_cache, &config);
+
+    client.server = &server;
+    client.session = &session;
+    client.root = &root;
+    session.client = &client;
+    list_init(&client.state.opens);
+    list_init(&client.state.delegations);
+    list_init(&client.state.dir_delegations);
+    InitializeCriticalSection(&client.state.lock);
+    for (i = 0; i < STATE_INDEX_BUCKETS; i++) {
+        list_init(&client.state.delegations_by_stateid.buckets[i].head);
+        list_init(&client.state.delegations_by_fh.buckets[i].head);
+        list_init(&client.state.delegations_by_fileid.buckets[i].head);
+        list_init(&client.state.opens_by_fileid.buckets[i].head);
+    }
+
+    return insert("\\", 1, NF4DIR) || insert("\\a", 2, NF4DIR) ||
+        insert("\\b", 3, NF4DIR);
+}
+
+/* the last component of a path, pointing into it */
+static nfs41_component last_name(const char *path)
+{
+    nfs41_component name;
+    last_component(path, path + strlen(path), &name);
+    return name;
+}
+
+/* the name cache entry at a path, or NULL */
+static struct name_cache_entry* cache_entry(const char *path)
+{
+    struct name_cache_entry *target = NULL;
+    if (name_cache_lookup(server.name_cache, 0, path, path + strlen(path),
+            NULL, NULL, &target, NULL))
+        return NULL;
+    return target;
+}
+
+static void request(const char *path, uint64_t fileid, stateid4 *stateid)
+{
+    nfs41_abs_path dir_path = { 0 };
+    nfs41_path_fh dir;
+    bitmap4 child_attributes = { 1, { FATTR4_WORD0_CHANGE } };
+    const LONG granted = server_state.granted;
+
+    dir_path.len = (unsigned short)strlen(path);
+    (void)StringCchCopyA(dir_path.path, NFS41_MAX_PATH_LEN, path);
+    path_fh_init(&dir, &dir_path);
+    make_fh(fileid, &dir.fh);
+
+    if (nfs41_delegation_dir_request(&session, &dir, &child_attributes) ||
+            server_state.granted != granted + 1) {
+        test_fail("GET_DIR_DELEGATION was not granted", path);
+        return;
+    }
+    (void)memcpy(stateid->other, (const void*)&server_state.granted,
+        sizeof(LONG));
+    if (cache_entry(path) == NULL || !cache_entry(path)->dir_delegated)
+        test_fail("directory is not held in the name cache", path);
+}
+
+static void notify(const stateid4 *stateid, const char *expected)
+{
+    struct notify_dir4 change;
+
+    ZeroMemory(&change, sizeof(change));
+    change.type = NOTIFY4_ADD_ENTRY;
+    (void)StringCchCopyA(change.entry.name, sizeof(change.entry.name), "new");
+    change.entry.name_len = 3;
+
+    notified_path[0] = '\0';
+    if (nfs41_delegation_notify(&client, stateid, &change, 1))
+        test_fail("CB_NOTIFY failed", expected);
+    else if (strcmp(notified_path, expected))
+        test_fail("CB_NOTIFY applied under the wrong path", notified_path);
+}
+
+/* wait for the recall pool to finish with them */
+static uint64_t recall_jobs_done(void)
+{
+    uint64_t done;
+    AcquireSRWLockShared(&recall_pool.lock);
+    done = recall_pool.returned;
+    ReleaseSRWLockShared(&recall_pool.lock);
+    return done;
+}
+
+static void wait_returned(LONG expected)
+{
+    uint32_t waited = 0;
+    while (recall_jobs_done() < (uint64_t)expected &&
+            waited < RETURN_WAIT_MS) {
+        Sleep(10);
+        waited += 10;
+    }
+    if (server_state.returned != expected)
+        test_fail("delegations weren't returned", "timed out");
+}
+
+static void check_released(const char *path)
+{
+    struct name_cache_entry *entry = cache_entry(path);
+    if (entry && (entry->dir_delegated || list_empty(&entry->exp_entry)))
+        test_fail("directory is still held after DELEGRETURN", path);
+}
+
+static void check_idle(void)
+{
+    if (client.state.dir_delegation_count)
+        test_fail("client still counts delegations", "dir_delegation_count");
+    if (server.name_cache->dir_delegation_count)
+        test_fail("name cache still holds directories", "dir_delegations");
+}
+
+static void test_rename(void)
+{
+    static const char src_path[] = "\\a\\d", dst_path[] = "\\b\\e";
+    change_info4 cinfo = { TRUE, 1, 1 };
+    nfs41_component src = last_name(src_path), dst = last_name(dst_path);
+    stateid4 stateid = { 0 };
+    const LONG returned = server_state.returned;
+
+    insert("\\a\\d", 10, NF4DIR);
+    insert("\\a\\d\\f", 11, NF4REG);
+    request("\\a\\d", 10, &stateid);
+    notify(&stateid, "\\a\\d");
+
+    /* move it to another parent and name */
+    if (nfs41_name_cache_rename(server.name_cache, src_path, &src, &cinfo,
+            dst_path, &dst, &cinfo))
+        test_fail("rename failed", "\\a\\d");
+    else if (cache_entry("\\b\\e") == NULL ||
+            !cache_entry("\\b\\e")->dir_delegated)
+        test_fail("rename lost the delegated entry", "\\b\\e");
+
+    notify(&stateid, "\\b\\e");
+
+    if (nfs41_delegation_recall(&client, NULL, &stateid, FALSE))
+        test_fail("CB_RECALL failed", "\\b\\e");
+    wait_returned(returned + 1);
+    check_released("\\b\\e");
+    check_idle();
+}
+
+static void test_forgotten(void)
+{
+    static const char path[] = "\\a\\g";
+    nfs41_component name = last_name(path);
+    stateid4 stateid = { 0 };
+    const LONG returned = server_state.returned;
+
+    insert("\\a\\g", 20, NF4DIR);
+    request("\\a\\g", 20, &stateid);
+
+    /* the name cache drops the entry, e.g. for a failed rename */
+    (void)nfs41_name_cache_unlink(server.name_cache, path, &name);
+    notify(&stateid, "(none)");
+
+    if (nfs41_delegation_recall(&client, NULL, &stateid, FALSE))
+        test_fail("CB_RECALL failed", "\\a\\g");
+    wait_returned(returned + 1);
+    check_idle();
+}
+
+static void test_recall_any(void)
+{
+    const bitmap4 files = { 1, { (1 << RCA4_TYPE_MASK_RDATA_DLG) |
+        (1 << RCA4_TYPE_MASK_WDATA_DLG) } };
+    const bitmap4 dirs = { 1, { 1 << RCA4_TYPE_MASK_DIR_DLG } };
+    stateid4 stateid[3] = { 0 };
+    const LONG returned = server_state.returned;
+
+    insert("\\a\\h0", 30, NF4DIR);
+    insert("\\a\\h1", 31, NF4DIR);
+    insert("\\b\\h2", 32, NF4DIR);
+    request("\\a\\h0", 30, &stateid[0]);
+    request("\\a\\h1", 31, &stateid[1]);
+    request("\\b\\h2", 32, &stateid[2]);
+
+    /* asking for file delegations leaves directories alone */
+    if (nfs41_delegation_recall_any(&client, 0, &files))
+        test_fail("CB_RECALL_ANY failed", "files");
+    Sleep(100);
+    if (server_state.returned != returned)
+        test_fail("CB_RECALL_ANY returned directories", "files");
+
+    /* keep one of three */
+    if (nfs41_delegation_recall_any(&client, 1, &dirs))
+        test_fail("CB_RECALL_ANY failed", "dirs");
+    wait_returned(returned + 2);
+    if (client.state.dir_delegation_count != 1)
+        test_fail("CB_RECALL_ANY kept the wrong number", "dirs");
+
+    /* and the last one */
+    if (nfs41_delegation_recall_any(&client, 0, &dirs))
+        test_fail("CB_RECALL_ANY failed", "dirs");
+    wait_returned(returned + 3);
+    check_released("\\a\\h0");
+    check_released("\\a\\h1");
+    check_released("\\b\\h2");
+    check_idle();
+}
+
+int main(int argc, char *argv[])
+{
+    if (client_setup()) {
+        (void)printf("dirdelegtest1: setup failed\n");
+        return EXIT_FAILURE;
+    }
+
+    test_rename();
+    test_forgotten();
+    test_recall_any();
+
+    (void)printf("%ld directory delegations granted, %ld returned\n",
+        server_state.granted, server_state.returned);
+    if (failures) {
+        (void)printf("dirdelegtest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("dirdelegtest1: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,487 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * idmaptest1.c - test and benchmark for the idmap caches in
+ * daemon/idmap.c, against an ldap stand-in with 100k users and 100k
+ * groups
+ *
+ * The stand-in answers the searches idmap.c sends, after a configurable
+ * delay, and counts them.  The daemon's clock is replaced by one the
+ * test moves forward, so entries can be aged without waiting.
+ *
+ * Looks up every user and group once, which has to query the stand-in
+ * for each, then times random lookups by name, uid, principal, group
+ * name and gid, which must all come from the cache.  For comparison it
+ * times lookups by name with a linear search of the same entries, as
+ * the cache did before it was hashed.  Names the stand-in doesn't know
+ * must only be queried once while their negative entries are valid.
+ *
+ * Then ages the caches: a hit in the last quarter of the ttl must be
+ * answered from the cache and refreshed in the background, and the
+ * refresh thread must free negative entries once they expire, and
+ * positive entries once theirs do.
+ *
+ * Needs no server; the ldap client calls are stubbed out below.
+ *
+ * Usage: idmaptest1 [ldap delay in microseconds]
+ */
+
+#include <Windows.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the test's clock, in milliseconds */
+static volatile LONGLONG test_now;
+static ULONGLONG test_clock(void) { return (ULONGLONG)test_now; }
+#define GetTickCount64 test_clock
+
+/* build the ldap client rather than the cygwin one */
+#include "nfs41_build_features.h"
+#undef NFS41_DRIVER_FEATURE_IDMAPPER_CYGWIN
+
+#include "../../daemon/idmap.c"
+
+
+/* stubs for what idmap.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...) { (void)format; }
+
+
+/* the ldap stand-in */
+#define IDENTITIES 100000
+#define ID_BASE 100000
+#define UNKNOWN 10000
+#define DEFAULT_DELAY 20
+
+static struct {
+    struct idmap_context *context; /* for the schema */
+    LONGLONG delay; /* in performance counter ticks */
+    volatile LONG queries;
+} ldap;
+
+struct ldap_result {
+    enum ldap_class klass;
+    uint32_t id; /* index of the user or group */
+};
+
+static void ldap_delay(void)
+{
+    LARGE_INTEGER start, now;
+
+    (void)QueryPerformanceCounter(&start);
+    do
+        (void)QueryPerformanceCounter(&now);
+    while (now.QuadPart - start.QuadPart < ldap.delay);
+}
+
+static int ldap_attr(const char *name)
+{
+    int i;
+    for (i = 0; i < NUM_ATTRIBUTES; i++)
+        if (strcmp(ldap.context->config.attributes[i], name) == 0)
+            return i;
+    return -1;
+}
+
+/* parse the number after a name's prefix, for names of identities */
+static bool_t ldap_name_id(const char *value, const char *prefix,
+    const char *suffix, uint32_t *id)
+{
+    const size_t len = strlen(prefix);
+    char *end;
+
+    if (strncmp(value, prefix, len) != 0)
+        return FALSE;
+    *id = (uint32_t)strtoul(value + len, &end, 10);
+    return end != value + len && strcmp(end, suffix) == 0 &&
+        *id < IDENTITIES;
+}
+
+LDAP* ldap_initA(const PCHAR host, ULONG port)
+{
+    return (LDAP*)&ldap;
+}
+
+ULONG ldap_set_option(LDAP *ld, int option, const void *value)
+{
+    return LDAP_SUCCESS;
+}
+
+ULONG ldap_search_stA(LDAP *ld, const PCHAR base, ULONG scope,
+    const PCHAR filter, PCHAR attrs[], ULONG attrsonly,
+    struct l_timeval *timeout, LDAPMessage **res)
+{
+    char klass[NAME_LEN], attr[NAME_LEN], value[VAL_LEN];
+    struct ldap_result *result;
+    uint32_t id;
+    bool_t found = FALSE;
+
+    InterlockedIncrement(&ldap.queries);
+    ldap_delay();
+
+    if (sscanf(filter, "(&(objectClass=%31[^)])(%31[^=]=%256[^)]))",
+            klass, attr, value) != 3)
+        return LDAP_FILTER_ERROR;
+
+    result = calloc(1, sizeof(struct ldap_result));
+    if (result == NULL)
+        return LDAP_NO_MEMORY;
+    result->klass = strcmp(klass,
+        ldap.context->config.classes[CLASS_USER]) ? CLASS_GROUP : CLASS_USER;
+
+    switch (ldap_attr(attr)) {
+    case ATTR_USER_NAME: /* same as ATTR_GROUP_NAME by default */
+    case ATTR_GROUP_NAME:
+        found = ldap_name_id(value, result->klass == CLASS_USER ?
+            "user" : "group", "", &id);
+        break;
+    case ATTR_PRINCIPAL:
+        found = ldap_name_id(value, "user", "@EXAMPLE.COM", &id);
+        break;
+    case ATTR_UID:
+    case ATTR_GID:
+        id = (uint32_t)strtoul(value, NULL, 10) - ID_BASE;
+        found = id < IDENTITIES;
+        break;
+    }
+    result->id = found ? id : UINT32_MAX;
+    *res = (LDAPMessage*)result;
+    return LDAP_SUCCESS;
+}
+
+LDAPMessage* ldap_first_entry(LDAP *ld, LDAPMessage *res)
+{
+    const struct ldap_result *result = (const struct ldap_result*)res;
+    return result->id == UINT32_MAX ? NULL : res;
+}
+
+PCHAR* ldap_get_valuesA(LDAP *ld, LDAPMessage *entry, const PCHAR attr)
+{
+    const struct ldap_result *result = (const struct ldap_result*)entry;
+    const bool_t user = result->klass == CLASS_USER;
+    PCHAR *values = calloc(1, 2 * sizeof(PCHAR) + VAL_LEN);
+
+    if (values == NULL)
+        return NULL;
+    values[0] = (PCHAR)(values + 2);
+
+    switch (ldap_attr(attr)) {
+    case ATTR_USER_NAME:
+    case ATTR_GROUP_NAME:
+        (void)sprintf(values[0], "%s%u", user ? "user" : "group",
+            result->id);
+        break;
+    case ATTR_PRINCIPAL:
+        (void)sprintf(values[0], "user%u@EXAMPLE.COM", result->id);
+        break;
+    case ATTR_UID:
+        (void)sprintf(values[0], "%u", ID_BASE + result->id);
+        break;
+    case ATTR_GID:
+        /* users belong to one of 1000 groups */
+        (void)sprintf(values[0], "%u", ID_BASE +
+            (user ? result->id % 1000 : result->id));
+        break;
+    default:
+        free(values);
+        return NULL;
+    }
+    return values;
+}
+
+ULONG ldap_value_freeA(PCHAR *values)
+{
+    free(values);
+    return LDAP_SUCCESS;
+}
+
+ULONG ldap_msgfree(LDAPMessage *res)
+{
+    free(res);
+    return LDAP_SUCCESS;
+}
+
+ULONG ldap_unbind(LDAP *ld) { return LDAP_SUCCESS; }
+PCHAR ldap_err2stringA(ULONG err) { return "ldap error"; }
+ULONG LdapGetLastError(VOID) { return LDAP_SUCCESS; }
+ULONG LdapMapErrorToWin32(ULONG err) { return ERROR_INTERNAL_ERROR; }
+
+
+#define LOOKUPS 1000000
+#define LINEAR_LOOKUPS 1000
+#define TTL 600
+#define NEGATIVE_TTL 60
+#define START (1000 * 1000) /* milliseconds */
+
+static long failures = 0;
+
+static void test_fail(const char *test, const char *msg, uint32_t id)
+{
+    if (++failures <= 10)
+        (void)fprintf(stderr, "FAIL: %s: %s (id=%u)\n", test, msg, id);
+}
+
+static uint32_t test_random(uint32_t *seed)
+{
+    /* xorshift32 */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static double elapsed_ns(const LARGE_INTEGER *start, uint32_t count)
+{
+    LARGE_INTEGER freq, end;
+    (void)QueryPerformanceCounter(&end);
+    (void)QueryPerformanceFrequency(&freq);
+    return (double)(end.QuadPart - start->QuadPart) * 1e9 /
+        (double)freq.QuadPart / count;
+}
+
+static void set_clock(struct idmap_context *context, LONGLONG seconds)
+{
+    /* take the refresh lock, so the thread is either waiting for the
+     * wakeup or hasn't read the clock yet */
+    test_now = START + seconds * 1000;
+    AcquireSRWLockExclusive(&context->refresh_lock);
+    ReleaseSRWLockExclusive(&context->refresh_lock);
+    WakeConditionVariable(&context->refresh_cond);
+}
+
+static uint32_t cache_count(struct idmap_cache *cache)
+{
+    uint32_t count;
+    AcquireSRWLockShared(&cache->lock);
+    count = cache->count;
+    ReleaseSRWLockShared(&cache->lock);
+    return count;
+}
+
+/* wait for the refresh thread to bring the cache to a count */
+static void wait_count(const char *test, struct idmap_cache *cache,
+    uint32_t expected)
+{
+    uint32_t i;
+    for (i = 0; i < 10000 && cache_count(cache) != expected; i++)
+        Sleep(1);
+    if (cache_count(cache) != expected)
+        test_fail(test, "cache count", cache_count(cache));
+}
+
+static void lookup_user(struct idmap_context *context, const char *test,
+    uint32_t id)
+{
+    char name[VAL_LEN];
+    uid_t uid;
+    gid_t gid;
+
+    (void)sprintf(name, "user%u", id);
+    if (nfs41_idmap_name_to_ids(context, name, &uid, &gid) != NO_ERROR ||
+            uid != ID_BASE + id || gid != ID_BASE + id % 1000)
+        test_fail(test, "name to ids", id);
+}
+
+static void lookup_group(struct idmap_context *context, const char *test,
+    uint32_t id)
+{
+    char name[VAL_LEN];
+    gid_t gid;
+
+    (void)sprintf(name, "group%u", id);
+    if (nfs41_idmap_group_to_gid(context, name, &gid) != NO_ERROR ||
+            gid != ID_BASE + id)
+        test_fail(test, "group to gid", id);
+}
+
+/* one lookup of each kind, by random identity */
+static void lookup_any(struct idmap_context *context, uint32_t id,
+    uint32_t kind)
+{
+    char name[VAL_LEN], expected[VAL_LEN];
+    uid_t uid;
+    gid_t gid;
+
+    switch (kind) {
+    case 0:
+        lookup_user(context, "warm", id);
+        break;
+    case 1:
+        (void)sprintf(expected, "user%u", id);
+        if (nfs41_idmap_uid_to_name(context, ID_BASE + id, name,
+                VAL_LEN) != NO_ERROR || strcmp(name, expected) != 0)
+            test_fail("warm", "uid to name", id);
+        break;
+    case 2:
+        (void)sprintf(name, "user%u@EXAMPLE.COM", id);
+        if (nfs41_idmap_principal_to_ids(context, name, &uid, &gid) !=
+                NO_ERROR || uid != ID_BASE + id)
+            test_fail("warm", "principal to ids", id);
+        break;
+    case 3:
+        lookup_group(context, "warm", id);
+        break;
+    default:
+        (void)sprintf(expected, "group%u", id);
+        if (nfs41_idmap_gid_to_group(context, ID_BASE + id, name,
+                VAL_LEN) != NO_ERROR || strcmp(name, expected) != 0)
+            test_fail("warm", "gid to group", id);
+        break;
+    }
+}
+
+/* what cache_lookup() did before the cache was hashed: compare the name
+ * of every entry on the list, under the shared lock */
+static bool_t linear_lookup(struct idmap_cache *cache, const char *name,
+    struct idmap_user *user_out)
+{
+    struct list_entry *pos;
+    struct idmap_user *user;
+    bool_t found = FALSE;
+
+    AcquireSRWLockShared(&cache->lock);
+    list_for_each(pos, &cache->head) {
+        user = list_container(pos, struct idmap_user, entry.list);
+        if (strcmp(user->username, name) == 0) {
+            user_cache_copy(&user_out->entry, &user->entry);
+            found = TRUE;
+            break;
+        }
+    }
+    ReleaseSRWLockShared(&cache->lock);
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    struct idmap_context *context;
+    struct idmap_user user;
+    LARGE_INTEGER freq, start;
+    char name[VAL_LEN];
+    uint32_t i, seed = 1;
+    LONG queries;
+    double cold_ns, warm_ns, linear_ns;
+    uid_t uid;
+    int status;
+
+    (void)QueryPerformanceFrequency(&freq);
+    ldap.delay = (argc > 1 ? (LONGLONG)strtoul(argv[1], NULL, 0) :
+        DEFAULT_DELAY) * freq.QuadPart / 1000000;
+    test_now = START;
+
+    status = nfs41_idmap_create(&context, "EXAMPLE.COM");
+    if (status) {
+        (void)fprintf(stderr, "nfs41_idmap_create() failed with %d\n",
+            status);
+        return EXIT_FAILURE;
+    }
+    if (context->refresh_thread == NULL) {
+        (void)fprintf(stderr, "caching is disabled in the config file\n");
+        return EXIT_FAILURE;
+    }
+    ldap.context = context;
+    context->users.ttl = context->groups.ttl = TTL;
+    context->users.negative_ttl = context->groups.negative_ttl =
+        NEGATIVE_TTL;
+
+    /* every identity once, from the stand-in */
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < IDENTITIES; i++) {
+        lookup_user(context, "cold", i);
+        lookup_group(context, "cold", i);
+    }
+    cold_ns = elapsed_ns(&start, 2 * IDENTITIES);
+    if (ldap.queries != 2 * IDENTITIES)
+        test_fail("cold", "queries", ldap.queries);
+
+    /* then from the cache */
+    queries = ldap.queries;
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < LOOKUPS; i++)
+        lookup_any(context, test_random(&seed) % IDENTITIES, i % 5);
+    warm_ns = elapsed_ns(&start, LOOKUPS);
+    if (ldap.queries != queries)
+        test_fail("warm", "queries", ldap.queries - queries);
+
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < LINEAR_LOOKUPS; i++) {
+        const uint32_t id = test_random(&seed) % IDENTITIES;
+        (void)sprintf(name, "user%u", id);
+        if (!linear_lookup(&context->users, name, &user) ||
+                user.uid != ID_BASE + id)
+            test_fail("linear", "name to uid", id);
+    }
+    linear_ns = elapsed_ns(&start, LINEAR_LOOKUPS);
+
+    (void)printf("%u users and %u groups, ldap delay %.0f us\n",
+        IDENTITIES, IDENTITIES,
+        (double)ldap.delay * 1e6 / (double)freq.QuadPart);
+    (void)printf("cold lookups:   %10.0f ns/op\n", cold_ns);
+    (void)printf("cached lookups: %10.0f ns/op\n", warm_ns);
+    (void)printf("linear search:  %10.0f ns/op, %.0fx\n", linear_ns,
+        warm_ns > 0.0 ? linear_ns / warm_ns : 0.0);
+
+    /* names the server doesn't know are queried once */
+    queries = ldap.queries;
+    for (i = 0; i < 2 * UNKNOWN; i++) {
+        (void)sprintf(name, "nobody%u", i % UNKNOWN);
+        if (nfs41_idmap_name_to_uid(context, name, &uid) != ERROR_NOT_FOUND)
+            test_fail("negative", "found an unknown name", i);
+    }
+    if (ldap.queries - queries != UNKNOWN)
+        test_fail("negative", "queries", ldap.queries - queries);
+    if (cache_count(&context->users) != IDENTITIES + UNKNOWN)
+        test_fail("negative", "cache count",
+            cache_count(&context->users));
+
+    /* a hit near expiration is answered from the cache, and refreshed */
+    set_clock(context, TTL - TTL / 8);
+    queries = ldap.queries;
+    lookup_user(context, "refresh", 0);
+    for (i = 0; i < 10000 && ldap.queries == queries; i++)
+        Sleep(1);
+    if (ldap.queries != queries + 1)
+        test_fail("refresh", "queries", ldap.queries - queries);
+
+    /* expired negative entries go first, then the positive ones; only
+     * the refreshed entry survives */
+    set_clock(context, TTL - TTL / 16);
+    wait_count("reap negative", &context->users, IDENTITIES);
+    wait_count("reap negative", &context->groups, IDENTITIES);
+    set_clock(context, TTL + TTL / 16);
+    wait_count("reap", &context->users, 1);
+    wait_count("reap", &context->groups, 0);
+    queries = ldap.queries;
+    lookup_user(context, "reap", 0);
+    if (ldap.queries != queries)
+        test_fail("reap", "refreshed entry was freed", 0);
+
+    nfs41_idmap_free(context);
+
+    if (failures) {
+        (void)printf("idmaptest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("idmaptest1: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,428 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * namecachetest1.c - stress test for the lock-free readers of the name
+ * and attribute cache in daemon/name_cache.c
+ *
+ * Writer threads keep inserting, updating, renaming and unlinking the
+ * files of two directories, with filehandles whose length moves the
+ * entries between inline storage and the name arena, and enough files
+ * to make the attribute table grow.  Each file only ever lives under
+ * one of three names, \dir\fileN, \dir\movedN and \dir2\fileN, so
+ * that a rename changes both the name and the parent of an entry.
+ * Reader threads look the files up by all three paths and by fileid at
+ * the same time, without the cache lock.  Every value a writer stores
+ * is self-describing: the filehandle starts with the fileid and is
+ * padded with its own length, and the size is derived from the change
+ * attribute.  A reader that returns a torn or mixed up entry, or one
+ * from under the wrong directory, fails one of these checks.
+ *
+ * Without a reader count, runs with 1, 2, 4, 8, 16 and 32 readers and
+ * prints how the lookup rate scales with them.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: namecachetest1 [reader threads] [iterations per thread]
+ */
+
+#include "../../daemon/name_cache.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+
+/* stubs for what name_cache.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+int nfs_to_windows_error(int status, int default_error) { return default_error; }
+
+void compound_init(nfs41_compound *compound, nfs_argop4 *argops,
+    nfs_resop4 *resops, const char *tag) {}
+void compound_add_op(nfs41_compound *compound, uint32_t opnum,
+    void *arg, void *res) {}
+int compound_encode_send_decode(nfs41_session *session,
+    nfs41_compound *compound, bool_t try_recovery) { return NFS4ERR_IO; }
+void nfs41_session_sequence(nfs41_sequence_args *args,
+    nfs41_session *session, bool_t cachethis) {}
+
+/* same as daemon/util.c */
+bool_t next_component(const char *path, const char *path_end,
+    nfs41_component *component)
+{
+    const char *component_end;
+    component->name = next_non_delimiter(path, path_end);
+    component_end = next_delimiter(component->name, path_end);
+    component->len = (unsigned short)(component_end - component->name);
+    return component->len > 0;
+}
+
+bool_t is_last_component(const char *path, const char *path_end)
+{
+    path = next_delimiter(path, path_end);
+    return next_non_delimiter(path, path_end) == path_end;
+}
+
+
+#define MAX_READERS 32
+#define DEFAULT_ITERATIONS 200000
+#define WRITERS 2
+#define FILES 4000          /* enough to grow the attribute table */
+#define FILEID_BASE 1000
+#define SIZE_FACTOR 4099
+
+/* the three names a file can have, and their directories */
+enum file_name { NAME_FILE, NAME_MOVED, NAME_DIR2, NAME_COUNT };
+static const uint64_t dir_fileid[NAME_COUNT] = {
+    FILEID_BASE - 1, FILEID_BASE - 1, FILEID_BASE - 3
+};
+/* a rename never changes a directory, so its change info always matches */
+static const change_info4 dir_cinfo = { TRUE, 1, 1 };
+
+struct test_context {
+    struct nfs41_name_cache *cache;
+    uint32_t iterations;
+    volatile LONG writers_done;
+    volatile LONG failures;
+    volatile LONG64 hits;
+    volatile LONG64 lookups;
+    HANDLE start;
+};
+
+static void test_fail(struct test_context *ctx, const char *msg,
+    uint32_t file, uint64_t value)
+{
+    if (InterlockedIncrement(&ctx->failures) <= 10)
+        (void)fprintf(stderr, "FAIL: %s (file=%u value=%llu)\n",
+            msg, file, (unsigned long long)value);
+}
+
+static uint32_t test_random(uint32_t *seed)
+{
+    /* xorshift32 */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void file_path(uint32_t file, enum file_name which,
+    char *path, nfs41_component *name)
+{
+    switch (which) {
+    case NAME_FILE:
+        (void)sprintf(path, "\\dir\\file%u", file);
+        name->name = path + 5;
+        break;
+    case NAME_MOVED:
+        (void)sprintf(path, "\\dir\\moved%u", file);
+        name->name = path + 5;
+        break;
+    default:
+        (void)sprintf(path, "\\dir2\\file%u", file);
+        name->name = path + 6;
+        break;
+    }
+    name->len = (unsigned short)strlen(name->name);
+}
+
+/* the filehandle is the fileid, padded with its length to 9..56 bytes */
+static void file_fh(uint64_t fileid, uint32_t gen, nfs41_fh *fh)
+{
+    ZeroMemory(fh, sizeof(nfs41_fh));
+    fh->fileid = fileid;
+    fh->len = 9 + gen % 48;
+    (void)memcpy(fh->fh, &fileid, sizeof(fileid));
+    (void)memset(fh->fh + sizeof(fileid), (int)fh->len,
+        fh->len - sizeof(fileid));
+}
+
+static void file_info(uint64_t fileid, uint32_t type, uint32_t gen,
+    nfs41_file_info *info)
+{
+    ZeroMemory(info, sizeof(nfs41_file_info));
+    info->attrmask.count = 2;
+    info->attrmask.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE |
+        FATTR4_WORD0_SIZE | FATTR4_WORD0_FILEID;
+    info->attrmask.arr[1] = FATTR4_WORD1_NUMLINKS;
+    info->type = type;
+    info->fileid = fileid;
+    info->change = gen;
+    info->size = (uint64_t)gen * SIZE_FACTOR;
+    info->numlinks = 1;
+}
+
+static void check_fh(struct test_context *ctx, uint32_t file,
+    const nfs41_fh *fh)
+{
+    const uint64_t fileid = FILEID_BASE + file;
+    uint32_t i;
+
+    if (fh->fileid != fileid)
+        test_fail(ctx, "wrong fileid in filehandle", file, fh->fileid);
+    if (fh->len < 9 || fh->len > 56) {
+        test_fail(ctx, "bad filehandle length", file, fh->len);
+        return;
+    }
+    if (memcmp(fh->fh, &fileid, sizeof(fileid)) != 0)
+        test_fail(ctx, "wrong filehandle bytes", file, fh->len);
+    for (i = sizeof(fileid); i < fh->len; i++) {
+        if (fh->fh[i] != fh->len) {
+            test_fail(ctx, "torn filehandle", file, fh->fh[i]);
+            break;
+        }
+    }
+}
+
+static void check_info(struct test_context *ctx, uint32_t file,
+    const nfs41_file_info *info)
+{
+    if (info->fileid != FILEID_BASE + file)
+        test_fail(ctx, "wrong fileid in attributes", file, info->fileid);
+    if (info->type != NF4REG)
+        test_fail(ctx, "wrong type", file, info->type);
+    if (info->size != info->change * SIZE_FACTOR)
+        test_fail(ctx, "torn attributes", file, info->size);
+}
+
+static unsigned int WINAPI writer_thread(void *arg)
+{
+    struct test_context *ctx = (struct test_context *)arg;
+    uint32_t seed = GetCurrentThreadId() | 1;
+    uint32_t i, gen = 0;
+    char path[NFS41_MAX_PATH_LEN], dst_path[NFS41_MAX_PATH_LEN];
+    nfs41_component name, dst_name;
+    nfs41_file_info info;
+    nfs41_fh fh;
+
+    (void)WaitForSingleObject(ctx->start, INFINITE);
+
+    for (i = 0; i < ctx->iterations; i++) {
+        const uint32_t file = test_random(&seed) % FILES;
+        const uint64_t fileid = FILEID_BASE + file;
+        const enum file_name which = test_random(&seed) % NAME_COUNT;
+        enum file_name dst;
+
+        gen++;
+        switch (test_random(&seed) % 8) {
+        case 0: /* forget the name, and its attributes with it */
+            file_path(file, which, path, &name);
+            (void)nfs41_name_cache_unlink(ctx->cache, path, &name);
+            break;
+        case 1: case 2: case 3: /* new attributes only */
+            file_info(fileid, NF4REG, gen, &info);
+            (void)nfs41_attr_cache_update(ctx->cache, fileid, &info);
+            break;
+        case 4: case 5: /* move it to one of its other names */
+            dst = (which + 1 + test_random(&seed) % 2) % NAME_COUNT;
+            file_path(file, which, path, &name);
+            file_path(file, dst, dst_path, &dst_name);
+            (void)nfs41_name_cache_rename(ctx->cache, path, &name,
+                &dir_cinfo, dst_path, &dst_name, &dir_cinfo);
+            break;
+        default: /* new filehandle and attributes */
+            file_path(file, which, path, &name);
+            file_fh(fileid, gen, &fh);
+            file_info(fileid, NF4REG, gen, &info);
+            if (nfs41_name_cache_insert(ctx->cache, path, &name,
+                    &fh, &info, NULL, OPEN_DELEGATE_NONE))
+                test_fail(ctx, "insert failed", file, 0);
+            break;
+        }
+    }
+    (void)InterlockedIncrement(&ctx->writers_done);
+    return 0;
+}
+
+static unsigned int WINAPI reader_thread(void *arg)
+{
+    struct test_context *ctx = (struct test_context *)arg;
+    uint32_t seed = GetCurrentThreadId() | 1;
+    char path[NFS41_MAX_PATH_LEN];
+    nfs41_component name;
+    nfs41_file_info info;
+    nfs41_fh parent, target;
+    LONG64 hits = 0, lookups = 0;
+    bool_t negative;
+    int status;
+
+    (void)WaitForSingleObject(ctx->start, INFINITE);
+
+    while (ctx->writers_done < WRITERS) {
+        const uint32_t file = test_random(&seed) % FILES;
+        const enum file_name which = test_random(&seed) % NAME_COUNT;
+
+        file_path(file, which, path, &name);
+        negative = FALSE;
+        ZeroMemory(&info, sizeof(info));
+        status = nfs41_name_cache_lookup(ctx->cache, path,
+            path + strlen(path), NULL, &parent, &target, &info, &negative);
+        if (status == NO_ERROR && !negative && target.len) {
+            check_fh(ctx, file, &target);
+            if (info.attrmask.count)
+                check_info(ctx, file, &info);
+            if (parent.fileid != dir_fileid[which])
+                test_fail(ctx, "wrong parent", file, parent.fileid);
+            hits++;
+        }
+
+        ZeroMemory(&info, sizeof(info));
+        if (nfs41_attr_cache_lookup(ctx->cache,
+                FILEID_BASE + file, &info) == NO_ERROR) {
+            check_info(ctx, file, &info);
+            hits++;
+        }
+        lookups += 2;
+    }
+    (void)InterlockedAdd64(&ctx->hits, hits);
+    (void)InterlockedAdd64(&ctx->lookups, lookups);
+    return 0;
+}
+
+static int insert_dir(struct nfs41_name_cache *cache)
+{
+    const char dir[] = "\\dir", dir2[] = "\\dir2";
+    const nfs41_component name = { dir + 1, 3 };
+    const nfs41_component name2 = { dir2 + 1, 4 };
+    nfs41_file_info info;
+    nfs41_fh fh;
+    int status;
+
+    file_fh(FILEID_BASE - 2, 0, &fh);
+    file_info(FILEID_BASE - 2, NF4DIR, 1, &info);
+    status = nfs41_name_cache_insert(cache, NULL, NULL, &fh, &info,
+        NULL, OPEN_DELEGATE_NONE);
+    if (status)
+        return status;
+
+    file_fh(FILEID_BASE - 1, 0, &fh);
+    file_info(FILEID_BASE - 1, NF4DIR, 1, &info);
+    status = nfs41_name_cache_insert(cache, dir, &name, &fh, &info,
+        NULL, OPEN_DELEGATE_NONE);
+    if (status)
+        return status;
+
+    file_fh(FILEID_BASE - 3, 0, &fh);
+    file_info(FILEID_BASE - 3, NF4DIR, 1, &info);
+    return nfs41_name_cache_insert(cache, dir2, &name2, &fh, &info,
+        NULL, OPEN_DELEGATE_NONE);
+}
+
+/* returns the lookup rate, per second */
+static double run_phase(struct test_context *ctx, uint32_t nreaders,
+    double base_rate)
+{
+    HANDLE *threads;
+    ULONGLONG start, elapsed;
+    uint32_t i, nthreads;
+    double rate;
+
+    ctx->writers_done = 0;
+    ctx->hits = ctx->lookups = 0;
+
+    nthreads = nreaders + WRITERS;
+    threads = calloc(nthreads, sizeof(HANDLE));
+    if (threads == NULL)
+        return 0.0;
+    ctx->start = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+    for (i = 0; i < nthreads; i++)
+        threads[i] = (HANDLE)_beginthreadex(NULL, 0,
+            i < WRITERS ? writer_thread : reader_thread, ctx, 0, NULL);
+
+    start = GetTickCount64();
+    (void)SetEvent(ctx->start);
+    for (i = 0; i < nthreads; i++) {
+        (void)WaitForSingleObject(threads[i], INFINITE);
+        (void)CloseHandle(threads[i]);
+    }
+    elapsed = GetTickCount64() - start;
+    (void)CloseHandle(ctx->start);
+    free(threads);
+
+    rate = (double)ctx->lookups * 1000.0 / (double)max(elapsed, 1);
+    (void)printf("readers=%-2u writers=%u: %llu writes, %lld lookups "
+        "(%lld hit) in %llu ms, %.0f lookups/s", nreaders, WRITERS,
+        (unsigned long long)WRITERS * ctx->iterations,
+        (long long)ctx->lookups, (long long)ctx->hits,
+        (unsigned long long)elapsed, rate);
+    if (base_rate > 0.0)
+        (void)printf(", %.1fx", rate / base_rate);
+    (void)printf("\n");
+    return rate;
+}
+
+int main(int argc, char *argv[])
+{
+    const nfs41_name_cache_config config = { 3600, 3600, 32, TRUE };
+    struct test_context ctx = { 0 };
+    uint32_t nreaders = 0;
+    double base_rate;
+    int status;
+
+    if (argc > 1) {
+        nreaders = (uint32_t)strtoul(argv[1], NULL, 0);
+        if (nreaders == 0)
+            return EXIT_FAILURE;
+    }
+    ctx.iterations = argc > 2 ?
+        (uint32_t)strtoul(argv[2], NULL, 0) : DEFAULT_ITERATIONS;
+
+    status = nfs41_name_cache_create(&ctx.cache);
+    if (status) {
+        (void)fprintf(stderr, "nfs41_name_cache_create() failed with %d\n",
+            status);
+        return EXIT_FAILURE;
+    }
+    nfs41_name_cache_configure(ctx.cache, &config);
+    status = insert_dir(ctx.cache);
+    if (status) {
+        (void)fprintf(stderr, "insert_dir() failed with %d\n", status);
+        return EXIT_FAILURE;
+    }
+
+    if (nreaders) {
+        (void)run_phase(&ctx, nreaders, 0.0);
+    } else {
+        /* the lookup rate should grow with the readers, up to the
+         * number of cpus */
+        base_rate = run_phase(&ctx, 1, 0.0);
+        for (nreaders = 2; nreaders <= MAX_READERS; nreaders *= 2)
+            (void)run_phase(&ctx, nreaders, base_rate);
+    }
+    (void)printf("%u attribute slots\n",
+        ctx.cache->attributes.table->mask + 1);
+
+    (void)nfs41_name_cache_free(&ctx.cache);
+
+    if (ctx.failures) {
+        (void)printf("namecachetest1: %ld failures\n", ctx.failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("namecachetest1: OK\n");
+    return EXIT_SUCCESS;
+}
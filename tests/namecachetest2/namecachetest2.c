@@ -0,0 +1,313 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * namecachetest2.c - footprint and owner table test for the name and
+ * attribute cache in daemon/name_cache.c
+ *
+ * Fills a cache of the default size with files of typical names and
+ * 28 byte filehandles, counting every byte that name_cache.c allocates,
+ * and prints how many entries it holds per MB, both of its budget and
+ * of the heap it actually uses.
+ *
+ * Then keeps changing the owners of a set of files to strings it has
+ * never used before, many more over time than the owner table has
+ * slots.  The cached attributes must keep returning the current owner
+ * and group of every file, which only works if the table frees the
+ * slots of owners no entry refers to any more.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: namecachetest2
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+/* count what name_cache.c allocates */
+static size_t heap_bytes = 0;
+
+struct heap_block {
+    size_t size;
+    size_t pad; /* keep the block aligned */
+};
+
+static void* test_malloc(size_t size)
+{
+    struct heap_block *block = malloc(sizeof(struct heap_block) + size);
+    if (block == NULL)
+        return NULL;
+    block->size = size;
+    heap_bytes += size;
+    return block + 1;
+}
+
+static void* test_calloc(size_t count, size_t size)
+{
+    void *p = test_malloc(count * size);
+    if (p)
+        memset(p, 0, count * size);
+    return p;
+}
+
+static void test_free(void *p)
+{
+    struct heap_block *block;
+    if (p == NULL)
+        return;
+    block = (struct heap_block*)p - 1;
+    heap_bytes -= block->size;
+    free(block);
+}
+
+#define malloc test_malloc
+#define calloc test_calloc
+#define free test_free
+#include "../../daemon/name_cache.c"
+#undef malloc
+#undef calloc
+#undef free
+
+#include <stdarg.h>
+
+
+/* stubs for what name_cache.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+int nfs_to_windows_error(int status, int default_error) { return default_error; }
+
+void compound_init(nfs41_compound *compound, nfs_argop4 *argops,
+    nfs_resop4 *resops, const char *tag) {}
+void compound_add_op(nfs41_compound *compound, uint32_t opnum,
+    void *arg, void *res) {}
+int compound_encode_send_decode(nfs41_session *session,
+    nfs41_compound *compound, bool_t try_recovery) { return NFS4ERR_IO; }
+void nfs41_session_sequence(nfs41_sequence_args *args,
+    nfs41_session *session, bool_t cachethis) {}
+
+/* same as daemon/util.c */
+bool_t next_component(const char *path, const char *path_end,
+    nfs41_component *component)
+{
+    const char *component_end;
+    component->name = next_non_delimiter(path, path_end);
+    component_end = next_delimiter(component->name, path_end);
+    component->len = (unsigned short)(component_end - component->name);
+    return component->len > 0;
+}
+
+bool_t is_last_component(const char *path, const char *path_end)
+{
+    path = next_delimiter(path, path_end);
+    return next_non_delimiter(path, path_end) == path_end;
+}
+
+
+#define DIRS 64
+#define FILEID_BASE 1000
+#define FH_LEN 28           /* a typical Linux server */
+#define OWNER_FILES 1000
+#define OWNER_ROUNDS 20     /* 20000 owners, many more than the table */
+
+static long failures = 0;
+
+static void test_fail(const char *msg, uint64_t fileid)
+{
+    if (++failures <= 10)
+        (void)fprintf(stderr, "FAIL: %s (fileid=%llu)\n",
+            msg, (unsigned long long)fileid);
+}
+
+static void make_fh(uint64_t fileid, nfs41_fh *fh)
+{
+    ZeroMemory(fh, sizeof(nfs41_fh));
+    fh->fileid = fileid;
+    fh->len = FH_LEN;
+    (void)memcpy(fh->fh, &fileid, sizeof(fileid));
+}
+
+static void make_info(uint64_t fileid, uint32_t type, const char *owner,
+    const char *group, nfs41_file_info *info)
+{
+    ZeroMemory(info, sizeof(nfs41_file_info));
+    info->attrmask.count = 2;
+    info->attrmask.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE |
+        FATTR4_WORD0_SIZE | FATTR4_WORD0_FILEID;
+    info->attrmask.arr[1] = FATTR4_WORD1_MODE | FATTR4_WORD1_NUMLINKS |
+        FATTR4_WORD1_OWNER | FATTR4_WORD1_OWNER_GROUP |
+        FATTR4_WORD1_TIME_MODIFY;
+    info->type = type;
+    info->fileid = fileid;
+    info->change = 1;
+    info->size = fileid;
+    info->mode = 0644;
+    info->numlinks = 1;
+    info->time_modify.seconds = 1700000000;
+    info->owner = info->owner_buf;
+    info->owner_group = info->owner_group_buf;
+    (void)StringCchCopyA(info->owner, NFS4_FATTR4_OWNER_LIMIT+1, owner);
+    (void)StringCchCopyA(info->owner_group, NFS4_FATTR4_OWNER_LIMIT+1, group);
+}
+
+static int insert(struct nfs41_name_cache *cache, const char *path,
+    uint64_t fileid, uint32_t type, const char *owner, const char *group)
+{
+    const char *last = strrchr(path, '\\');
+    nfs41_component name;
+    nfs41_file_info info;
+    nfs41_fh fh;
+
+    name.name = last + 1;
+    name.len = (unsigned short)strlen(name.name);
+    make_fh(fileid, &fh);
+    make_info(fileid, type, owner, group, &info);
+    if (path[1] == '\0') /* the root */
+        return nfs41_name_cache_insert(cache, NULL, NULL, &fh, &info,
+            NULL, OPEN_DELEGATE_NONE);
+    return nfs41_name_cache_insert(cache, path, &name, &fh, &info,
+        NULL, OPEN_DELEGATE_NONE);
+}
+
+static struct nfs41_name_cache* create_cache(void)
+{
+    const nfs41_name_cache_config config = { 3600, 3600,
+        NAME_CACHE_DEFAULT_MB, TRUE };
+    struct nfs41_name_cache *cache;
+
+    if (nfs41_name_cache_create(&cache))
+        return NULL;
+    nfs41_name_cache_configure(cache, &config);
+    if (insert(cache, "\\", FILEID_BASE - 1, NF4DIR, "root", "root")) {
+        (void)nfs41_name_cache_free(&cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void test_footprint(void)
+{
+    struct nfs41_name_cache *cache;
+    char path[NFS41_MAX_PATH_LEN], owner[32];
+    uint64_t fileid = FILEID_BASE;
+    size_t empty;
+    uint32_t i, max_entries;
+
+    heap_bytes = 0;
+    cache = create_cache();
+    if (cache == NULL) {
+        test_fail("failed to create the cache", 0);
+        return;
+    }
+    empty = heap_bytes;
+    max_entries = cache->max_entries;
+
+    /* fill it up: DIRS directories of files with short names */
+    for (i = 0; i < DIRS; i++) {
+        (void)sprintf(path, "\\dir%u", i);
+        if (insert(cache, path, fileid++, NF4DIR, "root", "root"))
+            test_fail("directory insert failed", fileid - 1);
+    }
+    for (i = 0; cache->entries < max_entries; i++) {
+        (void)sprintf(path, "\\dir%u\\file%u.txt", i % DIRS, i);
+        (void)sprintf(owner, "user%u@example.com", i % 16);
+        if (insert(cache, path, fileid++, NF4REG, owner, "staff")) {
+            test_fail("file insert failed", fileid - 1);
+            break;
+        }
+    }
+
+    (void)printf("%u MB budget: %u entries, %u entries per MB; "
+        "%u bytes per name and attribute entry\n", NAME_CACHE_DEFAULT_MB,
+        max_entries, max_entries / NAME_CACHE_DEFAULT_MB,
+        (unsigned)(NAME_ENTRY_SIZE + ATTR_ENTRY_SIZE));
+    (void)printf("full: %u entries in %.1f MB of heap (%.1f MB empty), "
+        "%.0f entries per MB\n", cache->entries,
+        heap_bytes / 1048576.0, empty / 1048576.0,
+        cache->entries / ((heap_bytes - empty) / 1048576.0));
+
+    (void)nfs41_name_cache_free(&cache);
+    if (heap_bytes)
+        test_fail("leaked bytes", heap_bytes);
+}
+
+static void test_owners(void)
+{
+    struct nfs41_name_cache *cache;
+    char path[NFS41_MAX_PATH_LEN], owner[32], group[32];
+    nfs41_file_info info;
+    uint32_t round, i;
+
+    cache = create_cache();
+    if (cache == NULL) {
+        test_fail("failed to create the cache", 0);
+        return;
+    }
+
+    for (round = 0; round < OWNER_ROUNDS; round++) {
+        /* a new owner for every file, and a new group every round */
+        (void)sprintf(group, "group%u", round);
+        for (i = 0; i < OWNER_FILES; i++) {
+            (void)sprintf(path, "\\file%u", i);
+            (void)sprintf(owner, "user%u", round * OWNER_FILES + i);
+            if (insert(cache, path, FILEID_BASE + i, NF4REG, owner, group))
+                test_fail("insert failed", FILEID_BASE + i);
+        }
+        for (i = 0; i < OWNER_FILES; i++) {
+            ZeroMemory(&info, sizeof(info));
+            if (nfs41_attr_cache_lookup(cache, FILEID_BASE + i, &info)) {
+                test_fail("lookup failed", FILEID_BASE + i);
+                continue;
+            }
+            (void)sprintf(owner, "user%u", round * OWNER_FILES + i);
+            if (!(info.attrmask.arr[1] & FATTR4_WORD1_OWNER) ||
+                    strcmp(info.owner, owner) != 0)
+                test_fail("wrong or missing owner", FILEID_BASE + i);
+            if (!(info.attrmask.arr[1] & FATTR4_WORD1_OWNER_GROUP) ||
+                    strcmp(info.owner_group, group) != 0)
+                test_fail("wrong or missing group", FILEID_BASE + i);
+        }
+    }
+    (void)printf("%u owners through a table of %u: %u slots in use, "
+        "%u unreferenced\n", OWNER_ROUNDS * OWNER_FILES + OWNER_ROUNDS,
+        ATTR_CACHE_MAX_OWNERS, cache->attributes.owner_count - 1,
+        cache->attributes.owner_unused);
+
+    (void)nfs41_name_cache_free(&cache);
+}
+
+int main(int argc, char *argv[])
+{
+    test_footprint();
+    test_owners();
+
+    if (failures) {
+        (void)printf("namecachetest2: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("namecachetest2: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,396 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * namecachetest3.c - path lookup benchmark for the full-path index of
+ * the name cache in daemon/name_cache.c
+ *
+ * Fills the cache with a synthetic build tree of about 1M entries:
+ * eight fixed levels like \src\project\build\..., then five levels of
+ * ten directories each, with ten files in every leaf directory, so
+ * every file is 14 components deep.  Then looks up random files, and
+ * times name_cache_lookup(), which probes the index first, against a
+ * copy of the component walk that it did before the index.  It does
+ * that for a set of files small enough to stay in the cpu caches, and
+ * for one spread over the whole tree.  Both lookups must find the same
+ * entry for every path, also after a directory on the way is renamed
+ * and a file is removed.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: namecachetest3 [lookups]
+ */
+
+#include "../../daemon/name_cache.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+
+/* stubs for what name_cache.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+int nfs_to_windows_error(int status, int default_error) { return default_error; }
+
+void compound_init(nfs41_compound *compound, nfs_argop4 *argops,
+    nfs_resop4 *resops, const char *tag) {}
+void compound_add_op(nfs41_compound *compound, uint32_t opnum,
+    void *arg, void *res) {}
+int compound_encode_send_decode(nfs41_session *session,
+    nfs41_compound *compound, bool_t try_recovery) { return NFS4ERR_IO; }
+void nfs41_session_sequence(nfs41_sequence_args *args,
+    nfs41_session *session, bool_t cachethis) {}
+
+/* same as daemon/util.c */
+bool_t next_component(const char *path, const char *path_end,
+    nfs41_component *component)
+{
+    const char *component_end;
+    component->name = next_non_delimiter(path, path_end);
+    component_end = next_delimiter(component->name, path_end);
+    component->len = (unsigned short)(component_end - component->name);
+    return component->len > 0;
+}
+
+bool_t is_last_component(const char *path, const char *path_end)
+{
+    path = next_delimiter(path, path_end);
+    return next_non_delimiter(path, path_end) == path_end;
+}
+
+
+/* name_cache_lookup() before the full-path index */
+static int name_cache_walk(
+    IN struct nfs41_name_cache *cache,
+    IN bool_t skip_invis,
+    IN const char *path,
+    IN const char *path_end,
+    OUT OPTIONAL const char **remaining_path_out,
+    OUT OPTIONAL struct name_cache_entry **parent_out,
+    OUT OPTIONAL struct name_cache_entry **target_out,
+    OUT OPTIONAL bool_t *is_negative)
+{
+    struct name_cache_entry *parent, *target;
+    nfs41_component component;
+    const char *path_pos;
+    int status = NO_ERROR;
+
+    parent = NULL;
+    target = cache->root;
+    component.name = path_pos = path;
+
+    if (target == NULL || (skip_invis && entry_invis(target, is_negative))) {
+        target = NULL;
+        status = ERROR_PATH_NOT_FOUND;
+        goto out;
+    }
+
+    while (next_component(path_pos, path_end, &component)) {
+        parent = target;
+        target = name_cache_search(cache, parent, &component);
+        path_pos = component.name + component.len;
+        if (target == NULL || (skip_invis && entry_invis(target, is_negative))) {
+            target = NULL;
+            if (is_last_component(component.name, path_end))
+                status = ERROR_FILE_NOT_FOUND;
+            else
+                status = ERROR_PATH_NOT_FOUND;
+            break;
+        }
+    }
+out:
+    if (remaining_path_out) *remaining_path_out = component.name;
+    if (parent_out) *parent_out = parent;
+    if (target_out) *target_out = target;
+    return status;
+}
+
+
+#define PREFIX "\\src\\project\\build\\out\\intermediate\\x64\\release\\obj"
+#define PREFIX_LEVELS 8
+#define FANOUT 10
+#define DIR_LEVELS 5
+#define FILES (FANOUT * FANOUT * FANOUT * FANOUT * FANOUT * FANOUT)
+#define PATH_LEN 128
+#define SAMPLE 65536        /* distinct random paths to look up */
+#define HOT_SAMPLE 1024
+#define DEFAULT_LOOKUPS 2000000
+#define CACHE_MB 512        /* enough for the whole tree */
+
+static long failures = 0;
+static uint64_t next_fileid = 2;
+
+static void test_fail(const char *msg, const char *path)
+{
+    if (++failures <= 10)
+        (void)fprintf(stderr, "FAIL: %s (%s)\n", msg, path);
+}
+
+static uint32_t test_random(uint32_t *seed)
+{
+    /* xorshift32 */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/* the path of a file, or of its directory at the given level */
+static size_t file_path(uint32_t file, uint32_t levels, bool_t leaf,
+    char *path, nfs41_component *name)
+{
+    uint32_t i, div = FILES / FANOUT;
+    size_t len = sizeof(PREFIX) - 1;
+
+    (void)memcpy(path, PREFIX, len);
+    for (i = 0; i < levels; i++, div /= FANOUT)
+        len += sprintf(path + len, "\\dir%u", file / div % FANOUT);
+    if (leaf)
+        len += sprintf(path + len, "\\file%u.obj", file % FANOUT);
+    if (name) {
+        name->name = strrchr(path, '\\') + 1;
+        name->len = (unsigned short)(path + len - name->name);
+    }
+    return len;
+}
+
+static int insert(struct nfs41_name_cache *cache, const char *path,
+    const nfs41_component *name, uint32_t type)
+{
+    nfs41_file_info info;
+    nfs41_fh fh;
+
+    ZeroMemory(&fh, sizeof(fh));
+    fh.fileid = next_fileid;
+    fh.len = 28; /* a typical Linux filehandle */
+    (void)memcpy(fh.fh, &next_fileid, sizeof(next_fileid));
+
+    ZeroMemory(&info, sizeof(info));
+    info.attrmask.count = 2;
+    info.attrmask.arr[0] = FATTR4_WORD0_TYPE | FATTR4_WORD0_CHANGE |
+        FATTR4_WORD0_SIZE | FATTR4_WORD0_FILEID;
+    info.attrmask.arr[1] = FATTR4_WORD1_NUMLINKS;
+    info.type = type;
+    info.fileid = next_fileid++;
+    info.change = 1;
+    info.numlinks = 1;
+
+    return nfs41_name_cache_insert(cache, path, name, &fh, &info,
+        NULL, OPEN_DELEGATE_NONE);
+}
+
+static int fill_tree(struct nfs41_name_cache *cache)
+{
+    char path[PATH_LEN];
+    nfs41_component name;
+    const char *pos;
+    uint32_t file, level, div;
+    int status;
+
+    status = insert(cache, NULL, NULL, NF4DIR);
+    if (status)
+        return status;
+
+    /* the fixed levels */
+    (void)strcpy(path, PREFIX);
+    for (pos = path + 1; pos; pos = strchr(pos + 1, '\\')) {
+        name.name = pos[0] == '\\' ? pos + 1 : pos;
+        name.len = (unsigned short)(strcspn(name.name, "\\"));
+        status = insert(cache, path, &name, NF4DIR);
+        if (status)
+            return status;
+    }
+
+    /* the directories, level by level, then the files */
+    for (level = 1, div = FILES / FANOUT; level <= DIR_LEVELS;
+            level++, div /= FANOUT) {
+        for (file = 0; file < FILES; file += div) {
+            (void)file_path(file, level, FALSE, path, &name);
+            status = insert(cache, path, &name, NF4DIR);
+            if (status)
+                return status;
+        }
+    }
+    for (file = 0; file < FILES; file++) {
+        (void)file_path(file, DIR_LEVELS, TRUE, path, &name);
+        status = insert(cache, path, &name, NF4REG);
+        if (status)
+            return status;
+    }
+    return NO_ERROR;
+}
+
+typedef int (*lookup_fn)(struct nfs41_name_cache*, bool_t, const char*,
+    const char*, const char**, struct name_cache_entry**,
+    struct name_cache_entry**, bool_t*);
+
+/* returns nanoseconds per lookup */
+static double bench(struct nfs41_name_cache *cache, lookup_fn lookup,
+    const char *paths, const size_t *lens, uint32_t sample, uint32_t lookups)
+{
+    LARGE_INTEGER freq, start, end;
+    struct name_cache_entry *target;
+    const char *path;
+    uint32_t i;
+
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < lookups; i++) {
+        path = paths + (size_t)(i % sample) * PATH_LEN;
+        if (lookup(cache, 1, path, path + lens[i % sample],
+                NULL, NULL, &target, NULL) != NO_ERROR) {
+            test_fail("lookup failed", path);
+            break;
+        }
+    }
+    (void)QueryPerformanceCounter(&end);
+    (void)QueryPerformanceFrequency(&freq);
+    return (double)(end.QuadPart - start.QuadPart) * 1e9 /
+        (double)freq.QuadPart / lookups;
+}
+
+/* both lookups must agree on every path */
+static void compare(struct nfs41_name_cache *cache, const char *test,
+    const char *path, size_t len)
+{
+    struct name_cache_entry *indexed, *walked;
+    int status, expected;
+
+    status = name_cache_lookup(cache, 1, path, path + len,
+        NULL, NULL, &indexed, NULL);
+    expected = name_cache_walk(cache, 1, path, path + len,
+        NULL, NULL, &walked, NULL);
+    if (status != expected || indexed != walked)
+        test_fail(test, path);
+}
+
+static void test_consistency(struct nfs41_name_cache *cache,
+    const char *paths, const size_t *lens)
+{
+    static const change_info4 cinfo = { TRUE, 1, 1 };
+    char src[PATH_LEN], dst[PATH_LEN], path[PATH_LEN];
+    nfs41_component src_name, dst_name, name;
+    size_t len;
+    uint32_t i, file;
+
+    for (i = 0; i < SAMPLE; i++)
+        compare(cache, "lookup", paths + (size_t)i * PATH_LEN, lens[i]);
+
+    /* rename dir3 on the way to file 0, whose path is in the index,
+     * and remove file 1 */
+    file = 0;
+    len = file_path(file, DIR_LEVELS, TRUE, path, NULL);
+    compare(cache, "before rename", path, len);
+    (void)file_path(file, 3, FALSE, src, &src_name);
+    (void)strcpy(dst, src);
+    dst[strlen(dst) - 1] = 'x';
+    dst_name.name = dst + (src_name.name - src);
+    dst_name.len = src_name.len;
+    if (nfs41_name_cache_rename(cache, src, &src_name, &cinfo,
+            dst, &dst_name, &cinfo) != NO_ERROR)
+        test_fail("rename failed", src);
+    compare(cache, "after rename", path, len);
+    if (name_cache_lookup(cache, 1, path, path + len,
+            NULL, NULL, NULL, NULL) == NO_ERROR)
+        test_fail("found under the old name", path);
+    path[dst_name.name - dst + dst_name.len - 1] = 'x';
+    compare(cache, "new name", path, len);
+    if (name_cache_lookup(cache, 1, path, path + len,
+            NULL, NULL, NULL, NULL) != NO_ERROR)
+        test_fail("not found under the new name", path);
+
+    len = file_path(file + 1, DIR_LEVELS, TRUE, path, &name);
+    path[dst_name.name - dst + dst_name.len - 1] = 'x';
+    compare(cache, "before remove", path, len);
+    if (nfs41_name_cache_remove(cache, path, &name, 0, &cinfo) != NO_ERROR)
+        test_fail("remove failed", path);
+    compare(cache, "after remove", path, len);
+}
+
+int main(int argc, char *argv[])
+{
+    const nfs41_name_cache_config config = { 3600, 3600, CACHE_MB, FALSE };
+    struct nfs41_name_cache *cache;
+    char *paths;
+    size_t *lens;
+    static const uint32_t samples[] = { HOT_SAMPLE, SAMPLE };
+    uint32_t i, lookups, seed = 1;
+    double walk, indexed;
+    int status;
+
+    lookups = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) :
+        DEFAULT_LOOKUPS;
+    paths = malloc((size_t)SAMPLE * PATH_LEN);
+    lens = malloc(SAMPLE * sizeof(size_t));
+    if (lookups == 0 || paths == NULL || lens == NULL)
+        return EXIT_FAILURE;
+
+    status = nfs41_name_cache_create(&cache);
+    if (status) {
+        (void)fprintf(stderr, "nfs41_name_cache_create() failed with %d\n",
+            status);
+        return EXIT_FAILURE;
+    }
+    nfs41_name_cache_configure(cache, &config);
+    status = fill_tree(cache);
+    if (status) {
+        (void)fprintf(stderr, "fill_tree() failed with %d\n", status);
+        return EXIT_FAILURE;
+    }
+    (void)printf("%u entries, %u index slots, %u components per file\n",
+        cache->entries, cache->index->mask + 1,
+        PREFIX_LEVELS + DIR_LEVELS + 1);
+
+    for (i = 0; i < SAMPLE; i++)
+        lens[i] = file_path(test_random(&seed) % FILES, DIR_LEVELS, TRUE,
+            paths + (size_t)i * PATH_LEN, NULL);
+
+    for (i = 0; i < ARRAYSIZE(samples); i++) {
+        /* the first pass fills the index */
+        walk = bench(cache, name_cache_walk, paths, lens,
+            samples[i], lookups);
+        (void)bench(cache, name_cache_lookup, paths, lens,
+            samples[i], samples[i]);
+        indexed = bench(cache, name_cache_lookup, paths, lens,
+            samples[i], lookups);
+        (void)printf("%6u files: component walk %.0f ns/lookup, "
+            "path index %.0f ns/lookup, %.1fx\n", samples[i], walk,
+            indexed, indexed > 0.0 ? walk / indexed : 0.0);
+    }
+
+    test_consistency(cache, paths, lens);
+
+    (void)nfs41_name_cache_free(&cache);
+    free(lens);
+    free(paths);
+
+    if (failures) {
+        (void)printf("namecachetest3: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("namecachetest3: OK\n");
+    return EXIT_SUCCESS;
+}
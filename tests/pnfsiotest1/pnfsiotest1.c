@@ -0,0 +1,562 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * pnfsiotest1.c - test and benchmark for striped pNFS reads and writes
+ * on the io pool in daemon/pnfs_io.c
+ *
+ * Builds a file layout with 1 to 256 stripes, one stand-in data server
+ * per stripe, all serving the same file in memory.  pnfs_read() and
+ * pnfs_write() of unaligned ranges across every stripe must move the
+ * right bytes, send every stripe unit to the data server of its stripe,
+ * and report the most severe error of any unit.  Layouts with more than
+ * 64 stripes check that nothing depends on the old limit of 64 threads
+ * per wait.
+ *
+ * Then it times reads of one small stripe unit per stripe, for 1 to 256
+ * stripes, with the units run on the io pool and, for comparison, with
+ * a thread started for every unit as pattern_fork() used to do.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: pnfsiotest1 [reads per stripe count]
+ */
+
+#include "../../daemon/pnfs_io.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* stubs for what pnfs_io.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...) { (void)format; }
+const char* nfs_error_string(int status) { return "status"; }
+const char* pnfs_error_string(enum pnfs_status status) { return "status"; }
+
+enum pnfs_status pnfs_layout_state_prepare(pnfs_layout_state *state,
+    nfs41_session *session, nfs41_path_fh *meta_file, stateid_arg *stateid,
+    enum pnfs_iomode iomode, uint64_t offset,
+    uint64_t length) { return PNFS_SUCCESS; }
+enum pnfs_status pnfs_layout_recall_status(const pnfs_layout_state *state,
+    const pnfs_layout *layout) { return PNFS_SUCCESS; }
+void pnfs_layout_recall_fenced(pnfs_layout_state *state,
+    const pnfs_layout *layout) {}
+void pnfs_layout_io_start(pnfs_layout_state *state) { state->io_count++; }
+void pnfs_layout_io_finished(pnfs_layout_state *state) { state->io_count--; }
+enum nfsstat4 pnfs_rpc_layoutcommit(nfs41_session *session,
+    nfs41_path_fh *file, stateid4 *stateid, uint64_t offset,
+    uint64_t length, uint64_t *new_last_offset, nfstime4 *new_time_modify,
+    nfs41_file_info *info) { return NFS4_OK; }
+int nfs41_getattr(nfs41_session *session, nfs41_path_fh *file,
+    bitmap4 *attr_request, nfs41_file_info *info) { return NFS4_OK; }
+uint32_t max_read_size(const nfs41_session *session,
+    const nfs41_fh *fh) { return 1024 * 1024; }
+uint32_t max_write_size(const nfs41_session *session,
+    const nfs41_fh *fh) { return 1024 * 1024; }
+
+/* same as daemon/util.c */
+bool_t verify_write(
+    IN nfs41_write_verf *verf,
+    IN OUT enum stable_how4 *stable)
+{
+    if (verf->committed != UNSTABLE4) {
+        *stable = verf->committed;
+        return 1;
+    }
+    if (*stable != UNSTABLE4) {
+        memcpy(verf->expected, verf->verf, NFS4_VERIFIER_SIZE);
+        *stable = UNSTABLE4;
+        return 1;
+    }
+    return memcmp(verf->expected, verf->verf, NFS4_VERIFIER_SIZE) == 0;
+}
+
+bool_t verify_commit(
+    IN nfs41_write_verf *verf)
+{
+    return memcmp(verf->expected, verf->verf, NFS4_VERIFIER_SIZE) == 0;
+}
+
+/* same as daemon/util.c */
+static struct io_pool {
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+    struct list_entry queue;
+    uint32_t queued;
+    uint32_t idle;
+    uint32_t workers;
+} io_pool = {
+    SRWLOCK_INIT,
+    CONDITION_VARIABLE_INIT,
+    { &io_pool.queue, &io_pool.queue },
+    0, 0, 0
+};
+
+static unsigned int WINAPI io_pool_worker(void *args)
+{
+    io_pool_work *work;
+
+    for (;;) {
+        AcquireSRWLockExclusive(&io_pool.lock);
+        io_pool.idle++;
+        while (list_empty(&io_pool.queue))
+            SleepConditionVariableSRW(&io_pool.cond,
+                &io_pool.lock, INFINITE, 0);
+        io_pool.idle--;
+        work = list_container(io_pool.queue.next, io_pool_work, entry);
+        list_remove(&work->entry);
+        io_pool.queued--;
+        ReleaseSRWLockExclusive(&io_pool.lock);
+
+        work->fn(work);
+    }
+    return 0;
+}
+
+void io_pool_queue(
+    IN io_pool_work *work,
+    IN io_pool_work_fn fn,
+    IN uint32_t max_workers)
+{
+    HANDLE thread;
+
+    work->fn = fn;
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    list_add_tail(&io_pool.queue, &work->entry);
+    io_pool.queued++;
+
+    if (max_workers > IO_POOL_MAX_WORKERS)
+        max_workers = IO_POOL_MAX_WORKERS;
+    if (io_pool.queued > io_pool.idle && io_pool.workers < max_workers) {
+        thread = (HANDLE)_beginthreadex(NULL, 0, io_pool_worker, NULL, 0, NULL);
+        if (thread != NULL) {
+            CloseHandle(thread);
+            io_pool.workers++;
+        }
+    }
+    ReleaseSRWLockExclusive(&io_pool.lock);
+    WakeConditionVariable(&io_pool.cond);
+}
+
+bool_t io_pool_cancel(
+    IN io_pool_work *work)
+{
+    bool_t cancelled = FALSE;
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    if (!list_empty(&work->entry)) {
+        list_remove(&work->entry);
+        io_pool.queued--;
+        cancelled = TRUE;
+    }
+    ReleaseSRWLockExclusive(&io_pool.lock);
+    return cancelled;
+}
+
+
+/* pattern_fork() before the io pool, for the benchmark */
+static enum pnfs_status pattern_join_threads(
+    IN HANDLE *threads,
+    IN DWORD count)
+{
+    DWORD status;
+    /* WaitForMultipleObjects() supports a maximum of 64 objects */
+    while (count) {
+        const DWORD n = min(count, MAXIMUM_WAIT_OBJECTS);
+        status = WaitForMultipleObjects(n, threads, TRUE, INFINITE);
+        if (status != WAIT_OBJECT_0)
+            return PNFSERR_RESOURCES;
+
+        count -= n;
+        threads += n;
+    }
+    return PNFS_SUCCESS;
+}
+
+static enum pnfs_status pattern_fork_threads(
+    IN pnfs_io_pattern *pattern,
+    IN pnfs_io_thread_fn thread_fn)
+{
+    HANDLE *threads;
+    uint32_t i;
+    enum pnfs_status status = PNFS_SUCCESS;
+
+    if (pattern->count == 0)
+        goto out;
+
+    if (pattern->count == 1) {
+        status = (enum pnfs_status)thread_fn(pattern->threads);
+        goto out;
+    }
+
+    threads = calloc(pattern->count, sizeof(HANDLE));
+    if (threads == NULL) {
+        status = PNFSERR_RESOURCES;
+        goto out;
+    }
+
+    for (i = 0; i < pattern->count; i++) {
+        threads[i] = (HANDLE)_beginthreadex(NULL, 0,
+            thread_fn, &pattern->threads[i], 0, NULL);
+        if (threads[i] == NULL) {
+            pattern->count = i;
+            break;
+        }
+    }
+
+    status = pattern_join_threads(threads, pattern->count);
+    if (status)
+        goto out;
+
+    for (i = 0; i < pattern->count; i++) {
+        DWORD exitcode;
+        if (GetExitCodeThread(threads[i], &exitcode))
+            status = max(status, (enum pnfs_status)exitcode);
+        CloseHandle(threads[i]);
+    }
+    free(threads);
+out:
+    return status;
+}
+
+
+/* the stand-in data servers */
+#define MAX_STRIPES 256
+#define FILE_SIZE (2 * MAX_STRIPES * 64 * 1024)
+
+static struct {
+    unsigned char   data[FILE_SIZE];
+    uint32_t        unit_size;
+    uint32_t        stripe_count;
+    int             fail_server; /* returns NFS4ERR_IO, -1 for none */
+    volatile LONG   requests[MAX_STRIPES];
+    volatile LONG   misdirected;
+} server;
+
+static nfs41_client ds_clients[MAX_STRIPES];
+static nfs41_session ds_sessions[MAX_STRIPES];
+
+/* which data server a session belongs to, and whether it serves the
+ * stripe of the given offset; the layout is sparse and starts at 0 */
+static int server_check(nfs41_session *session, uint64_t offset)
+{
+    const int id = (int)(session - ds_sessions);
+
+    if ((offset / server.unit_size) % server.stripe_count != (uint32_t)id)
+        InterlockedIncrement(&server.misdirected);
+    InterlockedIncrement(&server.requests[id]);
+    return id == server.fail_server ? NFS4ERR_IO : NFS4_OK;
+}
+
+int nfs41_read(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN uint64_t offset,
+    IN uint32_t count,
+    OUT unsigned char *data_out,
+    OUT uint32_t *data_len_out,
+    OUT bool_t *eof_out)
+{
+    const int status = server_check(session, offset);
+    if (status)
+        return status;
+    if (offset + count > FILE_SIZE)
+        count = offset < FILE_SIZE ? (uint32_t)(FILE_SIZE - offset) : 0;
+    memcpy(data_out, server.data + offset, count);
+    *data_len_out = count;
+    *eof_out = offset + count >= FILE_SIZE;
+    return NFS4_OK;
+}
+
+int nfs41_write(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN unsigned char *data,
+    IN uint32_t data_len,
+    IN uint64_t offset,
+    IN enum stable_how4 stable,
+    OUT uint32_t *bytes_written,
+    OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *cinfo)
+{
+    const int status = server_check(session, offset);
+    if (status)
+        return status;
+    if (offset + data_len > FILE_SIZE)
+        return NFS4ERR_FBIG;
+    memcpy(server.data + offset, data, data_len);
+    *bytes_written = data_len;
+    memset(verf->verf, 0x42, NFS4_VERIFIER_SIZE);
+    verf->committed = UNSTABLE4;
+    return NFS4_OK;
+}
+
+int nfs41_commit(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN uint64_t offset,
+    IN uint32_t count,
+    IN bool_t do_getattr,
+    OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *cinfo)
+{
+    memset(verf->verf, 0x42, NFS4_VERIFIER_SIZE);
+    verf->committed = FILE_SYNC4;
+    return NFS4_OK;
+}
+
+enum pnfs_status pnfs_data_server_client(
+    IN nfs41_root *root,
+    IN pnfs_data_server *ds,
+    IN uint32_t default_lease,
+    OUT nfs41_client **client_out)
+{
+    *client_out = ds->client;
+    return PNFS_SUCCESS;
+}
+
+
+#define DEFAULT_READS 200
+#define BENCH_UNIT 4096
+
+static long failures = 0;
+
+static void test_fail(const char *test, uint32_t stripes, const char *msg,
+    long long value, long long expected)
+{
+    failures++;
+    (void)fprintf(stderr, "FAIL: %s stripes=%u: %s (got %lld, "
+        "expected %lld)\n", test, stripes, msg, value, expected);
+}
+
+struct test_layout {
+    nfs41_root root;
+    nfs41_session session;
+    nfs41_open_state state;
+    pnfs_layout_state layout_state;
+    pnfs_file_layout layout;
+    pnfs_file_device device;
+    uint32_t stripes[MAX_STRIPES];
+    pnfs_data_server servers[MAX_STRIPES];
+    stateid_arg stateid;
+};
+
+static void layout_init(struct test_layout *t, uint32_t stripe_count,
+    uint32_t unit_size)
+{
+    uint32_t i;
+
+    ZeroMemory(t, sizeof(*t));
+    for (i = 0; i < stripe_count; i++) {
+        t->stripes[i] = i;
+        t->servers[i].client = &ds_clients[i];
+        InitializeSRWLock(&t->servers[i].lock);
+        ds_clients[i].session = &ds_sessions[i];
+        ds_sessions[i].client = &ds_clients[i];
+        server.requests[i] = 0;
+    }
+    t->device.stripes.count = stripe_count;
+    t->device.stripes.arr = t->stripes;
+    t->device.servers.count = stripe_count;
+    t->device.servers.arr = t->servers;
+
+    /* one sparse layout for the whole file, every stripe on the
+     * metadata server's filehandle */
+    t->layout.layout.offset = 0;
+    t->layout.layout.length = NFS4_UINT64_MAX;
+    t->layout.layout.iomode = PNFS_IOMODE_RW;
+    t->layout.layout.type = PNFS_LAYOUTTYPE_FILE;
+    t->layout.device = &t->device;
+    t->layout.util = unit_size;
+
+    InitializeSRWLock(&t->layout_state.lock);
+    list_init(&t->layout_state.layouts);
+    list_init(&t->layout_state.recalls);
+    list_add_tail(&t->layout_state.layouts, &t->layout.layout.entry);
+
+    t->session.lease_time = 90;
+    t->state.session = &t->session;
+    InitializeSRWLock(&t->state.lock);
+
+    server.unit_size = unit_size;
+    server.stripe_count = stripe_count;
+    server.fail_server = -1;
+    server.misdirected = 0;
+}
+
+static void fill_pattern(unsigned char *buf, uint64_t offset, uint32_t len,
+    unsigned char seed)
+{
+    uint32_t i;
+    for (i = 0; i < len; i++)
+        buf[i] = (unsigned char)((offset + i) * 31 / 7 + seed);
+}
+
+static void check_requests(const char *test, uint32_t stripe_count)
+{
+    uint32_t i;
+
+    if (server.misdirected)
+        test_fail(test, stripe_count, "units sent to the wrong server",
+            server.misdirected, 0);
+    for (i = 0; i < stripe_count; i++) {
+        if (server.requests[i] == 0) {
+            test_fail(test, stripe_count, "server got no units", i, 0);
+            break;
+        }
+    }
+}
+
+static void test_stripes(uint32_t stripe_count)
+{
+    const uint32_t unit_size = 64 * 1024;
+    const uint64_t offset = unit_size / 2 + 5;
+    const uint32_t length = stripe_count * unit_size + unit_size / 3;
+    struct test_layout *t;
+    unsigned char *buffer, *expected;
+    enum pnfs_status status;
+    ULONG len;
+
+    t = malloc(sizeof(*t));
+    buffer = malloc(length);
+    expected = malloc(length);
+    if (t == NULL || buffer == NULL || expected == NULL) {
+        test_fail("alloc", stripe_count, "out of memory", 0, 0);
+        goto out;
+    }
+
+    /* read an unaligned range that covers every stripe */
+    layout_init(t, stripe_count, unit_size);
+    fill_pattern(server.data, 0, FILE_SIZE, 1);
+    memset(buffer, 0, length);
+    status = pnfs_read(&t->root, &t->state, &t->stateid, &t->layout_state,
+        offset, length, buffer, &len);
+    if (status != PNFS_SUCCESS)
+        test_fail("read", stripe_count, "pnfs_read() failed", status, 0);
+    if (len != length)
+        test_fail("read", stripe_count, "length", len, length);
+    if (memcmp(buffer, server.data + offset, length) != 0)
+        test_fail("read", stripe_count, "data differs", 0, 0);
+    check_requests("read", stripe_count);
+
+    /* write the same range with new data */
+    layout_init(t, stripe_count, unit_size);
+    fill_pattern(buffer, offset, length, 2);
+    memcpy(expected, buffer, length);
+    status = pnfs_write(&t->root, &t->state, &t->stateid, &t->layout_state,
+        offset, length, buffer, &len, NULL);
+    if (status != PNFS_SUCCESS)
+        test_fail("write", stripe_count, "pnfs_write() failed", status, 0);
+    if (len != length)
+        test_fail("write", stripe_count, "length", len, length);
+    if (memcmp(server.data + offset, expected, length) != 0)
+        test_fail("write", stripe_count, "data differs", 0, 0);
+    check_requests("write", stripe_count);
+
+    /* one failing data server fails the whole read */
+    layout_init(t, stripe_count, unit_size);
+    server.fail_server = (int)(stripe_count - 1);
+    status = pnfs_read(&t->root, &t->state, &t->stateid, &t->layout_state,
+        offset, length, buffer, &len);
+    if (status != PNFSERR_IO)
+        test_fail("error", stripe_count, "status", status, PNFSERR_IO);
+
+    /* every pattern must have let go of the layout */
+    if (t->layout_state.io_count)
+        test_fail("layout", stripe_count, "io still pending on the layout",
+            t->layout_state.io_count, 0);
+out:
+    free(expected);
+    free(buffer);
+    free(t);
+}
+
+typedef enum pnfs_status (*fork_fn)(pnfs_io_pattern*, pnfs_io_thread_fn);
+
+/* returns microseconds per read of one unit from each stripe */
+static double bench_reads(struct test_layout *t, uint32_t stripe_count,
+    uint32_t reads, fork_fn fork)
+{
+    static unsigned char buffer[MAX_STRIPES * BENCH_UNIT];
+    const uint32_t length = stripe_count * BENCH_UNIT;
+    LARGE_INTEGER freq, start, end;
+    pnfs_io_pattern pattern;
+    enum pnfs_status status;
+    uint32_t i;
+
+    layout_init(t, stripe_count, BENCH_UNIT);
+    (void)QueryPerformanceCounter(&start);
+    for (i = 0; i < reads; i++) {
+        ZeroMemory(&pattern, sizeof(pattern));
+        status = pattern_init(&pattern, &t->root, &t->state.file,
+            &t->stateid, &t->layout_state, buffer, PNFS_IOMODE_READ,
+            0, length, 90);
+        if (status == PNFS_SUCCESS) {
+            status = fork(&pattern, file_layout_read_thread);
+            pattern_free(&pattern);
+        }
+        if (status != PNFS_SUCCESS) {
+            test_fail("bench", stripe_count, "read failed", status, 0);
+            break;
+        }
+    }
+    (void)QueryPerformanceCounter(&end);
+    (void)QueryPerformanceFrequency(&freq);
+    return (double)(end.QuadPart - start.QuadPart) * 1000000.0 /
+        (double)freq.QuadPart / reads;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t stripe_counts[] = { 1, 2, 3, 7, 16, 64, 65, 256 };
+    struct test_layout *t;
+    uint32_t reads, stripes, i;
+    double pool, threads;
+
+    reads = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : DEFAULT_READS;
+    t = malloc(sizeof(*t));
+    if (t == NULL || reads == 0)
+        return EXIT_FAILURE;
+
+    for (i = 0; i < ARRAYSIZE(stripe_counts); i++)
+        test_stripes(stripe_counts[i]);
+
+    (void)printf("%-8s %12s %12s %8s\n", "stripes", "pool us",
+        "threads us", "speedup");
+    for (stripes = 1; stripes <= MAX_STRIPES; stripes *= 2) {
+        pool = bench_reads(t, stripes, reads, pattern_fork);
+        threads = bench_reads(t, stripes, reads, pattern_fork_threads);
+        (void)printf("%-8u %12.1f %12.1f %7.1fx\n", stripes, pool, threads,
+            pool > 0.0 ? threads / pool : 0.0);
+    }
+    free(t);
+
+    if (failures) {
+        (void)printf("pnfsiotest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("pnfsiotest1: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,465 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * recoverytest1.c - test and benchmark for state recovery after a server
+ * reboot, with nfs41_recover_client_state() from daemon/recovery.c
+ *
+ * A stand-in for the rebooted server answers the reclaims.  It holds
+ * every compound for one round trip, tracks the opens and locks it has
+ * granted, and enforces the grace period: reclaims are only accepted
+ * until the grace period ends or the client sends RECLAIM_COMPLETE,
+ * and anything else is refused until then.  The grace period is
+ * counted in compounds, so it ends at the same point on every run.
+ *
+ * Recovers a client with many opens, each with a few byte-range locks,
+ * and checks that the server ends up with every open and lock, and the
+ * client with the stateids the server gave out.  Recovery is timed on a
+ * session with one slot and room for one reclaim per compound, which is
+ * how the client used to recover, and on a session with 64 slots and
+ * the 50 operations per compound that Linux nfsd allows.  The time at
+ * which the server saw the last open, the last lock and the
+ * RECLAIM_COMPLETE is reported for each.
+ *
+ * Then recovers again with a grace period that ends part way through:
+ * RECLAIM_COMPLETE must be sent once, before the first open or lock
+ * outside of grace, and the rest must still be recovered.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: recoverytest1 [opens] [round trip in milliseconds]
+ */
+
+#include "../../daemon/recovery.c"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* the rebooted server */
+#define LOCKS_PER_OPEN 3
+#define DEFAULT_OPENS 1000
+#define DEFAULT_RTT 1 /* milliseconds */
+
+struct server_file {
+    volatile LONG opens;
+    volatile LONG locks;
+};
+
+static struct {
+    struct server_file *files;
+    uint32_t file_count;
+    uint32_t rtt;
+    uint32_t max_ops; /* ca_maxoperations */
+    LONG grace_compounds; /* when the grace period ends */
+    volatile LONG compounds;
+    volatile LONG in_flight;
+    volatile LONG max_in_flight;
+    volatile LONG reclaim_complete;
+    volatile LONG errors; /* sent against the grace period rules */
+    volatile LONG reclaims; /* accepted in grace */
+    LARGE_INTEGER start;
+    volatile LONGLONG last_open, last_lock, complete; /* ticks */
+} server;
+
+static long failures = 0;
+
+static void test_fail(const char *test, const char *msg, uint32_t id)
+{
+    if (++failures <= 10)
+        (void)fprintf(stderr, "FAIL: %s: %s (id=%u)\n", test, msg, id);
+}
+
+static LONGLONG server_now(void)
+{
+    LARGE_INTEGER now;
+    (void)QueryPerformanceCounter(&now);
+    return now.QuadPart - server.start.QuadPart;
+}
+
+static void server_record(volatile LONGLONG *last)
+{
+    const LONGLONG now = server_now();
+    LONGLONG prev = *last;
+    while (prev < now) {
+        const LONGLONG seen = InterlockedCompareExchange64(last, now, prev);
+        if (seen == prev)
+            break;
+        prev = seen;
+    }
+}
+
+/* start a compound of the given number of operations; returns whether
+ * the server is still in its grace period for this client */
+static bool_t server_compound(uint32_t ops)
+{
+    const LONG in_flight = InterlockedIncrement(&server.in_flight);
+    LONG prev = server.max_in_flight;
+    bool_t grace;
+
+    while (prev < in_flight) {
+        const LONG seen = InterlockedCompareExchange(
+            &server.max_in_flight, in_flight, prev);
+        if (seen == prev)
+            break;
+        prev = seen;
+    }
+    if (ops > server.max_ops)
+        test_fail("compound", "too many operations", ops);
+
+    grace = InterlockedIncrement(&server.compounds) <=
+        server.grace_compounds && !server.reclaim_complete;
+    Sleep(server.rtt);
+    InterlockedDecrement(&server.in_flight);
+    return grace;
+}
+
+/* check a request against the grace period */
+static uint32_t server_grace(bool_t grace, bool_t reclaim, uint32_t id)
+{
+    if (reclaim && !grace)
+        return NFS4ERR_NO_GRACE;
+    if (!reclaim && grace) {
+        InterlockedIncrement(&server.errors);
+        test_fail("grace", "normal request in grace", id);
+        return NFS4ERR_GRACE;
+    }
+    if (reclaim)
+        InterlockedIncrement(&server.reclaims);
+    return NFS4_OK;
+}
+
+static uint32_t server_file_id(const nfs41_path_fh *file)
+{
+    const uint32_t id = (uint32_t)file->fh.fileid;
+    if (id >= server.file_count)
+        test_fail("server", "unknown file", id);
+    return id;
+}
+
+static void server_stateid(stateid4 *stateid, uint32_t id, bool_t lock)
+{
+    ZeroMemory(stateid, sizeof(stateid4));
+    stateid->seqid = 1;
+    memcpy(stateid->other, &id, sizeof(id));
+    stateid->other[sizeof(id)] = lock ? 'L' : 'O';
+}
+
+static bool_t server_stateid_valid(const stateid4 *stateid,
+    uint32_t id, bool_t lock)
+{
+    stateid4 expected;
+    server_stateid(&expected, id, lock);
+    return stateid->seqid == expected.seqid && memcmp(stateid->other,
+        expected.other, NFS4_STATEID_OTHER) == 0;
+}
+
+static uint32_t server_open(bool_t grace, bool_t reclaim,
+    const nfs41_path_fh *file, stateid4 *stateid,
+    open_delegation4 *delegation)
+{
+    const uint32_t id = server_file_id(file);
+    const uint32_t status = server_grace(grace, reclaim, id);
+
+    if (status == NFS4_OK) {
+        if (InterlockedIncrement(&server.files[id].opens) > 1)
+            test_fail("server", "opened twice", id);
+        server_stateid(stateid, id, FALSE);
+        delegation->type = OPEN_DELEGATE_NONE;
+        server_record(&server.last_open);
+    }
+    return status;
+}
+
+
+/* stubs for what recovery.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...) { (void)format; }
+const char* nfs_opnum_to_string(int opnum) { return "op"; }
+
+int nfs41_open(nfs41_session *session, nfs41_path_fh *parent,
+    nfs41_path_fh *file, state_owner4 *owner, open_claim4 *claim,
+    uint32_t allow, uint32_t deny, uint32_t create, uint32_t how_mode,
+    nfs41_file_info *createattrs, bool_t try_recovery, stateid4 *stateid,
+    open_delegation4 *delegation, nfs41_file_info *info)
+{
+    const bool_t grace = server_compound(3);
+    return server_open(grace, claim->claim == CLAIM_PREVIOUS,
+        file, stateid, delegation);
+}
+
+int nfs41_open_reclaim(nfs41_session *session, uint32_t count,
+    nfs41_open_reclaim_args *reclaims)
+{
+    const bool_t grace = server_compound(1 + 2 * count);
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        reclaims[i].status = NFS4ERR_DELAY;
+    for (i = 0; i < count; i++) {
+        reclaims[i].status = server_open(grace, TRUE, reclaims[i].file,
+            &reclaims[i].stateid, &reclaims[i].delegation);
+        if (reclaims[i].status)
+            break;
+    }
+    return NFS4_OK;
+}
+
+int nfs41_lock_reclaim(nfs41_session *session, nfs41_path_fh *file,
+    state_owner4 *owner, bool_t reclaim, uint32_t count,
+    nfs41_lock_reclaim_args *locks, stateid_arg *stateid)
+{
+    const bool_t grace = server_compound(2 + count);
+    const uint32_t id = server_file_id(file);
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        locks[i].status = NFS4ERR_DELAY;
+
+    /* the first lock has to name the open or lock stateid we gave out */
+    if (!server_stateid_valid(&stateid->stateid, id,
+            stateid->type == STATEID_LOCK)) {
+        test_fail("server", "bad stateid for lock", id);
+        locks[0].status = NFS4ERR_BAD_STATEID;
+        return NFS4_OK;
+    }
+    for (i = 0; i < count; i++) {
+        locks[i].status = server_grace(grace, reclaim, id);
+        if (locks[i].status)
+            break;
+        InterlockedIncrement(&server.files[id].locks);
+        server_stateid(&stateid->stateid, id, TRUE);
+        stateid->type = STATEID_LOCK;
+        server_record(&server.last_lock);
+    }
+    return NFS4_OK;
+}
+
+enum nfsstat4 nfs41_reclaim_complete(nfs41_session *session)
+{
+    (void)server_compound(2);
+    if (InterlockedIncrement(&server.reclaim_complete) > 1)
+        test_fail("server", "RECLAIM_COMPLETE sent again",
+            server.reclaim_complete);
+    server_record(&server.complete);
+    return NFS4_OK;
+}
+
+enum nfsstat4 nfs41_want_delegation(nfs41_session *session,
+    nfs41_path_fh *file, deleg_claim4 *claim, uint32_t want,
+    bool_t try_recovery, open_delegation4 *delegation)
+{
+    test_fail("server", "unexpected WANT_DELEGATION", 0);
+    return NFS4ERR_NOTSUPP;
+}
+
+int nfs41_close(nfs41_session *session, nfs41_path_fh *file,
+    stateid_arg *stateid) { return NFS4_OK; }
+enum nfsstat4 nfs41_free_stateid(nfs41_session *session,
+    stateid4 *stateid) { return NFS4_OK; }
+enum nfsstat4 nfs41_test_stateid(nfs41_session *session,
+    stateid_arg *stateid_array, uint32_t count,
+    uint32_t *status_array) { return NFS4_OK; }
+int nfs41_session_renew(nfs41_session *session) { return NFS4_OK; }
+int nfs41_client_renew(nfs41_client *client) { return NFS4_OK; }
+int nfs41_client_delegation_recovery(nfs41_client *client)
+{ return NFS4_OK; }
+int nfs41_delegation_granted(nfs41_session *session,
+    nfs41_path_fh *parent, nfs41_path_fh *file,
+    open_delegation4 *delegation, bool_t try_recovery,
+    nfs41_delegation_state **deleg_out) { return NFS4_OK; }
+void nfs41_delegation_reclaimed(nfs41_client *client,
+    nfs41_delegation_state *deleg,
+    const open_delegation4 *delegation) {}
+enum pnfs_status pnfs_file_layout_recall(struct __nfs41_client *client,
+    const struct cb_layoutrecall_args *recall) { return PNFS_SUCCESS; }
+
+
+/* the client's state from before the reboot */
+struct test_client {
+    nfs41_client client;
+    nfs41_session *session;
+    nfs41_open_state *opens;
+    nfs41_lock_state *locks;
+    uint32_t count;
+};
+
+static int client_create(struct test_client *tc, uint32_t count,
+    LONG max_slots, uint32_t max_ops)
+{
+    nfs41_open_state *open;
+    nfs41_lock_state *lock;
+    uint32_t i, j;
+
+    ZeroMemory(tc, sizeof(struct test_client));
+    tc->count = count;
+    tc->session = calloc(1, sizeof(nfs41_session));
+    tc->opens = calloc(count, sizeof(nfs41_open_state));
+    tc->locks = calloc(count * LOCKS_PER_OPEN, sizeof(nfs41_lock_state));
+    if (tc->session == NULL || tc->opens == NULL || tc->locks == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    tc->session->client = &tc->client;
+    tc->session->table.max_slots = max_slots;
+    tc->session->fore_chan_attrs.ca_maxoperations = max_ops;
+
+    InitializeCriticalSection(&tc->client.state.lock);
+    list_init(&tc->client.state.opens);
+    list_init(&tc->client.state.delegations);
+
+    for (i = 0; i < count; i++) {
+        open = &tc->opens[i];
+        open->file.fh.fileid = i;
+        open->share_access = OPEN4_SHARE_ACCESS_BOTH;
+        open->share_deny = OPEN4_SHARE_DENY_NONE;
+        /* a stateid from before the reboot */
+        open->stateid.seqid = 7;
+        InitializeSRWLock(&open->lock);
+        list_init(&open->locks.list);
+        for (j = 0; j < LOCKS_PER_OPEN; j++) {
+            lock = &tc->locks[i * LOCKS_PER_OPEN + j];
+            lock->offset = j * 4096;
+            lock->length = 4096;
+            lock->exclusive = j & 1;
+            list_add_tail(&open->locks.list, &lock->open_entry);
+        }
+        list_add_tail(&tc->client.state.opens, &open->client_entry);
+    }
+    return NO_ERROR;
+}
+
+static void client_free(struct test_client *tc)
+{
+    DeleteCriticalSection(&tc->client.state.lock);
+    free(tc->locks);
+    free(tc->opens);
+    free(tc->session);
+}
+
+static void server_reboot(uint32_t count, uint32_t max_ops,
+    LONG grace_compounds)
+{
+    free(server.files);
+    server.files = calloc(count, sizeof(struct server_file));
+    server.file_count = count;
+    server.max_ops = max_ops;
+    server.grace_compounds = grace_compounds;
+    server.compounds = server.in_flight = server.max_in_flight = 0;
+    server.reclaim_complete = server.errors = server.reclaims = 0;
+    server.last_open = server.last_lock = server.complete = 0;
+    (void)QueryPerformanceCounter(&server.start);
+}
+
+static double ticks_ms(LONGLONG ticks)
+{
+    LARGE_INTEGER freq;
+    (void)QueryPerformanceFrequency(&freq);
+    return (double)ticks * 1000.0 / (double)freq.QuadPart;
+}
+
+/* recover the client's state, and check it against the server's */
+static double recover(const char *test, uint32_t count, LONG max_slots,
+    uint32_t max_ops, LONG grace_compounds, bool_t report)
+{
+    struct test_client tc;
+    nfs41_open_state *open;
+    uint32_t i;
+    int status;
+
+    if (client_create(&tc, count, max_slots, max_ops)) {
+        test_fail(test, "out of memory", count);
+        client_free(&tc);
+        return 0.0;
+    }
+    server_reboot(count, max_ops, grace_compounds);
+
+    status = nfs41_recover_client_state(tc.session, &tc.client);
+    if (status)
+        test_fail(test, "nfs41_recover_client_state() failed", status);
+
+    for (i = 0; i < count; i++) {
+        open = &tc.opens[i];
+        if (server.files[i].opens != 1)
+            test_fail(test, "open not recovered", i);
+        else if (!server_stateid_valid(&open->stateid, i, FALSE) ||
+                !open->do_close)
+            test_fail(test, "open stateid not updated", i);
+        if (server.files[i].locks != LOCKS_PER_OPEN)
+            test_fail(test, "locks not recovered", i);
+        else if (!server_stateid_valid(&open->locks.stateid, i, TRUE))
+            test_fail(test, "lock stateid not updated", i);
+    }
+    if (server.reclaim_complete != 1)
+        test_fail(test, "RECLAIM_COMPLETE count", server.reclaim_complete);
+    if (server.max_in_flight > max_slots)
+        test_fail(test, "more compounds in flight than slots",
+            server.max_in_flight);
+
+    if (report)
+        (void)printf("%-8s %5u %3u %5ld %3ld %9.1f %9.1f %9.1f\n", test,
+            (uint32_t)max_slots, max_ops, server.compounds,
+            server.max_in_flight, ticks_ms(server.last_open),
+            ticks_ms(server.last_lock), ticks_ms(server.complete));
+    client_free(&tc);
+    return ticks_ms(server.complete);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t count = argc > 1 ?
+        strtoul(argv[1], NULL, 0) : DEFAULT_OPENS;
+    double serial, batched;
+    LONG reclaims;
+
+    server.rtt = argc > 2 ? strtoul(argv[2], NULL, 0) : DEFAULT_RTT;
+
+    (void)printf("%u opens with %u locks each, %u ms round trip\n",
+        count, LOCKS_PER_OPEN, server.rtt);
+    (void)printf("%-8s %5s %3s %5s %3s %9s %9s %9s\n", "", "slots", "ops",
+        "cmpds", "max", "opens ms", "locks ms", "grace ms");
+
+    serial = recover("serial", count, 1, 3, LONG_MAX, TRUE);
+    batched = recover("batched", count, 64, 50, LONG_MAX, TRUE);
+    if (server.reclaims != count * (1 + LOCKS_PER_OPEN))
+        test_fail("batched", "reclaims in grace", server.reclaims);
+    (void)printf("grace period %.1fx shorter\n",
+        batched > 0.0 ? serial / batched : 0.0);
+
+    /* the grace period ends a quarter of the way through the locks */
+    (void)recover("expiry", count, 64, 50,
+        (LONG)((count + 15) / 16 + count / 4), FALSE);
+    reclaims = server.reclaims;
+    if (reclaims == 0 || reclaims >= (LONG)(count * (1 + LOCKS_PER_OPEN)))
+        test_fail("expiry", "grace period didn't end part way", reclaims);
+    if (server.errors)
+        test_fail("expiry", "normal requests in grace", server.errors);
+
+    free(server.files);
+
+    if (failures) {
+        (void)printf("recoverytest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("recoverytest1: OK\n");
+    return EXIT_SUCCESS;
+}
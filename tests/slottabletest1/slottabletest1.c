@@ -0,0 +1,210 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * slottabletest1.c - stress test and micro-benchmark for the session
+ * slot table in daemon/nfs41_session.c
+ *
+ * Hammers nfs41_session_get_slot()/nfs41_session_bump_seq()/
+ * nfs41_session_free_slot() from many threads, first with the full
+ * table and then with a table much smaller than the number of threads,
+ * so that most callers queue up for a slot.  Checks that no slot is
+ * ever held twice, that every slot's seqid advances by exactly one per
+ * use, that no slot above max_slots is handed out, and that the table
+ * is empty at the end.  Prints the get/free throughput of each phase.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: slottabletest1 [threads] [iterations per thread]
+ */
+
+#include "../../daemon/nfs41_session.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+
+
+/* stubs for what nfs41_session.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+void debug_delayed_free(void *in_ptr) { free(in_ptr); }
+
+int nfs41_create_session(nfs41_client *clnt, nfs41_session *session,
+    bool_t try_recovery) { return NFS4ERR_IO; }
+int nfs41_destroy_session(nfs41_session *session) { return NFS4_OK; }
+int nfs41_send_sequence(nfs41_session *session) { return NFS4_OK; }
+void nfs41_callback_session_init(nfs41_session *session) {}
+
+
+#define DEFAULT_THREADS 64
+#define DEFAULT_ITERATIONS 20000
+
+struct test_context {
+    nfs41_session *session;
+    uint32_t target_highest_slotid;
+    uint32_t iterations;
+    volatile LONG holders[NFS41_MAX_NUM_SLOTS];
+    uint32_t expected_seqid[NFS41_MAX_NUM_SLOTS]; /* owned by the holder */
+    volatile LONG failures;
+    HANDLE start;
+};
+
+static void test_fail(struct test_context *ctx, const char *msg,
+    uint32_t slot, uint32_t value)
+{
+    if (InterlockedIncrement(&ctx->failures) <= 10)
+        (void)fprintf(stderr, "FAIL: %s (slot=%u value=%u)\n",
+            msg, slot, value);
+}
+
+static unsigned int WINAPI test_thread(void *arg)
+{
+    struct test_context *ctx = (struct test_context *)arg;
+    const LONG self = (LONG)GetCurrentThreadId();
+    uint32_t i, slot, seqid, highest;
+
+    (void)WaitForSingleObject(ctx->start, INFINITE);
+
+    for (i = 0; i < ctx->iterations; i++) {
+        nfs41_session_get_slot(ctx->session, &slot, &seqid, &highest);
+
+        if (slot >= NFS41_MAX_NUM_SLOTS) {
+            test_fail(ctx, "slotid out of range", slot, slot);
+            continue;
+        }
+        if (InterlockedCompareExchange(&ctx->holders[slot], self, 0) != 0)
+            test_fail(ctx, "slot handed out twice", slot,
+                (uint32_t)ctx->holders[slot]);
+        if (seqid != ctx->expected_seqid[slot])
+            test_fail(ctx, "unexpected seqid", slot, seqid);
+        if (highest < slot)
+            test_fail(ctx, "highest_slotid below our slot", slot, highest);
+
+        /* give other threads a chance to contend for the slot */
+        if ((i & 7) == 0)
+            SwitchToThread();
+
+        ctx->expected_seqid[slot] = seqid + 1;
+        nfs41_session_bump_seq(ctx->session, slot,
+            ctx->target_highest_slotid);
+
+        (void)InterlockedExchange(&ctx->holders[slot], 0);
+        nfs41_session_free_slot(ctx->session, slot);
+    }
+    return 0;
+}
+
+static int run_phase(struct test_context *ctx, const char *name,
+    uint32_t nthreads, uint32_t target_highest_slotid)
+{
+    nfs41_slot_table *table = &ctx->session->table;
+    HANDLE *threads;
+    ULONGLONG start, elapsed;
+    uint32_t i, w;
+
+    ctx->target_highest_slotid = target_highest_slotid;
+    resize_slot_table(table, target_highest_slotid);
+
+    threads = calloc(nthreads, sizeof(HANDLE));
+    if (threads == NULL)
+        return 1;
+    ctx->start = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+    for (i = 0; i < nthreads; i++)
+        threads[i] = (HANDLE)_beginthreadex(NULL, 0, test_thread, ctx, 0, NULL);
+
+    start = GetTickCount64();
+    (void)SetEvent(ctx->start);
+    for (i = 0; i < nthreads; i++) {
+        (void)WaitForSingleObject(threads[i], INFINITE);
+        (void)CloseHandle(threads[i]);
+    }
+    elapsed = GetTickCount64() - start;
+    (void)CloseHandle(ctx->start);
+    free(threads);
+
+    /* everything must be back in the table */
+    if (table->num_used != 0)
+        test_fail(ctx, "slots still in use", 0, (uint32_t)table->num_used);
+    if (table->num_waiters != 0 || !list_empty(&table->waiters))
+        test_fail(ctx, "threads still waiting", 0,
+            (uint32_t)table->num_waiters);
+    for (w = 0; w < NFS41_SLOT_BITMAP_WORDS; w++)
+        if (table->used_slots[w] != 0)
+            test_fail(ctx, "bitmap not empty", w * 32,
+                (uint32_t)table->used_slots[w]);
+
+    (void)printf("%-12s threads=%u slots=%u: %llu get/free pairs "
+        "in %llu ms (%.0f/s)\n", name, nthreads,
+        target_highest_slotid + 1,
+        (unsigned long long)nthreads * ctx->iterations,
+        (unsigned long long)elapsed, elapsed ?
+        (double)nthreads * ctx->iterations * 1000.0 / elapsed : 0.0);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    nfs41_client client = { 0 };
+    struct test_context *ctx;
+    uint32_t nthreads = DEFAULT_THREADS;
+    uint32_t i;
+    int status;
+
+    if (argc > 1)
+        nthreads = (uint32_t)strtoul(argv[1], NULL, 0);
+    ctx = calloc(1, sizeof(struct test_context));
+    if (ctx == NULL || nthreads == 0)
+        return EXIT_FAILURE;
+    ctx->iterations = argc > 2 ?
+        (uint32_t)strtoul(argv[2], NULL, 0) : DEFAULT_ITERATIONS;
+
+    status = session_alloc(&client, &ctx->session);
+    if (status) {
+        (void)fprintf(stderr, "session_alloc() failed with %d\n", status);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < NFS41_MAX_NUM_SLOTS; i++)
+        ctx->expected_seqid[i] = ctx->session->table.seq_nums[i];
+
+    /* uncontended: more slots than threads */
+    (void)run_phase(ctx, "full", min(nthreads, NFS41_MAX_NUM_SLOTS / 2),
+        NFS41_MAX_NUM_SLOTS - 1);
+    /* all threads fight over a few slots, most of them queue up */
+    (void)run_phase(ctx, "contended", nthreads, 3);
+    /* a single slot, every free is a FIFO handoff */
+    (void)run_phase(ctx, "single", nthreads, 0);
+
+    free(ctx->session);
+
+    if (ctx->failures) {
+        (void)printf("slottabletest1: %ld failures\n", ctx->failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("slottabletest1: OK\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,587 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * writepipelinetest1.c - test and benchmark for the chunked WRITE
+ * pipeline in write_to_mds() in daemon/readwrite.c
+ *
+ * A stand-in server keeps the file in memory and sleeps for a given
+ * latency in every WRITE and COMMIT.  It can also "reboot" before a
+ * given WRITE: it changes its write verifier and forgets everything
+ * that wasn't committed.  The test checks that:
+ *
+ * - a write that fits in one chunk goes out as a single FILE_SYNC4
+ *   WRITE, with no COMMIT;
+ * - a large write reaches the server intact with a single COMMIT;
+ * - short writes are finished before the chunk counts as written;
+ * - after a reboot, only the chunks the server forgot are resent, and
+ *   committed again;
+ * - args->ctime is the change attribute that came back with the last
+ *   COMMIT.
+ *
+ * Then it times the same write with one chunk in flight, as before the
+ * pipeline, and with up to 16 in flight, for a range of injected
+ * latencies, and prints the throughput of each.
+ *
+ * Needs no server; the daemon's RPC entry points are stubbed out below.
+ *
+ * Usage: writepipelinetest1 [size in MB] [chunk size in KB]
+ */
+
+#include "../../daemon/readwrite.c"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* stubs for what readwrite.c links against */
+int g_debug_level = 0;
+
+void dprintf_out(LPCSTR format, ...) { (void)format; }
+void eprintf(LPCSTR format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    (void)vfprintf(stderr, format, args);
+    va_end(args);
+}
+const char* opcode2string(nfs41_opcodes opcode) { return "opcode"; }
+const char* nfs_error_string(int status) { return "status"; }
+int nfs_to_windows_error(int status, int default_error)
+{
+    return status ? default_error : NO_ERROR;
+}
+nfs41_daemon_globals nfs41_dg;
+
+int safe_read(unsigned char **pos, uint32_t *remaining, void *dest,
+    uint32_t dest_len) { return ERROR_BUFFER_OVERFLOW; }
+int safe_write(unsigned char **pos, uint32_t *remaining, void *dest,
+    uint32_t dest_len) { return ERROR_BUFFER_OVERFLOW; }
+void get_nfs_time(nfstime4 *nfs_time) { ZeroMemory(nfs_time, sizeof(*nfs_time)); }
+uint32_t state_hash(const void *key, uint32_t len) { return 0; }
+uint32_t max_read_size(const nfs41_session *session,
+    const nfs41_fh *fh) { return 0; }
+int nfs41_attr_cache_lookup(struct nfs41_name_cache *cache, uint64_t fileid,
+    nfs41_file_info *info_out) { return ERROR_FILE_NOT_FOUND; }
+int nfs41_attr_cache_update(struct nfs41_name_cache *cache, uint64_t fileid,
+    const nfs41_file_info *info) { return NO_ERROR; }
+void nfs41_open_state_ref(nfs41_open_state *state) {}
+void nfs41_open_state_deref(nfs41_open_state *state) {}
+void nfs41_open_stateid_arg(nfs41_open_state *state,
+    struct __stateid_arg *arg) {}
+int nfs41_read(nfs41_session *session, nfs41_path_fh *file,
+    stateid_arg *stateid, uint64_t offset, uint32_t count,
+    unsigned char *data_out, uint32_t *data_len_out,
+    bool_t *eof_out) { return NFS4ERR_IO; }
+int nfs41_setattr(nfs41_session *session, nfs41_path_fh *file,
+    stateid_arg *stateid, nfs41_file_info *info) { return NFS4ERR_IO; }
+enum pnfs_status pnfs_layout_state_open(nfs41_open_state *state,
+    pnfs_layout_state **layout_out) { return PNFSERR_NOT_SUPPORTED; }
+enum pnfs_status pnfs_read(nfs41_root *root, nfs41_open_state *state,
+    stateid_arg *stateid, pnfs_layout_state *layout, uint64_t offset,
+    uint64_t length, unsigned char *buffer_out,
+    ULONG *len_out) { return PNFSERR_NOT_SUPPORTED; }
+enum pnfs_status pnfs_write(nfs41_root *root, nfs41_open_state *state,
+    stateid_arg *stateid, pnfs_layout_state *layout, uint64_t offset,
+    uint64_t length, unsigned char *buffer, ULONG *len_out,
+    nfs41_file_info *cinfo) { return PNFSERR_NOT_SUPPORTED; }
+
+/* same as daemon/util.c */
+bool_t verify_write(
+    IN nfs41_write_verf *verf,
+    IN OUT enum stable_how4 *stable)
+{
+    if (verf->committed != UNSTABLE4) {
+        *stable = verf->committed;
+        return 1;
+    }
+    if (*stable != UNSTABLE4) {
+        memcpy(verf->expected, verf->verf, NFS4_VERIFIER_SIZE);
+        *stable = UNSTABLE4;
+        return 1;
+    }
+    return memcmp(verf->expected, verf->verf, NFS4_VERIFIER_SIZE) == 0;
+}
+
+bool_t verify_commit(
+    IN nfs41_write_verf *verf)
+{
+    return memcmp(verf->expected, verf->verf, NFS4_VERIFIER_SIZE) == 0;
+}
+
+/* same as daemon/util.c */
+static struct io_pool {
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+    struct list_entry queue;
+    uint32_t queued;
+    uint32_t idle;
+    uint32_t workers;
+} io_pool = {
+    SRWLOCK_INIT,
+    CONDITION_VARIABLE_INIT,
+    { &io_pool.queue, &io_pool.queue },
+    0, 0, 0
+};
+
+static unsigned int WINAPI io_pool_worker(void *args)
+{
+    io_pool_work *work;
+
+    for (;;) {
+        AcquireSRWLockExclusive(&io_pool.lock);
+        io_pool.idle++;
+        while (list_empty(&io_pool.queue))
+            SleepConditionVariableSRW(&io_pool.cond,
+                &io_pool.lock, INFINITE, 0);
+        io_pool.idle--;
+        work = list_container(io_pool.queue.next, io_pool_work, entry);
+        list_remove(&work->entry);
+        io_pool.queued--;
+        ReleaseSRWLockExclusive(&io_pool.lock);
+
+        work->fn(work);
+    }
+    return 0;
+}
+
+void io_pool_queue(
+    IN io_pool_work *work,
+    IN io_pool_work_fn fn,
+    IN uint32_t max_workers)
+{
+    HANDLE thread;
+
+    work->fn = fn;
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    list_add_tail(&io_pool.queue, &work->entry);
+    io_pool.queued++;
+
+    if (max_workers > IO_POOL_MAX_WORKERS)
+        max_workers = IO_POOL_MAX_WORKERS;
+    if (io_pool.queued > io_pool.idle && io_pool.workers < max_workers) {
+        thread = (HANDLE)_beginthreadex(NULL, 0, io_pool_worker, NULL, 0, NULL);
+        if (thread != NULL) {
+            CloseHandle(thread);
+            io_pool.workers++;
+        }
+    }
+    ReleaseSRWLockExclusive(&io_pool.lock);
+    WakeConditionVariable(&io_pool.cond);
+}
+
+bool_t io_pool_cancel(
+    IN io_pool_work *work)
+{
+    bool_t cancelled = FALSE;
+
+    AcquireSRWLockExclusive(&io_pool.lock);
+    if (!list_empty(&work->entry)) {
+        list_remove(&work->entry);
+        io_pool.queued--;
+        cancelled = TRUE;
+    }
+    ReleaseSRWLockExclusive(&io_pool.lock);
+    return cancelled;
+}
+
+/* the chunk size and number of chunks in flight are the test's knobs,
+ * rather than the session's io tuner */
+static uint32_t test_chunk_size;
+static uint32_t test_inflight;
+
+uint32_t max_write_size(
+    IN const nfs41_session *session,
+    IN const nfs41_fh *fh)
+{
+    return test_chunk_size;
+}
+
+void nfs41_session_io_tuning(
+    IN nfs41_session *session,
+    IN bool_t write,
+    IN uint32_t max_size,
+    IN uint64_t length,
+    OUT uint32_t *size_out,
+    OUT uint32_t *inflight_out)
+{
+    *size_out = max_size;
+    *inflight_out = test_inflight;
+}
+
+
+/* the stand-in server */
+static struct {
+    SRWLOCK         lock;
+    unsigned char   *data;      /* what READ would return */
+    unsigned char   *stable;    /* what survives a reboot */
+    uint64_t        size;
+    unsigned char   verf[NFS4_VERIFIER_SIZE];
+    uint64_t        change;
+    DWORD           latency;    /* ms, per WRITE and COMMIT */
+    uint32_t        max_count;  /* most bytes a WRITE takes, 0 for all */
+    LONG            reboot_at;  /* reboot before this WRITE, 0 for never */
+    LONG            writes;
+    volatile LONG   commits;
+    volatile LONG   inflight;
+    volatile LONG   max_inflight;
+} server;
+
+static void server_reset(void)
+{
+    memset(server.data, 0, (size_t)server.size);
+    memset(server.stable, 0, (size_t)server.size);
+    server.verf[0]++;
+    server.max_count = 0;
+    server.reboot_at = 0;
+    server.writes = server.commits = 0;
+    server.inflight = server.max_inflight = 0;
+}
+
+static void server_enter(void)
+{
+    const LONG inflight = InterlockedIncrement(&server.inflight);
+    LONG max_inflight = server.max_inflight;
+    while (inflight > max_inflight) {
+        const LONG prev = InterlockedCompareExchange(
+            &server.max_inflight, inflight, max_inflight);
+        if (prev == max_inflight)
+            break;
+        max_inflight = prev;
+    }
+    if (server.latency)
+        Sleep(server.latency);
+}
+
+static void server_leave(void)
+{
+    InterlockedDecrement(&server.inflight);
+}
+
+static void server_change_info(nfs41_file_info *info)
+{
+    ZeroMemory(info, sizeof(*info));
+    info->attrmask.count = 1;
+    info->attrmask.arr[0] = FATTR4_WORD0_CHANGE;
+    info->change = server.change;
+}
+
+int nfs41_write(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN stateid_arg *stateid,
+    IN unsigned char *data,
+    IN uint32_t data_len,
+    IN uint64_t offset,
+    IN enum stable_how4 stable,
+    OUT uint32_t *bytes_written,
+    OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *cinfo)
+{
+    server_enter();
+    if (offset + data_len > server.size) {
+        server_leave();
+        return NFS4ERR_FBIG;
+    }
+    if (server.max_count && data_len > server.max_count)
+        data_len = server.max_count;
+
+    /* count WRITEs in the order they land, so a reboot splits them
+     * into those before and after it */
+    AcquireSRWLockExclusive(&server.lock);
+    if (++server.writes == server.reboot_at) {
+        /* forget whatever wasn't committed */
+        memcpy(server.data, server.stable, (size_t)server.size);
+        server.verf[1]++;
+    }
+    memcpy(server.data + offset, data, data_len);
+    if (stable != UNSTABLE4)
+        memcpy(server.stable + offset, data, data_len);
+    server.change++;
+    memcpy(verf->verf, server.verf, NFS4_VERIFIER_SIZE);
+    verf->committed = stable;
+    if (cinfo)
+        server_change_info(cinfo);
+    ReleaseSRWLockExclusive(&server.lock);
+
+    *bytes_written = data_len;
+    server_leave();
+    return NFS4_OK;
+}
+
+int nfs41_commit(
+    IN nfs41_session *session,
+    IN nfs41_path_fh *file,
+    IN uint64_t offset,
+    IN uint32_t count,
+    IN bool_t do_getattr,
+    OUT nfs41_write_verf *verf,
+    OUT nfs41_file_info *cinfo)
+{
+    InterlockedIncrement(&server.commits);
+    server_enter();
+    AcquireSRWLockExclusive(&server.lock);
+    if (offset + count > server.size)
+        count = (uint32_t)(server.size - offset);
+    memcpy(server.stable + offset, server.data + offset, count);
+    memcpy(verf->verf, server.verf, NFS4_VERIFIER_SIZE);
+    verf->committed = FILE_SYNC4;
+    if (do_getattr && cinfo)
+        server_change_info(cinfo);
+    ReleaseSRWLockExclusive(&server.lock);
+    server_leave();
+    return NFS4_OK;
+}
+
+int nfs41_getattr(
+    IN nfs41_session *session,
+    IN OPTIONAL nfs41_path_fh *file,
+    IN bitmap4 *attr_request,
+    OUT nfs41_file_info *info)
+{
+    server_enter();
+    AcquireSRWLockShared(&server.lock);
+    server_change_info(info);
+    ReleaseSRWLockShared(&server.lock);
+    server_leave();
+    return NFS4_OK;
+}
+
+
+#define DEFAULT_SIZE_MB 16
+#define DEFAULT_CHUNK_KB 1024
+
+static long failures = 0;
+
+static void test_fail(const char *test, const char *msg,
+    long long value, long long expected)
+{
+    failures++;
+    (void)fprintf(stderr, "FAIL: %s: %s (got %lld, expected %lld)\n",
+        test, msg, value, expected);
+}
+
+struct test_file {
+    nfs41_session session;
+    nfs41_superblock superblock;
+    nfs41_open_state state;
+    unsigned char *buffer;
+    uint64_t size;
+};
+
+static int do_write(struct test_file *file, uint64_t offset,
+    uint32_t length, nfs41_upcall *upcall)
+{
+    stateid_arg stateid;
+
+    ZeroMemory(upcall, sizeof(*upcall));
+    ZeroMemory(&stateid, sizeof(stateid));
+    upcall->state_ref = &file->state;
+    upcall->args.rw.buffer = file->buffer + offset;
+    upcall->args.rw.offset = offset;
+    upcall->args.rw.len = length;
+    return write_to_mds(upcall, &stateid);
+}
+
+/* the written range must have reached stable storage, and nothing else */
+static void check_data(const char *test, struct test_file *file,
+    uint64_t offset, uint32_t length)
+{
+    if (memcmp(server.stable + offset, file->buffer + offset, length))
+        test_fail(test, "data not committed", 0, 0);
+    if (memcmp(server.data, server.stable, (size_t)server.size))
+        test_fail(test, "uncommitted data left on the server", 0, 0);
+}
+
+static void check_write(const char *test, struct test_file *file,
+    uint64_t offset, uint32_t length, LONG writes, LONG commits)
+{
+    nfs41_upcall upcall;
+    int status;
+
+    status = do_write(file, offset, length, &upcall);
+    if (status)
+        test_fail(test, "write_to_mds() failed", status, NO_ERROR);
+    if (upcall.args.rw.out_len != length)
+        test_fail(test, "out_len", upcall.args.rw.out_len, length);
+    if (upcall.args.rw.ctime != server.change)
+        test_fail(test, "ctime", (long long)upcall.args.rw.ctime,
+            (long long)server.change);
+    if (server.writes != writes)
+        test_fail(test, "WRITEs sent", server.writes, writes);
+    if (server.commits != commits)
+        test_fail(test, "COMMITs sent", server.commits, commits);
+    check_data(test, file, offset, length);
+}
+
+/* WRITEs needed for length bytes, with at most count per WRITE */
+static LONG write_count(uint32_t length, uint32_t count)
+{
+    LONG writes = 0;
+    while (length) {
+        const uint32_t chunk = min(length, test_chunk_size);
+        writes += (chunk + count - 1) / count;
+        length -= chunk;
+    }
+    return writes;
+}
+
+static void run_tests(struct test_file *file)
+{
+    const uint32_t size = (uint32_t)file->size;
+    const uint32_t unaligned = size - 3 * test_chunk_size / 2;
+    const LONG chunks = write_count(size, test_chunk_size);
+    const uint32_t short_count = (test_chunk_size + 2) / 3;
+
+    test_inflight = MAX_CHUNKS_IN_FLIGHT;
+    server.latency = 1;
+
+    /* fits in one chunk: FILE_SYNC4, no COMMIT */
+    server_reset();
+    check_write("single", file, file->size - test_chunk_size,
+        test_chunk_size, 1, 0);
+
+    /* the whole file, one WRITE per chunk and one COMMIT */
+    server_reset();
+    check_write("chunked", file, 0, size, chunks, 1);
+    if (server.max_inflight < 2)
+        test_fail("chunked", "chunks in flight", server.max_inflight, 2);
+    if (server.max_inflight > MAX_CHUNKS_IN_FLIGHT)
+        test_fail("chunked", "chunks in flight", server.max_inflight,
+            MAX_CHUNKS_IN_FLIGHT);
+
+    /* an unaligned range that ends in a partial chunk */
+    server_reset();
+    check_write("unaligned", file, 4096 + 1, unaligned,
+        write_count(unaligned, test_chunk_size),
+        unaligned > test_chunk_size ? 1 : 0);
+
+    /* every WRITE is short; a full chunk takes 3 */
+    server_reset();
+    server.max_count = short_count;
+    check_write("short", file, 0, size, write_count(size, short_count), 1);
+
+    /* the server reboots halfway through; the WRITEs before that must
+     * be sent again, and COMMITed again */
+    if (chunks > 2) {
+        server_reset();
+        server.reboot_at = chunks / 2 + 1;
+        check_write("reboot", file, 0, size, chunks + chunks / 2, 2);
+    }
+
+    /* and again, with one chunk at a time */
+    if (chunks > 2) {
+        test_inflight = 1;
+        server_reset();
+        server.reboot_at = chunks / 2 + 1;
+        check_write("reboot-serial", file, 0, size, chunks + chunks / 2, 2);
+        if (server.max_inflight != 1)
+            test_fail("reboot-serial", "chunks in flight",
+                server.max_inflight, 1);
+    }
+}
+
+static void run_benchmark(struct test_file *file)
+{
+    static const DWORD latencies[] = { 0, 1, 2, 5, 10, 20 };
+    static const uint32_t inflights[] = { 1, 4, MAX_CHUNKS_IN_FLIGHT };
+    uint32_t l, i;
+
+    (void)printf("%-8s %-9s %10s %10s %8s\n",
+        "latency", "inflight", "ms", "MB/s", "speedup");
+    for (l = 0; l < ARRAYSIZE(latencies); l++) {
+        double serial = 0.0;
+        for (i = 0; i < ARRAYSIZE(inflights); i++) {
+            nfs41_upcall upcall;
+            LARGE_INTEGER freq, start, end;
+            double ms;
+
+            server_reset();
+            server.latency = latencies[l];
+            test_inflight = inflights[i];
+
+            (void)QueryPerformanceFrequency(&freq);
+            (void)QueryPerformanceCounter(&start);
+            if (do_write(file, 0, (uint32_t)file->size, &upcall))
+                test_fail("benchmark", "write_to_mds() failed", 0, 0);
+            (void)QueryPerformanceCounter(&end);
+            ms = (double)(end.QuadPart - start.QuadPart) * 1000.0 /
+                (double)freq.QuadPart;
+            if (i == 0)
+                serial = ms;
+
+            (void)printf("%-8lu %-9u %10.1f %10.1f %7.1fx\n",
+                (unsigned long)latencies[l], inflights[i], ms,
+                ms > 0.0 ? (double)file->size / 1048576.0 * 1000.0 / ms : 0.0,
+                ms > 0.0 ? serial / ms : 0.0);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct test_file *file;
+    uint64_t i;
+
+    file = calloc(1, sizeof(struct test_file));
+    if (file == NULL)
+        return EXIT_FAILURE;
+
+    file->size = (uint64_t)(argc > 1 ?
+        strtoul(argv[1], NULL, 0) : DEFAULT_SIZE_MB) * 1048576;
+    test_chunk_size = (argc > 2 ?
+        (uint32_t)strtoul(argv[2], NULL, 0) : DEFAULT_CHUNK_KB) * 1024;
+    if (file->size == 0 || file->size > 1024 * 1048576 ||
+        test_chunk_size < 4096 || test_chunk_size > file->size / 2) {
+        (void)fprintf(stderr, "Usage: writepipelinetest1 "
+            "[size in MB] [chunk size in KB]\n");
+        return EXIT_FAILURE;
+    }
+
+    file->buffer = malloc((size_t)file->size);
+    server.size = file->size;
+    server.data = malloc((size_t)server.size);
+    server.stable = malloc((size_t)server.size);
+    if (file->buffer == NULL || server.data == NULL || server.stable == NULL)
+        return EXIT_FAILURE;
+    for (i = 0; i < file->size; i++)
+        file->buffer[i] = (unsigned char)(i * 2654435761u >> 24);
+    InitializeSRWLock(&server.lock);
+
+    file->session.table.max_slots = 64;
+    file->superblock.maxwrite = test_chunk_size;
+    file->state.session = &file->session;
+    file->state.file.fh.superblock = &file->superblock;
+
+    run_tests(file);
+    run_benchmark(file);
+
+    free(server.stable);
+    free(server.data);
+    free(file->buffer);
+    free(file);
+
+    if (failures) {
+        (void)printf("writepipelinetest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("writepipelinetest1: OK\n");
+    return EXIT_SUCCESS;
+}
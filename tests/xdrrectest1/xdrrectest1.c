@@ -0,0 +1,510 @@
+/* NFSv4.1 client for Windows
+ * Copyright  2012 The Regents of the University of Michigan
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at
+ * your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * without any warranty; without even the implied warranty of merchantability
+ * or fitness for a particular purpose.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ */
+
+/*
+ * xdrrectest1.c - unit test for the gather writes of WRITE payloads and
+ * the direct reads of READ payloads in libtirpc/src/xdr_rec.c
+ *
+ * Encodes WRITE-like calls the way clnt_vc does, with the payload passed
+ * to xdrrec_putbytes_ref(), under AUTH_SYS and under the RPCSEC_GSS
+ * integrity (krb5i) and privacy (krb5p) wrappers of authsspi_prot.c.
+ * The records that reach the transport must match the same call encoded
+ * into a plain xdrmem buffer, with the MIC or wrap token computed over
+ * the same bytes.  Unwrapped payloads must go out by reference, wrapped
+ * ones must be copied.  The gather writer only sends a few hundred bytes
+ * per call, so every record also takes the partial send path.
+ *
+ * Decodes READ-like replies, split into several fragments, the way
+ * decode_read_res_ok() does with xdr_bytes(), from a transport that
+ * hands out either everything it has or a segment at a time.  The
+ * payload and the fields around it must decode intact, and at most
+ * FILL_READ_MAX bytes of a large payload may be staged in the input
+ * buffer; the rest must be read straight into the destination.
+ *
+ * Then prints the bytes copied out of the input buffer per payload byte
+ * and the decoding rate for 1 MB replies, next to a loop that stages
+ * every byte and copies it out, as xdr_rec did before direct reads.
+ * The transport is an in-memory stand-in for a loopback socket, so its
+ * memcpy() takes the place of the kernel's copy.
+ *
+ * Needs no server or Kerberos; the SSPI calls are stubbed out below with
+ * a checksum and a byte-wise cipher.
+ *
+ * Usage: xdrrectest1
+ */
+
+#include <wintirpc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rpc/rpc.h>
+#include "rpc/auth_sspi.h"
+
+
+/* stubs for what authsspi_prot.c links against */
+void log_debug(const char *fmt, ...) { (void)fmt; }
+void log_status(char *m, uint32_t major, uint32_t minor) {}
+void log_hexdump(bool_t on, const char *title, const u_char *buf, int len,
+    int offset) {}
+void wintirpc_warnx(const char *format, ...) { (void)format; }
+
+static uint64_t checksum(const unsigned char *buf, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL; /* fnv-1a */
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= buf[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint32_t sspi_get_mic(void *ctx, u_int qop, u_int seq,
+    sspi_buffer_desc *bufin, sspi_buffer_desc *bufout)
+{
+    uint64_t mic = checksum(bufin->value, bufin->length) ^ seq;
+
+    bufout->length = sizeof(mic);
+    bufout->value = malloc(bufout->length);
+    if (bufout->value == NULL)
+        return SEC_E_INSUFFICIENT_MEMORY;
+    memcpy(bufout->value, &mic, sizeof(mic));
+    return SEC_E_OK;
+}
+
+uint32_t sspi_wrap(void *ctx, u_int seq, sspi_buffer_desc *bufin,
+    sspi_buffer_desc *bufout, u_int *conf_state)
+{
+    const unsigned char *in = bufin->value;
+    unsigned char *out;
+    uint32_t i;
+
+    /* a 4-byte token header, then the data with every byte flipped */
+    bufout->length = bufin->length + 4;
+    bufout->value = out = malloc(bufout->length);
+    if (out == NULL)
+        return SEC_E_INSUFFICIENT_MEMORY;
+    memcpy(out, "wrap", 4);
+    for (i = 0; i < bufin->length; i++)
+        out[i + 4] = in[i] ^ 0x5a;
+    *conf_state = 1;
+    return SEC_E_OK;
+}
+
+uint32_t sspi_verify_mic(void *ctx, u_int seq, sspi_buffer_desc *bufin,
+    sspi_buffer_desc *bufout, unsigned long *qop_state)
+{ return SEC_E_INTERNAL_ERROR; }
+uint32_t sspi_unwrap(void *ctx, u_int seq, sspi_buffer_desc *bufin,
+    sspi_buffer_desc *bufout, u_int *conf_state, unsigned long *qop_state)
+{ return SEC_E_INTERNAL_ERROR; }
+void sspi_release_buffer(sspi_buffer_desc *buf) { free(buf->value); }
+
+
+#define SENDSIZE (1024 * 1024)
+#define RECVSIZE (SENDSIZE + 4096)
+#define HEADER_LEN 40       /* stands in for the call header and creds */
+#define MAX_SEND 700        /* bytes the gather writer sends per call */
+#define GSS_SEQ 12345
+#define FRAGSIZE 300000     /* splits large replies into fragments */
+#define SEGMENT 1460        /* a TCP segment */
+#define DIRECT_MIN 4096     /* DIRECT_READ_MIN in libtirpc/src/xdr_rec.c */
+#define FILL_READ_MAX 8192  /* same as libtirpc/src/xdr_rec.c */
+#define BENCH_REPLIES 64
+#define BENCH_PASSES 8
+
+static long failures = 0;
+
+static void test_fail(const char *test, uint32_t len, const char *msg)
+{
+    failures++;
+    (void)fprintf(stderr, "FAIL: %s len=%u: %s\n", test, len, msg);
+}
+
+/* the transport: everything written is appended to 'wire', and
+ * reads consume it from 'pos' */
+struct transport {
+    unsigned char *wire;
+    uint32_t len;
+    uint32_t writes;
+    uint32_t writevs;
+    uint32_t pos;
+    uint32_t max_read;      /* most bytes a read returns */
+    const char *dst;        /* reads into here are direct */
+    uint32_t dst_len;
+    uint64_t direct;        /* bytes read straight into dst */
+    uint64_t reads;
+};
+
+static int test_read(void *handle, void *buf, int len)
+{
+    struct transport *t = (struct transport*)handle;
+    const char *p = (const char*)buf;
+
+    if (t->pos == t->len)
+        return -1;
+    if ((uint32_t)len > t->len - t->pos)
+        len = (int)(t->len - t->pos);
+    if ((uint32_t)len > t->max_read)
+        len = (int)t->max_read;
+    memcpy(buf, t->wire + t->pos, len);
+    t->pos += len;
+    t->reads++;
+    if (p >= t->dst && p < t->dst + t->dst_len)
+        t->direct += len;
+    return len;
+}
+
+static int test_write(void *handle, void *buf, int len)
+{
+    struct transport *t = (struct transport*)handle;
+    memcpy(t->wire + t->len, buf, len);
+    t->len += len;
+    t->writes++;
+    return len;
+}
+
+/* sends at most MAX_SEND bytes, like a short WSASend() */
+static int test_writev(void *handle, struct xdrrec_iov *iov, int count)
+{
+    struct transport *t = (struct transport*)handle;
+    u_int i, n, sent = 0;
+
+    t->writevs++;
+    for (i = 0; i < (u_int)count && sent < MAX_SEND; i++) {
+        n = min(iov[i].iov_len, MAX_SEND - sent);
+        memcpy(t->wire + t->len, iov[i].iov_base, n);
+        t->len += n;
+        sent += n;
+    }
+    return (int)sent;
+}
+
+/* the tail of a WRITE, as daemon/nfs41_xdr.c encode_op_write() sends it */
+struct write_args {
+    char *data;
+    u_int len;
+};
+
+static bool_t encode_write(XDR *xdr, struct write_args *args)
+{
+    static char zero[4] = { 0 };
+    u_int pad = (4 - (args->len & 3)) & 3;
+
+    return xdr_u_int32_t(xdr, &args->len)
+        && xdrrec_putbytes_ref(xdr, args->data, args->len)
+        && (pad == 0 || XDR_PUTBYTES(xdr, zero, pad));
+}
+
+static bool_t encode_call(XDR *xdr, rpc_sspi_svc_t svc,
+    struct write_args *args)
+{
+    char header[HEADER_LEN];
+
+    memset(header, 'h', sizeof(header));
+    if (!XDR_PUTBYTES(xdr, header, sizeof(header)))
+        return FALSE;
+    if (svc == RPCSEC_SSPI_SVC_NONE)
+        return encode_write(xdr, args);
+    return xdr_rpc_sspi_data(xdr, (xdrproc_t)encode_write, (caddr_t)args,
+        NULL, 0, svc, GSS_SEQ);
+}
+
+/* strip the record marks off the wire; returns the record length */
+static uint32_t unframe(const char *test, uint32_t len,
+    const struct transport *t, unsigned char *record)
+{
+    uint32_t pos = 0, out = 0, mark, frag;
+
+    for (;;) {
+        if (t->len - pos < 4) {
+            test_fail(test, len, "truncated record mark");
+            return 0;
+        }
+        memcpy(&mark, t->wire + pos, 4);
+        mark = ntohl(mark);
+        frag = mark & 0x7fffffff;
+        pos += 4;
+        if (t->len - pos < frag) {
+            test_fail(test, len, "truncated fragment");
+            return 0;
+        }
+        memcpy(record + out, t->wire + pos, frag);
+        out += frag;
+        pos += frag;
+        if (mark & 0x80000000)
+            break;
+    }
+    if (pos != t->len)
+        test_fail(test, len, "bytes after the last fragment");
+    return out;
+}
+
+static void test_call(const char *test, rpc_sspi_svc_t svc, uint32_t len)
+{
+    static unsigned char expected[SENDSIZE + 4096], record[SENDSIZE + 4096];
+    static unsigned char wire[2 * SENDSIZE];
+    struct transport t = { wire, 0, 0, 0 };
+    struct write_args args;
+    XDR xdr;
+    uint32_t i, expected_len, record_len;
+
+    args.len = len;
+    args.data = malloc(len + 1);
+    if (args.data == NULL) {
+        test_fail(test, len, "out of memory");
+        return;
+    }
+    for (i = 0; i < len; i++)
+        args.data[i] = (char)(i * 7 + i / 251);
+
+    /* the reference: the same call in a flat buffer */
+    xdrmem_create(&xdr, (char*)expected, sizeof(expected), XDR_ENCODE);
+    if (!encode_call(&xdr, svc, &args)) {
+        test_fail(test, len, "xdrmem encoding failed");
+        goto out;
+    }
+    expected_len = XDR_GETPOS(&xdr);
+    XDR_DESTROY(&xdr);
+
+    /* the same call through xdrrec, as clnt_vc sends it */
+    xdrrec_create(&xdr, SENDSIZE, SENDSIZE, &t, test_read, test_write);
+    xdrrec_setwritev(&xdr, test_writev);
+    xdr.x_op = XDR_ENCODE;
+    if (!encode_call(&xdr, svc, &args) || !xdrrec_endofrecord(&xdr, TRUE)) {
+        test_fail(test, len, "xdrrec encoding failed");
+        XDR_DESTROY(&xdr);
+        goto out;
+    }
+    XDR_DESTROY(&xdr);
+
+    record_len = unframe(test, len, &t, record);
+    if (record_len != expected_len)
+        test_fail(test, len, "wrong record length");
+    else if (memcmp(record, expected, expected_len) != 0)
+        test_fail(test, len, "record differs from the xdrmem encoding");
+
+    /* only unwrapped payloads go by reference */
+    if (svc == RPCSEC_SSPI_SVC_NONE && len >= 4096) {
+        if (t.writevs == 0)
+            test_fail(test, len, "payload was copied");
+        else if (t.writevs < (t.len + MAX_SEND - 1) / MAX_SEND)
+            test_fail(test, len, "partial sends were not resent");
+    } else if (t.writevs != 0) {
+        test_fail(test, len, "payload was sent by reference");
+    }
+out:
+    free(args.data);
+}
+
+/* the tail of a READ reply, as daemon/nfs41_xdr.c decode_read_res_ok()
+ * decodes it, with a field after the payload */
+struct read_res {
+    bool_t eof;
+    char *data;
+    u_int len;
+    uint32_t trailer;
+};
+
+static bool_t xdr_read_res(XDR *xdr, struct read_res *res, u_int max_len)
+{
+    char header[HEADER_LEN];
+
+    memset(header, 'h', sizeof(header));
+    return xdr_opaque(xdr, header, sizeof(header))
+        && xdr_bool(xdr, &res->eof)
+        && xdr_bytes(xdr, &res->data, &res->len, max_len)
+        && xdr_u_int32_t(xdr, &res->trailer);
+}
+
+/* puts count replies with len-byte payloads on the wire, in fragments
+ * of at most fragsize bytes */
+static bool_t encode_replies(struct transport *t, const char *data,
+    uint32_t len, uint32_t count, uint32_t fragsize)
+{
+    struct read_res res = { TRUE, (char*)data, len, 0 };
+    XDR xdr;
+    uint32_t i;
+
+    t->len = t->pos = 0;
+    xdrrec_create(&xdr, fragsize, RECVSIZE, t, test_read, test_write);
+    xdr.x_op = XDR_ENCODE;
+    for (i = 0; i < count; i++) {
+        res.trailer = 0xc0ffee00 + i;
+        if (!xdr_read_res(&xdr, &res, len) || !xdrrec_endofrecord(&xdr, TRUE)) {
+            XDR_DESTROY(&xdr);
+            return FALSE;
+        }
+    }
+    XDR_DESTROY(&xdr);
+    return TRUE;
+}
+
+static void test_reply(const char *test, uint32_t max_read, uint32_t len)
+{
+    static unsigned char wire[4 * (SENDSIZE + 4096)];
+    struct transport t = { wire };
+    struct read_res res;
+    char *data, *dst;
+    XDR xdr;
+    uint32_t i;
+
+    data = malloc(len + 1);
+    dst = malloc(len + 1);
+    if (data == NULL || dst == NULL) {
+        test_fail(test, len, "out of memory");
+        goto out;
+    }
+    for (i = 0; i < len; i++)
+        data[i] = (char)(i * 13 + i / 509);
+
+    /* two replies back to back, so the second shows whether the
+     * stream stayed in step */
+    if (!encode_replies(&t, data, len, 2, FRAGSIZE)) {
+        test_fail(test, len, "encoding failed");
+        goto out;
+    }
+
+    t.max_read = max_read;
+    t.dst = dst;
+    t.dst_len = len;
+    xdrrec_create(&xdr, FRAGSIZE, RECVSIZE, &t, test_read, test_write);
+    xdr.x_op = XDR_DECODE;
+    for (i = 0; i < 2; i++) {
+        memset(dst, 0, len + 1);
+        t.direct = 0;
+        ZeroMemory(&res, sizeof(res));
+        res.data = dst;
+        if (!xdrrec_skiprecord(&xdr) || !xdr_read_res(&xdr, &res, len)) {
+            test_fail(test, len, "decoding failed");
+            break;
+        }
+        if (res.len != len || !res.eof)
+            test_fail(test, len, "wrong length or eof");
+        else if (memcmp(dst, data, len) != 0)
+            test_fail(test, len, "payload differs");
+        if (res.trailer != 0xc0ffee00 + i)
+            test_fail(test, len, "wrong field after the payload");
+        /* each fragment's header comes in with a fill */
+        if (len >= DIRECT_MIN && t.direct + FILL_READ_MAX *
+                (uint64_t)(len / FRAGSIZE + 1) < len)
+            test_fail(test, len, "payload was staged");
+    }
+    if (i == 2 && t.pos != t.len)
+        test_fail(test, len, "bytes left on the wire");
+    XDR_DESTROY(&xdr);
+out:
+    free(dst);
+    free(data);
+}
+
+static double elapsed_ms(LARGE_INTEGER *start)
+{
+    LARGE_INTEGER freq, end;
+    (void)QueryPerformanceCounter(&end);
+    (void)QueryPerformanceFrequency(&freq);
+    return (double)(end.QuadPart - start->QuadPart) * 1000.0 /
+        (double)freq.QuadPart;
+}
+
+static void bench_replies(uint32_t fragsize)
+{
+    static unsigned char wire[BENCH_REPLIES * (SENDSIZE + 4096)];
+    static char staging[RECVSIZE];
+    const uint32_t len = SENDSIZE;
+    const double mb = (double)BENCH_PASSES * BENCH_REPLIES * len / 1048576.0;
+    const double payload = (double)BENCH_PASSES * BENCH_REPLIES * len;
+    struct transport t = { wire };
+    struct read_res res;
+    LARGE_INTEGER start;
+    char *data, *dst;
+    XDR xdr;
+    uint32_t i, pass, n;
+    double ms;
+
+    data = calloc(1, len);
+    dst = malloc(len);
+    if (data == NULL || dst == NULL || !encode_replies(&t, data, len,
+            BENCH_REPLIES, fragsize)) {
+        test_fail("bench", len, "setup failed");
+        goto out;
+    }
+    t.max_read = UINT32_MAX;
+    t.dst = dst;
+    t.dst_len = len;
+
+    (void)QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++) {
+        t.pos = 0;
+        xdrrec_create(&xdr, fragsize, RECVSIZE, &t, test_read, test_write);
+        xdr.x_op = XDR_DECODE;
+        for (i = 0; i < BENCH_REPLIES; i++) {
+            res.data = dst;
+            if (!xdrrec_skiprecord(&xdr) || !xdr_read_res(&xdr, &res, len)) {
+                test_fail("bench", len, "decoding failed");
+                break;
+            }
+        }
+        XDR_DESTROY(&xdr);
+    }
+    ms = elapsed_ms(&start);
+    (void)printf("direct: 1 MB replies in %u-byte fragments, %.4f bytes "
+        "copied per payload byte, %.1f reads per reply, %.0f MB/s\n",
+        fragsize, (payload - (double)t.direct) / payload,
+        (double)t.reads / (BENCH_PASSES * BENCH_REPLIES), mb * 1000.0 / ms);
+
+    /* the same bytes, staged whole and copied out */
+    (void)QueryPerformanceCounter(&start);
+    for (pass = 0; pass < BENCH_PASSES; pass++) {
+        for (t.pos = 0; t.pos < t.len; t.pos += n) {
+            n = min(t.len - t.pos, sizeof(staging));
+            memcpy(staging, t.wire + t.pos, n);
+            memcpy(dst, staging, min(n, len));
+        }
+    }
+    ms = elapsed_ms(&start);
+    (void)printf("staged: 1 MB replies, 1.0000 bytes copied per payload "
+        "byte, %.0f MB/s\n", mb * 1000.0 / ms);
+out:
+    free(dst);
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t sizes[] = { 0, 1, 100, 4095, 4096, 4097,
+        32768, 65536, 65537, 262144 + 3, 1000000 };
+    uint32_t i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        test_call("auth_sys", RPCSEC_SSPI_SVC_NONE, sizes[i]);
+        test_call("krb5i", RPCSEC_SSPI_SVC_INTEGRITY, sizes[i]);
+        test_call("krb5p", RPCSEC_SSPI_SVC_PRIVACY, sizes[i]);
+        test_reply("read", UINT32_MAX, sizes[i]);
+        test_reply("read-segments", SEGMENT, sizes[i]);
+    }
+    bench_replies(FRAGSIZE);
+    bench_replies(RECVSIZE);
+
+    if (failures) {
+        (void)printf("xdrrectest1: %ld failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    (void)printf("xdrrectest1: OK\n");
+    return EXIT_SUCCESS;
+}